@@ -47,7 +47,6 @@
 #include <infiniband/verbs.h>
 #include <ifaddrs.h>
 #include <dlfcn.h>
-#include <search.h>
 #include <netdb.h>
 #include <net/if.h>
 #include <sys/ioctl.h>
@@ -69,6 +68,10 @@
 #define MAX_EP_ADDR 4
 #define MAX_EP_MC   2
 
+#define ACMP_DEST_STRIPES     64
+#define ACMP_DEST_MIN_BUCKETS 256
+#define ACMP_DEST_AGE_STEP    4
+
 enum acmp_state {
 	ACMP_INIT,
 	ACMP_QUERY_ADDR,
@@ -102,7 +105,7 @@ enum acmp_addr_preload {
 };
 
 /*
- * Nested locking order: dest -> ep, dest -> port
+ * Nested locking order: dest -> ep, dest -> port, dest -> dest map stripe
  */
 struct acmp_ep;
 
@@ -122,9 +125,28 @@ struct acmp_dest {
 	uint64_t	       addr_timeout;
 	uint64_t	       route_timeout;
 	uint8_t                addr_type;
+	uint8_t                referenced;
+	uint8_t                preloaded;
+	uint32_t               hash;
+	struct acmp_dest       *hash_next;
 	struct acmp_ep         *ep;
 };
 
+/*
+ * Destinations are hashed on their address.  Each chain is guarded by one
+ * of the stripe locks, chosen by the low bits of the hash, so that lookups
+ * of different destinations rarely contend.  Growing the table takes every
+ * stripe.  Idle entries are aged out a few buckets at a time as new
+ * destinations are added.
+ */
+struct acmp_dest_map {
+	struct acmp_dest      **buckets;
+	unsigned int          bucket_cnt;
+	atomic_t              dest_cnt;
+	atomic_t              age_hand;
+	pthread_mutex_t       lock[ACMP_DEST_STRIPES];
+};
+
 struct acmp_device;
 
 struct acmp_port {
@@ -176,7 +198,7 @@ struct acmp_ep {
 	uint8_t               *recv_bufs;
 	struct list_node      entry;
 	char		      id_string[IBV_SYSFS_NAME_MAX + 11];
-	void                  *dest_map[ACM_ADDRESS_RESERVED - 1];
+	struct acmp_dest_map  dest_map;
 	struct acmp_dest      mc_dest[MAX_EP_MC];
 	int                   mc_cnt;
 	uint16_t              pkey_index;
@@ -271,6 +293,7 @@ static enum acmp_addr_prot addr_prot = ACMP_ADDR_PROT_ACM;
 static int addr_timeout = 1440;
 static enum acmp_route_prot route_prot = ACMP_ROUTE_PROT_SA;
 static int route_timeout = -1;
+static int dest_cache_size;
 static enum acmp_loopback_prot loopback_prot = ACMP_LOOPBACK_PROT_LOCAL;
 static int timeout = 2000;
 static int retries = 2;
@@ -284,9 +307,86 @@ static enum acmp_addr_preload addr_preload;
 
 static int acmp_initialized = 0;
 
-static int acmp_compare_dest(const void *dest1, const void *dest2)
+static uint32_t acmp_dest_hash(uint8_t addr_type, const uint8_t *addr)
+{
+	uint32_t hash = 2166136261U;
+	int i;
+
+	for (i = 0; i < ACM_MAX_ADDRESS; i++)
+		hash = (hash ^ addr[i]) * 16777619U;
+	return (hash ^ addr_type) * 16777619U;
+}
+
+static int acmp_init_dest_map(struct acmp_dest_map *map)
+{
+	int i;
+
+	map->buckets = calloc(ACMP_DEST_MIN_BUCKETS, sizeof(*map->buckets));
+	if (!map->buckets)
+		return -1;
+
+	map->bucket_cnt = ACMP_DEST_MIN_BUCKETS;
+	atomic_init(&map->dest_cnt);
+	atomic_init(&map->age_hand);
+	for (i = 0; i < ACMP_DEST_STRIPES; i++)
+		pthread_mutex_init(&map->lock[i], NULL);
+	return 0;
+}
+
+static pthread_mutex_t *
+acmp_dest_map_lock(struct acmp_dest_map *map, uint32_t hash)
 {
-	return memcmp(dest1, dest2, ACM_MAX_ADDRESS);
+	return &map->lock[hash % ACMP_DEST_STRIPES];
+}
+
+/* Caller must hold the stripe lock of hash. */
+static struct acmp_dest **
+acmp_find_dest(struct acmp_dest_map *map, uint32_t hash, uint8_t addr_type,
+	       const uint8_t *addr)
+{
+	struct acmp_dest **pdest;
+
+	for (pdest = &map->buckets[hash & (map->bucket_cnt - 1)]; *pdest;
+	     pdest = &(*pdest)->hash_next) {
+		if ((*pdest)->hash == hash && (*pdest)->addr_type == addr_type &&
+		    !memcmp((*pdest)->address, addr, ACM_MAX_ADDRESS))
+			break;
+	}
+	return pdest;
+}
+
+static void acmp_grow_dest_map(struct acmp_dest_map *map)
+{
+	struct acmp_dest **buckets, *dest;
+	unsigned int i, cnt;
+
+	for (i = 0; i < ACMP_DEST_STRIPES; i++)
+		pthread_mutex_lock(&map->lock[i]);
+
+	/* Someone else may have grown it while we waited */
+	if (atomic_get(&map->dest_cnt) <= 2 * map->bucket_cnt)
+		goto unlock;
+
+	cnt = map->bucket_cnt * 2;
+	buckets = calloc(cnt, sizeof(*buckets));
+	if (!buckets)
+		goto unlock;
+
+	for (i = 0; i < map->bucket_cnt; i++) {
+		while ((dest = map->buckets[i])) {
+			map->buckets[i] = dest->hash_next;
+			dest->hash_next = buckets[dest->hash & (cnt - 1)];
+			buckets[dest->hash & (cnt - 1)] = dest;
+		}
+	}
+	free(map->buckets);
+	map->buckets = buckets;
+	map->bucket_cnt = cnt;
+	acm_log(2, "grew to %u buckets\n", cnt);
+
+unlock:
+	for (i = ACMP_DEST_STRIPES; i > 0; i--)
+		pthread_mutex_unlock(&map->lock[i - 1]);
 }
 
 static void
@@ -327,19 +427,24 @@ acmp_alloc_dest(uint8_t addr_type, const uint8_t *addr)
 	return dest;
 }
 
-/* Caller must hold ep lock. */
 static struct acmp_dest *
 acmp_get_dest(struct acmp_ep *ep, uint8_t addr_type, const uint8_t *addr)
 {
-	struct acmp_dest *dest, **tdest;
+	struct acmp_dest_map *map = &ep->dest_map;
+	uint32_t hash = acmp_dest_hash(addr_type, addr);
+	struct acmp_dest *dest;
 
-	tdest = tfind(addr, &ep->dest_map[addr_type - 1], acmp_compare_dest);
-	if (tdest) {
-		dest = *tdest;
+	pthread_mutex_lock(acmp_dest_map_lock(map, hash));
+	dest = *acmp_find_dest(map, hash, addr_type, addr);
+	if (dest) {
 		(void) atomic_inc(&dest->refcnt);
+		dest->referenced = 1;
+	}
+	pthread_mutex_unlock(acmp_dest_map_lock(map, hash));
+
+	if (dest) {
 		acm_log(2, "%s\n", dest->name);
 	} else {
-		dest = NULL;
 		acm_format_name(2, log_data, sizeof log_data,
 				addr_type, addr, ACM_MAX_ADDRESS);
 		acm_log(2, "%s not found\n", log_data);
@@ -356,48 +461,103 @@ acmp_put_dest(struct acmp_dest *dest)
 	}
 }
 
-/* Caller must hold ep lock. */
-static void
-acmp_remove_dest(struct acmp_ep *ep, struct acmp_dest *dest)
+/*
+ * An entry can be dropped once nothing but the map refers to it and its
+ * address has timed out, it never resolved, or the cache is over
+ * dest_cache_size and it has not been used since the last pass.  Local and
+ * preloaded entries are kept.
+ */
+static int acmp_dest_idle(struct acmp_dest *dest, uint64_t now, int over)
 {
-	acm_log(2, "%s\n", dest->name);
-	tdelete(dest->address, &ep->dest_map[dest->addr_type - 1],
-		acmp_compare_dest);
-	acmp_put_dest(dest);
+	if (dest->addr_timeout == (uint64_t) ~0ULL || dest->preloaded ||
+	    atomic_get(&dest->refcnt) != 1 || !list_empty(&dest->req_queue))
+		return 0;
+
+	return now > dest->addr_timeout || dest->state == ACMP_INIT ||
+	       (over && !dest->referenced);
+}
+
+/* Sweeps the next few buckets, clock style */
+static void acmp_age_dests(struct acmp_dest_map *map)
+{
+	struct acmp_dest **pdest, *dest;
+	uint64_t now = time_stamp_min();
+	unsigned int hand;
+	int i, over;
+
+	over = dest_cache_size > 0 &&
+	       atomic_get(&map->dest_cnt) > dest_cache_size;
+
+	for (i = 0; i < ACMP_DEST_AGE_STEP; i++) {
+		hand = (unsigned int) atomic_inc(&map->age_hand);
+		pthread_mutex_lock(acmp_dest_map_lock(map, hand));
+		pdest = &map->buckets[hand & (map->bucket_cnt - 1)];
+		while ((dest = *pdest)) {
+			if (acmp_dest_idle(dest, now, over)) {
+				acm_log(2, "aged out %s\n", dest->name);
+				*pdest = dest->hash_next;
+				(void) atomic_dec(&map->dest_cnt);
+				acmp_put_dest(dest);
+			} else {
+				dest->referenced = 0;
+				pdest = &dest->hash_next;
+			}
+		}
+		pthread_mutex_unlock(acmp_dest_map_lock(map, hand));
+	}
 }
 
 static struct acmp_dest *
 acmp_acquire_dest(struct acmp_ep *ep, uint8_t addr_type, const uint8_t *addr)
 {
-	struct acmp_dest *dest;
+	struct acmp_dest_map *map = &ep->dest_map;
+	uint32_t hash = acmp_dest_hash(addr_type, addr);
+	struct acmp_dest *dest, **pdest;
 	int64_t rec_expr_minutes;
+	int added = 0;
 
 	acm_format_name(2, log_data, sizeof log_data,
 			addr_type, addr, ACM_MAX_ADDRESS);
 	acm_log(2, "%s\n", log_data);
-	pthread_mutex_lock(&ep->lock);
-	dest = acmp_get_dest(ep, addr_type, addr);
+	pthread_mutex_lock(acmp_dest_map_lock(map, hash));
+	pdest = acmp_find_dest(map, hash, addr_type, addr);
+	dest = *pdest;
 	if (dest && dest->state == ACMP_READY &&
 	    dest->addr_timeout != (uint64_t)~0ULL) {
 		rec_expr_minutes = dest->addr_timeout - time_stamp_min();
 		if (rec_expr_minutes <= 0) {
 			acm_log(2, "Record expired\n");
-			acmp_remove_dest(ep, dest);
+			*pdest = dest->hash_next;
+			(void) atomic_dec(&map->dest_cnt);
+			acmp_put_dest(dest);
 			dest = NULL;
 		} else {
 			acm_log(2, "Record valid for the next %" PRId64 " minute(s)\n",
 				rec_expr_minutes);
 		}
 	}
-	if (!dest) {
+	if (dest) {
+		(void) atomic_inc(&dest->refcnt);
+		dest->referenced = 1;
+	} else {
 		dest = acmp_alloc_dest(addr_type, addr);
 		if (dest) {
 			dest->ep = ep;
-			tsearch(dest, &ep->dest_map[addr_type - 1], acmp_compare_dest);
+			dest->hash = hash;
+			dest->referenced = 1;
+			dest->hash_next = map->buckets[hash & (map->bucket_cnt - 1)];
+			map->buckets[hash & (map->bucket_cnt - 1)] = dest;
 			(void) atomic_inc(&dest->refcnt);
+			added = atomic_inc(&map->dest_cnt);
 		}
 	}
-	pthread_mutex_unlock(&ep->lock);
+	pthread_mutex_unlock(acmp_dest_map_lock(map, hash));
+
+	if (added) {
+		if (added > 2 * map->bucket_cnt)
+			acmp_grow_dest_map(map);
+		acmp_age_dests(map);
+	}
 	return dest;
 }
 
@@ -2224,6 +2384,7 @@ static int acmp_parse_osm_fullv1_paths(FILE *f, __be64 *lid2guid, struct acmp_ep
 			}
 			dest->remote_qpn = 1;
 			dest->state = ACMP_READY;
+			dest->preloaded = 1;
 			acmp_put_dest(dest);
 			acm_log(1, "added cached dest %s\n", dest->name);
 		}
@@ -2322,6 +2483,7 @@ static void acmp_parse_hosts_file(struct acmp_ep *ep)
 		dest->remote_qpn = 1;
 		dest->addr_timeout = time_stamp_min() + (unsigned) addr_timeout;
 		dest->route_timeout = time_stamp_min() + (unsigned) route_timeout;
+		dest->preloaded = 1;
 		acmp_put_dest(dest);
 		acm_log(1, "added host %s address type %d IB GID %s\n",
 			addr, addr_type, gid);
@@ -2502,6 +2664,10 @@ acmp_alloc_ep(struct acmp_port *port, struct acm_endpoint *endpoint)
 	list_head_init(&ep->active_queue);
 	list_head_init(&ep->wait_queue);
 	pthread_mutex_init(&ep->lock, NULL);
+	if (acmp_init_dest_map(&ep->dest_map)) {
+		free(ep);
+		return NULL;
+	}
 	sprintf(ep->id_string, "%s-%d-0x%x", port->dev->verbs->device->name,
 		port->port_num, endpoint->pkey);
 	for (i = 0; i < ACM_MAX_COUNTER; i++)
@@ -2611,6 +2777,7 @@ err2:
 err1:
 	ibv_destroy_cq(ep->cq);
 err0:
+	free(ep->dest_map.buckets);
 	free(ep);
 	return -1;
 }
@@ -2859,6 +3026,8 @@ static void acmp_set_options(void)
 			route_prot = acmp_convert_route_prot(value);
 		else if (!strcmp("route_timeout", opt))
 			route_timeout = atoi(value);
+		else if (!strcasecmp("dest_cache_size", opt))
+			dest_cache_size = atoi(value);
 		else if (!strcasecmp("loopback_prot", opt))
 			loopback_prot = acmp_convert_loopback_prot(value);
 		else if (!strcasecmp("timeout", opt))
@@ -2894,6 +3063,7 @@ static void acmp_log_options(void)
 	acm_log(0, "address timeout %d\n", addr_timeout);
 	acm_log(0, "route resolution %d\n", route_prot);
 	acm_log(0, "route timeout %d\n", route_timeout);
+	acm_log(0, "destination cache size %d\n", dest_cache_size);
 	acm_log(0, "loopback resolution %d\n", loopback_prot);
 	acm_log(0, "timeout %d ms\n", timeout);
 	acm_log(0, "retries %d\n", retries);
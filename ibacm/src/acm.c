@@ -40,6 +40,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <infiniband/acm.h>
@@ -53,6 +54,7 @@
 #include <net/if.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <sys/un.h>
 #include <net/if_arp.h>
 #include <linux/netlink.h>
@@ -63,6 +65,7 @@
 #include <inttypes.h>
 #include <getopt.h>
 #include <systemd/sd-daemon.h>
+#include <ccan/array_size.h>
 #include <ccan/list.h>
 #include <util/util.h>
 #include "acm_mad.h"
@@ -120,9 +123,15 @@ struct acmc_port {
 	uint16_t            def_acm_pkey;
 };
 
+/* Something the server loop waits on, run on the main thread when ready */
+struct acmc_event_src {
+	void (*handler)(struct acmc_event_src *src);
+};
+
 struct acmc_device {
 	struct acm_device       device;
 	struct list_node        entry;
+	struct acmc_event_src   async_src;
 	struct list_head        prov_dev_context_list;
 	int                     port_cnt;
 	struct acmc_port        port[0];
@@ -142,11 +151,50 @@ struct acmc_ep {
 	struct list_node      entry;
 };
 
+/*
+ * Resolved paths are published in a file that clients map read-only, so
+ * that they can answer repeated lookups without a round trip to us.  The
+ * file is a set-associative table of responses keyed on the resolve data
+ * of the request, each entry guarded by a sequence count.  librdmacm keeps
+ * its own copy of this layout; any change needs a new ACM_CACHE_VERSION.
+ */
+#define ACM_CACHE_MAGIC       0x4d434149
+#define ACM_CACHE_VERSION     1
+#define ACM_CACHE_WAYS        4
+#define ACM_CACHE_REQ_LENGTH  (ACM_MSG_EP_LENGTH * 3)
+#define ACM_CACHE_RESP_LENGTH (ACM_MSG_HDR_LENGTH + ACM_MSG_EP_LENGTH * 3)
+
+struct acm_cache_hdr {
+	uint32_t          magic;
+	uint16_t          version;
+	uint16_t          entry_size;
+	uint32_t          entry_cnt;
+	uint32_t          generation;
+	uint32_t          retired;
+	uint8_t           reserved[44];
+};
+
+struct acm_cache_entry {
+	uint32_t          seq;       /* odd while being written */
+	uint32_t          hash;
+	uint32_t          generation;
+	uint16_t          req_len;
+	uint16_t          resp_len;
+	uint64_t          expires;   /* CLOCK_MONOTONIC seconds */
+	uint8_t           req[ACM_CACHE_REQ_LENGTH];
+	uint8_t           resp[ACM_CACHE_RESP_LENGTH];
+};
+
 struct acmc_client {
 	pthread_mutex_t lock;   /* acquire ep lock first */
 	int      sock;
 	int      index;
 	atomic_t refcnt;
+	struct acmc_event_src src;
+	struct list_node work_entry;
+	int      resolve_cnt;
+	int      cache_req_len;
+	uint8_t  cache_req[ACM_CACHE_REQ_LENGTH];
 };
 
 union socket_addr {
@@ -185,7 +233,36 @@ static LIST_HEAD(dev_list);
 
 static int listen_socket;
 static int ip_mon_socket;
-static struct acmc_client client_array[FD_SETSIZE - 1];
+
+/*
+ * Providers refer to a client by its index until they respond, so clients
+ * are allocated in chunks that never move or go away.  Only the main
+ * thread adds chunks.
+ */
+#define ACM_CLIENT_CHUNK_SIZE	256
+#define ACM_MAX_CLIENT_CHUNKS	4096
+
+static struct acmc_client client_chunk0[ACM_CLIENT_CHUNK_SIZE];
+static struct acmc_client *client_chunks[ACM_MAX_CLIENT_CHUNKS] = {
+	client_chunk0
+};
+static int client_cnt;
+static int client_next;
+
+static int epoll_fd = -1;
+
+/*
+ * Client requests are served by a pool of worker threads.  A client is
+ * handed to one worker at a time, which keeps its requests in order.
+ * Workers hold server_lock for reading while they look up endpoints; the
+ * main thread holds it for writing while it handles device and address
+ * changes.
+ */
+static pthread_rwlock_t server_lock;
+static int server_threads = 4;
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(work_list);
 
 static FILE *flog;
 static pthread_mutex_t log_lock;
@@ -222,6 +299,8 @@ static char lock_file[128] = IBACM_PID_FILE;
 static short server_port = 6125;
 static int server_mode = IBACM_SERVER_MODE_DEFAULT;
 static int acme_plus_kernel_only = IBACM_ACME_PLUS_KERNEL_ONLY_DEFAULT;
+static int path_cache_entries = 4096;
+static int path_cache_timeout = 60;
 static int support_ips_in_addr_cfg = 0;
 static char prov_lib_path[256] = IBACM_LIB_PATH;
 
@@ -478,9 +557,211 @@ __be64 acm_path_comp_mask(struct ibv_path_record *path)
 	return comp_mask;
 }
 
+static struct acmc_client *acm_get_client(uint64_t id)
+{
+	return &client_chunks[id / ACM_CLIENT_CHUNK_SIZE]
+			     [id % ACM_CLIENT_CHUNK_SIZE];
+}
+
+static struct acm_cache_hdr *path_cache;
+static size_t path_cache_size;
+static pthread_mutex_t path_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t acm_cache_hash(const uint8_t *data, int len)
+{
+	uint32_t hash = 2166136261U;
+
+	while (len--)
+		hash = (hash ^ *data++) * 16777619U;
+	return hash;
+}
+
+static uint64_t acm_cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static struct acm_cache_entry *acm_cache_set(uint32_t hash)
+{
+	struct acm_cache_entry *entries = (struct acm_cache_entry *) (path_cache + 1);
+
+	return &entries[(hash & (path_cache->entry_cnt / ACM_CACHE_WAYS - 1)) *
+			ACM_CACHE_WAYS];
+}
+
+/* Tells clients still mapping a file left by an earlier instance to stop */
+static void acm_cache_retire(const char *path)
+{
+	struct acm_cache_hdr *hdr;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (!fstat(fd, &st) && st.st_size >= sizeof(*hdr)) {
+		hdr = mmap(NULL, sizeof(*hdr), PROT_READ | PROT_WRITE,
+			   MAP_SHARED, fd, 0);
+		if (hdr != MAP_FAILED) {
+			__atomic_store_n(&hdr->retired, 1, __ATOMIC_RELEASE);
+			munmap(hdr, sizeof(*hdr));
+		}
+	}
+	close(fd);
+}
+
+/*
+ * The table is built under a temporary name and renamed into place, so
+ * clients never see a partial file.
+ */
+static void acm_cache_open(void)
+{
+	static const char tmp_path[] = IBACM_PATH_CACHE_FILE ".new";
+	struct acm_cache_hdr *hdr;
+	int fd, cnt;
+
+	BUILD_ASSERT(sizeof(struct acm_cache_hdr) == 64);
+
+	acm_cache_retire(IBACM_PATH_CACHE_FILE);
+	unlink(IBACM_PATH_CACHE_FILE);
+	if (path_cache_entries <= 0 || acme_plus_kernel_only)
+		return;
+
+	for (cnt = ACM_CACHE_WAYS; cnt < path_cache_entries && cnt < (1 << 24);)
+		cnt <<= 1;
+
+	unlink(tmp_path);
+	fd = open(tmp_path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+		  0644);
+	if (fd < 0) {
+		acm_log(0, "notice - unable to create path cache %s\n", tmp_path);
+		return;
+	}
+
+	path_cache_size = sizeof(*hdr) + cnt * sizeof(struct acm_cache_entry);
+	if (fchmod(fd, 0644) || ftruncate(fd, path_cache_size))
+		goto err;
+
+	hdr = mmap(NULL, path_cache_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	if (hdr == MAP_FAILED)
+		goto err;
+
+	hdr->magic = ACM_CACHE_MAGIC;
+	hdr->version = ACM_CACHE_VERSION;
+	hdr->entry_size = sizeof(struct acm_cache_entry);
+	hdr->entry_cnt = cnt;
+	hdr->generation = 1;
+	if (rename(tmp_path, IBACM_PATH_CACHE_FILE)) {
+		munmap(hdr, path_cache_size);
+		goto err;
+	}
+
+	close(fd);
+	path_cache = hdr;
+	acm_log(1, "publishing %d paths in %s\n", cnt, IBACM_PATH_CACHE_FILE);
+	return;
+
+err:
+	acm_log(0, "notice - unable to set up path cache\n");
+	close(fd);
+	unlink(tmp_path);
+}
+
+static void acm_cache_close(void)
+{
+	if (!path_cache)
+		return;
+
+	__atomic_store_n(&path_cache->retired, 1, __ATOMIC_RELEASE);
+	munmap(path_cache, path_cache_size);
+	path_cache = NULL;
+	unlink(IBACM_PATH_CACHE_FILE);
+}
+
+/* Called when addresses or ports change, drops every published path */
+static void acm_cache_invalidate(void)
+{
+	if (path_cache)
+		__atomic_add_fetch(&path_cache->generation, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Entries are written under a sequence count, which readers check before
+ * and after copying an entry out.  The oldest way of the set is replaced,
+ * unless the set already holds this request.
+ */
+static void acm_cache_publish(const uint8_t *req, int req_len,
+			      struct acm_msg *msg)
+{
+	struct acm_cache_entry *entry, *victim = NULL;
+	uint32_t hash, generation, seq;
+	uint64_t expires, oldest = 0;
+	int i;
+
+	if (msg->hdr.length > ACM_CACHE_RESP_LENGTH)
+		return;
+
+	hash = acm_cache_hash(req, req_len);
+	pthread_mutex_lock(&path_cache_lock);
+	generation = __atomic_load_n(&path_cache->generation, __ATOMIC_ACQUIRE);
+	entry = acm_cache_set(hash);
+	for (i = 0; i < ACM_CACHE_WAYS; i++, entry++) {
+		if (entry->hash == hash && entry->req_len == req_len &&
+		    !memcmp(entry->req, req, req_len)) {
+			victim = entry;
+			break;
+		}
+
+		expires = entry->generation == generation ? entry->expires : 0;
+		if (!victim || expires < oldest) {
+			victim = entry;
+			oldest = expires;
+		}
+	}
+
+	seq = victim->seq;
+	__atomic_store_n(&victim->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	victim->hash = hash;
+	victim->generation = generation;
+	victim->req_len = req_len;
+	victim->resp_len = msg->hdr.length;
+	victim->expires = acm_cache_now() + path_cache_timeout;
+	memcpy(victim->req, req, req_len);
+	memcpy(victim->resp, msg, msg->hdr.length);
+
+	__atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&path_cache_lock);
+}
+
+/*
+ * A response can only be matched to its request while the client has no
+ * other resolve in flight, which is how librdmacm talks to us.
+ */
+static void acm_cache_track(struct acmc_client *client, struct acm_msg *msg)
+{
+	int len = msg->hdr.length - ACM_MSG_HDR_LENGTH;
+
+	pthread_mutex_lock(&client->lock);
+	if (client->resolve_cnt++ || !path_cache ||
+	    len <= 0 || len > ACM_CACHE_REQ_LENGTH) {
+		client->cache_req_len = 0;
+	} else {
+		memcpy(client->cache_req, msg->resolve_data, len);
+		client->cache_req_len = len;
+	}
+	pthread_mutex_unlock(&client->lock);
+}
+
 int acm_resolve_response(uint64_t id, struct acm_msg *msg)
 {
-	struct acmc_client *client = &client_array[id];
+	struct acmc_client *client = acm_get_client(id);
 	int ret;
 
 	acm_log(2, "client %d, status 0x%x\n", client->index, msg->hdr.status);
@@ -491,6 +772,14 @@ int acm_resolve_response(uint64_t id, struct acm_msg *msg)
 		atomic_inc(&counter[ACM_CNTR_ERROR]);
 
 	pthread_mutex_lock(&client->lock);
+	if (id != NL_CLIENT_INDEX) {
+		if (client->cache_req_len && !msg->hdr.status)
+			acm_cache_publish(client->cache_req,
+					  client->cache_req_len, msg);
+		client->cache_req_len = 0;
+		client->resolve_cnt--;
+	}
+
 	if (client->sock == -1) {
 		acm_log(0, "ERROR - connection lost\n");
 		ret = ACM_STATUS_ENOTCONN;
@@ -527,7 +816,7 @@ acmc_resolve_response(uint64_t id, struct acm_msg *req_msg, uint8_t status)
 
 int acm_query_response(uint64_t id, struct acm_msg *msg)
 {
-	struct acmc_client *client = &client_array[id];
+	struct acmc_client *client = acm_get_client(id);
 	int ret;
 
 	acm_log(2, "status 0x%x\n", msg->hdr.status);
@@ -558,17 +847,52 @@ static int acmc_query_response(uint64_t id, struct acm_msg *msg, uint8_t status)
 	return acm_query_response(id, msg);
 }
 
-static void acm_init_server(void)
+static void acm_svr_queue_client(struct acmc_event_src *src);
+
+static void acm_init_clients(struct acmc_client *chunk, int first)
 {
-	FILE *f;
 	int i;
 
-	for (i = 0; i < FD_SETSIZE - 1; i++) {
-		pthread_mutex_init(&client_array[i].lock, NULL);
-		client_array[i].index = i;
-		client_array[i].sock = -1;
-		atomic_init(&client_array[i].refcnt);
+	for (i = 0; i < ACM_CLIENT_CHUNK_SIZE; i++) {
+		pthread_mutex_init(&chunk[i].lock, NULL);
+		chunk[i].index = first + i;
+		chunk[i].sock = -1;
+		atomic_init(&chunk[i].refcnt);
+		chunk[i].src.handler = acm_svr_queue_client;
 	}
+}
+
+static int acm_grow_clients(void)
+{
+	struct acmc_client *chunk;
+
+	if (client_cnt == ACM_MAX_CLIENT_CHUNKS * ACM_CLIENT_CHUNK_SIZE)
+		return -1;
+
+	chunk = calloc(ACM_CLIENT_CHUNK_SIZE, sizeof(*chunk));
+	if (!chunk)
+		return -1;
+
+	acm_init_clients(chunk, client_cnt);
+	client_chunks[client_cnt / ACM_CLIENT_CHUNK_SIZE] = chunk;
+	client_cnt += ACM_CLIENT_CHUNK_SIZE;
+	return 0;
+}
+
+static void acm_init_server(void)
+{
+	pthread_rwlockattr_t attr;
+	FILE *f;
+
+	acm_init_clients(client_chunk0, 0);
+	client_cnt = ACM_CLIENT_CHUNK_SIZE;
+
+	/* Address and device changes must not wait behind a request storm */
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+				      PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&server_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
 
 	if (server_mode != IBACM_SERVER_MODE_UNIX) {
 		f = fopen(IBACM_IBACME_PORT_FILE, "w");
@@ -663,7 +987,7 @@ static int acm_listen(void)
 		}
 	}
 
-	ret = listen(listen_socket, 0);
+	ret = listen(listen_socket, SOMAXCONN);
 	if (ret == -1) {
 		acm_log(0, "ERROR - unable to start listen\n");
 		return errno;
@@ -695,12 +1019,12 @@ static int acm_listen_systemd(void)
 			/* ListenNetlink for RDMA_NL_GROUP_LS multicast
 			 * messages from the kernel
 			 */
-			if (client_array[NL_CLIENT_INDEX].sock != -1) {
+			if (acm_get_client(NL_CLIENT_INDEX)->sock != -1) {
 				fprintf(stderr,
 					"sd_listen_fds returned more than one netlink socket\n");
 				return -1;
 			}
-			client_array[NL_CLIENT_INDEX].sock = fd;
+			acm_get_client(NL_CLIENT_INDEX)->sock = fd;
 
 			/* systemd sets NONBLOCK on the netlink socket, while
 			 * we want blocking send to the kernel.
@@ -739,10 +1063,22 @@ static void acm_disconnect_client(struct acmc_client *client)
 	(void) atomic_dec(&client->refcnt);
 }
 
-static void acm_svr_accept(void)
+/* Requests of a client are read by one worker at a time */
+static int acm_svr_arm_client(struct acmc_client *client, int op)
 {
+	struct epoll_event event = {
+		.events = EPOLLIN | EPOLLONESHOT,
+		.data.ptr = &client->src,
+	};
+
+	return epoll_ctl(epoll_fd, op, client->sock, &event);
+}
+
+static void acm_svr_accept(struct acmc_event_src *src)
+{
+	struct acmc_client *client;
 	int s;
-	int i;
+	int i = 0, n;
 
 	acm_log(2, "\n");
 	s = accept(listen_socket, NULL, NULL);
@@ -751,21 +1087,35 @@ static void acm_svr_accept(void)
 		return;
 	}
 
-	for (i = 0; i < FD_SETSIZE - 1; i++) {
+	for (n = 0; n < client_cnt; n++) {
+		i = (client_next + n) % client_cnt;
 		if (i == NL_CLIENT_INDEX)
 			continue;
-		if (!atomic_get(&client_array[i].refcnt))
+		if (!atomic_get(&acm_get_client(i)->refcnt))
 			break;
 	}
 
-	if (i == FD_SETSIZE - 1) {
-		acm_log(0, "ERROR - all connections busy - rejecting\n");
+	if (n == client_cnt) {
+		i = client_cnt;
+		if (acm_grow_clients()) {
+			acm_log(0, "ERROR - unable to add client - rejecting\n");
+			close(s);
+			return;
+		}
+	}
+
+	client = acm_get_client(i);
+	client->sock = s;
+	atomic_set(&client->refcnt, 1);
+	if (acm_svr_arm_client(client, EPOLL_CTL_ADD)) {
+		acm_log(0, "ERROR - unable to poll client - rejecting\n");
+		client->sock = -1;
+		atomic_set(&client->refcnt, 0);
 		close(s);
 		return;
 	}
 
-	client_array[i].sock = s;
-	atomic_set(&client_array[i].refcnt, 1);
+	client_next = i + 1;
 	acm_log(2, "assigned client %d\n", i);
 }
 
@@ -1105,9 +1455,11 @@ static int acm_svr_resolve(struct acmc_client *client, struct acm_msg *msg)
 		if (msg->resolve_data[0].flags & ACM_FLAGS_QUERY_SA) {
 			return acm_svr_query_path(client, msg);
 		} else {
+			acm_cache_track(client, msg);
 			return acm_svr_resolve_path(client, msg);
 		}
 	} else {
+		acm_cache_track(client, msg);
 		return acm_svr_resolve_dest(client, msg);
 	}
 }
@@ -1795,20 +2147,119 @@ static int acm_init_nl(void)
 	}
 
 	/* init nl client structure */
-	client_array[NL_CLIENT_INDEX].sock = nl_rcv_socket;
+	acm_get_client(NL_CLIENT_INDEX)->sock = nl_rcv_socket;
+	return 0;
+}
+
+/* Runs on the main thread: hand a client with pending requests to a worker */
+static void acm_svr_queue_client(struct acmc_event_src *src)
+{
+	struct acmc_client *client = container_of(src, struct acmc_client, src);
+
+	/* Keeps the index from being reused until the worker is done */
+	(void) atomic_inc(&client->refcnt);
+
+	pthread_mutex_lock(&work_lock);
+	list_add_tail(&work_list, &client->work_entry);
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&work_lock);
+}
+
+static void *acm_server_worker(void *context)
+{
+	struct acmc_client *client;
+
+	for (;;) {
+		pthread_mutex_lock(&work_lock);
+		while (!(client = list_pop(&work_list, struct acmc_client,
+					   work_entry)))
+			pthread_cond_wait(&work_cond, &work_lock);
+		pthread_mutex_unlock(&work_lock);
+
+		acm_log(2, "receiving from client %d\n", client->index);
+		pthread_rwlock_rdlock(&server_lock);
+		if (client->index == NL_CLIENT_INDEX)
+			acm_nl_receive(client);
+		else
+			acm_svr_receive(client);
+		pthread_rwlock_unlock(&server_lock);
+
+		pthread_mutex_lock(&client->lock);
+		if (client->sock != -1 &&
+		    acm_svr_arm_client(client, EPOLL_CTL_MOD))
+			acm_log(0, "ERROR - unable to poll client %d\n",
+				client->index);
+		pthread_mutex_unlock(&client->lock);
+		(void) atomic_dec(&client->refcnt);
+	}
+
+	return NULL;
+}
+
+static int acm_start_workers(void)
+{
+	pthread_t thread_id;
+	int i;
+
+	if (server_threads < 1)
+		server_threads = 1;
+
+	for (i = 0; i < server_threads; i++) {
+		if (pthread_create(&thread_id, NULL, acm_server_worker, NULL)) {
+			acm_log(0, "ERROR - failed to create server thread\n");
+			return i ? 0 : -1;
+		}
+		pthread_detach(thread_id);
+	}
+
 	return 0;
 }
 
+static void acm_ipnl_event(struct acmc_event_src *src)
+{
+	pthread_rwlock_wrlock(&server_lock);
+	acm_ipnl_handler();
+	acm_cache_invalidate();
+	pthread_rwlock_unlock(&server_lock);
+}
+
+static void acm_async_event(struct acmc_event_src *src)
+{
+	struct acmc_device *dev = container_of(src, struct acmc_device,
+					       async_src);
+
+	acm_log(2, "handling event from %s\n", dev->device.verbs->device->name);
+	pthread_rwlock_wrlock(&server_lock);
+	acm_event_handler(dev);
+	acm_cache_invalidate();
+	pthread_rwlock_unlock(&server_lock);
+}
+
+static int acm_server_poll_fd(int fd, struct acmc_event_src *src)
+{
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.ptr = src,
+	};
+
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
 static void acm_server(bool systemd)
 {
-	fd_set readfds;
+	static struct acmc_event_src listen_src = { acm_svr_accept };
+	static struct acmc_event_src ipnl_src = { acm_ipnl_event };
+	struct epoll_event events[16];
+	struct acmc_event_src *src;
+	struct acmc_client *nl_client;
 	int i, n, ret;
 	struct acmc_device *dev;
 
 	acm_log(0, "started\n");
 	acm_init_server();
 
-	client_array[NL_CLIENT_INDEX].sock = -1;
+	nl_client = acm_get_client(NL_CLIENT_INDEX);
+	nl_client->sock = -1;
 	listen_socket = -1;
 	if (systemd) {
 		ret = acm_listen_systemd();
@@ -1826,63 +2277,55 @@ static void acm_server(bool systemd)
 		}
 	}
 
-	if (client_array[NL_CLIENT_INDEX].sock == -1) {
+	if (nl_client->sock == -1) {
 		ret = acm_init_nl();
 		if (ret)
 			acm_log(1, "Warn - Netlink init failed\n");
 	}
 
-	if (systemd)
-		sd_notify(0, "READY=1");
-
-	while (1) {
-		n = (int) listen_socket;
-		FD_ZERO(&readfds);
-		FD_SET(listen_socket, &readfds);
-		n = max(n, (int) ip_mon_socket);
-		FD_SET(ip_mon_socket, &readfds);
-
-		for (i = 0; i < FD_SETSIZE - 1; i++) {
-			if (client_array[i].sock != -1) {
-				FD_SET(client_array[i].sock, &readfds);
-				n = max(n, (int) client_array[i].sock);
-			}
-		}
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		acm_log(0, "ERROR - unable to create epoll fd\n");
+		return;
+	}
 
-		list_for_each(&dev_list, dev, entry) {
-			FD_SET(dev->device.verbs->async_fd, &readfds);
-			n = max(n, (int) dev->device.verbs->async_fd);
-		}
+	if (acm_server_poll_fd(listen_socket, &listen_src)) {
+		acm_log(0, "ERROR - unable to poll listen socket\n");
+		return;
+	}
+	if (ip_mon_socket != -1 &&
+	    acm_server_poll_fd(ip_mon_socket, &ipnl_src))
+		acm_log(0, "ERROR - unable to poll IP monitor socket\n");
+	if (nl_client->sock != -1 &&
+	    acm_svr_arm_client(nl_client, EPOLL_CTL_ADD))
+		acm_log(0, "ERROR - unable to poll netlink socket\n");
 
-		ret = select(n + 1, &readfds, NULL, NULL, NULL);
-		if (ret == -1) {
-			acm_log(0, "ERROR - server select error\n");
-			continue;
-		}
+	list_for_each(&dev_list, dev, entry) {
+		dev->async_src.handler = acm_async_event;
+		if (acm_server_poll_fd(dev->device.verbs->async_fd,
+				       &dev->async_src))
+			acm_log(0, "ERROR - unable to poll events of %s\n",
+				dev->device.verbs->device->name);
+	}
 
-		if (FD_ISSET(listen_socket, &readfds))
-			acm_svr_accept();
+	acm_cache_open();
+	if (acm_start_workers())
+		return;
 
-		if (FD_ISSET(ip_mon_socket, &readfds))
-			acm_ipnl_handler();
+	if (systemd)
+		sd_notify(0, "READY=1");
 
-		for (i = 0; i < FD_SETSIZE - 1; i++) {
-			if (client_array[i].sock != -1 &&
-				FD_ISSET(client_array[i].sock, &readfds)) {
-				acm_log(2, "receiving from client %d\n", i);
-				if (i == NL_CLIENT_INDEX)
-					acm_nl_receive(&client_array[i]);
-				else
-					acm_svr_receive(&client_array[i]);
-			}
+	while (1) {
+		n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), -1);
+		if (n == -1) {
+			if (errno != EINTR)
+				acm_log(0, "ERROR - server epoll error\n");
+			continue;
 		}
 
-		list_for_each(&dev_list, dev, entry) {
-			if (FD_ISSET(dev->device.verbs->async_fd, &readfds)) {
-				acm_log(2, "handling event from %s\n",
-					dev->device.verbs->device->name);
-				acm_event_handler(dev);
-			}
+		for (i = 0; i < n; i++) {
+			src = events[i].data.ptr;
+			src->handler(src);
 		}
 	}
 }
@@ -3065,6 +3508,12 @@ static void acm_set_options(void)
 			sa.retries = atoi(value);
 		else if (!strcasecmp("sa_depth", opt))
 			sa.depth = atoi(value);
+		else if (!strcasecmp("server_threads", opt))
+			server_threads = atoi(value);
+		else if (!strcasecmp("path_cache_entries", opt))
+			path_cache_entries = atoi(value);
+		else if (!strcasecmp("path_cache_timeout", opt))
+			path_cache_timeout = atoi(value);
 	}
 
 	fclose(f);
@@ -3083,8 +3532,11 @@ static void acm_log_options(void)
 	acm_log(0, "lock file %s\n", lock_file);
 	acm_log(0, "server_port %d\n", server_port);
 	acm_log(0, "server_mode %s\n", server_mode_names[server_mode]);
+	acm_log(0, "server_threads %d\n", server_threads);
 	acm_log(0, "acme_plus_kernel_only %s\n",
 		acme_plus_kernel_only ? "yes" : "no");
+	acm_log(0, "path cache entries %d\n", path_cache_entries);
+	acm_log(0, "path cache timeout %d s\n", path_cache_timeout);
 	acm_log(0, "timeout %d ms\n", sa.timeout);
 	acm_log(0, "retries %d\n", sa.retries);
 	acm_log(0, "sa depth %d\n", sa.depth);
@@ -3228,8 +3680,9 @@ int main(int argc, char **argv)
 	acm_server(systemd);
 
 	acm_log(0, "shutting down\n");
-	if (client_array[NL_CLIENT_INDEX].sock != -1)
-		close(client_array[NL_CLIENT_INDEX].sock);
+	acm_cache_close();
+	if (acm_get_client(NL_CLIENT_INDEX)->sock != -1)
+		close(acm_get_client(NL_CLIENT_INDEX)->sock);
 	acm_close_providers();
 	acm_stop_sa_handler();
 	umad_done();
@@ -181,6 +181,15 @@ static void gen_opts_temp(FILE *f)
 	fprintf(f, "\n");
 	fprintf(f, "route_timeout -1\n");
 	fprintf(f, "\n");
+	fprintf(f, "# dest_cache_size:\n");
+	fprintf(f, "# Number of destinations cached per endpoint above which entries\n");
+	fprintf(f, "# that have not been used recently are dropped.  Entries whose\n");
+	fprintf(f, "# address has timed out are dropped regardless.  Preloaded\n");
+	fprintf(f, "# destinations are never dropped.  A value of 0 indicates that\n");
+	fprintf(f, "# the cache is not limited in size.\n");
+	fprintf(f, "\n");
+	fprintf(f, "dest_cache_size 0\n");
+	fprintf(f, "\n");
 	fprintf(f, "# loopback_prot:\n");
 	fprintf(f, "# Address and route resolution protocol to resolve local addresses\n");
 	fprintf(f, "# Supported protocols are:\n");
@@ -212,6 +221,12 @@ static void gen_opts_temp(FILE *f)
 #else
 	fprintf(f, "server_mode unix\n");
 #endif
+	fprintf(f, "\n");
+	fprintf(f, "# server_threads:\n");
+	fprintf(f, "# Number of threads that serve client requests.  Requests\n");
+	fprintf(f, "# from one client are always handled in order.\n");
+	fprintf(f, "\n");
+	fprintf(f, "server_threads 4\n");
 	fprintf(f, "\n");
 	fprintf(f, "# acme_plus_kernel_only:\n");
 	fprintf(f, "# If set to 'true', 'yes' or a non-zero number\n");
@@ -227,6 +242,21 @@ static void gen_opts_temp(FILE *f)
 #else
 	fprintf(f, "acme_plus_kernel_only no\n");
 #endif
+	fprintf(f, "\n");
+	fprintf(f, "# path_cache_entries:\n");
+	fprintf(f, "# Number of resolved paths published in %s,\n",
+		IBACM_PATH_CACHE_FILE);
+	fprintf(f, "# from which librdmacm answers repeated lookups without\n");
+	fprintf(f, "# contacting the ACM service.  A value of 0 disables the file.\n");
+	fprintf(f, "\n");
+	fprintf(f, "path_cache_entries 4096\n");
+	fprintf(f, "\n");
+	fprintf(f, "# path_cache_timeout:\n");
+	fprintf(f, "# Number of seconds a published path may be used before\n");
+	fprintf(f, "# clients must ask the ACM service again.  Paths are also\n");
+	fprintf(f, "# dropped whenever local addresses or ports change.\n");
+	fprintf(f, "\n");
+	fprintf(f, "path_cache_timeout 60\n");
 	fprintf(f, "\n");
 	fprintf(f, "# timeout:\n");
 	fprintf(f, "# Additional time, in milliseconds, that the ACM service will wait for a\n");
@@ -44,6 +44,48 @@
 #include <fcntl.h>
 #include "sysfs.h"
 
+static char infiniband_path[256];
+static char infiniband_mad_path[256];
+
+/*
+ * The class directories live under SYSFS_PATH rather than /sys when it is
+ * set, so that tests can run against a fake tree.  As in libibverbs the
+ * environment is ignored by SUID programs.
+ */
+static void init_class_paths(void)
+{
+	const char *root = NULL;
+	int len;
+
+	if (getuid() == geteuid())
+		root = getenv("SYSFS_PATH");
+	if (!root)
+		root = "/sys";
+
+	len = strlen(root);
+	while (len > 0 && root[len - 1] == '/')
+		len--;
+
+	snprintf(infiniband_path, sizeof(infiniband_path),
+		 "%.*s/class/infiniband", len, root);
+	snprintf(infiniband_mad_path, sizeof(infiniband_mad_path),
+		 "%.*s/class/infiniband_mad", len, root);
+}
+
+const char *sys_infiniband_path(void)
+{
+	if (!infiniband_path[0])
+		init_class_paths();
+	return infiniband_path;
+}
+
+const char *sys_infiniband_mad_path(void)
+{
+	if (!infiniband_mad_path[0])
+		init_class_paths();
+	return infiniband_mad_path;
+}
+
 static int ret_code(void)
 {
 	int e = errno;
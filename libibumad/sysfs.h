@@ -37,6 +37,10 @@
 #include <linux/types.h>
 #include <infiniband/umad.h>
 
+/* SYS_INFINIBAND and SYS_INFINIBAND_MAD, moved by SYSFS_PATH */
+extern const char *sys_infiniband_path(void);
+extern const char *sys_infiniband_mad_path(void);
+
 extern int sys_read_string(const char *dir_name, const char *file_name, char *str, int len);
 extern int sys_read_guid(const char *dir_name, const char *file_name, __be64 * net_guid);
 extern int sys_read_gid(const char *dir_name, const char *file_name,
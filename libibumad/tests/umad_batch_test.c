@@ -0,0 +1,299 @@
+/*
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Exercises the batch, pool and tracker calls without an HCA.  The port
+ * is one end of a SOCK_SEQPACKET socketpair, which like the umad device
+ * moves one MAD per write() and read(), and the test plays the kernel on
+ * the other end.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <infiniband/umad.h>
+#include <infiniband/umad_types.h>
+
+#define TEST_AGENT	3
+#define MAD_LEN		256
+#define NUM_MADS	8
+
+static int test_failures = 0;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			printf(" FAIL at line %d: %s\n", __LINE__, #cond);	\
+			test_failures++;				\
+		}							\
+	} while (0)
+
+static int open_fake_port(int *kernel_fd)
+{
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds)) {
+		perror("socketpair");
+		exit(1);
+	}
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	*kernel_fd = fds[1];
+	return fds[0];
+}
+
+static void build_mad(void *umad, uint8_t method, uint64_t tid)
+{
+	struct umad_hdr *hdr = umad_get_mad(umad);
+
+	memset(umad, 0, umad_size() + MAD_LEN);
+	hdr->base_version = 1;
+	hdr->mgmt_class = UMAD_CLASS_SUBN_ADM;
+	hdr->class_version = 2;
+	hdr->method = method;
+	hdr->tid = htobe64(tid);
+}
+
+/* What the kernel does with a send: read it and tell the caller about it */
+static int kernel_read(int kernel_fd, void *umad)
+{
+	return read(kernel_fd, umad, umad_size() + MAD_LEN) ==
+	       umad_size() + MAD_LEN ? 0 : -1;
+}
+
+static void kernel_reply(int kernel_fd, void *umad, int status)
+{
+	struct ib_user_mad *mad = umad;
+	struct umad_hdr *hdr = umad_get_mad(umad);
+
+	mad->status = status;
+	mad->length = umad_size() + MAD_LEN;
+	if (!status)
+		hdr->method |= UMAD_METHOD_RESP_MASK;
+	if (write(kernel_fd, umad, umad_size() + MAD_LEN) !=
+	    umad_size() + MAD_LEN)
+		test_failures++;
+}
+
+static uint64_t mad_tid(void *umad)
+{
+	struct umad_hdr *hdr = umad_get_mad(umad);
+
+	return be64toh(hdr->tid);
+}
+
+static void test_batch(void)
+{
+	char bufs[NUM_MADS][sizeof(struct ib_user_mad) + MAD_LEN];
+	char in[sizeof(struct ib_user_mad) + MAD_LEN];
+	void *umads[NUM_MADS];
+	int lengths[NUM_MADS];
+	int fd, kernel_fd, i, ret;
+
+	printf("\n batch send and receive ... ");
+	fd = open_fake_port(&kernel_fd);
+
+	for (i = 0; i < NUM_MADS; i++) {
+		umads[i] = bufs[i];
+		lengths[i] = MAD_LEN;
+		build_mad(umads[i], UMAD_METHOD_GET, i + 1);
+	}
+
+	ret = umad_send_batch(fd, TEST_AGENT, umads, lengths, NUM_MADS, 100, 2);
+	CHECK(ret == NUM_MADS);
+
+	for (i = 0; i < NUM_MADS; i++) {
+		struct ib_user_mad *mad = (struct ib_user_mad *)in;
+
+		CHECK(!kernel_read(kernel_fd, in));
+		CHECK(mad->agent_id == TEST_AGENT);
+		CHECK(mad->timeout_ms == 100 && mad->retries == 2);
+		CHECK(mad_tid(in) == i + 1);
+		kernel_reply(kernel_fd, in, 0);
+	}
+
+	memset(bufs, 0, sizeof(bufs));
+	ret = umad_recv_batch(fd, umads, lengths, NUM_MADS / 2, 100);
+	CHECK(ret == NUM_MADS / 2);
+	ret = umad_recv_batch(fd, umads + NUM_MADS / 2, lengths + NUM_MADS / 2,
+			      NUM_MADS / 2, 0);
+	CHECK(ret == NUM_MADS / 2);
+	for (i = 0; i < NUM_MADS; i++) {
+		struct umad_hdr *hdr = umad_get_mad(umads[i]);
+
+		CHECK(lengths[i] == MAD_LEN);
+		CHECK(mad_tid(umads[i]) == i + 1);
+		CHECK(hdr->method == (UMAD_METHOD_GET | UMAD_METHOD_RESP_MASK));
+	}
+
+	ret = umad_recv_batch(fd, umads, lengths, NUM_MADS, 0);
+	CHECK(ret == -EAGAIN || ret == -EWOULDBLOCK);
+	ret = umad_recv_batch(fd, umads, lengths, NUM_MADS, 10);
+	CHECK(ret == -ETIMEDOUT);
+
+	close(fd);
+	close(kernel_fd);
+	printf("done\n");
+}
+
+static void test_pool(void)
+{
+	struct umad_pool *pool;
+	void *umads[4];
+	int i;
+
+	printf("\n buffer pool ... ");
+	CHECK(!umad_pool_create(4, 16));
+
+	pool = umad_pool_create(4, MAD_LEN);
+	CHECK(pool);
+	if (!pool)
+		return;
+
+	for (i = 0; i < 4; i++) {
+		umads[i] = umad_pool_get(pool);
+		CHECK(umads[i]);
+		memset(umads[i], 0xff, umad_size() + MAD_LEN);
+	}
+	CHECK(!umad_pool_get(pool));
+
+	umad_pool_put(pool, umads[2]);
+	CHECK(umad_pool_get(pool) == umads[2]);
+	for (i = 0; i < 4; i++)
+		umad_pool_put(pool, umads[i]);
+
+	umad_pool_destroy(pool);
+	printf("done\n");
+}
+
+/*
+ * Of the requests sent, the "kernel" answers some, drops some and hands
+ * one back as timed out; it also delivers a duplicate response and an
+ * unsolicited request.
+ */
+static void test_tracker(void)
+{
+	char reqs[NUM_MADS][sizeof(struct ib_user_mad) + MAD_LEN];
+	char in[NUM_MADS][sizeof(struct ib_user_mad) + MAD_LEN];
+	struct umad_completion comps[NUM_MADS];
+	struct umad_tracker *tracker;
+	int done[NUM_MADS] = {};
+	int fd, kernel_fd, i, n, ret, unsolicited = 0, timeouts = 0;
+
+	printf("\n request tracker ... ");
+	fd = open_fake_port(&kernel_fd);
+
+	tracker = umad_tracker_create(fd, TEST_AGENT, NUM_MADS, MAD_LEN, 20, 1);
+	CHECK(tracker);
+	if (!tracker)
+		goto out;
+
+	for (i = 0; i < NUM_MADS; i++) {
+		build_mad(reqs[i], UMAD_METHOD_GET, 0x1234567800000000ULL);
+		CHECK(!umad_tracker_send(tracker, reqs[i], MAD_LEN, &done[i]));
+	}
+	build_mad(reqs[0], UMAD_METHOD_GET, 0);
+	CHECK(umad_tracker_send(tracker, reqs[0], MAD_LEN, NULL) == -EAGAIN);
+
+	for (i = 0; i < NUM_MADS; i++) {
+		CHECK(!kernel_read(kernel_fd, in[i]));
+		CHECK(mad_tid(in[i]) >> 32 == 0x12345678);
+	}
+
+	/* Requests 0-4 are answered, 5 timed out, 6 and 7 lost */
+	for (i = 0; i < 5; i++)
+		kernel_reply(kernel_fd, in[i], 0);
+	kernel_reply(kernel_fd, in[1], 0);
+	kernel_reply(kernel_fd, in[5], ETIMEDOUT);
+	build_mad(in[6], UMAD_METHOD_REPORT, 0x99);
+	((struct ib_user_mad *)in[6])->agent_id = TEST_AGENT;
+	if (write(kernel_fd, in[6], umad_size() + MAD_LEN) < 0)
+		test_failures++;
+
+	for (n = 0; n < NUM_MADS + 1;) {
+		ret = umad_tracker_poll(tracker, comps, 3, 1000);
+		CHECK(ret > 0);
+		if (ret <= 0)
+			break;
+
+		for (i = 0; i < ret; i++, n++) {
+			struct umad_completion *comp = &comps[i];
+
+			if (!comp->solicited) {
+				CHECK(comp->umad && mad_tid(comp->umad) == 0x99);
+				unsolicited++;
+			} else if (comp->status) {
+				CHECK(comp->status == ETIMEDOUT && !comp->umad);
+				(*(int *)comp->context)++;
+				timeouts++;
+			} else {
+				CHECK(comp->umad && comp->length == MAD_LEN);
+				(*(int *)comp->context)++;
+			}
+			if (comp->umad)
+				umad_tracker_release(tracker, comp->umad);
+		}
+	}
+
+	CHECK(unsolicited == 1);
+	CHECK(timeouts == 3);
+	for (i = 0; i < NUM_MADS; i++)
+		CHECK(done[i] == 1);
+
+	ret = umad_tracker_poll(tracker, comps, NUM_MADS, 0);
+	CHECK(ret == 0);
+
+	/* Every slot is free again */
+	for (i = 0; i < NUM_MADS; i++)
+		CHECK(!umad_tracker_send(tracker, reqs[i], MAD_LEN, NULL));
+
+	umad_tracker_destroy(tracker);
+out:
+	close(fd);
+	close(kernel_fd);
+	printf("done\n");
+}
+
+int main(int argc, char *argv[])
+{
+	test_batch();
+	test_pool();
+	test_tracker();
+	printf("\n *******************\n");
+	printf("   umad_batch had %d failures\n", test_failures);
+	printf(" *******************\n");
+	return test_failures;
+}
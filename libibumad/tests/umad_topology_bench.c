@@ -0,0 +1,355 @@
+/*
+ * This software is available to you under the OpenIB.org BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Compares the query rate of umad_get_cas_names(), umad_get_ca() and
+ * umad_get_port(), which read sysfs on every call, with that of the
+ * umad_topology snapshot.  The CAs live in a fake sysfs tree built under a
+ * temporary directory, which SYSFS_PATH points at, and both paths must
+ * report the same ports.
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <infiniband/umad.h>
+
+static int num_cas = 4;
+static int num_ports = 2;
+static int num_pkeys = 16;
+static int calls = 1000;
+
+static int write_file(const char *dir, const char *name, const char *value)
+{
+	char path[1024];
+	FILE *file;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	file = fopen(path, "w");
+	if (!file)
+		return -1;
+	fprintf(file, "%s\n", value);
+	return fclose(file);
+}
+
+static int build_port(const char *ports, int portnum)
+{
+	char dir[700], sub[800], value[64];
+	int i;
+
+	snprintf(dir, sizeof(dir), "%s/%d", ports, portnum);
+	if (mkdir(dir, 0755))
+		return -1;
+
+	snprintf(value, sizeof(value), "0x%x", portnum + 1);
+	if (write_file(dir, "lid", value) ||
+	    write_file(dir, "lid_mask_count", "0") ||
+	    write_file(dir, "sm_lid", "0x1") ||
+	    write_file(dir, "sm_sl", "0") ||
+	    write_file(dir, "state", "4: ACTIVE") ||
+	    write_file(dir, "phys_state", "5: LinkUp") ||
+	    write_file(dir, "rate", "100 Gb/sec (4X EDR)") ||
+	    write_file(dir, "cap_mask", "0x2659e848") ||
+	    write_file(dir, "link_layer", "InfiniBand"))
+		return -1;
+
+	snprintf(sub, sizeof(sub), "%s/gids", dir);
+	if (mkdir(sub, 0755))
+		return -1;
+	snprintf(value, sizeof(value),
+		 "fe80:0000:0000:0000:0002:c903:00%02x:%04x", portnum, 0x1234);
+	if (write_file(sub, "0", value))
+		return -1;
+
+	snprintf(sub, sizeof(sub), "%s/pkeys", dir);
+	if (mkdir(sub, 0755))
+		return -1;
+	for (i = 0; i < num_pkeys; i++) {
+		char name[16];
+
+		snprintf(name, sizeof(name), "%d", i);
+		if (write_file(sub, name, i ? "0x0000" : "0xffff"))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int build_sysfs(const char *root)
+{
+	char dir[256], ca[512], ports[600], value[64];
+	int i, p;
+
+	snprintf(dir, sizeof(dir), "%s/class", root);
+	if (mkdir(dir, 0755))
+		return -1;
+	snprintf(dir, sizeof(dir), "%s/class/infiniband", root);
+	if (mkdir(dir, 0755))
+		return -1;
+
+	for (i = 0; i < num_cas; i++) {
+		snprintf(ca, sizeof(ca), "%s/bench_%d", dir, i);
+		if (mkdir(ca, 0755))
+			return -1;
+
+		snprintf(value, sizeof(value), "0002:c903:0000:%04x", i);
+		if (write_file(ca, "node_type", "1: CA") ||
+		    write_file(ca, "fw_ver", "16.35.1012") ||
+		    write_file(ca, "hw_rev", "0") ||
+		    write_file(ca, "hca_type", "MT4119") ||
+		    write_file(ca, "node_guid", value) ||
+		    write_file(ca, "sys_image_guid", value))
+			return -1;
+
+		snprintf(ports, sizeof(ports), "%s/ports", ca);
+		if (mkdir(ports, 0755))
+			return -1;
+		for (p = 1; p <= num_ports; p++)
+			if (build_port(ports, p))
+				return -1;
+	}
+
+	return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+			struct FTW *ftw)
+{
+	return remove(path);
+}
+
+static double elapsed_us(struct timeval *start, struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000.0 +
+	       (end->tv_usec - start->tv_usec);
+}
+
+/* One query round: list the CAs, then read each CA and each of its ports */
+static int query_sysfs(char (*names)[UMAD_CA_NAME_LEN], umad_port_t *out)
+{
+	umad_ca_t ca;
+	umad_port_t port;
+	int n, i, p;
+
+	n = umad_get_cas_names(names, num_cas);
+	for (i = 0; i < n; i++) {
+		if (umad_get_ca(names[i], &ca) < 0)
+			return -1;
+		umad_release_ca(&ca);
+		for (p = 1; p <= num_ports; p++) {
+			if (umad_get_port(names[i], p, &port) < 0)
+				return -1;
+			if (out)
+				out[i * num_ports + p - 1] = port;
+			else
+				umad_release_port(&port);
+		}
+	}
+	return n;
+}
+
+static int query_topology(struct umad_topology *topo,
+			  char (*names)[UMAD_CA_NAME_LEN], umad_port_t *out)
+{
+	umad_ca_t ca;
+	umad_port_t port;
+	int n, i, p;
+
+	n = umad_topology_get_cas_names(topo, names, num_cas);
+	for (i = 0; i < n; i++) {
+		if (umad_topology_get_ca(topo, names[i], &ca) < 0)
+			return -1;
+		umad_release_ca(&ca);
+		for (p = 1; p <= num_ports; p++) {
+			if (umad_topology_get_port(topo, names[i], p, &port) < 0)
+				return -1;
+			if (out)
+				out[i * num_ports + p - 1] = port;
+			else
+				umad_release_port(&port);
+		}
+	}
+	return n;
+}
+
+static int same_port(umad_port_t *a, umad_port_t *b)
+{
+	return !strcmp(a->ca_name, b->ca_name) && a->portnum == b->portnum &&
+	       a->base_lid == b->base_lid && a->state == b->state &&
+	       a->phys_state == b->phys_state && a->capmask == b->capmask &&
+	       a->port_guid == b->port_guid && a->pkeys_size == b->pkeys_size &&
+	       !memcmp(a->pkeys, b->pkeys, a->pkeys_size * sizeof(*a->pkeys)) &&
+	       !strcmp(a->link_layer, b->link_layer);
+}
+
+static int check(struct umad_topology *topo,
+		 char (*names)[UMAD_CA_NAME_LEN])
+{
+	umad_port_t *a, *b;
+	int i, ret = 0, total = num_cas * num_ports;
+
+	a = calloc(total + 1, sizeof(*a));
+	b = calloc(total + 1, sizeof(*b));
+	if (!a || !b ||
+	    query_sysfs(names, a) != num_cas ||
+	    query_topology(topo, names, b) != num_cas)
+		ret = -1;
+
+	/* The default port is chosen the same way */
+	if (!ret && umad_get_port(NULL, 0, &a[total]) < 0)
+		ret = -1;
+	if (!ret && umad_topology_get_port(topo, NULL, 0, &b[total]) < 0)
+		ret = -1;
+	total++;
+
+	for (i = 0; i < total; i++) {
+		if (!ret && !same_port(&a[i], &b[i]))
+			ret = -1;
+		free(a[i].pkeys);
+		free(b[i].pkeys);
+	}
+	free(a);
+	free(b);
+	return ret;
+}
+
+static int run(void)
+{
+	char (*names)[UMAD_CA_NAME_LEN];
+	struct umad_topology *topo;
+	struct timeval start, end;
+	double sysfs_us, cached_us, open_us;
+	int i, ret = -1;
+
+	names = calloc(num_cas, sizeof(*names));
+	if (!names)
+		return -1;
+
+	gettimeofday(&start, NULL);
+	topo = umad_topology_open(0);
+	gettimeofday(&end, NULL);
+	if (!topo) {
+		perror("umad_topology_open");
+		goto out;
+	}
+	open_us = elapsed_us(&start, &end);
+
+	if (check(topo, names)) {
+		printf("the snapshot does not match sysfs\n");
+		goto close;
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < calls; i++)
+		if (query_sysfs(names, NULL) != num_cas)
+			goto close;
+	gettimeofday(&end, NULL);
+	sysfs_us = elapsed_us(&start, &end) / calls;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < calls; i++)
+		if (query_topology(topo, names, NULL) != num_cas)
+			goto close;
+	gettimeofday(&end, NULL);
+	cached_us = elapsed_us(&start, &end) / calls;
+
+	printf("%d cas with %d ports, %d calls per round\n", num_cas,
+	       num_ports, 1 + num_cas * (num_ports + 1));
+	printf("%-20s %12s %12s\n", "", "us/round", "rounds/s");
+	printf("%-20s %12.1f %12.0f\n", "sysfs", sysfs_us, 1000000 / sysfs_us);
+	printf("%-20s %12.1f %12.0f\n", "snapshot", cached_us,
+	       1000000 / cached_us);
+	printf("%-20s %12.1f\n", "snapshot load", open_us);
+	ret = 0;
+
+close:
+	umad_topology_close(topo);
+out:
+	free(names);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	char root[] = "/tmp/umad_topology_bench.XXXXXX";
+	int op, ret;
+
+	while ((op = getopt(argc, argv, "n:p:k:c:")) != -1) {
+		switch (op) {
+		case 'n':
+			num_cas = atoi(optarg);
+			break;
+		case 'p':
+			num_ports = atoi(optarg);
+			break;
+		case 'k':
+			num_pkeys = atoi(optarg);
+			break;
+		case 'c':
+			calls = atoi(optarg);
+			break;
+		default:
+			printf("usage: %s\n", argv[0]);
+			printf("\t[-n cas]\n");
+			printf("\t[-p ports_per_ca]\n");
+			printf("\t[-k pkeys_per_port]\n");
+			printf("\t[-c rounds]\n");
+			exit(1);
+		}
+	}
+
+	if (num_cas < 1 || num_ports < 1 || num_ports >= UMAD_CA_MAX_PORTS ||
+	    num_pkeys < 1 || calls < 1) {
+		printf("invalid argument\n");
+		exit(1);
+	}
+
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		exit(1);
+	}
+
+	ret = build_sysfs(root);
+	if (ret)
+		printf("failed to build sysfs tree under %s\n", root);
+	else {
+		/* Read by libibumad on its first sysfs access */
+		setenv("SYSFS_PATH", root, 1);
+		ret = run();
+	}
+
+	nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return ret ? 1 : 0;
+}
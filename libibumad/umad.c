@@ -32,6 +32,7 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <config.h>
 
 #include <sys/poll.h>
@@ -46,7 +47,10 @@
 #include <dirent.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <stdbool.h>
+#include <time.h>
 #include <util/compiler.h>
+#include <util/util.h>
 
 #include <infiniband/umad.h>
 
@@ -99,10 +103,10 @@ static unsigned int get_abi_version(void)
 	if (abi_version != 0)
 		return abi_version & 0x7FFFFFFF;
 
-	if (sys_read_uint(IB_UMAD_ABI_DIR, IB_UMAD_ABI_FILE, &abi_version) <
-	    0) {
+	if (sys_read_uint(sys_infiniband_mad_path(), IB_UMAD_ABI_FILE,
+			  &abi_version) < 0) {
 		IBWARN("can't read ABI version from %s/%s (%m): is ib_umad module loaded?",
-		       IB_UMAD_ABI_DIR, IB_UMAD_ABI_FILE);
+		       sys_infiniband_mad_path(), IB_UMAD_ABI_FILE);
 		abi_version = 1 << 31;
 		return 0;
 	}
@@ -248,57 +252,41 @@ static int release_ca(umad_ca_t * ca)
  * the first port that is link up and if none are linkup, then
  * the first port that is not disabled.  Otherwise return -1.
  */
-static int resolve_ca_port(const char *ca_name, int *port)
+static int best_ca_port(umad_ca_t *ca, int *port)
 {
-	umad_ca_t ca;
 	int active = -1, up = -1;
-	int i, ret = 0;
-
-	TRACE("checking ca '%s'", ca_name);
-
-	if (umad_get_ca(ca_name, &ca) < 0)
-		return -1;
+	int i;
 
-	if (ca.node_type == 2) {
+	if (ca->node_type == 2) {
 		*port = 0;	/* switch sma port 0 */
-		ret = 1;
-		goto Exit;
+		return 1;
 	}
 
 	if (*port > 0) {	/* check only the port the user wants */
-		if (*port > ca.numports) {
-			ret = -1;
-			goto Exit;
-		}
-		if (!ca.ports[*port]) {
-			ret = -1;
-			goto Exit;
-		}
-		if (strcmp(ca.ports[*port]->link_layer, "InfiniBand") &&
-		    strcmp(ca.ports[*port]->link_layer, "IB")) {
-			ret = -1;
-			goto Exit;
-		}
-		if (ca.ports[*port]->state == 4) {
-			ret = 1;
-			goto Exit;
-		}
-		if (ca.ports[*port]->phys_state != 3)
-			goto Exit;
-		ret = -1;
-		goto Exit;
+		if (*port > ca->numports)
+			return -1;
+		if (!ca->ports[*port])
+			return -1;
+		if (strcmp(ca->ports[*port]->link_layer, "InfiniBand") &&
+		    strcmp(ca->ports[*port]->link_layer, "IB"))
+			return -1;
+		if (ca->ports[*port]->state == 4)
+			return 1;
+		if (ca->ports[*port]->phys_state != 3)
+			return 0;
+		return -1;
 	}
 
-	for (i = 0; i <= ca.numports; i++) {
+	for (i = 0; i <= ca->numports; i++) {
 		DEBUG("checking port %d", i);
-		if (!ca.ports[i])
+		if (!ca->ports[i])
 			continue;
-		if (strcmp(ca.ports[i]->link_layer, "InfiniBand") &&
-		    strcmp(ca.ports[i]->link_layer, "IB"))
+		if (strcmp(ca->ports[i]->link_layer, "InfiniBand") &&
+		    strcmp(ca->ports[i]->link_layer, "IB"))
 			continue;
-		if (up < 0 && ca.ports[i]->phys_state == 5)
+		if (up < 0 && ca->ports[i]->phys_state == 5)
 			up = *port = i;
-		if (ca.ports[i]->state == 4) {
+		if (ca->ports[i]->state == 4) {
 			active = *port = i;
 			DEBUG("found active port %d", i);
 			break;
@@ -306,27 +294,35 @@ static int resolve_ca_port(const char *ca_name, int *port)
 	}
 
 	if (active == -1 && up == -1) {	/* no active or linkup port found */
-		for (i = 0; i <= ca.numports; i++) {
+		for (i = 0; i <= ca->numports; i++) {
 			DEBUG("checking port %d", i);
-			if (!ca.ports[i])
+			if (!ca->ports[i])
 				continue;
-			if (ca.ports[i]->phys_state != 3) {
+			if (ca->ports[i]->phys_state != 3) {
 				up = *port = i;
 				break;
 			}
 		}
 	}
 
-	if (active >= 0) {
-		ret = 1;
-		goto Exit;
-	}
-	if (up >= 0) {
-		ret = 0;
-		goto Exit;
-	}
-	ret = -1;
-Exit:
+	if (active >= 0)
+		return 1;
+	if (up >= 0)
+		return 0;
+	return -1;
+}
+
+static int resolve_ca_port(const char *ca_name, int *port)
+{
+	umad_ca_t ca;
+	int ret;
+
+	TRACE("checking ca '%s'", ca_name);
+
+	if (umad_get_ca(ca_name, &ca) < 0)
+		return -1;
+
+	ret = best_ca_port(&ca, port);
 	release_ca(&ca);
 	return ret;
 }
@@ -401,7 +397,7 @@ static int get_ca(const char *ca_name, umad_ca_t * ca)
 	memset(ca->ports, 0, sizeof ca->ports);
 	strncpy(ca->ca_name, ca_name, sizeof(ca->ca_name) - 1);
 
-	snprintf(dir_name, sizeof(dir_name), "%s/%s", SYS_INFINIBAND,
+	snprintf(dir_name, sizeof(dir_name), "%s/%s", sys_infiniband_path(),
 		 ca->ca_name);
 
 	if ((r = sys_read_uint(dir_name, SYS_NODE_TYPE, &ca->node_type)) < 0)
@@ -422,7 +418,7 @@ static int get_ca(const char *ca_name, umad_ca_t * ca)
 		return r;
 
 	snprintf(dir_name, sizeof(dir_name), "%s/%s/%s",
-		 SYS_INFINIBAND, ca->ca_name, SYS_CA_PORTS_DIR);
+		 sys_infiniband_path(), ca->ca_name, SYS_CA_PORTS_DIR);
 
 	if (!(dir = opendir(dir_name)))
 		return -ENOENT;
@@ -484,7 +480,8 @@ static int umad_id_to_dev(int umad_id, char *dev, unsigned *port)
 	char path[256];
 	int r;
 
-	snprintf(path, sizeof(path), SYS_INFINIBAND_MAD "/umad%d/", umad_id);
+	snprintf(path, sizeof(path), "%s/umad%d/", sys_infiniband_mad_path(),
+		 umad_id);
 
 	if ((r =
 	     sys_read_string(path, SYS_IB_MAD_DEV, dev, UMAD_CA_NAME_LEN)) < 0)
@@ -539,7 +536,8 @@ static unsigned is_ib_type(const char *ca_name)
 	char dir_name[256];
 	unsigned type;
 
-	snprintf(dir_name, sizeof(dir_name), "%s/%s", SYS_INFINIBAND, ca_name);
+	snprintf(dir_name, sizeof(dir_name), "%s/%s", sys_infiniband_path(),
+		 ca_name);
 
 	if (sys_read_uint(dir_name, SYS_NODE_TYPE, &type) < 0)
 		return 0;
@@ -554,7 +552,7 @@ int umad_get_cas_names(char cas[][UMAD_CA_NAME_LEN], int max)
 
 	TRACE("max %d", max);
 
-	n = scandir(SYS_INFINIBAND, &namelist, NULL, alphasort);
+	n = scandir(sys_infiniband_path(), &namelist, NULL, alphasort);
 	if (n > 0) {
 		for (i = 0; i < n; i++) {
 			if (strcmp(namelist[i]->d_name, ".") &&
@@ -702,7 +700,7 @@ int umad_get_port(const char *ca_name, int portnum, umad_port_t * port)
 		return -ENODEV;
 
 	snprintf(dir_name, sizeof(dir_name), "%s/%s/%s",
-		 SYS_INFINIBAND, ca_name, SYS_CA_PORTS_DIR);
+		 sys_infiniband_path(), ca_name, SYS_CA_PORTS_DIR);
 
 	return get_port(ca_name, dir_name, portnum, port);
 }
@@ -722,6 +720,275 @@ int umad_release_port(umad_port_t * port)
 	return 0;
 }
 
+/*******************************
+ * Topology snapshot
+ *
+ * Every CA and port is read from sysfs once and queries are answered from
+ * memory.  The snapshot is read again after a kobject uevent for an RDMA
+ * device, which covers devices coming and going, and once it is older than
+ * max_age_ms, since port state and LID changes do not raise uevents.
+ */
+struct umad_topology {
+	int max_age_ms;
+	bool valid;
+	struct timespec loaded;
+	struct rdma_uevent uevent;
+	int num_cas;
+	umad_ca_t *cas;
+};
+
+static void topology_release(struct umad_topology *topo)
+{
+	int i;
+
+	for (i = 0; i < topo->num_cas; i++)
+		release_ca(&topo->cas[i]);
+	free(topo->cas);
+	topo->cas = NULL;
+	topo->num_cas = 0;
+	topo->valid = false;
+}
+
+static int topology_load(struct umad_topology *topo)
+{
+	struct dirent **namelist;
+	int n, i, ret = 0;
+
+	topology_release(topo);
+
+	n = scandir(sys_infiniband_path(), &namelist, NULL, alphasort);
+	if (n < 0) {
+		/* No RDMA devices at all */
+		if (errno != ENOENT)
+			return -errno;
+		namelist = NULL;
+		n = 0;
+	}
+
+	topo->cas = calloc(n ? n : 1, sizeof(*topo->cas));
+	if (!topo->cas)
+		ret = -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		umad_ca_t *ca = &topo->cas[topo->num_cas];
+		const char *name = namelist[i]->d_name;
+
+		if (!ret && strcmp(name, ".") && strcmp(name, "..") &&
+		    strlen(name) < UMAD_CA_NAME_LEN && !get_ca(name, ca)) {
+			if (ca->node_type >= 1 && ca->node_type <= 3)
+				topo->num_cas++;
+			else
+				release_ca(ca);
+		}
+		free(namelist[i]);
+	}
+	free(namelist);
+
+	if (ret)
+		return ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &topo->loaded);
+	topo->valid = true;
+	DEBUG("loaded %d cas", topo->num_cas);
+	return 0;
+}
+
+static bool topology_current(struct umad_topology *topo)
+{
+	struct timespec now;
+	long long age_ms;
+
+	if (rdma_uevent_pending(&topo->uevent))
+		return false;
+
+	if (!topo->valid)
+		return false;
+
+	if (!topo->max_age_ms)
+		return true;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	age_ms = (now.tv_sec - topo->loaded.tv_sec) * 1000LL +
+		 (now.tv_nsec - topo->loaded.tv_nsec) / 1000000;
+	return age_ms < topo->max_age_ms;
+}
+
+static int topology_update(struct umad_topology *topo)
+{
+	if (topology_current(topo))
+		return 0;
+	return topology_load(topo);
+}
+
+static umad_ca_t *topology_find_ca(struct umad_topology *topo,
+				   const char *ca_name)
+{
+	int i;
+
+	for (i = 0; i < topo->num_cas; i++)
+		if (!strcmp(topo->cas[i].ca_name, ca_name))
+			return &topo->cas[i];
+	return NULL;
+}
+
+/* Follows resolve_ca_name(), without reading sysfs */
+static umad_ca_t *topology_resolve_ca(struct umad_topology *topo,
+				      const char *ca_name, int *best_port)
+{
+	umad_ca_t *ca, *phys_ca = NULL;
+	int i, port, port_found = 0;
+
+	if (ca_name) {
+		ca = topology_find_ca(topo, ca_name);
+		if (ca && best_port && !*best_port &&
+		    best_ca_port(ca, best_port) < 0)
+			return NULL;
+		return ca;
+	}
+
+	for (i = 0; i < topo->num_cas; i++) {
+		ca = &topo->cas[i];
+		port = best_port ? *best_port : 0;
+		switch (best_ca_port(ca, &port)) {
+		case 1:
+			if (best_port)
+				*best_port = port;
+			return ca;
+		case 0:
+			if (!phys_ca) {
+				phys_ca = ca;
+				port_found = port;
+			}
+			break;
+		}
+	}
+
+	if (phys_ca && best_port)
+		*best_port = port_found;
+	return phys_ca;
+}
+
+static int copy_port(const umad_port_t *src, umad_port_t *dst)
+{
+	*dst = *src;
+	dst->pkeys = calloc(src->pkeys_size ? src->pkeys_size : 1,
+			    sizeof(*dst->pkeys));
+	if (!dst->pkeys)
+		return -ENOMEM;
+	memcpy(dst->pkeys, src->pkeys, src->pkeys_size * sizeof(*dst->pkeys));
+	return 0;
+}
+
+struct umad_topology *umad_topology_open(int max_age_ms)
+{
+	struct umad_topology *topo;
+	int ret;
+
+	TRACE("max_age_ms %d", max_age_ms);
+	if (max_age_ms < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	topo = calloc(1, sizeof(*topo));
+	if (!topo)
+		return NULL;
+
+	topo->max_age_ms = max_age_ms;
+	topo->uevent.fd = -1;
+	rdma_uevent_open(&topo->uevent);
+
+	ret = topology_load(topo);
+	if (ret) {
+		umad_topology_close(topo);
+		errno = -ret;
+		return NULL;
+	}
+	return topo;
+}
+
+void umad_topology_close(struct umad_topology *topo)
+{
+	if (!topo)
+		return;
+	topology_release(topo);
+	rdma_uevent_close(&topo->uevent);
+	free(topo);
+}
+
+void umad_topology_invalidate(struct umad_topology *topo)
+{
+	topo->valid = false;
+}
+
+int umad_topology_get_cas_names(struct umad_topology *topo,
+				char cas[][UMAD_CA_NAME_LEN], int max)
+{
+	int i, ret;
+
+	TRACE("max %d", max);
+	ret = topology_update(topo);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < topo->num_cas && i < max; i++)
+		strcpy(cas[i], topo->cas[i].ca_name);
+	return i;
+}
+
+int umad_topology_get_ca(struct umad_topology *topo, const char *ca_name,
+			 umad_ca_t *ca)
+{
+	umad_ca_t *cached;
+	int i, ret;
+
+	TRACE("ca_name %s", ca_name);
+	ret = topology_update(topo);
+	if (ret)
+		return ret;
+
+	cached = topology_resolve_ca(topo, ca_name, NULL);
+	if (!cached)
+		return -ENODEV;
+
+	*ca = *cached;
+	memset(ca->ports, 0, sizeof(ca->ports));
+	for (i = 0; i <= cached->numports; i++) {
+		if (!cached->ports[i])
+			continue;
+		ca->ports[i] = malloc(sizeof(*ca->ports[i]));
+		if (!ca->ports[i] || copy_port(cached->ports[i], ca->ports[i])) {
+			free(ca->ports[i]);
+			ca->ports[i] = NULL;
+			release_ca(ca);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+int umad_topology_get_port(struct umad_topology *topo, const char *ca_name,
+			   int portnum, umad_port_t *port)
+{
+	umad_ca_t *cached;
+	int ret;
+
+	TRACE("ca_name %s portnum %d", ca_name, portnum);
+	ret = topology_update(topo);
+	if (ret)
+		return ret;
+
+	cached = topology_resolve_ca(topo, ca_name, &portnum);
+	if (!cached)
+		return -ENODEV;
+
+	if (portnum < 0 || portnum > cached->numports ||
+	    !cached->ports[portnum])
+		return -EIO;
+
+	return copy_port(cached->ports[portnum], port);
+}
+
 int umad_close_port(int fd)
 {
 	close(fd);
@@ -184,6 +184,22 @@ int umad_release_port(umad_port_t * port);
 
 int umad_get_issm_path(const char *ca_name, int portnum, char path[], int max);
 
+/*
+ * A snapshot of all CAs and ports that answers queries without reading
+ * sysfs.  It may not be used by more than one thread at a time.
+ */
+struct umad_topology;
+
+struct umad_topology *umad_topology_open(int max_age_ms);
+void umad_topology_close(struct umad_topology *topo);
+void umad_topology_invalidate(struct umad_topology *topo);
+int umad_topology_get_cas_names(struct umad_topology *topo,
+				char cas[][UMAD_CA_NAME_LEN], int max);
+int umad_topology_get_ca(struct umad_topology *topo, const char *ca_name,
+			 umad_ca_t *ca);
+int umad_topology_get_port(struct umad_topology *topo, const char *ca_name,
+			   int portnum, umad_port_t *port);
+
 int umad_open_port(const char *ca_name, int portnum);
 int umad_close_port(int portid);
 
@@ -241,6 +257,43 @@ static inline void umad_free(void *umad)
 	free(umad);
 }
 
+/*
+ * Batched I/O, buffer pools and request tracking.  None of these objects
+ * may be used by more than one thread at a time.
+ */
+int umad_send_batch(int portid, int agentid, void *umads[],
+		    const int lengths[], int num, int timeout_ms, int retries);
+int umad_recv_batch(int portid, void *umads[], int lengths[], int num,
+		    int timeout_ms);
+
+struct umad_pool;
+
+struct umad_pool *umad_pool_create(int num, int length);
+void umad_pool_destroy(struct umad_pool *pool);
+void *umad_pool_get(struct umad_pool *pool);
+void umad_pool_put(struct umad_pool *pool, void *umad);
+
+struct umad_tracker;
+
+struct umad_completion {
+	void *context;		/* as given to umad_tracker_send() */
+	void *umad;		/* the received MAD, or NULL */
+	int length;
+	int agentid;
+	int status;		/* 0 or an errno value */
+	int solicited;		/* 0 for a MAD that matched no request */
+};
+
+struct umad_tracker *umad_tracker_create(int portid, int agentid,
+					 int max_outstanding, int length,
+					 int timeout_ms, int retries);
+void umad_tracker_destroy(struct umad_tracker *tracker);
+int umad_tracker_send(struct umad_tracker *tracker, void *umad, int length,
+		      void *context);
+int umad_tracker_poll(struct umad_tracker *tracker,
+		      struct umad_completion *comps, int num, int timeout_ms);
+void umad_tracker_release(struct umad_tracker *tracker, void *umad);
+
 /* Users should use the glibc functions directly, not these wrappers */
 #ifndef ntohll
 #undef ntohll
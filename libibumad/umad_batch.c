@@ -0,0 +1,482 @@
+/*
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <ccan/list.h>
+#include <infiniband/umad.h>
+#include <infiniband/umad_types.h>
+
+/*
+ * The umad device takes a single MAD per write() and returns a single MAD
+ * per read(), so a batch still costs one system call per MAD.  What the
+ * batch calls save is the poll() that umad_recv() issues for every MAD
+ * when given a timeout: umad_recv_batch() waits once and then drains the
+ * device without blocking.
+ */
+int umad_send_batch(int portid, int agentid, void *umads[],
+		    const int lengths[], int num, int timeout_ms, int retries)
+{
+	int i, ret;
+
+	for (i = 0; i < num; i++) {
+		ret = umad_send(portid, agentid, umads[i], lengths[i],
+				timeout_ms, retries);
+		if (ret)
+			return i ? i : ret;
+	}
+	return num;
+}
+
+int umad_recv_batch(int portid, void *umads[], int lengths[], int num,
+		    int timeout_ms)
+{
+	int i, ret, len;
+
+	if (num <= 0) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	if (timeout_ms) {
+		ret = umad_poll(portid, timeout_ms);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < num; i++) {
+		len = lengths[i];
+		ret = umad_recv(portid, umads[i], &len, 0);
+		if (ret < 0) {
+			/* An oversized MAD stays queued for the next call */
+			if (ret == -ENOSPC && !i)
+				lengths[i] = len;
+			break;
+		}
+		lengths[i] = len;
+	}
+
+	return i ? i : ret;
+}
+
+/*
+ * A pool is a single allocation carved into equally sized umad buffers, so
+ * that a caller exchanging many MADs does not go to malloc for each one.
+ */
+struct umad_pool {
+	char *buf;
+	size_t stride;
+	int length;
+	int num;
+	int num_free;
+	void **free;
+};
+
+struct umad_pool *umad_pool_create(int num, int length)
+{
+	struct umad_pool *pool;
+	int i;
+
+	if (num <= 0 || length < 256) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->stride = (umad_size() + length + 7) & ~(size_t)7;
+	pool->length = length;
+	pool->num = num;
+	pool->buf = calloc(num, pool->stride);
+	pool->free = calloc(num, sizeof(*pool->free));
+	if (!pool->buf || !pool->free) {
+		umad_pool_destroy(pool);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for (i = 0; i < num; i++)
+		pool->free[i] = pool->buf + (size_t)(num - i - 1) * pool->stride;
+	pool->num_free = num;
+	return pool;
+}
+
+void umad_pool_destroy(struct umad_pool *pool)
+{
+	if (!pool)
+		return;
+	free(pool->free);
+	free(pool->buf);
+	free(pool);
+}
+
+void *umad_pool_get(struct umad_pool *pool)
+{
+	if (!pool->num_free) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return pool->free[--pool->num_free];
+}
+
+void umad_pool_put(struct umad_pool *pool, void *umad)
+{
+	pool->free[pool->num_free++] = umad;
+}
+
+static bool pool_owns(struct umad_pool *pool, void *umad)
+{
+	char *p = umad;
+
+	return p >= pool->buf && p < pool->buf + pool->num * pool->stride;
+}
+
+/*
+ * The low 16 bits of the TID select the request slot and the next 16 bits
+ * count how often the slot was reused, so a response is matched without a
+ * search and a late response to an earlier use of the slot is ignored.
+ * The kernel replaces the upper 32 bits of the TID with its own value.
+ */
+#define TRACKER_MAX_OUTSTANDING	0xffff
+
+struct tracker_req {
+	struct list_node entry;
+	void *context;
+	struct timespec deadline;
+	uint16_t seq;
+	bool busy;
+};
+
+struct umad_tracker {
+	int portid;
+	int agentid;
+	int timeout_ms;
+	int retries;
+	struct umad_pool *pool;
+	struct tracker_req *reqs;
+	uint16_t *free_slots;
+	int num_free;
+	int max_outstanding;
+	/* Outstanding requests, oldest first, which is also deadline order */
+	struct list_head outstanding;
+};
+
+struct umad_tracker *umad_tracker_create(int portid, int agentid,
+					 int max_outstanding, int length,
+					 int timeout_ms, int retries)
+{
+	struct umad_tracker *tracker;
+	int i;
+
+	if (max_outstanding <= 0 || max_outstanding > TRACKER_MAX_OUTSTANDING ||
+	    timeout_ms <= 0 || retries < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	tracker = calloc(1, sizeof(*tracker));
+	if (!tracker)
+		return NULL;
+
+	tracker->portid = portid;
+	tracker->agentid = agentid;
+	tracker->timeout_ms = timeout_ms;
+	tracker->retries = retries;
+	tracker->max_outstanding = max_outstanding;
+	list_head_init(&tracker->outstanding);
+
+	/* Each request may have a response waiting to be released */
+	tracker->pool = umad_pool_create(2 * max_outstanding, length);
+	if (!tracker->pool)
+		goto err;
+
+	tracker->reqs = calloc(max_outstanding, sizeof(*tracker->reqs));
+	tracker->free_slots = calloc(max_outstanding,
+				     sizeof(*tracker->free_slots));
+	if (!tracker->reqs || !tracker->free_slots) {
+		errno = ENOMEM;
+		goto err;
+	}
+
+	for (i = 0; i < max_outstanding; i++)
+		tracker->free_slots[i] = max_outstanding - i - 1;
+	tracker->num_free = max_outstanding;
+	return tracker;
+
+err:
+	umad_tracker_destroy(tracker);
+	return NULL;
+}
+
+void umad_tracker_destroy(struct umad_tracker *tracker)
+{
+	if (!tracker)
+		return;
+	umad_pool_destroy(tracker->pool);
+	free(tracker->free_slots);
+	free(tracker->reqs);
+	free(tracker);
+}
+
+static void deadline_after(struct timespec *ts, int ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (long)(ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* Milliseconds until ts, rounded up; 0 if it has passed */
+static int ms_until(const struct timespec *ts)
+{
+	struct timespec now;
+	long long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (ts->tv_sec - now.tv_sec) * 1000LL +
+	     (ts->tv_nsec - now.tv_nsec + 999999) / 1000000;
+	return ms > 0 ? ms : 0;
+}
+
+int umad_tracker_send(struct umad_tracker *tracker, void *umad, int length,
+		      void *context)
+{
+	struct umad_hdr *hdr = umad_get_mad(umad);
+	struct tracker_req *req;
+	uint16_t slot;
+	uint64_t tid;
+	int ret;
+
+	if (!tracker->num_free) {
+		errno = EAGAIN;
+		return -EAGAIN;
+	}
+
+	slot = tracker->free_slots[tracker->num_free - 1];
+	req = &tracker->reqs[slot];
+	if (!++req->seq)
+		req->seq = 1;
+
+	tid = be64toh(hdr->tid) & ~0xffffffffULL;
+	tid |= (uint32_t)req->seq << 16 | slot;
+	hdr->tid = htobe64(tid);
+
+	ret = umad_send(tracker->portid, tracker->agentid, umad, length,
+			tracker->timeout_ms, tracker->retries);
+	if (ret)
+		return ret;
+
+	tracker->num_free--;
+	req->busy = true;
+	req->context = context;
+	/*
+	 * The kernel retries the send itself and hands it back with a status
+	 * once the retries run out.  The deadline only guards against that
+	 * report never arriving.
+	 */
+	deadline_after(&req->deadline,
+		       tracker->timeout_ms * (tracker->retries + 2));
+	list_add_tail(&tracker->outstanding, &req->entry);
+	return 0;
+}
+
+static void complete_req(struct umad_tracker *tracker, struct tracker_req *req,
+			 struct umad_completion *comp)
+{
+	comp->context = req->context;
+	comp->solicited = 1;
+
+	list_del(&req->entry);
+	req->busy = false;
+	req->context = NULL;
+	tracker->free_slots[tracker->num_free++] = req - tracker->reqs;
+}
+
+static int expire_reqs(struct umad_tracker *tracker,
+		       struct umad_completion *comps, int num)
+{
+	struct tracker_req *req;
+	int n = 0;
+
+	while (n < num) {
+		req = list_top(&tracker->outstanding, struct tracker_req, entry);
+		if (!req || ms_until(&req->deadline))
+			break;
+
+		memset(&comps[n], 0, sizeof(comps[n]));
+		comps[n].status = ETIMEDOUT;
+		complete_req(tracker, req, &comps[n]);
+		n++;
+	}
+	return n;
+}
+
+static struct tracker_req *match_req(struct umad_tracker *tracker, void *umad)
+{
+	struct umad_hdr *hdr = umad_get_mad(umad);
+	uint32_t tid = be64toh(hdr->tid);
+	struct tracker_req *req;
+	uint16_t slot = tid & 0xffff;
+
+	if (slot >= tracker->max_outstanding)
+		return NULL;
+
+	req = &tracker->reqs[slot];
+	if (!req->busy || req->seq != tid >> 16)
+		return NULL;
+	return req;
+}
+
+/* Reads one MAD, or returns a negative errno */
+static int read_mad(struct umad_tracker *tracker, void **umad, int *length)
+{
+	void *buf;
+	int ret, len;
+
+	buf = umad_pool_get(tracker->pool);
+	if (!buf)
+		return -ENOMEM;
+
+	len = tracker->pool->length;
+	ret = umad_recv(tracker->portid, buf, &len, 0);
+	if (ret == -ENOSPC) {
+		/* An RMPP response larger than the pool buffers */
+		umad_pool_put(tracker->pool, buf);
+		buf = malloc(umad_size() + len);
+		if (!buf)
+			return -ENOMEM;
+		ret = umad_recv(tracker->portid, buf, &len, 0);
+		if (ret < 0)
+			free(buf);
+	} else if (ret < 0) {
+		umad_pool_put(tracker->pool, buf);
+	}
+
+	if (ret < 0)
+		return ret;
+
+	*umad = buf;
+	*length = len;
+	return ret;
+}
+
+int umad_tracker_poll(struct umad_tracker *tracker,
+		      struct umad_completion *comps, int num, int timeout_ms)
+{
+	struct umad_completion *comp;
+	struct tracker_req *req;
+	struct umad_hdr *hdr;
+	void *umad;
+	int n, ret, length, wait, status;
+
+	if (num <= 0) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	n = expire_reqs(tracker, comps, num);
+	if (n)
+		timeout_ms = 0;
+
+	/* Never sleep past the deadline of the oldest request */
+	req = list_top(&tracker->outstanding, struct tracker_req, entry);
+	if (req && timeout_ms) {
+		wait = ms_until(&req->deadline);
+		if (timeout_ms < 0 || wait < timeout_ms)
+			timeout_ms = wait;
+	}
+
+	if (timeout_ms) {
+		ret = umad_poll(tracker->portid, timeout_ms);
+		if (ret == -ETIMEDOUT)
+			return expire_reqs(tracker, comps, num);
+		if (ret)
+			return ret;
+	}
+
+	while (n < num) {
+		ret = read_mad(tracker, &umad, &length);
+		if (ret < 0) {
+			if (ret == -EAGAIN || ret == -EWOULDBLOCK ||
+			    (ret == -ENOMEM && n))
+				break;
+			return n ? n : ret;
+		}
+
+		comp = &comps[n];
+		memset(comp, 0, sizeof(*comp));
+		comp->agentid = ret;
+
+		hdr = umad_get_mad(umad);
+		status = umad_status(umad);
+		req = ret == tracker->agentid ? match_req(tracker, umad) : NULL;
+		if (req && (status || hdr->method & UMAD_METHOD_RESP_MASK)) {
+			complete_req(tracker, req, comp);
+			if (status) {
+				/* A send handed back by the kernel */
+				comp->status = status;
+				umad_tracker_release(tracker, umad);
+				n++;
+				continue;
+			}
+		} else if (status || hdr->method & UMAD_METHOD_RESP_MASK) {
+			/* A late response or a send that was already expired */
+			umad_tracker_release(tracker, umad);
+			continue;
+		}
+
+		comp->umad = umad;
+		comp->length = length;
+		n++;
+	}
+
+	if (n < num)
+		n += expire_reqs(tracker, comps + n, num - n);
+	return n;
+}
+
+void umad_tracker_release(struct umad_tracker *tracker, void *umad)
+{
+	if (pool_owns(tracker->pool, umad))
+		umad_pool_put(tracker->pool, umad);
+	else
+		free(umad);
+}
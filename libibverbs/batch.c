@@ -0,0 +1,153 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include <util/util.h>
+
+#include "ibverbs.h"
+
+/*
+ * uverbs executes one command per system call, so a batch cannot be handed
+ * to the kernel as a unit.  Instead the commands of a large batch are
+ * issued from a few threads, which keeps several of them in flight in the
+ * kernel and the device firmware at once.  Small batches run in a loop.
+ */
+#define BATCH_CMDS_PER_THREAD	16
+
+struct verbs_batch {
+	unsigned int num;
+	atomic_uint next;
+	/* Lowest index that failed, or num */
+	atomic_uint bad;
+	atomic_int err;
+	int (*exec)(struct verbs_batch *batch, unsigned int i);
+};
+
+struct create_qp_batch {
+	struct verbs_batch batch;
+	struct ibv_context *context;
+	struct ibv_qp_init_attr_ex *attrs;
+	struct ibv_qp **qps;
+};
+
+struct modify_qp_batch {
+	struct verbs_batch batch;
+	struct ibv_qp **qps;
+	struct ibv_qp_attr *attrs;
+	int attr_mask;
+};
+
+static void batch_fail(struct verbs_batch *batch, unsigned int i, int err)
+{
+	unsigned int bad = atomic_load(&batch->bad);
+
+	while (i < bad &&
+	       !atomic_compare_exchange_weak(&batch->bad, &bad, i))
+		;
+	atomic_store(&batch->err, err);
+}
+
+static void *batch_worker(void *arg)
+{
+	struct verbs_batch *batch = arg;
+	unsigned int i;
+	int ret;
+
+	/* Commands already claimed complete, but no new ones start */
+	while (!atomic_load(&batch->err) &&
+	       (i = atomic_fetch_add(&batch->next, 1)) < batch->num) {
+		ret = batch->exec(batch, i);
+		if (ret)
+			batch_fail(batch, i, ret);
+	}
+
+	return NULL;
+}
+
+static int batch_run(struct verbs_batch *batch)
+{
+	atomic_init(&batch->next, 0);
+	atomic_init(&batch->bad, batch->num);
+	atomic_init(&batch->err, 0);
+
+	run_workers(batch->num / BATCH_CMDS_PER_THREAD, batch_worker, batch);
+	return atomic_load(&batch->err);
+}
+
+static int exec_create_qp(struct verbs_batch *batch, unsigned int i)
+{
+	struct create_qp_batch *cb =
+		container_of(batch, struct create_qp_batch, batch);
+
+	cb->qps[i] = ibv_create_qp_ex(cb->context, &cb->attrs[i]);
+	if (!cb->qps[i])
+		return errno ? errno : EINVAL;
+
+	return 0;
+}
+
+int ibv_create_qp_batch(struct ibv_context *context,
+			struct ibv_qp_init_attr_ex *attrs,
+			unsigned int num_qps, struct ibv_qp **qps)
+{
+	struct create_qp_batch cb = {
+		.batch = {
+			.num = num_qps,
+			.exec = exec_create_qp,
+		},
+		.context = context,
+		.attrs = attrs,
+		.qps = qps,
+	};
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < num_qps; i++)
+		qps[i] = NULL;
+
+	ret = batch_run(&cb.batch);
+	if (!ret)
+		return 0;
+
+	for (i = 0; i < num_qps; i++) {
+		if (qps[i])
+			ibv_destroy_qp(qps[i]);
+		qps[i] = NULL;
+	}
+
+	return ret;
+}
+
+static int exec_modify_qp(struct verbs_batch *batch, unsigned int i)
+{
+	struct modify_qp_batch *mb =
+		container_of(batch, struct modify_qp_batch, batch);
+
+	return ibv_modify_qp(mb->qps[i], &mb->attrs[i], mb->attr_mask);
+}
+
+int ibv_modify_qp_batch(struct ibv_qp **qps, struct ibv_qp_attr *attrs,
+			int attr_mask, unsigned int num_qps,
+			unsigned int *bad_qp)
+{
+	struct modify_qp_batch mb = {
+		.batch = {
+			.num = num_qps,
+			.exec = exec_modify_qp,
+		},
+		.qps = qps,
+		.attrs = attrs,
+		.attr_mask = attr_mask,
+	};
+	int ret;
+
+	ret = batch_run(&mb.batch);
+	if (ret && bad_qp)
+		*bad_qp = atomic_load(&mb.batch.bad);
+
+	return ret;
+}
@@ -225,6 +225,7 @@ int verbs_init_context(struct verbs_context *context_ex,
 
 	context_ex->priv->driver_id = driver_id;
 	verbs_set_ops(context_ex, &verbs_dummy_ops);
+	verbs_stats_init_context(context_ex);
 
 	return 0;
 }
@@ -297,12 +298,14 @@ LATEST_SYMVER_FUNC(ibv_open_device, 1_1, "IBVERBS_1.1",
 		return NULL;
 
 	set_lib_ops(context_ex);
+	verbs_stats_wrap_ops(context_ex);
 
 	return &context_ex->context;
 }
 
 void verbs_uninit_context(struct verbs_context *context_ex)
 {
+	verbs_stats_uninit_context(context_ex);
 	free(context_ex->priv);
 	close(context_ex->context.cmd_fd);
 	close(context_ex->context.async_fd);
@@ -77,7 +77,8 @@ struct verbs_srq {
 
 enum verbs_qp_mask {
 	VERBS_QP_XRCD		= 1 << 0,
-	VERBS_QP_RESERVED	= 1 << 1
+	VERBS_QP_EX		= 1 << 1,
+	VERBS_QP_RESERVED	= 1 << 2
 };
 
 enum ibv_gid_type {
@@ -101,7 +102,10 @@ static inline struct verbs_mr *verbs_get_mr(struct ibv_mr *mr)
 }
 
 struct verbs_qp {
-	struct ibv_qp		qp;
+	union {
+		struct ibv_qp		qp;
+		struct ibv_qp_ex	qp_ex;
+	};
 	uint32_t		comp_mask;
 	struct verbs_xrcd       *xrcd;
 };
@@ -383,6 +387,29 @@ void verbs_init_cq(struct ibv_cq *cq, struct ibv_context *context,
 		       struct ibv_comp_channel *channel,
 		       void *cq_context);
 
+/*
+ * Counters kept for each context when RDMAV_STATS is set. Providers may
+ * register counters of their own from alloc_context. Both calls do nothing
+ * when statistics are disabled.
+ */
+enum verbs_stats_counter {
+	VERBS_STATS_POST_SEND,
+	VERBS_STATS_SEND_WR,
+	VERBS_STATS_POST_RECV,
+	VERBS_STATS_RECV_WR,
+	VERBS_STATS_POLL_CQ,
+	VERBS_STATS_CQE,
+	VERBS_STATS_EMPTY_POLL,
+	VERBS_STATS_REG_MR,
+	VERBS_STATS_DEREG_MR,
+	VERBS_STATS_DOORBELL,		/* only counted by rxe */
+	VERBS_STATS_NUM_CORE,
+};
+
+/* Returns the index of the new counter, or -1 */
+int verbs_stats_register(struct ibv_context *context, const char *name);
+void verbs_stats_add(struct ibv_context *context, int counter, uint64_t val);
+
 int ibv_cmd_get_context(struct verbs_context *context,
 			struct ibv_get_context *cmd, size_t cmd_size,
 			struct ib_uverbs_get_context_resp *resp, size_t resp_size);
@@ -0,0 +1,254 @@
+/*
+ * This software is available to you under the OpenIB.org BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Measures the cost of ibv_get_device_list() for an increasing number of
+ * devices.  Each run builds a sysfs tree under a temporary directory and
+ * points SYSFS_PATH at it, so the devices are probed but never match a
+ * driver.  The first call, later calls that rescan sysfs, and later calls
+ * served from the cached device list are timed in separate processes.
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <infiniband/verbs.h>
+
+static int max_devs = 256;
+static int calls = 1000;
+static int use_host;
+
+static int write_file(const char *dir, const char *name, const char *value)
+{
+	char path[1024];
+	FILE *file;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	file = fopen(path, "w");
+	if (!file)
+		return -1;
+	fprintf(file, "%s\n", value);
+	return fclose(file);
+}
+
+static int build_sysfs(const char *root, int num_devs)
+{
+	char class[256], verbs[512], ibdev[512], value[64];
+	int i;
+
+	snprintf(class, sizeof(class), "%s/class", root);
+	snprintf(verbs, sizeof(verbs), "%s/infiniband_verbs", class);
+	snprintf(ibdev, sizeof(ibdev), "%s/infiniband", class);
+	if (mkdir(class, 0755) || mkdir(verbs, 0755) || mkdir(ibdev, 0755) ||
+	    write_file(verbs, "abi_version", "6"))
+		return -1;
+
+	for (i = 0; i < num_devs; i++) {
+		snprintf(ibdev, sizeof(ibdev), "%s/infiniband/bench_%d",
+			 class, i);
+		snprintf(verbs, sizeof(verbs), "%s/infiniband_verbs/uverbs%d",
+			 class, i);
+		snprintf(value, sizeof(value), "bench_%d", i);
+		if (mkdir(ibdev, 0755) || mkdir(verbs, 0755) ||
+		    write_file(verbs, "ibdev", value) ||
+		    write_file(verbs, "abi_version", "1"))
+			return -1;
+
+		strcat(verbs, "/device");
+		if (mkdir(verbs, 0755) ||
+		    write_file(verbs, "modalias",
+			       "pci:v000015B3d00001018sv000015B3sd00000001bc02sc00i00"))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+			struct FTW *ftw)
+{
+	return remove(path);
+}
+
+static double elapsed_us(struct timeval *start, struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000.0 +
+	       (end->tv_usec - start->tv_usec);
+}
+
+struct result {
+	double	us;
+	int	num_devs;
+};
+
+/* Runs in a child, since libibverbs reads its environment only once */
+static void time_calls(const char *root, int rescan, int first_only,
+		       struct result *res)
+{
+	struct ibv_device **list;
+	struct timeval start, end;
+	int i, num = first_only ? 1 : calls;
+
+	if (root)
+		setenv("SYSFS_PATH", root, 1);
+	if (rescan)
+		setenv("RDMAV_DEVICE_RESCAN", "1", 1);
+
+	if (!first_only)
+		ibv_free_device_list(ibv_get_device_list(NULL));
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < num; i++) {
+		list = ibv_get_device_list(&res->num_devs);
+		if (!list) {
+			res->us = -1;
+			return;
+		}
+		ibv_free_device_list(list);
+	}
+	gettimeofday(&end, NULL);
+
+	res->us = elapsed_us(&start, &end) / num;
+}
+
+static double run_child(const char *root, int rescan, int first_only,
+			int *num_devs)
+{
+	struct result res = { .us = -1 };
+	int fds[2], status;
+	pid_t pid;
+
+	if (pipe(fds))
+		return -1;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (!pid) {
+		time_calls(root, rescan, first_only, &res);
+		if (write(fds[1], &res, sizeof(res)) != sizeof(res))
+			_exit(1);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	if (read(fds[0], &res, sizeof(res)) != sizeof(res))
+		res.us = -1;
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+
+	if (num_devs)
+		*num_devs = res.num_devs;
+	return res.us;
+}
+
+/* Sysfs trees are reported by the number of device directories */
+static int run(const char *root, int num_devs)
+{
+	double first, rescan, cached;
+
+	first = run_child(root, 0, 1, root ? NULL : &num_devs);
+	rescan = run_child(root, 1, 0, NULL);
+	cached = run_child(root, 0, 0, NULL);
+	if (first < 0 || rescan < 0 || cached < 0) {
+		printf("ibv_get_device_list failed\n");
+		return -1;
+	}
+
+	printf("%-10d %12.1f %12.1f %12.1f\n", num_devs, first, rescan, cached);
+	return 0;
+}
+
+static int run_sysfs(int num_devs)
+{
+	char root[] = "/tmp/ibv_enum_bench.XXXXXX";
+	int ret;
+
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		return -1;
+	}
+
+	ret = build_sysfs(root, num_devs);
+	if (ret)
+		printf("failed to build sysfs tree under %s\n", root);
+	else
+		ret = run(root, num_devs);
+
+	nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int op, num_devs, ret = 0;
+
+	while ((op = getopt(argc, argv, "n:c:H")) != -1) {
+		switch (op) {
+		case 'n':
+			max_devs = atoi(optarg);
+			break;
+		case 'c':
+			calls = atoi(optarg);
+			break;
+		case 'H':
+			use_host = 1;
+			break;
+		default:
+			printf("usage: %s\n", argv[0]);
+			printf("\t[-n max_devices]\n");
+			printf("\t[-c calls_per_run]\n");
+			printf("\t[-H time the devices of this host]\n");
+			exit(1);
+		}
+	}
+
+	if (max_devs < 1 || calls < 1) {
+		printf("devices and calls must be positive\n");
+		exit(1);
+	}
+
+	printf("%-10s %12s %12s %12s\n", "devices", "first us",
+	       "rescan us", "cached us");
+
+	if (use_host)
+		return run(NULL, 0) ? 1 : 0;
+
+	for (num_devs = 1; !ret && num_devs <= max_devs; num_devs <<= 2)
+		ret = run_sysfs(num_devs);
+
+	return ret ? 1 : 0;
+}
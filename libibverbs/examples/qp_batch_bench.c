@@ -0,0 +1,330 @@
+/*
+ * This software is available to you under the OpenIB.org BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Measures the rate at which RC QPs are created and brought to RTS,
+ * comparing ibv_create_qp_ex() and ibv_modify_qp() called in a loop with
+ * ibv_create_qp_batch() and ibv_modify_qp_batch().  Each QP is connected
+ * to itself through the selected port.
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <infiniband/verbs.h>
+
+static char *ib_devname;
+static int ib_port = 1;
+static int gid_idx = -1;
+static unsigned int num_qps = 1024;
+
+struct bench {
+	struct ibv_context *context;
+	struct ibv_pd *pd;
+	struct ibv_cq *cq;
+	struct ibv_port_attr port_attr;
+	struct ibv_qp **qps;
+	struct ibv_qp_init_attr_ex *init_attrs;
+	struct ibv_qp_attr *attrs;
+};
+
+static double elapsed_us(struct timeval *start, struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000.0 +
+	       (end->tv_usec - start->tv_usec);
+}
+
+static void init_attrs(struct bench *b)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_qps; i++) {
+		b->init_attrs[i] = (struct ibv_qp_init_attr_ex) {
+			.send_cq = b->cq,
+			.recv_cq = b->cq,
+			.cap = {
+				.max_send_wr = 16,
+				.max_recv_wr = 16,
+				.max_send_sge = 1,
+				.max_recv_sge = 1,
+			},
+			.qp_type = IBV_QPT_RC,
+			.comp_mask = IBV_QP_INIT_ATTR_PD,
+			.pd = b->pd,
+		};
+	}
+}
+
+/* Fills the attributes that move each QP to @state, returns the mask */
+static int set_state_attrs(struct bench *b, enum ibv_qp_state state)
+{
+	union ibv_gid gid = {};
+	unsigned int i;
+
+	if (gid_idx >= 0)
+		ibv_query_gid(b->context, ib_port, gid_idx, &gid);
+
+	for (i = 0; i < num_qps; i++) {
+		struct ibv_qp_attr *attr = &b->attrs[i];
+
+		memset(attr, 0, sizeof(*attr));
+		attr->qp_state = state;
+
+		switch (state) {
+		case IBV_QPS_INIT:
+			attr->port_num = ib_port;
+			attr->qp_access_flags = IBV_ACCESS_REMOTE_WRITE;
+			break;
+		case IBV_QPS_RTR:
+			attr->path_mtu = IBV_MTU_1024;
+			attr->dest_qp_num = b->qps[i]->qp_num;
+			attr->max_dest_rd_atomic = 1;
+			attr->min_rnr_timer = 12;
+			attr->ah_attr.dlid = b->port_attr.lid;
+			attr->ah_attr.port_num = ib_port;
+			if (gid_idx >= 0) {
+				attr->ah_attr.is_global = 1;
+				attr->ah_attr.grh.hop_limit = 1;
+				attr->ah_attr.grh.dgid = gid;
+				attr->ah_attr.grh.sgid_index = gid_idx;
+			}
+			break;
+		default:
+			attr->timeout = 14;
+			attr->retry_cnt = 7;
+			attr->rnr_retry = 7;
+			attr->max_rd_atomic = 1;
+			break;
+		}
+	}
+
+	switch (state) {
+	case IBV_QPS_INIT:
+		return IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT |
+		       IBV_QP_ACCESS_FLAGS;
+	case IBV_QPS_RTR:
+		return IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+		       IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+		       IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
+	default:
+		return IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
+		       IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN |
+		       IBV_QP_MAX_QP_RD_ATOMIC;
+	}
+}
+
+static int create_loop(struct bench *b)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_qps; i++) {
+		b->qps[i] = ibv_create_qp_ex(b->context, &b->init_attrs[i]);
+		if (!b->qps[i])
+			return -1;
+	}
+	return 0;
+}
+
+static int create_batch(struct bench *b)
+{
+	return ibv_create_qp_batch(b->context, b->init_attrs, num_qps, b->qps);
+}
+
+static int connect_loop(struct bench *b)
+{
+	static const enum ibv_qp_state states[] = {
+		IBV_QPS_INIT, IBV_QPS_RTR, IBV_QPS_RTS
+	};
+	unsigned int i, s;
+	int mask;
+
+	for (s = 0; s < 3; s++) {
+		mask = set_state_attrs(b, states[s]);
+		for (i = 0; i < num_qps; i++)
+			if (ibv_modify_qp(b->qps[i], &b->attrs[i], mask))
+				return -1;
+	}
+	return 0;
+}
+
+static int connect_batch(struct bench *b)
+{
+	static const enum ibv_qp_state states[] = {
+		IBV_QPS_INIT, IBV_QPS_RTR, IBV_QPS_RTS
+	};
+	unsigned int s;
+	int mask;
+
+	for (s = 0; s < 3; s++) {
+		mask = set_state_attrs(b, states[s]);
+		if (ibv_modify_qp_batch(b->qps, b->attrs, mask, num_qps, NULL))
+			return -1;
+	}
+	return 0;
+}
+
+static void destroy_qps(struct bench *b)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_qps; i++) {
+		if (b->qps[i])
+			ibv_destroy_qp(b->qps[i]);
+		b->qps[i] = NULL;
+	}
+}
+
+static int run(struct bench *b, const char *name,
+	       int (*create)(struct bench *b),
+	       int (*connect)(struct bench *b))
+{
+	struct timeval start, mid, end;
+	int ret;
+
+	init_attrs(b);
+	gettimeofday(&start, NULL);
+	ret = create(b);
+	gettimeofday(&mid, NULL);
+	if (!ret)
+		ret = connect(b);
+	gettimeofday(&end, NULL);
+	destroy_qps(b);
+
+	if (ret) {
+		printf("%s failed\n", name);
+		return -1;
+	}
+
+	printf("%-8s %14.0f %14.0f\n", name,
+	       num_qps * 1000000.0 / elapsed_us(&start, &mid),
+	       num_qps * 1000000.0 / elapsed_us(&mid, &end));
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct ibv_device **dev_list, *ib_dev = NULL;
+	struct bench b = {};
+	int op, i, ret = 1;
+
+	while ((op = getopt(argc, argv, "d:i:g:n:")) != -1) {
+		switch (op) {
+		case 'd':
+			ib_devname = optarg;
+			break;
+		case 'i':
+			ib_port = atoi(optarg);
+			break;
+		case 'g':
+			gid_idx = atoi(optarg);
+			break;
+		case 'n':
+			num_qps = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			printf("usage: %s\n", argv[0]);
+			printf("\t[-d device]\n");
+			printf("\t[-i port]\n");
+			printf("\t[-g gid_index, required for RoCE]\n");
+			printf("\t[-n num_qps]\n");
+			exit(1);
+		}
+	}
+
+	if (!num_qps) {
+		printf("num_qps must be positive\n");
+		exit(1);
+	}
+
+	dev_list = ibv_get_device_list(NULL);
+	if (!dev_list) {
+		perror("Failed to get IB devices list");
+		return 1;
+	}
+
+	for (i = 0; dev_list[i]; i++) {
+		if (!ib_devname ||
+		    !strcmp(ibv_get_device_name(dev_list[i]), ib_devname)) {
+			ib_dev = dev_list[i];
+			break;
+		}
+	}
+	if (!ib_dev) {
+		fprintf(stderr, "IB device %s not found\n",
+			ib_devname ? ib_devname : "");
+		goto out_list;
+	}
+
+	b.context = ibv_open_device(ib_dev);
+	if (!b.context) {
+		fprintf(stderr, "Couldn't get context for %s\n",
+			ibv_get_device_name(ib_dev));
+		goto out_list;
+	}
+
+	if (ibv_query_port(b.context, ib_port, &b.port_attr)) {
+		fprintf(stderr, "Couldn't query port %d\n", ib_port);
+		goto out_context;
+	}
+
+	b.pd = ibv_alloc_pd(b.context);
+	b.cq = ibv_create_cq(b.context, 16, NULL, NULL, 0);
+	b.qps = calloc(num_qps, sizeof(*b.qps));
+	b.init_attrs = calloc(num_qps, sizeof(*b.init_attrs));
+	b.attrs = calloc(num_qps, sizeof(*b.attrs));
+	if (!b.pd || !b.cq || !b.qps || !b.init_attrs || !b.attrs) {
+		fprintf(stderr, "Couldn't allocate resources\n");
+		goto out_free;
+	}
+
+	printf("%u RC QPs on %s port %d\n", num_qps,
+	       ibv_get_device_name(ib_dev), ib_port);
+	printf("%-8s %14s %14s\n", "", "created/s", "connected/s");
+	if (!run(&b, "loop", create_loop, connect_loop) &&
+	    !run(&b, "batch", create_batch, connect_batch))
+		ret = 0;
+
+out_free:
+	free(b.attrs);
+	free(b.init_attrs);
+	free(b.qps);
+	if (b.cq)
+		ibv_destroy_cq(b.cq);
+	if (b.pd)
+		ibv_dealloc_pd(b.pd);
+out_context:
+	ibv_close_device(b.context);
+out_list:
+	ibv_free_device_list(dev_list);
+	return ret;
+}
@@ -60,6 +60,7 @@ static int use_odp;
 static int use_ts;
 static int validate_buf;
 static int use_dm;
+static int use_new_send;
 
 struct pingpong_context {
 	struct ibv_context	*context;
@@ -72,6 +73,7 @@ struct pingpong_context {
 		struct ibv_cq_ex	*cq_ex;
 	} cq_s;
 	struct ibv_qp		*qp;
+	struct ibv_qp_ex	*qpx;
 	char			*buf;
 	int			 size;
 	int			 send_flags;
@@ -464,12 +466,31 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 			.qp_type = IBV_QPT_RC
 		};
 
-		ctx->qp = ibv_create_qp(ctx->pd, &init_attr);
+		if (use_new_send) {
+			struct ibv_qp_init_attr_ex init_attr_ex = {
+				.send_cq = pp_cq(ctx),
+				.recv_cq = pp_cq(ctx),
+				.cap	 = init_attr.cap,
+				.qp_type = IBV_QPT_RC,
+				.comp_mask = IBV_QP_INIT_ATTR_PD |
+					     IBV_QP_INIT_ATTR_SEND_OPS_FLAGS,
+				.pd	 = ctx->pd,
+				.send_ops_flags = IBV_QP_EX_WITH_SEND,
+			};
+
+			ctx->qp = ibv_create_qp_ex(ctx->context, &init_attr_ex);
+		} else {
+			ctx->qp = ibv_create_qp(ctx->pd, &init_attr);
+		}
+
 		if (!ctx->qp)  {
 			fprintf(stderr, "Couldn't create QP\n");
 			goto clean_cq;
 		}
 
+		if (use_new_send)
+			ctx->qpx = ibv_qp_to_qp_ex(ctx->qp);
+
 		ibv_query_qp(ctx->qp, &attr, IBV_QP_CAP, &init_attr);
 		if (init_attr.cap.max_inline_data >= size) {
 			ctx->send_flags |= IBV_SEND_INLINE;
@@ -613,6 +634,22 @@ static int pp_post_send(struct pingpong_context *ctx)
 	};
 	struct ibv_send_wr *bad_wr;
 
+	if (use_new_send) {
+		ibv_wr_start(ctx->qpx);
+
+		ctx->qpx->wr_id = PINGPONG_SEND_WRID;
+		ctx->qpx->wr_flags = ctx->send_flags;
+
+		ibv_wr_send(ctx->qpx);
+		if (ctx->send_flags & IBV_SEND_INLINE)
+			ibv_wr_set_inline_data(ctx->qpx, ctx->buf, ctx->size);
+		else
+			ibv_wr_set_sge(ctx->qpx, list.lkey, list.addr,
+				       list.length);
+
+		return ibv_wr_complete(ctx->qpx);
+	}
+
 	return ibv_post_send(ctx->qp, &wr, &bad_wr);
 }
 
@@ -720,6 +757,7 @@ static void usage(const char *argv0)
 	printf("  -t, --ts	            get CQE with timestamp\n");
 	printf("  -c, --chk	            validate received buffer\n");
 	printf("  -j, --dm	            use device memory\n");
+	printf("  -N, --new_send         build sends with the ibv_wr_* calls\n");
 }
 
 int main(int argc, char *argv[])
@@ -767,10 +805,11 @@ int main(int argc, char *argv[])
 			{ .name = "ts",       .has_arg = 0, .val = 't' },
 			{ .name = "chk",      .has_arg = 0, .val = 'c' },
 			{ .name = "dm",       .has_arg = 0, .val = 'j' },
+			{ .name = "new_send", .has_arg = 0, .val = 'N' },
 			{}
 		};
 
-		c = getopt_long(argc, argv, "p:d:i:s:m:r:n:l:eg:otcj",
+		c = getopt_long(argc, argv, "p:d:i:s:m:r:n:l:eg:otcjN",
 				long_options, NULL);
 
 		if (c == -1)
@@ -843,6 +882,10 @@ int main(int argc, char *argv[])
 			use_dm = 1;
 			break;
 
+		case 'N':
+			use_new_send = 1;
+			break;
+
 		default:
 			usage(argv[0]);
 			return 1;
@@ -0,0 +1,252 @@
+/*
+ * This software is available to you under the OpenIB.org BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "../stats.h"
+
+#define MAX_SEGMENTS	256
+
+struct segment {
+	char name[256];
+	struct verbs_stats_segment *seg;
+	uint64_t prev[VERBS_STATS_MAX_COUNTERS];
+	bool seen;
+	/* Rates need a previous sample */
+	bool sampled;
+};
+
+static struct segment segments[MAX_SEGMENTS];
+static int num_segments;
+static int only_pid;
+static bool show_hist;
+
+static bool process_alive(pid_t pid)
+{
+	return !kill(pid, 0) || errno == EPERM;
+}
+
+static struct segment *find_segment(const char *name)
+{
+	int i;
+
+	for (i = 0; i < num_segments; i++)
+		if (!strcmp(segments[i].name, name))
+			return &segments[i];
+	return NULL;
+}
+
+static void drop_segment(int i)
+{
+	munmap(segments[i].seg, sizeof(*segments[i].seg));
+	segments[i] = segments[--num_segments];
+}
+
+static void map_segment(const char *name)
+{
+	struct verbs_stats_segment *seg;
+	struct segment *s;
+	char path[300];
+	int fd;
+
+	if (num_segments == MAX_SEGMENTS)
+		return;
+
+	snprintf(path, sizeof(path), "/dev/shm/%s", name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	seg = mmap(NULL, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED)
+		return;
+
+	if (seg->magic == VERBS_STATS_MAGIC && !process_alive(seg->pid))
+		/* Left behind by a process that crashed */
+		shm_unlink(name);
+
+	if (seg->magic != VERBS_STATS_MAGIC ||
+	    seg->version != VERBS_STATS_VERSION ||
+	    (only_pid && seg->pid != only_pid) || !process_alive(seg->pid)) {
+		munmap(seg, sizeof(*seg));
+		return;
+	}
+	atomic_thread_fence(memory_order_acquire);
+
+	s = &segments[num_segments++];
+	memset(s, 0, sizeof(*s));
+	snprintf(s->name, sizeof(s->name), "%s", name);
+	s->seg = seg;
+}
+
+/* Maps the segments of new contexts and drops those that went away */
+static void scan_segments(void)
+{
+	struct dirent *dent;
+	struct segment *s;
+	DIR *dir;
+	int i;
+
+	for (i = 0; i < num_segments; i++)
+		segments[i].seen = false;
+
+	dir = opendir("/dev/shm");
+	if (!dir)
+		return;
+
+	while ((dent = readdir(dir))) {
+		if (strncmp(dent->d_name, VERBS_STATS_SHM_PREFIX,
+			    strlen(VERBS_STATS_SHM_PREFIX)))
+			continue;
+
+		s = find_segment(dent->d_name);
+		if (!s) {
+			map_segment(dent->d_name);
+			s = find_segment(dent->d_name);
+		}
+		if (s)
+			s->seen = true;
+	}
+	closedir(dir);
+
+	for (i = num_segments - 1; i >= 0; i--)
+		if (!segments[i].seen || !process_alive(segments[i].seg->pid))
+			drop_segment(i);
+}
+
+static void print_hist(struct verbs_stats_segment *seg)
+{
+	static const char *const units[] = { "ns", "us", "ms", "s" };
+	uint64_t count, low;
+	int i, unit;
+
+	for (i = 0; i < VERBS_STATS_HIST_BUCKETS; i++) {
+		count = atomic_load_explicit(&seg->reg_mr_ns[i],
+					     memory_order_relaxed);
+		if (!count)
+			continue;
+
+		low = 1ULL << i;
+		for (unit = 0; unit < 3 && low >= 1000; unit++)
+			low /= 1000;
+		printf("    reg_mr >= %4llu %-2s %20llu\n",
+		       (unsigned long long)low, units[unit],
+		       (unsigned long long)count);
+	}
+}
+
+static void print_segment(struct segment *s, unsigned int interval)
+{
+	struct verbs_stats_segment *seg = s->seg;
+	uint32_t num, i;
+	uint64_t val;
+
+	num = atomic_load_explicit(&seg->num_counters, memory_order_acquire);
+	if (num > VERBS_STATS_MAX_COUNTERS)
+		num = VERBS_STATS_MAX_COUNTERS;
+
+	printf("pid %u %s\n", seg->pid, seg->device);
+	for (i = 0; i < num; i++) {
+		val = verbs_stats_read(seg, i);
+		if (val)
+			printf("    %-20.*s %14.0f/s %20llu\n",
+			       VERBS_STATS_NAME_MAX,
+			       seg->names[i],
+			       s->sampled ?
+				       (double)(val - s->prev[i]) / interval : 0.0,
+			       (unsigned long long)val);
+		s->prev[i] = val;
+	}
+	s->sampled = true;
+
+	if (show_hist)
+		print_hist(seg);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int interval = 1;
+	int op, i, count = -1;
+
+	while ((op = getopt(argc, argv, "p:i:c:H")) != -1) {
+		switch (op) {
+		case 'p':
+			only_pid = atoi(optarg);
+			break;
+		case 'i':
+			interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			count = atoi(optarg);
+			break;
+		case 'H':
+			show_hist = true;
+			break;
+		default:
+			printf("usage: %s\n", argv[0]);
+			printf("\t[-p pid]\n");
+			printf("\t[-i interval_seconds]\n");
+			printf("\t[-c count]\n");
+			printf("\t[-H show ibv_reg_mr latency histogram]\n");
+			exit(1);
+		}
+	}
+
+	if (!interval) {
+		printf("interval must be positive\n");
+		exit(1);
+	}
+
+	while (count) {
+		scan_segments();
+		for (i = 0; i < num_segments; i++)
+			print_segment(&segments[i], interval);
+		if (!num_segments)
+			printf("no processes with RDMAV_STATS set\n");
+		printf("\n");
+		fflush(stdout);
+
+		if (count > 0 && !--count)
+			break;
+		sleep(interval);
+	}
+
+	return 0;
+}
@@ -35,6 +35,7 @@
 #define IB_VERBS_H
 
 #include <pthread.h>
+#include <stdbool.h>
 
 #include <infiniband/driver.h>
 
@@ -62,10 +63,28 @@ int ibverbs_init(void);
 void ibverbs_device_put(struct ibv_device *dev);
 void ibverbs_device_hold(struct ibv_device *dev);
 
+int ibv_mr_cache_init(void);
+bool ibv_mr_cache_enabled(void);
+struct ibv_mr *ibv_mr_cache_get(struct ibv_pd *pd, void *addr, size_t length,
+				int access);
+void ibv_mr_cache_add(struct ibv_mr *mr, int access);
+int ibv_mr_cache_put(struct ibv_mr *mr);
+int ibv_mr_cache_detach(struct ibv_mr *mr);
+int ibv_mr_cache_flush(struct ibv_pd *pd);
+
+struct verbs_stats;
+void verbs_stats_enable(void);
+void verbs_stats_init_context(struct verbs_context *vctx);
+void verbs_stats_wrap_ops(struct verbs_context *vctx);
+void verbs_stats_uninit_context(struct verbs_context *vctx);
+void verbs_stats_reg_mr(struct ibv_context *context,
+			const struct timespec *start);
+
 struct verbs_ex_private {
 	BITMAP_DECLARE(unsupported_ioctls, VERBS_OPS_NUM);
 	uint32_t driver_id;
 	struct verbs_context_ops ops;
+	struct verbs_stats *stats;
 };
 
 static inline struct verbs_ex_private *get_priv(struct ibv_context *ctx)
@@ -78,6 +97,11 @@ static inline const struct verbs_context_ops *get_ops(struct ibv_context *ctx)
 	return &get_priv(ctx)->ops;
 }
 
+static inline bool verbs_stats_enabled(struct ibv_context *ctx)
+{
+	return get_priv(ctx)->stats;
+}
+
 #define IBV_INIT_CMD(cmd, size, opcode)					\
 	do {								\
 		(cmd)->hdr.command = IB_USER_VERBS_CMD_##opcode;	\
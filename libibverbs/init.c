@@ -81,99 +81,277 @@ static int try_access_device(const struct verbs_sysfs_dev *sysfs_dev)
 	return ret;
 }
 
-static int find_sysfs_devs(struct list_head *tmp_sysfs_dev_list)
+/*
+ * Probing a device reads several sysfs files, so large class directories,
+ * like those of hosts with many VFs, are probed by a few threads.
+ */
+#define PROBE_DEVS_PER_THREAD	4
+
+struct sysfs_probe {
+	const char *class_path;
+	char **names;
+	struct verbs_sysfs_dev **devs;
+	unsigned int num_names;
+	atomic_uint next;
+	atomic_int err;
+};
+
+static void free_names(char **names, unsigned int num_names)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_names; i++)
+		free(names[i]);
+	free(names);
+}
+
+/*
+ * Hash of a class directory entry.  The inode changes when a device is
+ * removed and added again under the same name, so that a re-created
+ * device is detected even though the set of names is the same.
+ */
+static uint64_t class_dir_entry_sig(const struct dirent *dent)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const char *c;
+	unsigned int i;
+
+	for (c = dent->d_name; *c; c++)
+		hash = (hash ^ (unsigned char)*c) * 0x100000001b3ULL;
+	for (i = 0; i < sizeof(dent->d_ino); i++)
+		hash = (hash ^ ((uint64_t)dent->d_ino >> (i * 8) & 0xff)) *
+		       0x100000001b3ULL;
+
+	return hash;
+}
+
+/* Also returns an order independent hash of the entries in *sig */
+static int read_class_dir(const char *class_path, char ***names,
+			  unsigned int *num_names, uint64_t *sig)
 {
-	char class_path[IBV_SYSFS_PATH_MAX];
 	DIR *class_dir;
 	struct dirent *dent;
-	struct verbs_sysfs_dev *sysfs_dev = NULL;
-	char value[8];
+	char **list = NULL, **tmp;
+	unsigned int num = 0, max = 0;
+	uint64_t hash = 0;
 	int ret = 0;
 
-	if (!check_snprintf(class_path, sizeof(class_path),
-			    "%s/class/infiniband_verbs", ibv_get_sysfs_path()))
-		return ENOMEM;
-
 	class_dir = opendir(class_path);
 	if (!class_dir)
 		return ENOSYS;
 
 	while ((dent = readdir(class_dir))) {
-		struct stat buf;
-
 		if (dent->d_name[0] == '.')
 			continue;
 
-		if (!sysfs_dev)
-			sysfs_dev = calloc(1, sizeof(*sysfs_dev));
-		if (!sysfs_dev) {
+		if (num == max) {
+			max = max ? max * 2 : 16;
+			tmp = realloc(list, max * sizeof(*list));
+			if (!tmp) {
+				ret = ENOMEM;
+				break;
+			}
+			list = tmp;
+		}
+
+		list[num] = strdup(dent->d_name);
+		if (!list[num]) {
 			ret = ENOMEM;
-			goto out;
+			break;
 		}
+		hash += class_dir_entry_sig(dent);
+		num++;
+	}
 
-		if (!check_snprintf(sysfs_dev->sysfs_path, sizeof sysfs_dev->sysfs_path,
-				    "%s/%s", class_path, dent->d_name))
-			continue;
+	closedir(class_dir);
+	if (ret) {
+		free_names(list, num);
+		return ret;
+	}
 
-		if (stat(sysfs_dev->sysfs_path, &buf)) {
-			fprintf(stderr, PFX "Warning: couldn't stat '%s'.\n",
-				sysfs_dev->sysfs_path);
-			continue;
-		}
+	*names = list;
+	*num_names = num;
+	*sig = hash + num;
+	return 0;
+}
 
-		if (!S_ISDIR(buf.st_mode))
-			continue;
+/* Returns 0 and sets *out to NULL if the entry is not a usable device */
+static int probe_sysfs_dev(const char *class_path, const char *name,
+			   struct verbs_sysfs_dev **out)
+{
+	struct verbs_sysfs_dev *sysfs_dev;
+	struct stat buf;
+	char value[8];
 
-		if (!check_snprintf(sysfs_dev->sysfs_name, sizeof sysfs_dev->sysfs_name,
-				    "%s", dent->d_name))
-			continue;
+	*out = NULL;
 
-		if (ibv_read_sysfs_file(sysfs_dev->sysfs_path, "ibdev",
-					sysfs_dev->ibdev_name,
-					sizeof sysfs_dev->ibdev_name) < 0) {
-			fprintf(stderr, PFX "Warning: no ibdev class attr for '%s'.\n",
-				dent->d_name);
-			continue;
-		}
+	sysfs_dev = calloc(1, sizeof(*sysfs_dev));
+	if (!sysfs_dev)
+		return ENOMEM;
 
-		if (!check_snprintf(
-			sysfs_dev->ibdev_path, sizeof(sysfs_dev->ibdev_path),
-			"%s/class/infiniband/%s", ibv_get_sysfs_path(),
-			sysfs_dev->ibdev_name))
-			continue;
+	if (!check_snprintf(sysfs_dev->sysfs_path, sizeof sysfs_dev->sysfs_path,
+			    "%s/%s", class_path, name))
+		goto skip;
 
-		if (stat(sysfs_dev->ibdev_path, &buf)) {
-			fprintf(stderr, PFX "Warning: couldn't stat '%s'.\n",
-				sysfs_dev->ibdev_path);
-			continue;
-		}
+	if (stat(sysfs_dev->sysfs_path, &buf)) {
+		fprintf(stderr, PFX "Warning: couldn't stat '%s'.\n",
+			sysfs_dev->sysfs_path);
+		goto skip;
+	}
 
-		if (try_access_device(sysfs_dev))
-			continue;
+	if (!S_ISDIR(buf.st_mode))
+		goto skip;
 
-		sysfs_dev->time_created = buf.st_mtim;
+	if (!check_snprintf(sysfs_dev->sysfs_name, sizeof sysfs_dev->sysfs_name,
+			    "%s", name))
+		goto skip;
 
-		if (ibv_read_sysfs_file(sysfs_dev->sysfs_path, "abi_version",
-					value, sizeof value) > 0)
-			sysfs_dev->abi_ver = strtol(value, NULL, 10);
+	if (ibv_read_sysfs_file(sysfs_dev->sysfs_path, "ibdev",
+				sysfs_dev->ibdev_name,
+				sizeof sysfs_dev->ibdev_name) < 0) {
+		fprintf(stderr, PFX "Warning: no ibdev class attr for '%s'.\n",
+			name);
+		goto skip;
+	}
 
-		if (ibv_read_sysfs_file(sysfs_dev->sysfs_path,
-					"device/modalias", sysfs_dev->modalias,
-					sizeof(sysfs_dev->modalias)) <= 0)
-			sysfs_dev->modalias[0] = 0;
+	if (!check_snprintf(
+		sysfs_dev->ibdev_path, sizeof(sysfs_dev->ibdev_path),
+		"%s/class/infiniband/%s", ibv_get_sysfs_path(),
+		sysfs_dev->ibdev_name))
+		goto skip;
 
-		list_add(tmp_sysfs_dev_list, &sysfs_dev->entry);
-		sysfs_dev      = NULL;
+	if (stat(sysfs_dev->ibdev_path, &buf)) {
+		fprintf(stderr, PFX "Warning: couldn't stat '%s'.\n",
+			sysfs_dev->ibdev_path);
+		goto skip;
 	}
 
- out:
-	if (sysfs_dev)
-		free(sysfs_dev);
+	if (try_access_device(sysfs_dev))
+		goto skip;
 
-	closedir(class_dir);
+	sysfs_dev->time_created = buf.st_mtim;
+
+	if (ibv_read_sysfs_file(sysfs_dev->sysfs_path, "abi_version",
+				value, sizeof value) > 0)
+		sysfs_dev->abi_ver = strtol(value, NULL, 10);
+
+	if (ibv_read_sysfs_file(sysfs_dev->sysfs_path,
+				"device/modalias", sysfs_dev->modalias,
+				sizeof(sysfs_dev->modalias)) <= 0)
+		sysfs_dev->modalias[0] = 0;
+
+	*out = sysfs_dev;
+	return 0;
+
+skip:
+	free(sysfs_dev);
+	return 0;
+}
+
+static void *probe_sysfs_worker(void *arg)
+{
+	struct sysfs_probe *probe = arg;
+	unsigned int i;
+	int ret;
+
+	while ((i = atomic_fetch_add(&probe->next, 1)) < probe->num_names) {
+		ret = probe_sysfs_dev(probe->class_path, probe->names[i],
+				      &probe->devs[i]);
+		if (ret)
+			atomic_store(&probe->err, ret);
+	}
+
+	return NULL;
+}
+
+/*
+ * Sets *complete if every entry in the class directory was probed as a
+ * usable device.
+ */
+static int find_sysfs_devs(struct list_head *tmp_sysfs_dev_list,
+			   uint64_t *sig, bool *complete)
+{
+	char class_path[IBV_SYSFS_PATH_MAX];
+	struct sysfs_probe probe = {};
+	unsigned int i;
+	int ret;
+
+	if (!check_snprintf(class_path, sizeof(class_path),
+			    "%s/class/infiniband_verbs", ibv_get_sysfs_path()))
+		return ENOMEM;
+
+	ret = read_class_dir(class_path, &probe.names, &probe.num_names, sig);
+	if (ret)
+		return ret;
+
+	probe.class_path = class_path;
+	probe.devs = calloc(probe.num_names, sizeof(*probe.devs));
+	if (!probe.devs && probe.num_names) {
+		ret = ENOMEM;
+		goto out;
+	}
+
+	run_workers(probe.num_names / PROBE_DEVS_PER_THREAD,
+		    probe_sysfs_worker, &probe);
+
+	ret = atomic_load(&probe.err);
+	*complete = true;
+	for (i = 0; i < probe.num_names; i++) {
+		if (!probe.devs[i]) {
+			*complete = false;
+			continue;
+		}
+		if (ret)
+			free(probe.devs[i]);
+		else
+			list_add(tmp_sysfs_dev_list, &probe.devs[i]->entry);
+	}
+
+	free(probe.devs);
+out:
+	free_names(probe.names, probe.num_names);
 	return ret;
 }
 
+/*
+ * The device list is kept between calls to ibverbs_get_device_list() and
+ * sysfs is only scanned again when a kobject uevent was seen for an RDMA
+ * device, when the entries in the infiniband_verbs class changed, or when
+ * the last scan left an entry without a device.  Without a uevent socket
+ * every call scans sysfs. All of this state is protected by the device
+ * list lock of the caller.
+ */
+static struct rdma_uevent uevent = { .fd = -1 };
+static bool device_rescan;
+static bool device_list_valid;
+static unsigned int cached_num_devices;
+static uint64_t cached_sig;
+
+static bool device_list_current(void)
+{
+	char class_path[IBV_SYSFS_PATH_MAX];
+	unsigned int num_names;
+	char **names;
+	uint64_t sig;
+
+	if (device_rescan)
+		return false;
+
+	if (rdma_uevent_pending(&uevent) || uevent.fd < 0 || !device_list_valid)
+		return false;
+
+	if (!check_snprintf(class_path, sizeof(class_path),
+			    "%s/class/infiniband_verbs", ibv_get_sysfs_path()))
+		return false;
+
+	if (read_class_dir(class_path, &names, &num_names, &sig))
+		return false;
+
+	free_names(names, num_names);
+
+	return sig == cached_sig;
+}
+
 void verbs_register_driver(const struct verbs_device_ops *ops)
 {
 	struct ibv_driver *driver;
@@ -616,9 +794,14 @@ int ibverbs_get_device_list(struct list_head *device_list)
 	static int drivers_loaded;
 	unsigned int num_devices = 0;
 	int statically_linked = 0;
+	bool complete;
 	int ret;
 
-	ret = find_sysfs_devs(&sysfs_list);
+	if (device_list_current())
+		return cached_num_devices;
+
+	device_list_valid = false;
+	ret = find_sysfs_devs(&sysfs_list, &cached_sig, &complete);
 	if (ret)
 		return -ret;
 
@@ -677,6 +860,12 @@ int ibverbs_get_device_list(struct list_head *device_list)
 	try_all_drivers(&sysfs_list, device_list, &num_devices);
 
 out:
+	/*
+	 * Keep the list only if every entry became a device.  An entry that
+	 * could not be accessed or matched no driver is probed again.
+	 */
+	device_list_valid = complete && list_empty(&sysfs_list);
+
 	/* Anything left in sysfs_list was not assoicated with a
 	 * driver.
 	 */
@@ -692,6 +881,7 @@ out:
 		free(sysfs_dev);
 	}
 
+	cached_num_devices = num_devices;
 	return num_devices;
 }
 
@@ -705,6 +895,17 @@ int ibverbs_init(void)
 			fprintf(stderr, PFX "Warning: fork()-safety requested "
 				"but init failed\n");
 
+	if (getenv("RDMAV_DEVICE_RESCAN"))
+		device_rescan = true;
+
+	if (getenv("RDMAV_STATS"))
+		verbs_stats_enable();
+
+	if (getenv("RDMAV_MR_CACHE"))
+		if (ibv_mr_cache_init())
+			fprintf(stderr, PFX "Warning: registration cache "
+				"requested but init failed\n");
+
 	sysfs_path = ibv_get_sysfs_path();
 	if (!sysfs_path)
 		return -ENOSYS;
@@ -43,6 +43,9 @@
 #include <dirent.h>
 #include <limits.h>
 #include <inttypes.h>
+#include <stdbool.h>
+
+#include <ccan/minmax.h>
 
 #include "ibverbs.h"
 
@@ -57,80 +60,141 @@ struct ibv_mem_node {
 	int			refcnt;
 };
 
-static struct ibv_mem_node *mm_root;
-static pthread_mutex_t mm_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * Ranges are tracked in a tree per shard, so that registrations of
+ * unrelated memory do not serialize on one lock.  The address space is cut
+ * into slices of 1 << MM_SHARD_SHIFT bytes, the size of a per-thread malloc
+ * heap, and each slice belongs to one shard.
+ */
+#define MM_SHARD_SHIFT	26
+#define MM_NUM_SHARDS	64
+
+struct ibv_mem_shard {
+	pthread_mutex_t		mutex;
+	struct ibv_mem_node    *root;
+};
+
+/* Mappings read from smaps, sorted by address */
+struct ibv_mem_vma {
+	uintptr_t		start, end;
+	unsigned long		page_size;
+};
+
+static struct ibv_mem_shard mm_shards[MM_NUM_SHARDS];
+static bool mm_initialized;
 static int page_size;
 static int huge_page_enabled;
 static int too_late;
 
-static unsigned long smaps_page_size(FILE *file)
+static pthread_rwlock_t vma_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct ibv_mem_vma *vma_cache;
+static int vma_cnt;
+
+static int vma_cache_load(void)
 {
-	int n;
-	unsigned long size = page_size;
+	struct ibv_mem_vma *vmas = NULL, *tmp;
+	int cnt = 0, max_cnt = 0;
+	uintptr_t range_start, range_end;
+	unsigned long size;
 	char buf[1024];
+	FILE *file;
+
+	file = fopen("/proc/self/smaps", "r" STREAM_CLOEXEC);
+	if (!file)
+		return errno;
 
 	while (fgets(buf, sizeof(buf), file) != NULL) {
-		if (!strstr(buf, "KernelPageSize:"))
-			continue;
+		if (sscanf(buf, "%" SCNxPTR "-%" SCNxPTR,
+			   &range_start, &range_end) == 2) {
+			if (cnt == max_cnt) {
+				max_cnt = max_cnt ? max_cnt * 2 : 256;
+				tmp = realloc(vmas, max_cnt * sizeof *vmas);
+				if (!tmp) {
+					free(vmas);
+					fclose(file);
+					return ENOMEM;
+				}
+				vmas = tmp;
+			}
 
-		n = sscanf(buf, "%*s %lu", &size);
-		if (n < 1)
+			vmas[cnt].start     = range_start;
+			vmas[cnt].end       = range_end;
+			vmas[cnt].page_size = page_size;
+			cnt++;
 			continue;
+		}
 
 		/* page size is printed in Kb */
-		size = size * 1024;
-
-		break;
+		if (cnt && sscanf(buf, "KernelPageSize: %lu", &size) == 1)
+			vmas[cnt - 1].page_size = size * 1024;
 	}
 
-	return size;
+	fclose(file);
+
+	free(vma_cache);
+	vma_cache = vmas;
+	vma_cnt   = cnt;
+	return 0;
 }
 
-static unsigned long get_page_size(void *base)
+static struct ibv_mem_vma *vma_cache_find(uintptr_t addr)
 {
-	unsigned long ret = page_size;
-	pid_t pid;
-	FILE *file;
-	char buf[1024];
-
-	pid = getpid();
-	snprintf(buf, sizeof(buf), "/proc/%d/smaps", pid);
-
-	file = fopen(buf, "r" STREAM_CLOEXEC);
-	if (!file)
-		goto out;
-
-	while (fgets(buf, sizeof(buf), file) != NULL) {
-		int n;
-		uintptr_t range_start, range_end;
-
-		n = sscanf(buf, "%" SCNxPTR "-%" SCNxPTR, &range_start, &range_end);
+	int lo = 0, hi = vma_cnt - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (addr < vma_cache[mid].start)
+			hi = mid - 1;
+		else if (addr >= vma_cache[mid].end)
+			lo = mid + 1;
+		else
+			return &vma_cache[mid];
+	}
 
-		if (n < 2)
-			continue;
+	return NULL;
+}
 
-		if ((uintptr_t) base >= range_start && (uintptr_t) base < range_end) {
-			ret = smaps_page_size(file);
-			break;
-		}
+/*
+ * Only the system page size is taken from the cache.  A mapping may be
+ * replaced behind our back, and rounding to a stale huge page size would
+ * mark unrelated memory DONTFORK without madvise failing, so huge pages
+ * always read smaps.  A stale system page size makes madvise fail on a
+ * huge page mapping, and the caller then asks for a reload.
+ */
+static unsigned long get_page_size(void *base, int reload)
+{
+	struct ibv_mem_vma *vma;
+	unsigned long ret = 0;
+
+	if (!reload) {
+		pthread_rwlock_rdlock(&vma_lock);
+		vma = vma_cache_find((uintptr_t) base);
+		if (vma && vma->page_size == page_size)
+			ret = vma->page_size;
+		pthread_rwlock_unlock(&vma_lock);
+		if (ret)
+			return ret;
 	}
 
-	fclose(file);
+	pthread_rwlock_wrlock(&vma_lock);
+	vma_cache_load();
+	vma = vma_cache_find((uintptr_t) base);
+	ret = vma ? vma->page_size : page_size;
+	pthread_rwlock_unlock(&vma_lock);
 
-out:
 	return ret;
 }
 
 int ibv_fork_init(void)
 {
 	void *tmp, *tmp_aligned;
-	int ret;
+	int ret, i;
 	unsigned long size;
 
 	if (getenv("RDMAV_HUGEPAGES_SAFE"))
 		huge_page_enabled = 1;
 
-	if (mm_root)
+	if (mm_initialized)
 		return 0;
 
 	if (too_late)
@@ -144,7 +208,7 @@ int ibv_fork_init(void)
 		return ENOMEM;
 
 	if (huge_page_enabled) {
-		size = get_page_size(tmp);
+		size = get_page_size(tmp, 0);
 		tmp_aligned = (void *) ((uintptr_t) tmp & ~(size - 1));
 	} else {
 		size = page_size;
@@ -159,19 +223,32 @@ int ibv_fork_init(void)
 	if (ret)
 		return ENOSYS;
 
-	mm_root = malloc(sizeof *mm_root);
-	if (!mm_root)
-		return ENOMEM;
+	for (i = 0; i < MM_NUM_SHARDS; i++) {
+		struct ibv_mem_node *root;
+
+		root = malloc(sizeof *root);
+		if (!root)
+			goto err;
+
+		root->parent = NULL;
+		root->left   = NULL;
+		root->right  = NULL;
+		root->color  = IBV_BLACK;
+		root->start  = 0;
+		root->end    = UINTPTR_MAX;
+		root->refcnt = 0;
 
-	mm_root->parent = NULL;
-	mm_root->left   = NULL;
-	mm_root->right  = NULL;
-	mm_root->color  = IBV_BLACK;
-	mm_root->start  = 0;
-	mm_root->end    = UINTPTR_MAX;
-	mm_root->refcnt = 0;
+		pthread_mutex_init(&mm_shards[i].mutex, NULL);
+		mm_shards[i].root = root;
+	}
 
+	mm_initialized = true;
 	return 0;
+
+err:
+	while (i--)
+		free(mm_shards[i].root);
+	return ENOMEM;
 }
 
 static struct ibv_mem_node *__mm_prev(struct ibv_mem_node *node)
@@ -206,7 +283,8 @@ static struct ibv_mem_node *__mm_next(struct ibv_mem_node *node)
 	return node;
 }
 
-static void __mm_rotate_right(struct ibv_mem_node *node)
+static void __mm_rotate_right(struct ibv_mem_shard *shard,
+			      struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *tmp;
 
@@ -222,7 +300,7 @@ static void __mm_rotate_right(struct ibv_mem_node *node)
 		else
 			node->parent->left = tmp;
 	} else
-		mm_root = tmp;
+		shard->root = tmp;
 
 	tmp->parent = node->parent;
 
@@ -230,7 +308,8 @@ static void __mm_rotate_right(struct ibv_mem_node *node)
 	node->parent = tmp;
 }
 
-static void __mm_rotate_left(struct ibv_mem_node *node)
+static void __mm_rotate_left(struct ibv_mem_shard *shard,
+			     struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *tmp;
 
@@ -246,7 +325,7 @@ static void __mm_rotate_left(struct ibv_mem_node *node)
 		else
 			node->parent->left = tmp;
 	} else
-		mm_root = tmp;
+		shard->root = tmp;
 
 	tmp->parent = node->parent;
 
@@ -282,7 +361,8 @@ static int verify(struct ibv_mem_node *node)
 }
 #endif
 
-static void __mm_add_rebalance(struct ibv_mem_node *node)
+static void __mm_add_rebalance(struct ibv_mem_shard *shard,
+			       struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *parent, *gp, *uncle;
 
@@ -301,7 +381,7 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				node = gp;
 			} else {
 				if (node == parent->right) {
-					__mm_rotate_left(parent);
+					__mm_rotate_left(shard, parent);
 					node   = parent;
 					parent = node->parent;
 				}
@@ -309,7 +389,7 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				gp->color     = IBV_RED;
 
-				__mm_rotate_right(gp);
+				__mm_rotate_right(shard, gp);
 			}
 		} else {
 			uncle = gp->left;
@@ -322,7 +402,7 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				node = gp;
 			} else {
 				if (node == parent->left) {
-					__mm_rotate_right(parent);
+					__mm_rotate_right(shard, parent);
 					node   = parent;
 					parent = node->parent;
 				}
@@ -330,19 +410,19 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				gp->color     = IBV_RED;
 
-				__mm_rotate_left(gp);
+				__mm_rotate_left(shard, gp);
 			}
 		}
 	}
 
-	mm_root->color = IBV_BLACK;
+	shard->root->color = IBV_BLACK;
 }
 
-static void __mm_add(struct ibv_mem_node *new)
+static void __mm_add(struct ibv_mem_shard *shard, struct ibv_mem_node *new)
 {
 	struct ibv_mem_node *node, *parent = NULL;
 
-	node = mm_root;
+	node = shard->root;
 	while (node) {
 		parent = node;
 		if (node->start < new->start)
@@ -361,10 +441,10 @@ static void __mm_add(struct ibv_mem_node *new)
 	new->right  = NULL;
 
 	new->color = IBV_RED;
-	__mm_add_rebalance(new);
+	__mm_add_rebalance(shard, new);
 }
 
-static void __mm_remove(struct ibv_mem_node *node)
+static void __mm_remove(struct ibv_mem_shard *shard, struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *child, *parent, *sib, *tmp;
 	int nodecol;
@@ -399,7 +479,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 			else
 				node->parent->right = tmp;
 		} else
-			mm_root = tmp;
+			shard->root = tmp;
 	} else {
 		nodecol = node->color;
 
@@ -414,7 +494,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 			else
 				parent->right = child;
 		} else
-			mm_root = child;
+			shard->root = child;
 	}
 
 	free(node);
@@ -422,14 +502,14 @@ static void __mm_remove(struct ibv_mem_node *node)
 	if (nodecol == IBV_RED)
 		return;
 
-	while ((!child || child->color == IBV_BLACK) && child != mm_root) {
+	while ((!child || child->color == IBV_BLACK) && child != shard->root) {
 		if (parent->left == child) {
 			sib = parent->right;
 
 			if (sib->color == IBV_RED) {
 				parent->color = IBV_RED;
 				sib->color    = IBV_BLACK;
-				__mm_rotate_left(parent);
+				__mm_rotate_left(shard, parent);
 				sib = parent->right;
 			}
 
@@ -443,7 +523,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 					if (sib->left)
 						sib->left->color = IBV_BLACK;
 					sib->color = IBV_RED;
-					__mm_rotate_right(sib);
+					__mm_rotate_right(shard, sib);
 					sib = parent->right;
 				}
 
@@ -451,8 +531,8 @@ static void __mm_remove(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				if (sib->right)
 					sib->right->color = IBV_BLACK;
-				__mm_rotate_left(parent);
-				child = mm_root;
+				__mm_rotate_left(shard, parent);
+				child = shard->root;
 				break;
 			}
 		} else {
@@ -461,7 +541,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 			if (sib->color == IBV_RED) {
 				parent->color = IBV_RED;
 				sib->color    = IBV_BLACK;
-				__mm_rotate_right(parent);
+				__mm_rotate_right(shard, parent);
 				sib = parent->left;
 			}
 
@@ -475,7 +555,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 					if (sib->right)
 						sib->right->color = IBV_BLACK;
 					sib->color = IBV_RED;
-					__mm_rotate_left(sib);
+					__mm_rotate_left(shard, sib);
 					sib = parent->left;
 				}
 
@@ -483,8 +563,8 @@ static void __mm_remove(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				if (sib->left)
 					sib->left->color = IBV_BLACK;
-				__mm_rotate_right(parent);
-				child = mm_root;
+				__mm_rotate_right(shard, parent);
+				child = shard->root;
 				break;
 			}
 		}
@@ -494,9 +574,10 @@ static void __mm_remove(struct ibv_mem_node *node)
 		child->color = IBV_BLACK;
 }
 
-static struct ibv_mem_node *__mm_find_start(uintptr_t start, uintptr_t end)
+static struct ibv_mem_node *__mm_find_start(struct ibv_mem_shard *shard,
+					    uintptr_t start, uintptr_t end)
 {
-	struct ibv_mem_node *node = mm_root;
+	struct ibv_mem_node *node = shard->root;
 
 	while (node) {
 		if (node->start <= start && node->end >= start)
@@ -511,17 +592,19 @@ static struct ibv_mem_node *__mm_find_start(uintptr_t start, uintptr_t end)
 	return node;
 }
 
-static struct ibv_mem_node *merge_ranges(struct ibv_mem_node *node,
+static struct ibv_mem_node *merge_ranges(struct ibv_mem_shard *shard,
+					 struct ibv_mem_node *node,
 					 struct ibv_mem_node *prev)
 {
 	prev->end = node->end;
 	prev->refcnt = node->refcnt;
-	__mm_remove(node);
+	__mm_remove(shard, node);
 
 	return prev;
 }
 
-static struct ibv_mem_node *split_range(struct ibv_mem_node *node,
+static struct ibv_mem_node *split_range(struct ibv_mem_shard *shard,
+					struct ibv_mem_node *node,
 					uintptr_t cut_line)
 {
 	struct ibv_mem_node *new_node = NULL;
@@ -533,23 +616,24 @@ static struct ibv_mem_node *split_range(struct ibv_mem_node *node,
 	new_node->end    = node->end;
 	new_node->refcnt = node->refcnt;
 	node->end  = cut_line - 1;
-	__mm_add(new_node);
+	__mm_add(shard, new_node);
 
 	return new_node;
 }
 
-static struct ibv_mem_node *get_start_node(uintptr_t start, uintptr_t end,
+static struct ibv_mem_node *get_start_node(struct ibv_mem_shard *shard,
+					   uintptr_t start, uintptr_t end,
 					   int inc)
 {
 	struct ibv_mem_node *node, *tmp = NULL;
 
-	node = __mm_find_start(start, end);
+	node = __mm_find_start(shard, start, end);
 	if (node->start < start)
-		node = split_range(node, start);
+		node = split_range(shard, node, start);
 	else {
 		tmp = __mm_prev(node);
 		if (tmp && tmp->refcnt == node->refcnt + inc)
-			node = merge_ranges(node, tmp);
+			node = merge_ranges(shard, node, tmp);
 	}
 	return node;
 }
@@ -558,7 +642,8 @@ static struct ibv_mem_node *get_start_node(uintptr_t start, uintptr_t end,
  * This function is called if madvise() fails to undo merging/splitting
  * operations performed on the node.
  */
-static struct ibv_mem_node *undo_node(struct ibv_mem_node *node,
+static struct ibv_mem_node *undo_node(struct ibv_mem_shard *shard,
+				      struct ibv_mem_node *node,
 				      uintptr_t start, int inc)
 {
 	struct ibv_mem_node *tmp = NULL;
@@ -568,7 +653,7 @@ static struct ibv_mem_node *undo_node(struct ibv_mem_node *node,
 	 * node with the previous one, so we need to split them.
 	*/
 	if (start > node->start) {
-		tmp = split_range(node, start);
+		tmp = split_range(shard, node, start);
 		if (tmp) {
 			node->refcnt += inc;
 			node = tmp;
@@ -578,41 +663,28 @@ static struct ibv_mem_node *undo_node(struct ibv_mem_node *node,
 
 	tmp  =  __mm_prev(node);
 	if (tmp && tmp->refcnt == node->refcnt)
-		node = merge_ranges(node, tmp);
+		node = merge_ranges(shard, node, tmp);
 
 	tmp  =  __mm_next(node);
 	if (tmp && tmp->refcnt == node->refcnt)
-		node = merge_ranges(tmp, node);
+		node = merge_ranges(shard, tmp, node);
 
 	return node;
 }
 
-static int ibv_madvise_range(void *base, size_t size, int advice)
+static int mm_madvise_shard(struct ibv_mem_shard *shard, uintptr_t start,
+			    uintptr_t end, int advice)
 {
-	uintptr_t start, end;
 	struct ibv_mem_node *node, *tmp;
 	int inc;
 	int rolling_back = 0;
 	int ret = 0;
-	unsigned long range_page_size;
-
-	if (!size || !base)
-		return 0;
-
-	if (huge_page_enabled)
-		range_page_size = get_page_size(base);
-	else
-		range_page_size = page_size;
-
-	start = (uintptr_t) base & ~(range_page_size - 1);
-	end   = ((uintptr_t) (base + size + range_page_size - 1) &
-		 ~(range_page_size - 1)) - 1;
 
-	pthread_mutex_lock(&mm_mutex);
+	pthread_mutex_lock(&shard->mutex);
 again:
 	inc = advice == MADV_DONTFORK ? 1 : -1;
 
-	node = get_start_node(start, end, inc);
+	node = get_start_node(shard, start, end, inc);
 	if (!node) {
 		ret = -1;
 		goto out;
@@ -620,7 +692,7 @@ again:
 
 	while (node && node->start <= end) {
 		if (node->end > end) {
-			if (!split_range(node, end + 1)) {
+			if (!split_range(shard, node, end + 1)) {
 				ret = -1;
 				goto out;
 			}
@@ -647,7 +719,7 @@ again:
 					      node->end - node->start + 1,
 					      advice);
 			if (ret) {
-				node = undo_node(node, start, inc);
+				node = undo_node(shard, node, start, inc);
 
 				if (rolling_back || !node)
 					goto out;
@@ -671,21 +743,88 @@ again:
 	if (node) {
 		tmp = __mm_prev(node);
 		if (tmp && node->refcnt == tmp->refcnt)
-			node = merge_ranges(node, tmp);
+			node = merge_ranges(shard, node, tmp);
 	}
 
 out:
 	if (rolling_back)
 		ret = -1;
 
-	pthread_mutex_unlock(&mm_mutex);
+	pthread_mutex_unlock(&shard->mutex);
+
+	return ret;
+}
+
+static struct ibv_mem_shard *mm_get_shard(uintptr_t addr, uintptr_t slice)
+{
+	return &mm_shards[(addr / slice) % MM_NUM_SHARDS];
+}
+
+static int mm_madvise_slices(uintptr_t start, uintptr_t end, uintptr_t slice,
+			     int advice)
+{
+	uintptr_t cur = start, last;
+	int ret;
+
+	for (;;) {
+		last = min(end, cur | (slice - 1));
+		ret = mm_madvise_shard(mm_get_shard(cur, slice), cur, last,
+				       advice);
+		if (ret) {
+			/* Roll back the slices already done */
+			if (cur > start)
+				mm_madvise_slices(start, cur - 1, slice,
+						  advice == MADV_DONTFORK ?
+						  MADV_DOFORK : MADV_DONTFORK);
+			return ret;
+		}
+
+		if (last == end)
+			return 0;
+		cur = last + 1;
+	}
+}
+
+static int ibv_madvise_range(void *base, size_t size, int advice)
+{
+	uintptr_t start, end;
+	unsigned long range_page_size;
+	int reload = 0;
+	int ret;
+
+	if (!size || !base)
+		return 0;
+
+again:
+	if (huge_page_enabled)
+		range_page_size = get_page_size(base, reload);
+	else
+		range_page_size = page_size;
+
+	start = (uintptr_t) base & ~(range_page_size - 1);
+	end   = ((uintptr_t) (base + size + range_page_size - 1) &
+		 ~(range_page_size - 1)) - 1;
+
+	/* A huge page is never split between shards */
+	ret = mm_madvise_slices(start, end,
+				max(1UL << MM_SHARD_SHIFT, range_page_size),
+				advice);
+
+	/*
+	 * A stale page size gives a misaligned range, which madvise()
+	 * rejects, so read the mappings again and retry.
+	 */
+	if (ret && huge_page_enabled && !reload) {
+		reload = 1;
+		goto again;
+	}
 
 	return ret;
 }
 
 int ibv_dontfork_range(void *base, size_t size)
 {
-	if (mm_root)
+	if (mm_initialized)
 		return ibv_madvise_range(base, size, MADV_DONTFORK);
 	else {
 		too_late = 1;
@@ -695,7 +834,7 @@ int ibv_dontfork_range(void *base, size_t size)
 
 int ibv_dofork_range(void *base, size_t size)
 {
-	if (mm_root)
+	if (mm_initialized)
 		return ibv_madvise_range(base, size, MADV_DOFORK);
 	else {
 		too_late = 1;
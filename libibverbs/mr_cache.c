@@ -0,0 +1,791 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+#include <ccan/list.h>
+
+#include "ibverbs.h"
+
+/*
+ * Registration cache
+ *
+ * Memory regions registered through ibv_reg_mr() are kept after
+ * ibv_dereg_mr() and handed back when the same range is registered again
+ * with the same PD and access flags.  Entries live in a red-black tree
+ * ordered by start address, which is augmented with the highest last
+ * address of each subtree so that all entries overlapping a range can be
+ * found.  Unused entries are kept on an LRU list and are deregistered once
+ * the pinned bytes would exceed the configured limit.
+ *
+ * A cached registration is only valid while the pages behind it stay
+ * mapped.  The cached ranges are registered with a userfaultfd, which
+ * reports munmap(), mremap() and madvise(MADV_DONTNEED) of them.  munmap()
+ * and madvise() do not return until the event has been read, and events
+ * are read and handled with mrc_mutex held, so a registration that follows
+ * the call cannot find the old entry.  Threads must therefore never hold
+ * mrc_mutex across a call that may unmap memory, such as free() or
+ * ibv_dereg_mr().  Ranges are unregistered from the userfaultfd once no
+ * valid entry covers them, and a page fault that races with that is
+ * resolved by the event thread.
+ */
+struct ibv_mr_cache_entry {
+	enum {
+		MRC_RED,
+		MRC_BLACK
+	}			color;
+	struct ibv_mr_cache_entry *parent;
+	struct ibv_mr_cache_entry *left, *right;
+	uintptr_t		start, last;
+	uintptr_t		max_last;
+	struct ibv_mr	       *mr;
+	int			access;
+	int			refcnt;
+	bool			invalid;
+	struct list_node	lru_entry;
+	struct list_node	free_entry;
+};
+
+static struct ibv_mr_cache_entry *mrc_root;
+static pthread_mutex_t mrc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(mrc_lru);
+static LIST_HEAD(mrc_free_list);
+static bool mrc_enabled;
+static uint64_t mrc_max_pinned = 1ULL << 30;
+static struct ibv_mr_cache_stats mrc_stats;
+static uintptr_t mrc_page_mask;
+static int mrc_uffd = -1;
+
+static uintptr_t __mrc_max_last(struct ibv_mr_cache_entry *node)
+{
+	uintptr_t max_last = node->last;
+
+	if (node->left && node->left->max_last > max_last)
+		max_last = node->left->max_last;
+	if (node->right && node->right->max_last > max_last)
+		max_last = node->right->max_last;
+
+	return max_last;
+}
+
+static void __mrc_update_path(struct ibv_mr_cache_entry *node)
+{
+	for (; node; node = node->parent)
+		node->max_last = __mrc_max_last(node);
+}
+
+static void __mrc_rotate_right(struct ibv_mr_cache_entry *node)
+{
+	struct ibv_mr_cache_entry *tmp;
+
+	tmp = node->left;
+
+	node->left = tmp->right;
+	if (node->left)
+		node->left->parent = node;
+
+	if (node->parent) {
+		if (node->parent->right == node)
+			node->parent->right = tmp;
+		else
+			node->parent->left = tmp;
+	} else
+		mrc_root = tmp;
+
+	tmp->parent = node->parent;
+
+	tmp->right = node;
+	node->parent = tmp;
+
+	node->max_last = __mrc_max_last(node);
+	tmp->max_last  = __mrc_max_last(tmp);
+}
+
+static void __mrc_rotate_left(struct ibv_mr_cache_entry *node)
+{
+	struct ibv_mr_cache_entry *tmp;
+
+	tmp = node->right;
+
+	node->right = tmp->left;
+	if (node->right)
+		node->right->parent = node;
+
+	if (node->parent) {
+		if (node->parent->right == node)
+			node->parent->right = tmp;
+		else
+			node->parent->left = tmp;
+	} else
+		mrc_root = tmp;
+
+	tmp->parent = node->parent;
+
+	tmp->left = node;
+	node->parent = tmp;
+
+	node->max_last = __mrc_max_last(node);
+	tmp->max_last  = __mrc_max_last(tmp);
+}
+
+static void __mrc_add_rebalance(struct ibv_mr_cache_entry *node)
+{
+	struct ibv_mr_cache_entry *parent, *gp, *uncle;
+
+	while (node->parent && node->parent->color == MRC_RED) {
+		parent = node->parent;
+		gp     = node->parent->parent;
+
+		if (parent == gp->left) {
+			uncle = gp->right;
+
+			if (uncle && uncle->color == MRC_RED) {
+				parent->color = MRC_BLACK;
+				uncle->color  = MRC_BLACK;
+				gp->color     = MRC_RED;
+
+				node = gp;
+			} else {
+				if (node == parent->right) {
+					__mrc_rotate_left(parent);
+					node   = parent;
+					parent = node->parent;
+				}
+
+				parent->color = MRC_BLACK;
+				gp->color     = MRC_RED;
+
+				__mrc_rotate_right(gp);
+			}
+		} else {
+			uncle = gp->left;
+
+			if (uncle && uncle->color == MRC_RED) {
+				parent->color = MRC_BLACK;
+				uncle->color  = MRC_BLACK;
+				gp->color     = MRC_RED;
+
+				node = gp;
+			} else {
+				if (node == parent->left) {
+					__mrc_rotate_right(parent);
+					node   = parent;
+					parent = node->parent;
+				}
+
+				parent->color = MRC_BLACK;
+				gp->color     = MRC_RED;
+
+				__mrc_rotate_left(gp);
+			}
+		}
+	}
+
+	mrc_root->color = MRC_BLACK;
+}
+
+static void __mrc_add(struct ibv_mr_cache_entry *new)
+{
+	struct ibv_mr_cache_entry *node, *parent = NULL;
+
+	new->parent   = NULL;
+	new->left     = NULL;
+	new->right    = NULL;
+	new->max_last = new->last;
+
+	node = mrc_root;
+	while (node) {
+		parent = node;
+		if (node->max_last < new->last)
+			node->max_last = new->last;
+		if (node->start < new->start)
+			node = node->right;
+		else
+			node = node->left;
+	}
+
+	if (!parent)
+		mrc_root = new;
+	else if (parent->start < new->start)
+		parent->right = new;
+	else
+		parent->left = new;
+
+	new->parent = parent;
+	new->color  = MRC_RED;
+	__mrc_add_rebalance(new);
+}
+
+static void __mrc_remove(struct ibv_mr_cache_entry *node)
+{
+	struct ibv_mr_cache_entry *child, *parent, *sib, *tmp;
+	int nodecol;
+
+	if (node->left && node->right) {
+		tmp = node->left;
+		while (tmp->right)
+			tmp = tmp->right;
+
+		nodecol    = tmp->color;
+		child      = tmp->left;
+		tmp->color = node->color;
+
+		if (tmp->parent != node) {
+			parent        = tmp->parent;
+			parent->right = tmp->left;
+			if (tmp->left)
+				tmp->left->parent = parent;
+
+			tmp->left          = node->left;
+			node->left->parent = tmp;
+		} else
+			parent = tmp;
+
+		tmp->right          = node->right;
+		node->right->parent = tmp;
+
+		tmp->parent = node->parent;
+		if (node->parent) {
+			if (node->parent->left == node)
+				node->parent->left = tmp;
+			else
+				node->parent->right = tmp;
+		} else
+			mrc_root = tmp;
+	} else {
+		nodecol = node->color;
+
+		child  = node->left ? node->left : node->right;
+		parent = node->parent;
+
+		if (child)
+			child->parent = parent;
+		if (parent) {
+			if (parent->left == node)
+				parent->left = child;
+			else
+				parent->right = child;
+		} else
+			mrc_root = child;
+	}
+
+	/* Rotations keep max_last, so only the spliced path needs fixing */
+	__mrc_update_path(parent);
+
+	if (nodecol == MRC_RED)
+		return;
+
+	while ((!child || child->color == MRC_BLACK) && child != mrc_root) {
+		if (parent->left == child) {
+			sib = parent->right;
+
+			if (sib->color == MRC_RED) {
+				parent->color = MRC_RED;
+				sib->color    = MRC_BLACK;
+				__mrc_rotate_left(parent);
+				sib = parent->right;
+			}
+
+			if ((!sib->left  || sib->left->color  == MRC_BLACK) &&
+			    (!sib->right || sib->right->color == MRC_BLACK)) {
+				sib->color = MRC_RED;
+				child  = parent;
+				parent = child->parent;
+			} else {
+				if (!sib->right || sib->right->color == MRC_BLACK) {
+					if (sib->left)
+						sib->left->color = MRC_BLACK;
+					sib->color = MRC_RED;
+					__mrc_rotate_right(sib);
+					sib = parent->right;
+				}
+
+				sib->color    = parent->color;
+				parent->color = MRC_BLACK;
+				if (sib->right)
+					sib->right->color = MRC_BLACK;
+				__mrc_rotate_left(parent);
+				child = mrc_root;
+				break;
+			}
+		} else {
+			sib = parent->left;
+
+			if (sib->color == MRC_RED) {
+				parent->color = MRC_RED;
+				sib->color    = MRC_BLACK;
+				__mrc_rotate_right(parent);
+				sib = parent->left;
+			}
+
+			if ((!sib->left  || sib->left->color  == MRC_BLACK) &&
+			    (!sib->right || sib->right->color == MRC_BLACK)) {
+				sib->color = MRC_RED;
+				child  = parent;
+				parent = child->parent;
+			} else {
+				if (!sib->left || sib->left->color == MRC_BLACK) {
+					if (sib->right)
+						sib->right->color = MRC_BLACK;
+					sib->color = MRC_RED;
+					__mrc_rotate_left(sib);
+					sib = parent->left;
+				}
+
+				sib->color    = parent->color;
+				parent->color = MRC_BLACK;
+				if (sib->left)
+					sib->left->color = MRC_BLACK;
+				__mrc_rotate_right(parent);
+				child = mrc_root;
+				break;
+			}
+		}
+	}
+
+	if (child)
+		child->color = MRC_BLACK;
+}
+
+/* Leftmost entry under node overlapping [start, last] */
+static struct ibv_mr_cache_entry *
+__mrc_subtree_first(struct ibv_mr_cache_entry *node, uintptr_t start,
+		    uintptr_t last)
+{
+	while (node) {
+		if (node->left && node->left->max_last >= start) {
+			node = node->left;
+			continue;
+		}
+
+		if (node->start > last)
+			return NULL;
+		if (node->last >= start)
+			return node;
+
+		node = node->right;
+		if (node && node->max_last < start)
+			return NULL;
+	}
+
+	return NULL;
+}
+
+static struct ibv_mr_cache_entry *__mrc_first(uintptr_t start, uintptr_t last)
+{
+	if (!mrc_root || mrc_root->max_last < start)
+		return NULL;
+
+	return __mrc_subtree_first(mrc_root, start, last);
+}
+
+static struct ibv_mr_cache_entry *__mrc_next(struct ibv_mr_cache_entry *node,
+					     uintptr_t start, uintptr_t last)
+{
+	struct ibv_mr_cache_entry *prev;
+
+	for (;;) {
+		if (node->right && node->right->max_last >= start)
+			return __mrc_subtree_first(node->right, start, last);
+
+		/* Climb until we arrive from a left child */
+		do {
+			prev = node;
+			node = node->parent;
+			if (!node)
+				return NULL;
+		} while (prev == node->right);
+
+		if (node->start > last)
+			return NULL;
+		if (node->last >= start)
+			return node;
+	}
+}
+
+#define mrc_for_each_overlap(node, start, last)				\
+	for (node = __mrc_first(start, last); node;			\
+	     node = __mrc_next(node, start, last))
+
+static uintptr_t mrc_page_start(struct ibv_mr_cache_entry *entry)
+{
+	return entry->start & ~mrc_page_mask;
+}
+
+static uintptr_t mrc_page_last(struct ibv_mr_cache_entry *entry)
+{
+	return entry->last | mrc_page_mask;
+}
+
+static uint64_t mrc_pinned_size(struct ibv_mr_cache_entry *entry)
+{
+	return mrc_page_last(entry) - mrc_page_start(entry) + 1;
+}
+
+static void __mrc_unregister_range(uintptr_t start, uintptr_t last)
+{
+	struct uffdio_range range;
+	struct ibv_mr_cache_entry *entry;
+
+	mrc_for_each_overlap(entry, start, last)
+		if (!entry->invalid)
+			return;
+
+	range.start = start;
+	range.len   = last - start + 1;
+	ioctl(mrc_uffd, UFFDIO_UNREGISTER, &range);
+}
+
+static void __mrc_unlink(struct ibv_mr_cache_entry *entry)
+{
+	__mrc_remove(entry);
+	if (!entry->invalid) {
+		/* Invalid entries are off the LRU and no longer counted */
+		if (!entry->refcnt)
+			list_del(&entry->lru_entry);
+		mrc_stats.pinned_bytes -= mrc_pinned_size(entry);
+	}
+	mrc_stats.num_entries--;
+	__mrc_unregister_range(mrc_page_start(entry), mrc_page_last(entry));
+}
+
+/*
+ * Unlinked entries are deregistered by the next application thread to
+ * leave the cache, never by the event thread: freeing the MR may unmap
+ * memory, and the event thread cannot wait on its own events.
+ */
+static void __mrc_drop(struct ibv_mr_cache_entry *entry)
+{
+	__mrc_unlink(entry);
+	list_add_tail(&mrc_free_list, &entry->free_entry);
+}
+
+static void mrc_unlock_and_free(void)
+{
+	struct ibv_mr_cache_entry *entry, *tmp;
+	LIST_HEAD(free_list);
+
+	list_append_list(&free_list, &mrc_free_list);
+	pthread_mutex_unlock(&mrc_mutex);
+
+	list_for_each_safe(&free_list, entry, tmp, free_entry) {
+		ibv_dereg_mr(entry->mr);
+		free(entry);
+	}
+}
+
+static void __mrc_invalidate(uintptr_t start, uintptr_t last)
+{
+	struct ibv_mr_cache_entry *entry, *next;
+
+	for (entry = __mrc_first(start, last); entry; entry = next) {
+		next = __mrc_next(entry, start, last);
+		if (entry->invalid)
+			continue;
+
+		mrc_stats.invalidations++;
+		if (entry->refcnt) {
+			/* Dropped by the last ibv_dereg_mr() */
+			entry->invalid = true;
+			mrc_stats.pinned_bytes -= mrc_pinned_size(entry);
+			continue;
+		}
+
+		/* Removal may rotate the tree, so search again */
+		__mrc_drop(entry);
+		next = __mrc_first(start, last);
+	}
+}
+
+static void __mrc_handle_event(struct uffd_msg *msg)
+{
+	struct uffdio_zeropage zero;
+
+	switch (msg->event) {
+	case UFFD_EVENT_UNMAP:
+		__mrc_invalidate(msg->arg.remove.start, msg->arg.remove.end - 1);
+		break;
+	case UFFD_EVENT_REMOVE:
+		__mrc_invalidate(msg->arg.remove.start, msg->arg.remove.end - 1);
+		__mrc_unregister_range(msg->arg.remove.start,
+				       msg->arg.remove.end - 1);
+		break;
+	case UFFD_EVENT_REMAP:
+		__mrc_invalidate(msg->arg.remap.from,
+				 msg->arg.remap.from + msg->arg.remap.len - 1);
+		__mrc_unregister_range(msg->arg.remap.to,
+				       msg->arg.remap.to + msg->arg.remap.len - 1);
+		break;
+	case UFFD_EVENT_PAGEFAULT:
+		/*
+		 * A page removed from a cached range was touched before the
+		 * range was unregistered.  Anonymous memory reads back zero.
+		 */
+		zero.range.start = msg->arg.pagefault.address & ~mrc_page_mask;
+		zero.range.len   = mrc_page_mask + 1;
+		zero.mode        = 0;
+		ioctl(mrc_uffd, UFFDIO_ZEROPAGE, &zero);
+		break;
+	}
+}
+
+static void *mrc_event_thread(void *arg)
+{
+	struct pollfd fds = { .fd = mrc_uffd, .events = POLLIN };
+	struct uffd_msg msg;
+
+	for (;;) {
+		if (poll(&fds, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		pthread_mutex_lock(&mrc_mutex);
+		while (read(mrc_uffd, &msg, sizeof msg) == sizeof msg)
+			__mrc_handle_event(&msg);
+		pthread_mutex_unlock(&mrc_mutex);
+	}
+
+	return NULL;
+}
+
+static void mrc_atfork_child(void)
+{
+	/* The event thread and the userfaultfd ranges are not inherited */
+	mrc_enabled = false;
+}
+
+int ibv_mr_cache_init(void)
+{
+	struct uffdio_api api = {
+		.api = UFFD_API,
+		.features = UFFD_FEATURE_EVENT_UNMAP | UFFD_FEATURE_EVENT_REMOVE |
+			    UFFD_FEATURE_EVENT_REMAP,
+	};
+	pthread_attr_t attr;
+	pthread_t thread;
+	const char *env;
+	int ret;
+
+#ifdef __NR_userfaultfd
+	mrc_uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+#ifdef UFFD_USER_MODE_ONLY
+	if (mrc_uffd < 0 && errno == EPERM)
+		mrc_uffd = syscall(__NR_userfaultfd,
+				   O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+#endif
+#else
+	errno = ENOSYS;
+#endif
+	if (mrc_uffd < 0)
+		return errno;
+
+	if (ioctl(mrc_uffd, UFFDIO_API, &api)) {
+		ret = ENOSYS;
+		goto err;
+	}
+
+	env = getenv("RDMAV_MR_CACHE_SIZE");
+	if (env)
+		mrc_max_pinned = strtoull(env, NULL, 0);
+	mrc_page_mask = sysconf(_SC_PAGESIZE) - 1;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, mrc_event_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret)
+		goto err;
+
+	pthread_atfork(NULL, NULL, mrc_atfork_child);
+	mrc_enabled = true;
+	return 0;
+
+err:
+	close(mrc_uffd);
+	mrc_uffd = -1;
+	return ret;
+}
+
+bool ibv_mr_cache_enabled(void)
+{
+	return mrc_enabled;
+}
+
+struct ibv_mr *ibv_mr_cache_get(struct ibv_pd *pd, void *addr, size_t length,
+				int access)
+{
+	struct ibv_mr_cache_entry *entry;
+	uintptr_t start = (uintptr_t) addr;
+	uintptr_t last = start + length - 1;
+	struct ibv_mr *mr = NULL;
+
+	if (!length)
+		return NULL;
+
+	pthread_mutex_lock(&mrc_mutex);
+	mrc_for_each_overlap(entry, start, last) {
+		if (entry->start != start || entry->last != last ||
+		    entry->mr->pd != pd || entry->access != access ||
+		    entry->invalid)
+			continue;
+
+		if (!entry->refcnt++)
+			list_del(&entry->lru_entry);
+		mr = entry->mr;
+		break;
+	}
+
+	if (mr)
+		mrc_stats.hits++;
+	else
+		mrc_stats.misses++;
+	mrc_unlock_and_free();
+
+	return mr;
+}
+
+void ibv_mr_cache_add(struct ibv_mr *mr, int access)
+{
+	struct ibv_mr_cache_entry *entry, *victim, *tmp;
+	struct uffdio_register reg;
+	uint64_t size;
+
+	if (!mr->length)
+		return;
+
+	entry = calloc(1, sizeof *entry);
+	if (!entry)
+		return;
+
+	entry->mr     = mr;
+	entry->access = access;
+	entry->refcnt = 1;
+	entry->start  = (uintptr_t) mr->addr;
+	entry->last   = entry->start + mr->length - 1;
+	size = mrc_pinned_size(entry);
+
+	pthread_mutex_lock(&mrc_mutex);
+	list_for_each_safe(&mrc_lru, victim, tmp, lru_entry) {
+		if (mrc_stats.pinned_bytes + size <= mrc_max_pinned)
+			break;
+		mrc_stats.evictions++;
+		__mrc_drop(victim);
+	}
+	if (mrc_stats.pinned_bytes + size > mrc_max_pinned)
+		goto out;
+
+	reg.range.start = mrc_page_start(entry);
+	reg.range.len   = size;
+	reg.mode        = UFFDIO_REGISTER_MODE_MISSING;
+	if (ioctl(mrc_uffd, UFFDIO_REGISTER, &reg))
+		goto out;
+
+	/* Hugetlb pages cannot be zero filled on a fault, so are not cached */
+	if (!(reg.ioctls & (1ULL << _UFFDIO_ZEROPAGE))) {
+		__mrc_unregister_range(reg.range.start,
+				       reg.range.start + size - 1);
+		goto out;
+	}
+
+	__mrc_add(entry);
+	mrc_stats.num_entries++;
+	mrc_stats.pinned_bytes += size;
+	entry = NULL;
+out:
+	mrc_unlock_and_free();
+	free(entry);
+}
+
+static struct ibv_mr_cache_entry *__mrc_find_mr(struct ibv_mr *mr)
+{
+	struct ibv_mr_cache_entry *entry;
+	uintptr_t start = (uintptr_t) mr->addr;
+
+	if (!mr->length)
+		return NULL;
+
+	mrc_for_each_overlap(entry, start, start + mr->length - 1)
+		if (entry->mr == mr)
+			return entry;
+
+	return NULL;
+}
+
+int ibv_mr_cache_put(struct ibv_mr *mr)
+{
+	struct ibv_mr_cache_entry *entry;
+
+	pthread_mutex_lock(&mrc_mutex);
+	entry = __mrc_find_mr(mr);
+	if (entry && !--entry->refcnt) {
+		if (entry->invalid)
+			__mrc_drop(entry);
+		else
+			list_add_tail(&mrc_lru, &entry->lru_entry);
+	}
+	mrc_unlock_and_free();
+
+	return entry ? 0 : ENOENT;
+}
+
+int ibv_mr_cache_detach(struct ibv_mr *mr)
+{
+	struct ibv_mr_cache_entry *entry;
+	int ret = 0;
+
+	pthread_mutex_lock(&mrc_mutex);
+	entry = __mrc_find_mr(mr);
+	if (entry && entry->refcnt > 1)
+		ret = EBUSY;
+	else if (entry)
+		__mrc_unlink(entry);
+	mrc_unlock_and_free();
+
+	if (entry && !ret)
+		free(entry);
+	return ret;
+}
+
+int ibv_mr_cache_flush(struct ibv_pd *pd)
+{
+	struct ibv_mr_cache_entry *entry, *tmp;
+	int cnt = 0;
+
+	pthread_mutex_lock(&mrc_mutex);
+	list_for_each_safe(&mrc_lru, entry, tmp, lru_entry) {
+		if (pd && entry->mr->pd != pd)
+			continue;
+		mrc_stats.evictions++;
+		__mrc_drop(entry);
+		cnt++;
+	}
+	cnt += !list_empty(&mrc_free_list);
+	mrc_unlock_and_free();
+
+	return cnt;
+}
+
+int ibv_query_mr_cache(struct ibv_mr_cache_stats *stats)
+{
+	if (!mrc_enabled)
+		return EOPNOTSUPP;
+
+	pthread_mutex_lock(&mrc_mutex);
+	*stats = mrc_stats;
+	pthread_mutex_unlock(&mrc_mutex);
+
+	return 0;
+}
@@ -0,0 +1,334 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+#include <config.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <ccan/list.h>
+
+#include "ibverbs.h"
+#include "stats.h"
+
+/*
+ * With RDMAV_STATS set, every device context gets a shared memory segment
+ * of counters that ibv_stats and similar readers can sample while the
+ * process runs.  The post and poll calls are counted by wrapping the
+ * context ops, so they cost nothing when statistics are disabled.
+ */
+struct verbs_stats {
+	struct list_node entry;
+	struct verbs_stats_segment *seg;
+	char shm_name[64];
+	int (*post_send)(struct ibv_qp *qp, struct ibv_send_wr *wr,
+			 struct ibv_send_wr **bad_wr);
+	int (*post_recv)(struct ibv_qp *qp, struct ibv_recv_wr *wr,
+			 struct ibv_recv_wr **bad_wr);
+	int (*poll_cq)(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc);
+};
+
+static const char *const core_names[VERBS_STATS_NUM_CORE] = {
+	[VERBS_STATS_POST_SEND] = "post_send",
+	[VERBS_STATS_SEND_WR] = "send_wr",
+	[VERBS_STATS_POST_RECV] = "post_recv",
+	[VERBS_STATS_RECV_WR] = "recv_wr",
+	[VERBS_STATS_POLL_CQ] = "poll_cq",
+	[VERBS_STATS_CQE] = "cqe",
+	[VERBS_STATS_EMPTY_POLL] = "empty_poll",
+	[VERBS_STATS_REG_MR] = "reg_mr",
+	[VERBS_STATS_DEREG_MR] = "dereg_mr",
+	[VERBS_STATS_DOORBELL] = "doorbell",
+};
+
+static bool stats_enabled;
+static atomic_uint stats_seq;
+static atomic_uint stats_next_slot;
+static __thread int stats_slot = -1;
+static LIST_HEAD(stats_list);
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Removes the segments of processes that exited without closing them */
+static void remove_stale_segments(void)
+{
+	struct dirent *dent;
+	char name[300];
+	DIR *dir;
+	int pid;
+
+	dir = opendir("/dev/shm");
+	if (!dir)
+		return;
+
+	while ((dent = readdir(dir))) {
+		if (strncmp(dent->d_name, VERBS_STATS_SHM_PREFIX,
+			    strlen(VERBS_STATS_SHM_PREFIX)))
+			continue;
+
+		if (sscanf(dent->d_name + strlen(VERBS_STATS_SHM_PREFIX),
+			   "%d.", &pid) != 1 || pid <= 0)
+			continue;
+
+		if (kill(pid, 0) && errno == ESRCH) {
+			snprintf(name, sizeof(name), "/%s", dent->d_name);
+			shm_unlink(name);
+		}
+	}
+	closedir(dir);
+}
+
+static void stats_fork_prepare(void)
+{
+	pthread_mutex_lock(&stats_lock);
+}
+
+static void stats_fork_parent(void)
+{
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * The segments of the parent stay mapped in the child.  Replace each with
+ * private memory, so that the child's calls are not counted as the
+ * parent's, and keep the child from removing them.  If that fails, the
+ * context stops counting in the child.
+ */
+static void stats_fork_child(void)
+{
+	struct verbs_stats *stats;
+
+	list_for_each(&stats_list, stats, entry) {
+		if (mmap(stats->seg, sizeof(*stats->seg),
+			 PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+			 -1, 0) == MAP_FAILED) {
+			munmap(stats->seg, sizeof(*stats->seg));
+			stats->seg = NULL;
+		}
+		stats->shm_name[0] = 0;
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void verbs_stats_enable(void)
+{
+	if (pthread_atfork(stats_fork_prepare, stats_fork_parent,
+			   stats_fork_child))
+		return;
+
+	remove_stale_segments();
+	stats_enabled = true;
+}
+
+static void counter_add(struct verbs_stats *stats, int counter, uint64_t val)
+{
+	if (!stats->seg)
+		return;
+
+	if (stats_slot < 0)
+		stats_slot = atomic_fetch_add(&stats_next_slot, 1) %
+			     VERBS_STATS_SLOTS;
+
+	atomic_fetch_add_explicit(&stats->seg->slots[stats_slot].counters[counter],
+				  val, memory_order_relaxed);
+}
+
+void verbs_stats_init_context(struct verbs_context *vctx)
+{
+	struct verbs_stats_segment *seg;
+	struct verbs_stats *stats;
+	int fd, i;
+
+	if (!stats_enabled)
+		return;
+
+	stats = calloc(1, sizeof(*stats));
+	if (!stats)
+		goto err;
+
+	snprintf(stats->shm_name, sizeof(stats->shm_name),
+		 "/" VERBS_STATS_SHM_PREFIX "%d.%u", getpid(),
+		 atomic_fetch_add(&stats_seq, 1));
+	fd = shm_open(stats->shm_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+		      0600);
+	if (fd < 0)
+		goto err_free;
+
+	if (ftruncate(fd, sizeof(*seg)))
+		goto err_unlink;
+
+	seg = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	if (seg == MAP_FAILED)
+		goto err_unlink;
+	close(fd);
+
+	seg->version = VERBS_STATS_VERSION;
+	seg->pid = getpid();
+	snprintf(seg->device, sizeof(seg->device), "%s",
+		 vctx->context.device->name);
+	for (i = 0; i < VERBS_STATS_NUM_CORE; i++)
+		snprintf(seg->names[i], sizeof(seg->names[i]), "%s",
+			 core_names[i]);
+	atomic_store_explicit(&seg->num_counters, VERBS_STATS_NUM_CORE,
+			      memory_order_release);
+	/* Readers ignore the segment until the magic is set */
+	atomic_thread_fence(memory_order_release);
+	seg->magic = VERBS_STATS_MAGIC;
+
+	stats->seg = seg;
+	vctx->priv->stats = stats;
+	pthread_mutex_lock(&stats_lock);
+	list_add_tail(&stats_list, &stats->entry);
+	pthread_mutex_unlock(&stats_lock);
+	return;
+
+err_unlink:
+	close(fd);
+	shm_unlink(stats->shm_name);
+err_free:
+	free(stats);
+err:
+	fprintf(stderr, PFX "Warning: couldn't create statistics for %s\n",
+		vctx->context.device->name);
+}
+
+void verbs_stats_uninit_context(struct verbs_context *vctx)
+{
+	struct verbs_stats *stats = vctx->priv->stats;
+
+	if (!stats)
+		return;
+
+	pthread_mutex_lock(&stats_lock);
+	list_del(&stats->entry);
+	pthread_mutex_unlock(&stats_lock);
+
+	if (stats->shm_name[0])
+		shm_unlink(stats->shm_name);
+	if (stats->seg)
+		munmap(stats->seg, sizeof(*stats->seg));
+	free(stats);
+	vctx->priv->stats = NULL;
+}
+
+int verbs_stats_register(struct ibv_context *context, const char *name)
+{
+	struct verbs_stats *stats = get_priv(context)->stats;
+	uint32_t num;
+
+	if (!stats || !stats->seg)
+		return -1;
+
+	num = atomic_load_explicit(&stats->seg->num_counters,
+				   memory_order_relaxed);
+	if (num == VERBS_STATS_MAX_COUNTERS)
+		return -1;
+
+	snprintf(stats->seg->names[num], sizeof(stats->seg->names[num]), "%s",
+		 name);
+	atomic_store_explicit(&stats->seg->num_counters, num + 1,
+			      memory_order_release);
+	return num;
+}
+
+void verbs_stats_add(struct ibv_context *context, int counter, uint64_t val)
+{
+	struct verbs_stats *stats = get_priv(context)->stats;
+
+	if (stats && counter >= 0)
+		counter_add(stats, counter, val);
+}
+
+void verbs_stats_reg_mr(struct ibv_context *context,
+			const struct timespec *start)
+{
+	struct verbs_stats *stats = get_priv(context)->stats;
+	struct timespec end;
+	uint64_t ns;
+	int bucket;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = (end.tv_sec - start->tv_sec) * 1000000000ULL +
+	     end.tv_nsec - start->tv_nsec;
+
+	bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+	if (bucket >= VERBS_STATS_HIST_BUCKETS)
+		bucket = VERBS_STATS_HIST_BUCKETS - 1;
+
+	counter_add(stats, VERBS_STATS_REG_MR, 1);
+	if (stats->seg)
+		atomic_fetch_add_explicit(&stats->seg->reg_mr_ns[bucket], 1,
+					  memory_order_relaxed);
+}
+
+static int stats_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr,
+			   struct ibv_send_wr **bad_wr)
+{
+	struct verbs_stats *stats = get_priv(qp->context)->stats;
+	uint64_t num = 0;
+	int ret;
+
+	ret = stats->post_send(qp, wr, bad_wr);
+	for (; wr && !(ret && wr == *bad_wr); wr = wr->next)
+		num++;
+
+	counter_add(stats, VERBS_STATS_POST_SEND, 1);
+	counter_add(stats, VERBS_STATS_SEND_WR, num);
+	return ret;
+}
+
+static int stats_post_recv(struct ibv_qp *qp, struct ibv_recv_wr *wr,
+			   struct ibv_recv_wr **bad_wr)
+{
+	struct verbs_stats *stats = get_priv(qp->context)->stats;
+	uint64_t num = 0;
+	int ret;
+
+	ret = stats->post_recv(qp, wr, bad_wr);
+	for (; wr && !(ret && wr == *bad_wr); wr = wr->next)
+		num++;
+
+	counter_add(stats, VERBS_STATS_POST_RECV, 1);
+	counter_add(stats, VERBS_STATS_RECV_WR, num);
+	return ret;
+}
+
+static int stats_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc)
+{
+	struct verbs_stats *stats = get_priv(cq->context)->stats;
+	int ret;
+
+	ret = stats->poll_cq(cq, num_entries, wc);
+
+	counter_add(stats, VERBS_STATS_POLL_CQ, 1);
+	if (ret > 0)
+		counter_add(stats, VERBS_STATS_CQE, ret);
+	else if (!ret)
+		counter_add(stats, VERBS_STATS_EMPTY_POLL, 1);
+	return ret;
+}
+
+void verbs_stats_wrap_ops(struct verbs_context *vctx)
+{
+	struct verbs_stats *stats = vctx->priv->stats;
+	struct ibv_context_ops *ops = &vctx->context.ops;
+
+	if (!stats)
+		return;
+
+	stats->post_send = ops->post_send;
+	stats->post_recv = ops->post_recv;
+	stats->poll_cq = ops->poll_cq;
+	ops->post_send = stats_post_send;
+	ops->post_recv = stats_post_recv;
+	ops->poll_cq = stats_poll_cq;
+}
@@ -0,0 +1,57 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+#ifndef VERBS_STATS_H
+#define VERBS_STATS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Layout of the shared memory segment that libibverbs keeps for each
+ * device context when RDMAV_STATS is set.  Segments are named
+ * /dev/shm/ibverbs-stats.<pid>.<n> and are only written by the process
+ * that owns them.
+ *
+ * Each thread adds to the counters of one slot, so that threads do not
+ * share cache lines on the fast path.  A counter's value is the sum over
+ * all slots, see verbs_stats_read().
+ */
+#define VERBS_STATS_SHM_PREFIX		"ibverbs-stats."
+#define VERBS_STATS_MAGIC		0x76737473
+#define VERBS_STATS_VERSION		2
+#define VERBS_STATS_MAX_COUNTERS	32
+#define VERBS_STATS_NAME_MAX		32
+#define VERBS_STATS_DEVICE_MAX		64
+#define VERBS_STATS_HIST_BUCKETS	32
+#define VERBS_STATS_SLOTS		16
+
+struct verbs_stats_slot {
+	_Atomic(uint64_t) counters[VERBS_STATS_MAX_COUNTERS];
+} __attribute__((aligned(64)));
+
+struct verbs_stats_segment {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pid;
+	/* Stored with release once the name of a new counter is written */
+	_Atomic(uint32_t) num_counters;
+	char device[VERBS_STATS_DEVICE_MAX];
+	char names[VERBS_STATS_MAX_COUNTERS][VERBS_STATS_NAME_MAX];
+	/* Bucket i counts ibv_reg_mr() calls that took [2^i, 2^(i+1)) ns */
+	_Atomic(uint64_t) reg_mr_ns[VERBS_STATS_HIST_BUCKETS];
+	struct verbs_stats_slot slots[VERBS_STATS_SLOTS];
+};
+
+static inline uint64_t verbs_stats_read(struct verbs_stats_segment *seg,
+					unsigned int counter)
+{
+	uint64_t val = 0;
+	unsigned int i;
+
+	for (i = 0; i < VERBS_STATS_SLOTS; i++)
+		val += atomic_load_explicit(&seg->slots[i].counters[counter],
+					    memory_order_relaxed);
+	return val;
+}
+
+#endif
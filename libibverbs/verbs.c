@@ -217,31 +217,63 @@ LATEST_SYMVER_FUNC(ibv_dealloc_pd, 1_1, "IBVERBS_1.1",
 		   int,
 		   struct ibv_pd *pd)
 {
+	if (ibv_mr_cache_enabled())
+		ibv_mr_cache_flush(pd);
+
 	return get_ops(pd->context)->dealloc_pd(pd);
 }
 
-LATEST_SYMVER_FUNC(ibv_reg_mr, 1_1, "IBVERBS_1.1",
-		   struct ibv_mr *,
-		   struct ibv_pd *pd, void *addr,
-		   size_t length, int access)
+static struct ibv_mr *reg_mr(struct ibv_pd *pd, void *addr, size_t length,
+			     int access)
 {
+	bool cache = ibv_mr_cache_enabled();
 	struct ibv_mr *mr;
 
+	if (cache) {
+		mr = ibv_mr_cache_get(pd, addr, length, access);
+		if (mr)
+			return mr;
+	}
+
 	if (ibv_dontfork_range(addr, length))
 		return NULL;
 
 	mr = get_ops(pd->context)->reg_mr(pd, addr, length, access);
+	/* Unused cached registrations may hold the memlock limit */
+	if (!mr && cache && errno == ENOMEM && ibv_mr_cache_flush(NULL))
+		mr = get_ops(pd->context)->reg_mr(pd, addr, length, access);
 	if (mr) {
 		mr->context = pd->context;
 		mr->pd      = pd;
 		mr->addr    = addr;
 		mr->length  = length;
+		if (cache)
+			ibv_mr_cache_add(mr, access);
 	} else
 		ibv_dofork_range(addr, length);
 
 	return mr;
 }
 
+LATEST_SYMVER_FUNC(ibv_reg_mr, 1_1, "IBVERBS_1.1",
+		   struct ibv_mr *,
+		   struct ibv_pd *pd, void *addr,
+		   size_t length, int access)
+{
+	struct timespec start;
+	struct ibv_mr *mr;
+
+	if (!verbs_stats_enabled(pd->context))
+		return reg_mr(pd, addr, length, access);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	mr = reg_mr(pd, addr, length, access);
+	if (mr)
+		verbs_stats_reg_mr(pd->context, &start);
+
+	return mr;
+}
+
 LATEST_SYMVER_FUNC(ibv_rereg_mr, 1_1, "IBVERBS_1.1",
 		   int,
 		   struct ibv_mr *mr, int flags,
@@ -274,6 +306,19 @@ LATEST_SYMVER_FUNC(ibv_rereg_mr, 1_1, "IBVERBS_1.1",
 		return IBV_REREG_MR_ERR_INPUT;
 	}
 
+	/*
+	 * A cached MR may be shared, and only its sole user may change it.
+	 * Detach only once the request is known to be valid, so that a
+	 * rejected call leaves the MR in the cache.
+	 */
+	if (ibv_mr_cache_enabled()) {
+		err = ibv_mr_cache_detach(mr);
+		if (err) {
+			errno = err;
+			return IBV_REREG_MR_ERR_INPUT;
+		}
+	}
+
 	if (flags & IBV_REREG_MR_CHANGE_TRANSLATION) {
 		err = ibv_dontfork_range(addr, length);
 		if (err)
@@ -314,8 +359,14 @@ LATEST_SYMVER_FUNC(ibv_dereg_mr, 1_1, "IBVERBS_1.1",
 	int ret;
 	void *addr	= mr->addr;
 	size_t length	= mr->length;
+	struct ibv_context *context = mr->context;
+
+	verbs_stats_add(context, VERBS_STATS_DEREG_MR, 1);
 
-	ret = get_ops(mr->context)->dereg_mr(verbs_get_mr(mr));
+	if (ibv_mr_cache_enabled() && !ibv_mr_cache_put(mr))
+		return 0;
+
+	ret = get_ops(context)->dereg_mr(verbs_get_mr(mr));
 	if (!ret && (verbs_get_mr(mr)->mr_type == IBV_MR_TYPE_MR))
 		ibv_dofork_range(addr, length);
 
@@ -507,6 +558,15 @@ LATEST_SYMVER_FUNC(ibv_create_qp, 1_1, "IBVERBS_1.1",
 	return qp;
 }
 
+struct ibv_qp_ex *ibv_qp_to_qp_ex(struct ibv_qp *qp)
+{
+	struct verbs_qp *vqp = (struct verbs_qp *)qp;
+
+	if (vqp->comp_mask & VERBS_QP_EX)
+		return &vqp->qp_ex;
+	return NULL;
+}
+
 LATEST_SYMVER_FUNC(ibv_query_qp, 1_1, "IBVERBS_1.1",
 		   int,
 		   struct ibv_qp *qp, struct ibv_qp_attr *attr,
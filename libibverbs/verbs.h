@@ -854,7 +854,8 @@ enum ibv_qp_init_attr_mask {
 	IBV_QP_INIT_ATTR_MAX_TSO_HEADER = 1 << 3,
 	IBV_QP_INIT_ATTR_IND_TABLE	= 1 << 4,
 	IBV_QP_INIT_ATTR_RX_HASH	= 1 << 5,
-	IBV_QP_INIT_ATTR_RESERVED	= 1 << 6
+	IBV_QP_INIT_ATTR_SEND_OPS_FLAGS	= 1 << 6,
+	IBV_QP_INIT_ATTR_RESERVED	= 1 << 7
 };
 
 enum ibv_qp_create_flags {
@@ -865,6 +866,16 @@ enum ibv_qp_create_flags {
 	IBV_QP_CREATE_PCI_WRITE_END_PADDING	= 1 << 11,
 };
 
+enum ibv_qp_create_send_ops_flags {
+	IBV_QP_EX_WITH_RDMA_WRITE		= 1 << 0,
+	IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM	= 1 << 1,
+	IBV_QP_EX_WITH_SEND			= 1 << 2,
+	IBV_QP_EX_WITH_SEND_WITH_IMM		= 1 << 3,
+	IBV_QP_EX_WITH_RDMA_READ		= 1 << 4,
+	IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP	= 1 << 5,
+	IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD	= 1 << 6,
+};
+
 struct ibv_rx_hash_conf {
 	/* enum ibv_rx_hash_function_flags */
 	uint8_t	rx_hash_function;
@@ -891,6 +902,8 @@ struct ibv_qp_init_attr_ex {
 	struct ibv_rwq_ind_table       *rwq_ind_tbl;
 	struct ibv_rx_hash_conf	rx_hash_conf;
 	uint32_t		source_qpn;
+	/* See enum ibv_qp_create_send_ops_flags */
+	uint64_t		send_ops_flags;
 };
 
 enum ibv_qp_open_attr_mask {
@@ -1171,6 +1184,146 @@ struct ibv_qp {
 	uint32_t		events_completed;
 };
 
+struct ibv_data_buf {
+	void			*addr;
+	size_t			length;
+};
+
+/*
+ * A QP created with IBV_QP_INIT_ATTR_SEND_OPS_FLAGS builds its send work
+ * requests through these calls instead of a list of struct ibv_send_wr.
+ * wr_start() begins a batch, each opcode call starts a new work request
+ * using the current wr_id and wr_flags, and the setters that follow
+ * supply its address and data.  wr_complete() posts the whole batch, or
+ * none of it if any request failed.
+ */
+struct ibv_qp_ex {
+	struct ibv_qp		qp_base;
+	uint64_t		comp_mask;
+
+	uint64_t		wr_id;
+	/* bitmask from enum ibv_send_flags */
+	unsigned int		wr_flags;
+
+	void (*wr_atomic_cmp_swp)(struct ibv_qp_ex *qp, uint32_t rkey,
+				  uint64_t remote_addr, uint64_t compare,
+				  uint64_t swap);
+	void (*wr_atomic_fetch_add)(struct ibv_qp_ex *qp, uint32_t rkey,
+				    uint64_t remote_addr, uint64_t add);
+	void (*wr_rdma_read)(struct ibv_qp_ex *qp, uint32_t rkey,
+			     uint64_t remote_addr);
+	void (*wr_rdma_write)(struct ibv_qp_ex *qp, uint32_t rkey,
+			      uint64_t remote_addr);
+	void (*wr_rdma_write_imm)(struct ibv_qp_ex *qp, uint32_t rkey,
+				  uint64_t remote_addr, __be32 imm_data);
+	void (*wr_send)(struct ibv_qp_ex *qp);
+	void (*wr_send_imm)(struct ibv_qp_ex *qp, __be32 imm_data);
+
+	void (*wr_set_ud_addr)(struct ibv_qp_ex *qp, struct ibv_ah *ah,
+			       uint32_t remote_qpn, uint32_t remote_qkey);
+	void (*wr_set_inline_data)(struct ibv_qp_ex *qp, void *addr,
+				   size_t length);
+	void (*wr_set_inline_data_list)(struct ibv_qp_ex *qp, size_t num_buf,
+					const struct ibv_data_buf *buf_list);
+	void (*wr_set_sge)(struct ibv_qp_ex *qp, uint32_t lkey, uint64_t addr,
+			   uint32_t length);
+	void (*wr_set_sge_list)(struct ibv_qp_ex *qp, size_t num_sge,
+				const struct ibv_sge *sg_list);
+
+	void (*wr_start)(struct ibv_qp_ex *qp);
+	int (*wr_complete)(struct ibv_qp_ex *qp);
+	void (*wr_abort)(struct ibv_qp_ex *qp);
+};
+
+struct ibv_qp_ex *ibv_qp_to_qp_ex(struct ibv_qp *qp);
+
+static inline void ibv_wr_atomic_cmp_swp(struct ibv_qp_ex *qp, uint32_t rkey,
+					 uint64_t remote_addr, uint64_t compare,
+					 uint64_t swap)
+{
+	qp->wr_atomic_cmp_swp(qp, rkey, remote_addr, compare, swap);
+}
+
+static inline void ibv_wr_atomic_fetch_add(struct ibv_qp_ex *qp, uint32_t rkey,
+					   uint64_t remote_addr, uint64_t add)
+{
+	qp->wr_atomic_fetch_add(qp, rkey, remote_addr, add);
+}
+
+static inline void ibv_wr_rdma_read(struct ibv_qp_ex *qp, uint32_t rkey,
+				    uint64_t remote_addr)
+{
+	qp->wr_rdma_read(qp, rkey, remote_addr);
+}
+
+static inline void ibv_wr_rdma_write(struct ibv_qp_ex *qp, uint32_t rkey,
+				     uint64_t remote_addr)
+{
+	qp->wr_rdma_write(qp, rkey, remote_addr);
+}
+
+static inline void ibv_wr_rdma_write_imm(struct ibv_qp_ex *qp, uint32_t rkey,
+					 uint64_t remote_addr, __be32 imm_data)
+{
+	qp->wr_rdma_write_imm(qp, rkey, remote_addr, imm_data);
+}
+
+static inline void ibv_wr_send(struct ibv_qp_ex *qp)
+{
+	qp->wr_send(qp);
+}
+
+static inline void ibv_wr_send_imm(struct ibv_qp_ex *qp, __be32 imm_data)
+{
+	qp->wr_send_imm(qp, imm_data);
+}
+
+static inline void ibv_wr_set_ud_addr(struct ibv_qp_ex *qp, struct ibv_ah *ah,
+				      uint32_t remote_qpn, uint32_t remote_qkey)
+{
+	qp->wr_set_ud_addr(qp, ah, remote_qpn, remote_qkey);
+}
+
+static inline void ibv_wr_set_inline_data(struct ibv_qp_ex *qp, void *addr,
+					  size_t length)
+{
+	qp->wr_set_inline_data(qp, addr, length);
+}
+
+static inline void ibv_wr_set_inline_data_list(struct ibv_qp_ex *qp,
+					       size_t num_buf,
+					       const struct ibv_data_buf *buf_list)
+{
+	qp->wr_set_inline_data_list(qp, num_buf, buf_list);
+}
+
+static inline void ibv_wr_set_sge(struct ibv_qp_ex *qp, uint32_t lkey,
+				  uint64_t addr, uint32_t length)
+{
+	qp->wr_set_sge(qp, lkey, addr, length);
+}
+
+static inline void ibv_wr_set_sge_list(struct ibv_qp_ex *qp, size_t num_sge,
+				       const struct ibv_sge *sg_list)
+{
+	qp->wr_set_sge_list(qp, num_sge, sg_list);
+}
+
+static inline void ibv_wr_start(struct ibv_qp_ex *qp)
+{
+	qp->wr_start(qp);
+}
+
+static inline int ibv_wr_complete(struct ibv_qp_ex *qp)
+{
+	return qp->wr_complete(qp);
+}
+
+static inline void ibv_wr_abort(struct ibv_qp_ex *qp)
+{
+	qp->wr_abort(qp);
+}
+
 struct ibv_comp_channel {
 	struct ibv_context     *context;
 	int			fd;
@@ -2094,6 +2247,23 @@ int ibv_rereg_mr(struct ibv_mr *mr, int flags,
  */
 int ibv_dereg_mr(struct ibv_mr *mr);
 
+struct ibv_mr_cache_stats {
+	uint64_t		hits;
+	uint64_t		misses;
+	uint64_t		evictions;
+	uint64_t		invalidations;
+	uint64_t		pinned_bytes;
+	uint32_t		num_entries;
+	uint32_t		reserved;
+};
+
+/**
+ * ibv_query_mr_cache - Get the counters of the memory registration cache
+ *
+ * Returns EOPNOTSUPP unless the cache was enabled by RDMAV_MR_CACHE.
+ */
+int ibv_query_mr_cache(struct ibv_mr_cache_stats *stats);
+
 /**
  * ibv_alloc_mw - Allocate a memory window
  */
@@ -2492,6 +2662,19 @@ ibv_create_qp_ex(struct ibv_context *context, struct ibv_qp_init_attr_ex *qp_ini
 	return vctx->create_qp_ex(context, qp_init_attr_ex);
 }
 
+/**
+ * ibv_create_qp_batch - Create several queue pairs.
+ * @context: The device context of the QPs.
+ * @attrs: An array of @num_qps initial attributes, one per QP.
+ * @num_qps: The number of QPs to create.
+ * @qps: An array of @num_qps entries that receives the created QPs.
+ *
+ * Either all the QPs are created, or none are and an errno is returned.
+ */
+int ibv_create_qp_batch(struct ibv_context *context,
+			struct ibv_qp_init_attr_ex *attrs,
+			unsigned int num_qps, struct ibv_qp **qps);
+
 /**
  * ibv_alloc_td - Allocate a thread domain
  */
@@ -2607,6 +2790,21 @@ ibv_open_qp(struct ibv_context *context, struct ibv_qp_open_attr *qp_open_attr)
 int ibv_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 		  int attr_mask);
 
+/**
+ * ibv_modify_qp_batch - Modify several queue pairs.
+ * @qps: An array of @num_qps QPs.
+ * @attrs: An array of @num_qps attributes, one per QP.
+ * @attr_mask: The attributes to modify, the same for every QP.
+ * @num_qps: The number of QPs to modify.
+ * @bad_qp: Set to the lowest index that failed on error, may be NULL.
+ *
+ * On error, QPs other than the failed one may or may not have been
+ * modified.
+ */
+int ibv_modify_qp_batch(struct ibv_qp **qps, struct ibv_qp_attr *attrs,
+			int attr_mask, unsigned int num_qps,
+			unsigned int *bad_qp);
+
 /**
  * ibv_modify_qp_rate_limit - Modify a queue pair rate limit values
  * @qp - QP object to modify
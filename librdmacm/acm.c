@@ -37,7 +37,11 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "cma.h"
@@ -111,10 +115,50 @@ struct acm_msg {
 	};
 };
 
+/*
+ * Paths resolved by ibacm, published in a file that we map read-only.
+ * Must match the layout in ibacm.
+ */
+#define ACM_CACHE_MAGIC       0x4d434149
+#define ACM_CACHE_VERSION     1
+#define ACM_CACHE_WAYS        4
+#define ACM_CACHE_REQ_LENGTH  (ACM_MSG_EP_LENGTH * 3)
+#define ACM_CACHE_RESP_LENGTH (ACM_MSG_HDR_LENGTH + ACM_MSG_EP_LENGTH * 3)
+#define ACM_CACHE_RETRY_SEC   1
+
+struct acm_cache_hdr {
+	uint32_t                magic;
+	uint16_t                version;
+	uint16_t                entry_size;
+	uint32_t                entry_cnt;
+	uint32_t                generation;
+	uint32_t                retired;
+	uint8_t                 reserved[44];
+};
+
+struct acm_cache_entry {
+	uint32_t                seq;
+	uint32_t                hash;
+	uint32_t                generation;
+	uint16_t                req_len;
+	uint16_t                resp_len;
+	uint64_t                expires;
+	uint8_t                 req[ACM_CACHE_REQ_LENGTH];
+	uint8_t                 resp[ACM_CACHE_RESP_LENGTH];
+};
+
 static pthread_mutex_t acm_lock = PTHREAD_MUTEX_INITIALIZER;
 static int sock = -1;
 static uint16_t server_port;
 
+/* The mapping is replaced under the write lock, and read under the read lock */
+static pthread_rwlock_t cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct acm_cache_hdr *cache;
+static struct acm_cache_entry *cache_entries;
+static uint32_t cache_sets;
+static size_t cache_size;
+static time_t cache_retry;
+
 static int ucma_set_server_port(void)
 {
 	FILE *f;
@@ -129,6 +173,153 @@ static int ucma_set_server_port(void)
 	return server_port;
 }
 
+/* Only a table that no one but its owner, root or us, can write is used */
+static void ucma_ib_map_cache(void)
+{
+	struct acm_cache_hdr *hdr;
+	struct stat st;
+	int fd;
+
+	fd = open(IBACM_PATH_CACHE_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) || (st.st_uid && st.st_uid != geteuid()) ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH)) || st.st_size < sizeof(*hdr))
+		goto out;
+
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		goto out;
+
+	if (hdr->magic != ACM_CACHE_MAGIC ||
+	    hdr->version != ACM_CACHE_VERSION ||
+	    hdr->entry_size != sizeof(struct acm_cache_entry) ||
+	    hdr->entry_cnt < ACM_CACHE_WAYS ||
+	    (hdr->entry_cnt & (hdr->entry_cnt - 1)) ||
+	    st.st_size < sizeof(*hdr) +
+			 (size_t) hdr->entry_cnt * sizeof(struct acm_cache_entry)) {
+		munmap(hdr, st.st_size);
+		goto out;
+	}
+
+	cache_sets = hdr->entry_cnt / ACM_CACHE_WAYS;
+	cache_entries = (struct acm_cache_entry *) (hdr + 1);
+	cache_size = st.st_size;
+	cache = hdr;
+out:
+	close(fd);
+}
+
+static uint32_t ucma_ib_cache_hash(const uint8_t *data, int len)
+{
+	uint32_t hash = 2166136261U;
+
+	while (len--)
+		hash = (hash ^ *data++) * 16777619U;
+	return hash;
+}
+
+/*
+ * A table that ibacm retired on exit, or one that was missing, is looked
+ * for again, at most once every ACM_CACHE_RETRY_SEC seconds, so that a
+ * restarted ibacm's table is picked up without hitting the file on every
+ * resolve.
+ */
+static void ucma_ib_remap_cache(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_rwlock_wrlock(&cache_lock);
+	if ((!cache || __atomic_load_n(&cache->retired, __ATOMIC_ACQUIRE)) &&
+	    now.tv_sec >= cache_retry) {
+		cache_retry = now.tv_sec + ACM_CACHE_RETRY_SEC;
+		if (cache) {
+			munmap(cache, cache_size);
+			cache = NULL;
+		}
+		ucma_ib_map_cache();
+	}
+	pthread_rwlock_unlock(&cache_lock);
+}
+
+/*
+ * Answers a resolve from the table, without a round trip to ibacm.  Each
+ * entry carries a sequence count that ibacm keeps odd while it rewrites
+ * the entry; a copy is only used if the count was even and did not change
+ * while it was taken.
+ */
+static int __ucma_ib_cache_lookup(struct acm_msg *msg)
+{
+	struct acm_cache_entry *entry;
+	struct acm_msg resp;
+	struct timespec now;
+	uint32_t hash, generation, seq;
+	int i, len, resp_len;
+
+	len = msg->hdr.length - ACM_MSG_HDR_LENGTH;
+	if (len > ACM_CACHE_REQ_LENGTH)
+		return 0;
+
+	hash = ucma_ib_cache_hash((uint8_t *) msg->resolve_data, len);
+	generation = __atomic_load_n(&cache->generation, __ATOMIC_ACQUIRE);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	entry = &cache_entries[(hash & (cache_sets - 1)) * ACM_CACHE_WAYS];
+	for (i = 0; i < ACM_CACHE_WAYS; i++, entry++) {
+		seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) || entry->hash != hash ||
+		    entry->generation != generation || entry->req_len != len ||
+		    entry->expires <= now.tv_sec ||
+		    memcmp(entry->req, msg->resolve_data, len))
+			continue;
+
+		resp_len = entry->resp_len;
+		if (resp_len < ACM_MSG_HDR_LENGTH ||
+		    resp_len > ACM_CACHE_RESP_LENGTH)
+			continue;
+		memcpy(&resp, entry->resp, resp_len);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		if (resp.hdr.length != resp_len || resp.hdr.status)
+			return 0;
+		memcpy(msg, &resp, resp_len);
+		return 1;
+	}
+	return 0;
+}
+
+/* Returns -1 if the table is missing or retired */
+static int ucma_ib_try_cache(struct acm_msg *msg)
+{
+	int ret = -1;
+
+	pthread_rwlock_rdlock(&cache_lock);
+	if (cache && !__atomic_load_n(&cache->retired, __ATOMIC_ACQUIRE))
+		ret = __ucma_ib_cache_lookup(msg);
+	pthread_rwlock_unlock(&cache_lock);
+	return ret;
+}
+
+static int ucma_ib_cache_lookup(struct acm_msg *msg)
+{
+	int ret;
+
+	if (sock < 0)
+		return 0;
+
+	ret = ucma_ib_try_cache(msg);
+	if (ret >= 0)
+		return ret;
+
+	ucma_ib_remap_cache();
+	return ucma_ib_try_cache(msg) > 0;
+}
+
 void ucma_ib_init(void)
 {
 	union {
@@ -176,6 +367,12 @@ void ucma_ib_init(void)
 			sock = -1;
 		}
 	}
+
+	if (sock >= 0) {
+		pthread_rwlock_wrlock(&cache_lock);
+		ucma_ib_map_cache();
+		pthread_rwlock_unlock(&cache_lock);
+	}
 out:
 	init = 1;
 unlock:
@@ -188,6 +385,8 @@ void ucma_ib_cleanup(void)
 		shutdown(sock, SHUT_RDWR);
 		close(sock);
 	}
+	if (cache)
+		munmap(cache, cache_size);
 }
 
 static int ucma_ib_set_addr(struct rdma_addrinfo *ib_rai,
@@ -445,6 +644,9 @@ void ucma_ib_resolve(struct rdma_addrinfo **rai,
 		msg.hdr.length += ACM_MSG_EP_LENGTH;
 	}
 
+	if (ucma_ib_cache_lookup(&msg))
+		goto resolved;
+
 	pthread_mutex_lock(&acm_lock);
 	ret = send(sock, (char *) &msg, msg.hdr.length, 0);
 	if (ret != msg.hdr.length) {
@@ -457,6 +659,7 @@ void ucma_ib_resolve(struct rdma_addrinfo **rai,
 	if (ret < ACM_MSG_HDR_LENGTH || ret != msg.hdr.length || msg.hdr.status)
 		return;
 
+resolved:
 	ucma_ib_save_resp(*rai, &msg);
 
 	if (af_ib_support && !(hints->ai_flags & RAI_ROUTEONLY) && (*rai)->ai_route_len)
@@ -132,7 +132,6 @@ static pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
 static int abi_ver = RDMA_USER_CM_MAX_ABI_VERSION;
 int af_ib_support;
 static struct index_map ucma_idm;
-static fastlock_t idm_lock;
 
 static int check_abi_version(void)
 {
@@ -201,7 +200,6 @@ int ucma_init(void)
 		return 0;
 	}
 
-	fastlock_init(&idm_lock);
 	ret = check_abi_version();
 	if (ret) {
 		ret = ERR(EPERM);
@@ -237,7 +235,6 @@ int ucma_init(void)
 err2:
 	ibv_free_device_list(dev_list);
 err1:
-	fastlock_destroy(&idm_lock);
 	pthread_mutex_unlock(&mut);
 	return ret;
 }
@@ -447,15 +444,12 @@ static struct ibv_xrcd *ucma_get_xrcd(struct cma_device *cma_dev)
 
 static void ucma_insert_id(struct cma_id_private *id_priv)
 {
-	fastlock_acquire(&idm_lock);
 	idm_set(&ucma_idm, id_priv->handle, id_priv);
-	fastlock_release(&idm_lock);
 }
 
 static void ucma_remove_id(struct cma_id_private *id_priv)
 {
-	if (id_priv->handle <= IDX_MAX_INDEX)
-		idm_clear(&ucma_idm, id_priv->handle);
+	idm_clear(&ucma_idm, id_priv->handle);
 }
 
 static struct cma_id_private *ucma_lookup_id(int handle)
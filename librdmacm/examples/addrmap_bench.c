@@ -0,0 +1,193 @@
+/*
+ * This software is available to you under the OpenIB.org BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Measures the cost of finding a datagram rsocket destination by address,
+ * comparing the address map used by rsockets with the tsearch tree that it
+ * replaced, for an increasing number of peers.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <search.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include "../indexer.h"
+
+union peer_addr {
+	struct sockaddr		sa;
+	struct sockaddr_in	sin;
+	struct sockaddr_in6	sin6;
+};
+
+struct peer {
+	union peer_addr		addr;	/* must be first */
+	void			*data;
+};
+
+static int max_peers = 1 << 16;
+static int lookups = 1 << 22;
+static int use_ipv6;
+
+static int compare_addr(const void *dst1, const void *dst2)
+{
+	const struct sockaddr *sa1 = dst1, *sa2 = dst2;
+	size_t len;
+
+	len = (sa1->sa_family == AF_INET6 && sa2->sa_family == AF_INET6) ?
+	      sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+	return memcmp(dst1, dst2, len);
+}
+
+/* Peers are freed as an array */
+static void free_node(void *node)
+{
+}
+
+static void init_peer(struct peer *peer, int i)
+{
+	memset(peer, 0, sizeof *peer);
+	if (use_ipv6) {
+		peer->addr.sin6.sin6_family = AF_INET6;
+		peer->addr.sin6.sin6_port = htobe16(7000 + (i & 0xFF));
+		peer->addr.sin6.sin6_addr.s6_addr[0] = 0xfe;
+		peer->addr.sin6.sin6_addr.s6_addr[1] = 0x80;
+		peer->addr.sin6.sin6_addr.s6_addr[13] = i >> 16;
+		peer->addr.sin6.sin6_addr.s6_addr[14] = i >> 8;
+		peer->addr.sin6.sin6_addr.s6_addr[15] = i;
+	} else {
+		peer->addr.sin.sin_family = AF_INET;
+		peer->addr.sin.sin_port = htobe16(7000 + (i & 0xFF));
+		peer->addr.sin.sin_addr.s_addr = htobe32(0x0A000000 | (i >> 8));
+	}
+}
+
+static double elapsed_ns(struct timeval *start, struct timeval *end)
+{
+	return ((end->tv_sec - start->tv_sec) * 1000000.0 +
+		(end->tv_usec - start->tv_usec)) * 1000.0;
+}
+
+static int run(int peer_cnt)
+{
+	struct addr_map map = {};
+	struct timeval start, end;
+	struct peer *peers;
+	void *tree = NULL;
+	int *order, i, misses = 0;
+	double tree_ns, map_ns;
+
+	peers = calloc(peer_cnt, sizeof *peers);
+	order = calloc(lookups, sizeof *order);
+	if (!peers || !order) {
+		printf("failed to allocate peers\n");
+		return -1;
+	}
+
+	for (i = 0; i < peer_cnt; i++) {
+		init_peer(&peers[i], i);
+		tsearch(&peers[i].addr, &tree, compare_addr);
+		if (addrm_insert(&map, &peers[i])) {
+			printf("addrm_insert failed\n");
+			return -1;
+		}
+	}
+
+	/* Look up peers in a random order, as a server replying to them would */
+	srand(peer_cnt);
+	for (i = 0; i < lookups; i++)
+		order[i] = rand() % peer_cnt;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < lookups; i++) {
+		if (!tfind(&peers[order[i]].addr, &tree, compare_addr))
+			misses++;
+	}
+	gettimeofday(&end, NULL);
+	tree_ns = elapsed_ns(&start, &end) / lookups;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < lookups; i++) {
+		if (addrm_lookup(&map, &peers[order[i]].addr.sa) != &peers[order[i]])
+			misses++;
+	}
+	gettimeofday(&end, NULL);
+	map_ns = elapsed_ns(&start, &end) / lookups;
+
+	printf("%-10d %12.1f %12.1f %8.1fx\n", peer_cnt, tree_ns, map_ns,
+	       tree_ns / map_ns);
+	if (misses)
+		printf("%d lookups failed\n", misses);
+
+	tdestroy(tree, free_node);
+	addrm_destroy(&map, NULL);
+	free(order);
+	free(peers);
+	return misses ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	int op, peers, ret = 0;
+
+	while ((op = getopt(argc, argv, "n:l:6")) != -1) {
+		switch (op) {
+		case 'n':
+			max_peers = atoi(optarg);
+			break;
+		case 'l':
+			lookups = atoi(optarg);
+			break;
+		case '6':
+			use_ipv6 = 1;
+			break;
+		default:
+			printf("usage: %s\n", argv[0]);
+			printf("\t[-n max_peers]\n");
+			printf("\t[-l lookups_per_run]\n");
+			printf("\t[-6 use IPv6 addresses]\n");
+			exit(1);
+		}
+	}
+
+	if (max_peers < 1 || lookups < 1) {
+		printf("peers and lookups must be positive\n");
+		exit(1);
+	}
+
+	printf("%-10s %12s %12s %9s\n", "peers", "tsearch ns", "addrmap ns",
+	       "speedup");
+	for (peers = 1; !ret && peers <= max_peers; peers <<= 2)
+		ret = run(peers);
+
+	return ret;
+}
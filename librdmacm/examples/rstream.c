@@ -37,6 +37,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <netdb.h>
 #include <fcntl.h>
@@ -89,24 +90,33 @@ static int iterations = 1;
 static int transfer_size = 1000;
 static int transfer_count = 1000;
 static int buffer_size, inline_size = 64;
+static int zcopy_threshold;
 static char test_name[10] = "custom";
 static const char *port = "7471";
 static int keepalive;
 static char *dst_addr;
 static char *src_addr;
 static struct timeval start, end;
+static struct rusage start_usage, end_usage;
 static void *buf;
 static struct rdma_addrinfo rai_hints;
 static struct addrinfo ai_hints;
 
+static float cpu_usec(struct rusage *usage)
+{
+	return (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000. +
+		usage->ru_utime.tv_usec + usage->ru_stime.tv_usec;
+}
+
 static void show_perf(void)
 {
 	char str[32];
-	float usec;
+	float usec, cpu;
 	long long bytes;
 
 	usec = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
 	bytes = (long long) iterations * transfer_count * transfer_size * 2;
+	cpu = cpu_usec(&end_usage) - cpu_usec(&start_usage);
 
 	/* name size transfers iterations bytes seconds Gb/sec usec/xfer */
 	printf("%-10s", test_name);
@@ -118,9 +128,10 @@ static void show_perf(void)
 	printf("%-8s", str);
 	size_str(str, sizeof str, bytes);
 	printf("%-8s", str);
-	printf("%8.2fs%10.2f%11.2f\n",
+	printf("%8.2fs%10.2f%11.2f%7.1f\n",
 		usec / 1000000., (bytes * 8) / (1000. * usec),
-		(usec / iterations) / (transfer_count * 2));
+		(usec / iterations) / (transfer_count * 2),
+		cpu * 100. / usec);
 }
 
 static void init_latency_test(int size)
@@ -231,6 +242,7 @@ static int run_test(void)
 	if (ret)
 		goto out;
 
+	getrusage(RUSAGE_SELF, &start_usage);
 	gettimeofday(&start, NULL);
 	for (i = 0; i < iterations; i++) {
 		for (t = 0; t < transfer_count; t++) {
@@ -248,6 +260,7 @@ static int run_test(void)
 		}
 	}
 	gettimeofday(&end, NULL);
+	getrusage(RUSAGE_SELF, &end_usage);
 	show_perf();
 	ret = 0;
 
@@ -307,6 +320,10 @@ static void set_options(int fd)
 			val = 0;
 			rs_setsockopt(fd, SOL_RDMA, RDMA_INLINE, &val, sizeof val);
 		}
+
+		if (zcopy_threshold)
+			rs_setsockopt(fd, SOL_RDMA, RDMA_ZCOPY_THRESHOLD,
+				      &zcopy_threshold, sizeof zcopy_threshold);
 	}
 
 	if (keepalive)
@@ -512,8 +529,9 @@ static int run(void)
 			goto free;
 	}
 
-	printf("%-10s%-8s%-8s%-8s%-8s%8s %10s%13s\n",
-	       "name", "bytes", "xfers", "iters", "total", "time", "Gb/sec", "usec/xfer");
+	printf("%-10s%-8s%-8s%-8s%-8s%8s %10s%13s%7s\n",
+	       "name", "bytes", "xfers", "iters", "total", "time", "Gb/sec",
+	       "usec/xfer", "%cpu");
 	if (!custom) {
 		optimization = opt_latency;
 		ret = dst_addr ? client_connect() : server_connect();
@@ -622,7 +640,7 @@ int main(int argc, char **argv)
 
 	ai_hints.ai_socktype = SOCK_STREAM;
 	rai_hints.ai_port_space = RDMA_PS_TCP;
-	while ((op = getopt(argc, argv, "s:b:f:B:i:I:C:S:p:k:T:")) != -1) {
+	while ((op = getopt(argc, argv, "s:b:f:B:i:I:C:S:p:k:z:T:")) != -1) {
 		switch (op) {
 		case 's':
 			dst_addr = optarg;
@@ -669,6 +687,9 @@ int main(int argc, char **argv)
 		case 'k':
 			keepalive = atoi(optarg);
 			break;
+		case 'z':
+			zcopy_threshold = atoi(optarg);
+			break;
 		case 'T':
 			if (!set_test_opt(optarg))
 				break;
@@ -687,6 +708,7 @@ int main(int argc, char **argv)
 			printf("\t[-S transfer_size or all]\n");
 			printf("\t[-p port_number]\n");
 			printf("\t[-k keepalive_time]\n");
+			printf("\t[-z zero_copy_threshold]\n");
 			printf("\t[-T test_option]\n");
 			printf("\t    s|sockets - use standard tcp/ip sockets\n");
 			printf("\t    a|async - asynchronous operation (use poll)\n");
@@ -36,6 +36,8 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
 
 #include "indexer.h"
 
@@ -120,45 +122,242 @@ void idx_replace(struct indexer *idx, int index, void *item)
 }
 
 
-static int idm_grow(struct index_map *idm, int index)
+/*
+ * Return the next level of the index map, allocating it if needed.  If
+ * another thread allocates the level first, we use theirs.
+ */
+static idm_entry_t *idm_grow(idm_entry_t *slot, size_t size)
 {
-	idm->array[idx_array_index(index)] = calloc(IDX_ENTRY_SIZE, sizeof(void *));
-	if (!idm->array[idx_array_index(index)])
-		goto nomem;
+	void *level, *cur = NULL;
 
-	return index;
+	level = atomic_load_explicit(slot, memory_order_acquire);
+	if (level)
+		return level;
 
-nomem:
-	errno = ENOMEM;
-	return -1;
+	level = calloc(size, sizeof(idm_entry_t));
+	if (!level)
+		return NULL;
+
+	if (!atomic_compare_exchange_strong_explicit(slot, &cur, level,
+						     memory_order_acq_rel,
+						     memory_order_acquire)) {
+		free(level);
+		level = cur;
+	}
+	return level;
 }
 
 int idm_set(struct index_map *idm, int index, void *item)
 {
-	void **entry;
+	idm_entry_t *level;
 
-	if (index > IDX_MAX_INDEX) {
+	if (index < 0) {
 		errno = ENOMEM;
 		return -1;
 	}
 
-	if (!idm->array[idx_array_index(index)]) {
-		if (idm_grow(idm, index) < 0)
-			return -1;
+	level = idm_grow(&idm->array[idm_top_index(index)], IDM_MID_SIZE);
+	if (level)
+		level = idm_grow(&level[idm_mid_index(index)], IDM_LEAF_SIZE);
+	if (!level) {
+		errno = ENOMEM;
+		return -1;
 	}
 
-	entry = idm->array[idx_array_index(index)];
-	entry[idx_entry_index(index)] = item;
+	atomic_store_explicit(&level[idm_leaf_index(index)], item,
+			      memory_order_release);
 	return index;
 }
 
 void *idm_clear(struct index_map *idm, int index)
 {
-	void **entry;
-	void *item;
+	idm_entry_t *level;
 
-	entry = idm->array[idx_array_index(index)];
-	item = entry[idx_entry_index(index)];
-	entry[idx_entry_index(index)] = NULL;
-	return item;
+	if (index < 0)
+		return NULL;
+
+	level = idm_next(idm->array, idm_top_index(index));
+	if (level)
+		level = idm_next(level, idm_mid_index(index));
+	return level ? atomic_exchange(&level[idm_leaf_index(index)], NULL) : NULL;
+}
+
+/* No lookups may run concurrently with, or after, destroying the map */
+void idm_destroy(struct index_map *idm)
+{
+	idm_entry_t *mid;
+	int i, j;
+
+	for (i = 0; i < IDM_TOP_SIZE; i++) {
+		mid = atomic_load(&idm->array[i]);
+		if (!mid)
+			continue;
+
+		for (j = 0; j < IDM_MID_SIZE; j++)
+			free(atomic_load(&mid[j]));
+		free(mid);
+		atomic_store(&idm->array[i], NULL);
+	}
+}
+
+/*
+ * Address map - open addressing hash table with linear probing.  Each
+ * entry caches the hash of its address, so that probes rarely need to
+ * touch the stored structure.  Removal shifts later entries of the probe
+ * sequence back, so that no deleted markers are needed.
+ */
+
+#define ADDRM_MIN_SIZE 16
+
+static uint32_t addrm_mix(uint32_t hash, uint32_t val)
+{
+	hash ^= val;
+	hash *= 0x9e3779b1;
+	return hash ^ (hash >> 15);
+}
+
+uint32_t addrm_hash(const struct sockaddr *addr)
+{
+	const struct sockaddr_in6 *sin6;
+	const struct sockaddr_in *sin;
+	uint32_t hash, val;
+	int i;
+
+	if (addr->sa_family == AF_INET6) {
+		sin6 = (const struct sockaddr_in6 *) addr;
+		hash = addrm_mix(AF_INET6, sin6->sin6_port);
+		for (i = 0; i < 16; i += sizeof(val)) {
+			memcpy(&val, &sin6->sin6_addr.s6_addr[i], sizeof(val));
+			hash = addrm_mix(hash, val);
+		}
+	} else {
+		sin = (const struct sockaddr_in *) addr;
+		hash = addrm_mix(addr->sa_family, sin->sin_port);
+		hash = addrm_mix(hash, sin->sin_addr.s_addr);
+	}
+	return hash;
+}
+
+/* Matches ds_compare_addr, the ordering previously used by rsockets */
+static int addrm_compare(const struct sockaddr *sa1, const struct sockaddr *sa2)
+{
+	size_t len;
+
+	len = (sa1->sa_family == AF_INET6 && sa2->sa_family == AF_INET6) ?
+	      sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+	return memcmp(sa1, sa2, len);
+}
+
+void *addrm_find(struct addr_map *am, const struct sockaddr *addr, uint32_t hash)
+{
+	struct addrm_entry *entry;
+	uint32_t i;
+
+	if (!am->table)
+		return NULL;
+
+	for (i = hash & am->mask; (entry = &am->table[i])->item;
+	     i = (i + 1) & am->mask) {
+		if (entry->hash == hash && !addrm_compare(addr, entry->item))
+			return entry->item;
+	}
+	return NULL;
+}
+
+static void addrm_place(struct addrm_entry *table, uint32_t mask,
+			struct addrm_entry *entry)
+{
+	uint32_t i;
+
+	for (i = entry->hash & mask; table[i].item; i = (i + 1) & mask)
+		;
+	table[i] = *entry;
+}
+
+static int addrm_grow(struct addr_map *am)
+{
+	struct addrm_entry *table;
+	uint32_t i, size;
+
+	size = am->table ? (am->mask + 1) << 1 : ADDRM_MIN_SIZE;
+	table = calloc(size, sizeof(*table));
+	if (!table) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (am->table) {
+		for (i = 0; i <= am->mask; i++) {
+			if (am->table[i].item)
+				addrm_place(table, size - 1, &am->table[i]);
+		}
+		free(am->table);
+	}
+
+	am->table = table;
+	am->mask = size - 1;
+	return 0;
+}
+
+/* The caller must check that the address is not already in the map */
+int addrm_insert(struct addr_map *am, void *item)
+{
+	struct addrm_entry entry;
+
+	/* Keep the load factor at or below 3/4 */
+	if (!am->table || (am->cnt + 1) * 4 > (am->mask + 1) * 3) {
+		if (addrm_grow(am))
+			return -1;
+	}
+
+	entry.item = item;
+	entry.hash = addrm_hash(item);
+	addrm_place(am->table, am->mask, &entry);
+	am->cnt++;
+	return 0;
+}
+
+void addrm_remove(struct addr_map *am, void *item)
+{
+	uint32_t i, j, home;
+
+	if (!am->table)
+		return;
+
+	for (i = addrm_hash(item) & am->mask; am->table[i].item != item;
+	     i = (i + 1) & am->mask) {
+		if (!am->table[i].item)
+			return;
+	}
+
+	for (j = (i + 1) & am->mask; am->table[j].item; j = (j + 1) & am->mask) {
+		/* Entries whose home slot lies in (i, j] stay in place */
+		home = am->table[j].hash & am->mask;
+		if ((i < j) ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+
+		am->table[i] = am->table[j];
+		i = j;
+	}
+
+	am->table[i].item = NULL;
+	am->cnt--;
+	am->gen++;
+}
+
+void addrm_destroy(struct addr_map *am, void (*free_item)(void *item))
+{
+	uint32_t i;
+
+	if (!am->table)
+		return;
+
+	for (i = 0; i <= am->mask; i++) {
+		if (am->table[i].item && free_item)
+			free_item(am->table[i].item);
+	}
+	free(am->table);
+	am->table = NULL;
+	am->mask = am->cnt = 0;
+	am->gen++;
 }
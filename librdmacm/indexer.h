@@ -37,6 +37,10 @@
 #include <config.h>
 #include <stddef.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
 
 /*
  * Indexer - to find a structure given an index.  Synchronization
@@ -75,30 +79,90 @@ static inline void *idx_at(struct indexer *idx, int index)
 }
 
 /*
- * Index map - associates a structure with an index.  Synchronization
- * must be provided by the caller.  Caller must initialize the
- * index map by setting it to 0.
+ * Index map - associates a structure with an index.  Caller must
+ * initialize the index map by setting it to 0, and release it with
+ * idm_destroy.
+ *
+ * The map covers all non-negative int values, as used for file
+ * descriptors, with three levels of arrays.  Levels are allocated on
+ * demand and are not freed until the map is destroyed, so lookups take no
+ * locks.  Setting or clearing an index is safe against concurrent updates
+ * to other indices; callers that update the same index must serialize.
  */
 
+#define IDM_LEAF_BITS 10
+#define IDM_MID_BITS  10
+#define IDM_TOP_BITS  11
+#define IDM_LEAF_SIZE (1 << IDM_LEAF_BITS)
+#define IDM_MID_SIZE  (1 << IDM_MID_BITS)
+#define IDM_TOP_SIZE  (1 << IDM_TOP_BITS)
+#define IDM_MAX_INDEX INT_MAX
+
+typedef _Atomic(void *) idm_entry_t;
+
 struct index_map
 {
-	void **array[IDX_ARRAY_SIZE];
+	idm_entry_t	 array[IDM_TOP_SIZE];
 };
 
+#define idm_top_index(index)  ((index) >> (IDM_MID_BITS + IDM_LEAF_BITS))
+#define idm_mid_index(index)  (((index) >> IDM_LEAF_BITS) & (IDM_MID_SIZE - 1))
+#define idm_leaf_index(index) ((index) & (IDM_LEAF_SIZE - 1))
+
 int idm_set(struct index_map *idm, int index, void *item);
 void *idm_clear(struct index_map *idm, int index);
+void idm_destroy(struct index_map *idm);
 
+static inline idm_entry_t *idm_next(idm_entry_t *level, int i)
+{
+	return atomic_load_explicit(&level[i], memory_order_acquire);
+}
+
+/* Caller must ensure that the index is not negative */
 static inline void *idm_at(struct index_map *idm, int index)
 {
-	void **entry;
-	entry = idm->array[idx_array_index(index)];
-	return entry[idx_entry_index(index)];
+	idm_entry_t *level;
+
+	level = idm_next(idm->array, idm_top_index(index));
+	if (level)
+		level = idm_next(level, idm_mid_index(index));
+	return level ? idm_next(level, idm_leaf_index(index)) : NULL;
 }
 
 static inline void *idm_lookup(struct index_map *idm, int index)
 {
-	return ((index <= IDX_MAX_INDEX) && idm->array[idx_array_index(index)]) ?
-		idm_at(idm, index) : NULL;
+	return (index >= 0) ? idm_at(idm, index) : NULL;
+}
+
+/*
+ * Address map - finds a structure given a socket address.  The address
+ * must be the first field of the stored structure.  Synchronization must
+ * be provided by the caller.  Caller must initialize the address map by
+ * setting it to 0.
+ */
+
+struct addrm_entry {
+	void		*item;
+	uint32_t	 hash;
+};
+
+struct addr_map
+{
+	struct addrm_entry *table;
+	uint32_t	 mask;
+	uint32_t	 cnt;
+	uint32_t	 gen;	/* changes when an item is removed */
+};
+
+uint32_t addrm_hash(const struct sockaddr *addr);
+void *addrm_find(struct addr_map *am, const struct sockaddr *addr, uint32_t hash);
+int addrm_insert(struct addr_map *am, void *item);
+void addrm_remove(struct addr_map *am, void *item);
+void addrm_destroy(struct addr_map *am, void (*free_item)(void *item));
+
+static inline void *addrm_lookup(struct addr_map *am, const struct sockaddr *addr)
+{
+	return am->cnt ? addrm_find(am, addr, addrm_hash(addr)) : NULL;
 }
 
 typedef struct _dlist_entry {
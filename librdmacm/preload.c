@@ -38,6 +38,7 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/sendfile.h>
+#include <sys/epoll.h>
 #include <stdarg.h>
 #include <dlfcn.h>
 #include <netdb.h>
@@ -47,6 +48,7 @@
 #include <netinet/tcp.h>
 #include <unistd.h>
 #include <semaphore.h>
+#include <signal.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -69,12 +71,16 @@ struct socket_calls {
 	ssize_t (*recvfrom)(int socket, void *buf, size_t len, int flags,
 			    struct sockaddr *src_addr, socklen_t *addrlen);
 	ssize_t (*recvmsg)(int socket, struct msghdr *msg, int flags);
+	int (*recvmmsg)(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+			int flags, struct timespec *timeout);
 	ssize_t (*read)(int socket, void *buf, size_t count);
 	ssize_t (*readv)(int socket, const struct iovec *iov, int iovcnt);
 	ssize_t (*send)(int socket, const void *buf, size_t len, int flags);
 	ssize_t (*sendto)(int socket, const void *buf, size_t len, int flags,
 			  const struct sockaddr *dest_addr, socklen_t addrlen);
 	ssize_t (*sendmsg)(int socket, const struct msghdr *msg, int flags);
+	int (*sendmmsg)(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+			int flags);
 	ssize_t (*write)(int socket, const void *buf, size_t count);
 	ssize_t (*writev)(int socket, const struct iovec *iov, int iovcnt);
 	int (*poll)(struct pollfd *fds, nfds_t nfds, int timeout);
@@ -90,6 +96,13 @@ struct socket_calls {
 	int (*dup2)(int oldfd, int newfd);
 	ssize_t (*sendfile)(int out_fd, int in_fd, off_t *offset, size_t count);
 	int (*fxstat)(int ver, int fd, struct stat *buf);
+	int (*epoll_create)(int size);
+	int (*epoll_create1)(int flags);
+	int (*epoll_ctl)(int epfd, int op, int fd, struct epoll_event *event);
+	int (*epoll_wait)(int epfd, struct epoll_event *events,
+			  int maxevents, int timeout);
+	int (*epoll_pwait)(int epfd, struct epoll_event *events,
+			   int maxevents, int timeout, const sigset_t *sigmask);
 };
 
 static struct socket_calls real;
@@ -98,6 +111,12 @@ static struct socket_calls rs;
 static struct index_map idm;
 static pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * Set while calling into librdmacm, so that sockets and epoll sets that
+ * rsockets create internally are not intercepted.
+ */
+static __thread int recursive;
+
 static int sq_size;
 static int rq_size;
 static int sq_inline;
@@ -105,7 +124,8 @@ static int fork_support;
 
 enum fd_type {
 	fd_normal,
-	fd_rsocket
+	fd_rsocket,
+	fd_repoll
 };
 
 enum fd_fork_state {
@@ -269,9 +289,7 @@ static int fd_open(void)
 
 	fdi->dupfd = -1;
 	atomic_store(&fdi->refcnt, 1);
-	pthread_mutex_lock(&mut);
 	ret = idm_set(&idm, index, fdi);
-	pthread_mutex_unlock(&mut);
 	if (ret < 0)
 		goto err2;
 
@@ -393,11 +411,13 @@ static void init_preload(void)
 	real.recv = dlsym(RTLD_NEXT, "recv");
 	real.recvfrom = dlsym(RTLD_NEXT, "recvfrom");
 	real.recvmsg = dlsym(RTLD_NEXT, "recvmsg");
+	real.recvmmsg = dlsym(RTLD_NEXT, "recvmmsg");
 	real.read = dlsym(RTLD_NEXT, "read");
 	real.readv = dlsym(RTLD_NEXT, "readv");
 	real.send = dlsym(RTLD_NEXT, "send");
 	real.sendto = dlsym(RTLD_NEXT, "sendto");
 	real.sendmsg = dlsym(RTLD_NEXT, "sendmsg");
+	real.sendmmsg = dlsym(RTLD_NEXT, "sendmmsg");
 	real.write = dlsym(RTLD_NEXT, "write");
 	real.writev = dlsym(RTLD_NEXT, "writev");
 	real.poll = dlsym(RTLD_NEXT, "poll");
@@ -411,6 +431,11 @@ static void init_preload(void)
 	real.dup2 = dlsym(RTLD_NEXT, "dup2");
 	real.sendfile = dlsym(RTLD_NEXT, "sendfile");
 	real.fxstat = dlsym(RTLD_NEXT, "__fxstat");
+	real.epoll_create = dlsym(RTLD_NEXT, "epoll_create");
+	real.epoll_create1 = dlsym(RTLD_NEXT, "epoll_create1");
+	real.epoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
+	real.epoll_wait = dlsym(RTLD_NEXT, "epoll_wait");
+	real.epoll_pwait = dlsym(RTLD_NEXT, "epoll_pwait");
 
 	rs.socket = dlsym(RTLD_DEFAULT, "rsocket");
 	rs.bind = dlsym(RTLD_DEFAULT, "rbind");
@@ -420,11 +445,13 @@ static void init_preload(void)
 	rs.recv = dlsym(RTLD_DEFAULT, "rrecv");
 	rs.recvfrom = dlsym(RTLD_DEFAULT, "rrecvfrom");
 	rs.recvmsg = dlsym(RTLD_DEFAULT, "rrecvmsg");
+	rs.recvmmsg = dlsym(RTLD_DEFAULT, "rrecvmmsg");
 	rs.read = dlsym(RTLD_DEFAULT, "rread");
 	rs.readv = dlsym(RTLD_DEFAULT, "rreadv");
 	rs.send = dlsym(RTLD_DEFAULT, "rsend");
 	rs.sendto = dlsym(RTLD_DEFAULT, "rsendto");
 	rs.sendmsg = dlsym(RTLD_DEFAULT, "rsendmsg");
+	rs.sendmmsg = dlsym(RTLD_DEFAULT, "rsendmmsg");
 	rs.write = dlsym(RTLD_DEFAULT, "rwrite");
 	rs.writev = dlsym(RTLD_DEFAULT, "rwritev");
 	rs.poll = dlsym(RTLD_DEFAULT, "rpoll");
@@ -531,7 +558,6 @@ static void set_rsocket_options(int rsocket)
 
 int socket(int domain, int type, int protocol)
 {
-	static __thread int recursive;
 	int index, ret;
 
 	init_preload();
@@ -809,6 +835,15 @@ ssize_t recvmsg(int socket, struct msghdr *msg, int flags)
 		rrecvmsg(fd, msg, flags) : real.recvmsg(fd, msg, flags);
 }
 
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	     int flags, struct timespec *timeout)
+{
+	int fd;
+	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
+		rrecvmmsg(fd, msgvec, vlen, flags, timeout) :
+		real.recvmmsg(fd, msgvec, vlen, flags, timeout);
+}
+
 ssize_t read(int socket, void *buf, size_t count)
 {
 	int fd;
@@ -848,6 +883,14 @@ ssize_t sendmsg(int socket, const struct msghdr *msg, int flags)
 		rsendmsg(fd, msg, flags) : real.sendmsg(fd, msg, flags);
 }
 
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	int fd;
+	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
+		rsendmmsg(fd, msgvec, vlen, flags) :
+		real.sendmmsg(fd, msgvec, vlen, flags);
+}
+
 ssize_t write(int socket, const void *buf, size_t count)
 {
 	int fd;
@@ -1020,7 +1063,12 @@ int close(int socket)
 
 	idm_clear(&idm, socket);
 	real.close(socket);
-	ret = (fdi->type == fd_rsocket) ? rclose(fdi->fd) : real.close(fdi->fd);
+	if (fdi->type == fd_rsocket)
+		ret = rclose(fdi->fd);
+	else if (fdi->type == fd_repoll)
+		ret = repoll_close(fdi->fd);
+	else
+		ret = real.close(fdi->fd);
 	free(fdi);
 	return ret;
 }
@@ -1100,6 +1148,85 @@ int fcntl(int socket, int cmd, ... /* arg */)
 	return ret;
 }
 
+/*
+ * All epoll sets are created as repoll sets, since rsockets may be added
+ * to a set at any time.  Normal fd's added to a repoll set are passed
+ * through to the kernel.
+ */
+int epoll_create1(int flags)
+{
+	int index, ret;
+
+	init_preload();
+	if (recursive)
+		goto real;
+
+	index = fd_open();
+	if (index < 0)
+		return index;
+
+	recursive = 1;
+	ret = repoll_create(flags);
+	recursive = 0;
+	if (ret >= 0) {
+		fd_store(index, ret, fd_repoll, fd_ready);
+		return index;
+	}
+	fd_close(index, &ret);
+real:
+	return real.epoll_create1(flags);
+}
+
+int epoll_create(int size)
+{
+	init_preload();
+	if (recursive || size <= 0)
+		return real.epoll_create(size);
+
+	return epoll_create1(0);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	int efd;
+
+	init_preload();
+	return (fd_get(epfd, &efd) == fd_repoll) ?
+		repoll_ctl(efd, op, fd_getd(fd), event) :
+		real.epoll_ctl(efd, op, fd_getd(fd), event);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	int efd;
+
+	init_preload();
+	return (fd_get(epfd, &efd) == fd_repoll) ?
+		repoll_wait(efd, events, maxevents, timeout) :
+		real.epoll_wait(efd, events, maxevents, timeout);
+}
+
+/*
+ * The signal mask is not applied atomically with respect to the wait.
+ */
+int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+		int timeout, const sigset_t *sigmask)
+{
+	sigset_t origmask;
+	int efd, ret;
+
+	init_preload();
+	if (fd_get(epfd, &efd) != fd_repoll)
+		return real.epoll_pwait(efd, events, maxevents, timeout, sigmask);
+
+	if (sigmask)
+		pthread_sigmask(SIG_SETMASK, sigmask, &origmask);
+	ret = repoll_wait(efd, events, maxevents, timeout);
+	if (sigmask)
+		pthread_sigmask(SIG_SETMASK, &origmask, NULL);
+	return ret;
+}
+
 /*
  * dup2 is not thread safe
  */
@@ -1135,10 +1262,6 @@ int dup2(int oldfd, int newfd)
 		return ERR(ENOMEM);
 	}
 
-	pthread_mutex_lock(&mut);
-	idm_set(&idm, newfd, newfdi);
-	pthread_mutex_unlock(&mut);
-
 	newfdi->fd = oldfdi->fd;
 	newfdi->type = oldfdi->type;
 	if (oldfdi->dupfd != -1) {
@@ -1149,6 +1272,7 @@ int dup2(int oldfd, int newfd)
 	}
 	atomic_store(&newfdi->refcnt, 1);
 	atomic_fetch_add(&oldfdi->refcnt, 1);
+	idm_set(&idm, newfd, newfdi);
 	return newfd;
 }
 
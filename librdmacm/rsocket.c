@@ -46,10 +46,12 @@
 #include <string.h>
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
-#include <search.h>
+#include <sys/eventfd.h>
+#include <sched.h>
 #include <byteswap.h>
 #include <util/compiler.h>
 #include <util/util.h>
+#include <ccan/array_size.h>
 #include <ccan/container_of.h>
 
 #include <rdma/rdma_cma.h>
@@ -60,14 +62,25 @@
 
 #define RS_OLAP_START_SIZE 2048
 #define RS_MAX_TRANSFER 65536
+#define RS_RBUF_GROW_STALLS 4
 #define RS_SNDLOWAT 2048
 #define RS_QP_MIN_SIZE 16
 #define RS_QP_MAX_SIZE 0xFFFE
 #define RS_QP_CTRL_SIZE 4	/* must be power of 2 */
 #define RS_CONN_RETRIES 6
 #define RS_SGL_SIZE 2
+#define RS_ZCOPY_MR_CNT 8
+#define RS_CQ_POLL_BATCH 16
+#define RS_CQ_GROUP_THREAD -1
+#define RS_SRQ_RBUF_CNT 16
+#define RS_SRQ_RBUF_CLASSES 5
+#define RS_SRQ_RBUF_MIN 4096
+#define RS_SRQ_CREDIT_SHARE 16
+#define DS_MMSG_BATCH 16
 static struct index_map idm;
 static pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
+static struct index_map ep_idm;
+static pthread_mutex_t ep_mut = PTHREAD_MUTEX_INITIALIZER;
 
 struct rsocket;
 
@@ -90,23 +103,41 @@ struct rs_svc {
 	pthread_t id;
 	int sock[2];
 	int cnt;
-	int size;
-	int context_size;
+	int epfd;
 	void *(*run)(void *svc);
-	struct rsocket **rss;
-	void *contexts;
 };
 
-static struct pollfd *udp_svc_fds;
-static void *udp_svc_run(void *arg);
-static struct rs_svc udp_svc = {
-	.context_size = sizeof(*udp_svc_fds),
-	.run = udp_svc_run
+/*
+ * Hierarchical timer wheel, with a resolution of one second.  Level n
+ * slots cover RS_WHEEL_SIZE^n seconds.  Timers are placed in the lowest
+ * level that covers their expiration, and move down a level each time
+ * that the level below wraps, so that the cost of running the wheel
+ * depends on the number of expired timers, not on the number of timers.
+ */
+#define RS_WHEEL_BITS 6
+#define RS_WHEEL_SIZE (1 << RS_WHEEL_BITS)
+#define RS_WHEEL_MASK (RS_WHEEL_SIZE - 1)
+#define RS_WHEEL_LEVELS 4
+#define RS_WHEEL_MAX ((1 << (RS_WHEEL_BITS * RS_WHEEL_LEVELS)) - 1)
+
+struct rs_timer {
+	dlist_entry	  entry;
+	uint32_t	  expires;
+};
+
+struct rs_timer_wheel {
+	uint32_t	  now;
+	dlist_entry	  slots[RS_WHEEL_LEVELS][RS_WHEEL_SIZE];
 };
-static uint32_t *tcp_svc_timeouts;
+
+#define RS_UDP_SVC_MAX 64
+
+static void *udp_svc_run(void *arg);
+static struct rs_svc udp_svc[RS_UDP_SVC_MAX];
+static int udp_svc_cnt = 1;
+static struct rs_timer_wheel tcp_svc_wheel;
 static void *tcp_svc_run(void *arg);
 static struct rs_svc tcp_svc = {
-	.context_size = sizeof(*tcp_svc_timeouts),
 	.run = tcp_svc_run
 };
 
@@ -116,7 +147,10 @@ static uint16_t def_sqsize = 384;
 static uint16_t def_rqsize = 384;
 static uint32_t def_mem = (1 << 17);
 static uint32_t def_wmem = (1 << 17);
+static uint32_t def_mem_max = (1 << 20);
+static uint32_t def_wmem_max = (1 << 20);
 static uint32_t polling_time = 10;
+static int single_cpu;
 
 /*
  * Immediate data format is determined by the upper bits
@@ -131,31 +165,43 @@ static uint32_t polling_time = 10;
  * bits [28-0]: receive credits granted
  * IOMAP_SGL
  * bits [28-16]: reserved, bits [15-0]: index
+ * DRA_SGL
+ * bits [28-0]: data bytes received by the peer when the buffer was posted
+ * DRA
+ * bits [28-0]: bytes written into the posted direct-receive buffer
  */
 
 enum {
 	RS_OP_DATA,
 	RS_OP_RSVD_DATA_MORE,
 	RS_OP_WRITE, /* opcode is not transmitted over the network */
-	RS_OP_RSVD_DRA_MORE,
+	RS_OP_DRA,
 	RS_OP_SGL,
-	RS_OP_RSVD,
+	RS_OP_DRA_SGL,
 	RS_OP_IOMAP_SGL,
 	RS_OP_CTRL
 };
 #define rs_msg_set(op, data)  ((op << 29) | (uint32_t) (data))
 #define rs_msg_op(imm_data)   (imm_data >> 29)
 #define rs_msg_data(imm_data) (imm_data & 0x1FFFFFFF)
+#define RS_MSG_DATA_MASK      0x1FFFFFFF
 #define RS_MSG_SIZE	      sizeof(uint32_t)
 
 #define RS_WR_ID_FLAG_RECV (((uint64_t) 1) << 63)
 #define RS_WR_ID_FLAG_MSG_SEND (((uint64_t) 1) << 62) /* See RS_OPT_MSG_SEND */
+#define RS_WR_ID_FLAG_ZCOPY (((uint64_t) 1) << 61) /* sent from a user buffer */
 #define rs_send_wr_id(data) ((uint64_t) data)
 #define rs_recv_wr_id(data) (RS_WR_ID_FLAG_RECV | (uint64_t) data)
 #define rs_wr_is_recv(wr_id) (wr_id & RS_WR_ID_FLAG_RECV)
 #define rs_wr_is_msg_send(wr_id) (wr_id & RS_WR_ID_FLAG_MSG_SEND)
+#define rs_wr_is_zcopy(wr_id) (wr_id & RS_WR_ID_FLAG_ZCOPY)
 #define rs_wr_data(wr_id) ((uint32_t) wr_id)
 
+/* Stream rsockets sharing a CQ carry their index in bits [60:32] */
+#define RS_WR_ID_INDEX_SHIFT 32
+#define RS_WR_ID_INDEX_MASK 0x1FFFFFFF
+#define rs_wr_index(wr_id) ((int) ((wr_id >> RS_WR_ID_INDEX_SHIFT) & RS_WR_ID_INDEX_MASK))
+
 enum {
 	RS_CTRL_DISCONNECT,
 	RS_CTRL_KEEPALIVE,
@@ -198,10 +244,25 @@ struct rs_iomap_mr {
 	int index;	/* -1 if mapping is local and not in iomap_list */
 };
 
+/*
+ * Registrations of user buffers used for zero-copy transfers.  A buffer is
+ * registered for the length of a transfer; transfers that run at the same
+ * time within a registered range share it.  Nothing is kept once the last
+ * transfer completes, since nothing tells us when the application frees or
+ * remaps the buffer.  Setting RDMAV_MR_CACHE lets libibverbs keep them,
+ * since it drops registrations whose memory changes.
+ */
+struct rs_zcopy_mr {
+	struct ibv_mr	*mr;
+	int		access;
+	int		refcnt;
+};
+
 #define RS_MAX_CTRL_MSG    (sizeof(struct rs_sge))
 #define rs_host_is_net()   (__BYTE_ORDER == __BIG_ENDIAN)
 #define RS_CONN_FLAG_NET   (1 << 0)
 #define RS_CONN_FLAG_IOMAP (1 << 1)
+#define RS_CONN_FLAG_DRA   (1 << 2)
 
 struct rs_conn_data {
 	uint8_t		  version;
@@ -251,6 +312,17 @@ enum rs_state {
  */
 #define RS_OPT_MSG_SEND   (1 << 1)
 #define RS_OPT_SVC_ACTIVE (1 << 2)
+/*
+ * Both peers support direct receive: a receiver may post a user buffer
+ * through RS_OP_DRA_SGL, which the sender answers with exactly one RS_OP_DRA
+ * message, writing zero or more bytes directly into the posted buffer.
+ */
+#define RS_OPT_DRA        (1 << 3)
+
+enum {
+	RS_DRA_IDLE,
+	RS_DRA_POSTED
+};
 
 union socket_addr {
 	struct sockaddr		sa;
@@ -295,6 +367,78 @@ struct ds_qp {
 	int		  cq_armed;
 };
 
+struct rs_wc {
+	struct rs_wc	  *next;
+	struct ibv_wc	  wc;
+};
+
+/*
+ * A CQ and completion channel shared by stream rsockets on the same device.
+ * Completions are moved from the CQ to per-rsocket queues in batches, using
+ * the rsocket index carried in the wr_id.  The lock protects the CQ, the
+ * member map, and all member completion queues.
+ */
+struct rs_cq_group {
+	dlist_entry	  entry;
+	int		  id;
+	int		  refcnt;
+	int		  cqe;
+	int		  cqe_used;
+	fastlock_t	  lock;
+	struct ibv_context *verbs;
+	struct ibv_comp_channel *channel;
+	struct ibv_cq	  *cq;
+	int		  unack_cqe;
+	struct index_map  members;
+	dlist_entry	  active_list; /* members with queued completions */
+	struct rs_wc	  *wc_free;
+	dlist_entry	  waiters;     /* rs_cq_waiter blocked on the channel */
+	int		  wake_fd;     /* one count per woken waiter */
+};
+
+struct rs_cq_waiter {
+	dlist_entry	  entry;
+	struct rsocket	  *rs;
+	int		  woken;
+};
+
+struct rs_rbuf_chunk {
+	dlist_entry	  entry;
+	struct ibv_mr	  *mr;
+	uint8_t		  *buf;
+	int		  cls;
+};
+
+struct rs_rbuf {
+	struct rs_rbuf	  *next;
+	struct rs_rbuf_chunk *chunk;
+	uint8_t		  *buf;
+};
+
+/*
+ * A receive queue and pool of receive buffers shared by the rsockets
+ * accepted through one listening rsocket on the same device.  Receive
+ * buffers are registered in chunks and recycled between connections.
+ * Buffers come in size classes that double from rbuf_min up to rbuf_size.
+ * A connection starts with the smallest class and moves to larger ones as
+ * its rbuf grows.  The credits granted to all connections never exceed the
+ * number of receives posted to the SRQ.
+ */
+struct rs_srq {
+	dlist_entry	  entry;
+	int		  refcnt;
+	fastlock_t	  lock;
+	struct ibv_context *verbs;
+	struct ibv_pd	  *pd;
+	struct ibv_srq	  *srq;
+	uint32_t	  size;
+	uint32_t	  credits;
+	uint32_t	  rbuf_size;
+	uint32_t	  rbuf_min;
+	dlist_entry	  chunk_list;
+	struct rs_rbuf	  *rbuf_free[RS_SRQ_RBUF_CLASSES];
+};
+
 struct rsocket {
 	int		  type;
 	int		  index;
@@ -303,6 +447,17 @@ struct rsocket {
 	fastlock_t	  cq_lock;
 	fastlock_t	  cq_wait_lock;
 	fastlock_t	  map_lock; /* acquire slock first if needed */
+	dlist_entry	  epoll_list; /* repoll items, protected by ep_mut */
+
+	/* busy polling, see rs_wait_comp */
+	uint32_t	  busy_poll;
+	uint32_t	  poll_time;
+	int		  poll_adaptive;
+	struct {
+		_Atomic(uint64_t) spin_hits;
+		_Atomic(uint64_t) spin_misses;
+		_Atomic(uint64_t) blocked;
+	} poll_stats;
 
 	union {
 		/* data stream */
@@ -310,6 +465,7 @@ struct rsocket {
 			struct rdma_cm_id *cm_id;
 			uint64_t	  tcp_opts;
 			unsigned int	  keepalive_time;
+			struct rs_timer	  keepalive;
 
 			unsigned int	  ctrl_seqno;
 			unsigned int	  ctrl_max_seqno;
@@ -336,14 +492,67 @@ struct rsocket {
 			struct ibv_mr	  *rmr;
 			uint8_t		  *rbuf;
 
+			/* receive buffer growth, see rs_grow_rbuf */
+			uint32_t	  rbuf_max;
+			uint32_t	  rbuf_adv;
+			int		  rbuf_stalls;
+			uint32_t	  rbuf_next_size;
+			struct ibv_mr	  *rmr_next;
+			uint8_t		  *rbuf_next;
+
 			int		  sbuf_bytes_avail;
 			struct ibv_mr	  *smr;
 			struct ibv_sge	  ssgl[2];
+			uint32_t	  sbuf_next_size;
+			struct ibv_mr	  *smr_next;
+			uint8_t		  *sbuf_next;
+
+			/* send sizing, see rs_adapt_send */
+			uint32_t	  sbuf_max;
+			uint32_t	  xfer_start;
+			uint32_t	  xfer_max;
+			int		  send_stall;
+
+			uint32_t	  zcopy_threshold;
+			_Atomic(int)	  zcopy_pending;
+			struct rs_zcopy_mr zcopy_mr[RS_ZCOPY_MR_CNT];
+
+			/* direct receive, sender side */
+			uint32_t	  sbytes;
+			volatile struct rs_sge	  *target_dra;
+			struct rs_sge	  dra_sge;
+			uint32_t	  dra_base;
+			_Atomic(int)	  dra_state;
+			_Atomic(int)	  send_active;
+
+			/* direct receive, receiver side */
+			uint32_t	  rbytes;
+			struct rs_sge	  remote_dra;
+			int		  dra_done;
+			int		  dra_tail;
+			uint32_t	  dra_len;
+
+			/* shared CQ */
+			int		  cq_group_id;
+			struct rs_cq_group *cq_group;
+			uint64_t	  wr_tag;
+			struct rs_wc	  *wc_head;
+			struct rs_wc	  *wc_tail;
+			dlist_entry	  active_entry;
+
+			/* shared receive queue */
+			uint32_t	  srq_size;
+			dlist_entry	  srq_list;
+			struct rs_srq	  *srq;
+			struct rs_rbuf	  *rbuf_slice;
+			struct rs_rbuf	  *rbuf_next_slice;
+			uint16_t	  srq_credits;
 		};
 		/* datagram */
 		struct {
 			struct ds_qp	  *qp_list;
-			void		  *dest_map;
+			struct addr_map	  dest_map;
+			uint64_t	  dest_map_id;
 			struct ds_dest    *conn_dest;
 
 			int		  udp_sock;
@@ -439,6 +648,15 @@ static void ds_remove_qp(struct rsocket *rs, struct ds_qp *qp)
 	}
 }
 
+/* Datagram rsockets are spread over the UDP service threads by index */
+static struct rs_svc *udp_svc_get(struct rsocket *rs)
+{
+	struct rs_svc *svc = &udp_svc[rs->index % udp_svc_cnt];
+
+	svc->run = udp_svc_run;
+	return svc;
+}
+
 static int rs_notify_svc(struct rs_svc *svc, struct rsocket *rs, int cmd)
 {
 	struct rs_svc_msg msg;
@@ -530,6 +748,9 @@ static void rs_configure(void)
 		fclose(f);
 	}
 
+	/* Spinning cannot help when the thread we wait on needs our CPU */
+	single_cpu = sysconf(_SC_NPROCESSORS_ONLN) == 1;
+
 	if ((f = fopen(RS_CONF_DIR "/inline_default", "r"))) {
 		failable_fscanf(f, "%hu", &def_inline);
 		fclose(f);
@@ -560,6 +781,26 @@ static void rs_configure(void)
 			def_wmem = RS_SNDLOWAT << 1;
 	}
 
+	if ((f = fopen(RS_CONF_DIR "/mem_max", "r"))) {
+		failable_fscanf(f, "%u", &def_mem_max);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/wmem_max", "r"))) {
+		failable_fscanf(f, "%u", &def_wmem_max);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/udp_svc_threads", "r"))) {
+		failable_fscanf(f, "%d", &udp_svc_cnt);
+		fclose(f);
+
+		if (udp_svc_cnt < 1)
+			udp_svc_cnt = 1;
+		else if (udp_svc_cnt > RS_UDP_SVC_MAX)
+			udp_svc_cnt = RS_UDP_SVC_MAX;
+	}
+
 	if ((f = fopen(RS_CONF_DIR "/iomap_size", "r"))) {
 		failable_fscanf(f, "%hu", &def_iomap_size);
 		fclose(f);
@@ -575,17 +816,13 @@ out:
 
 static int rs_insert(struct rsocket *rs, int index)
 {
-	pthread_mutex_lock(&mut);
 	rs->index = idm_set(&idm, index, rs);
-	pthread_mutex_unlock(&mut);
 	return rs->index;
 }
 
 static void rs_remove(struct rsocket *rs)
 {
-	pthread_mutex_lock(&mut);
 	idm_clear(&idm, rs->index);
-	pthread_mutex_unlock(&mut);
 }
 
 /* We only inherit from listening sockets */
@@ -599,9 +836,14 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 
 	rs->type = type;
 	rs->index = -1;
+	rs->busy_poll = inherited_rs ? inherited_rs->busy_poll : polling_time;
+	rs->poll_time = rs->busy_poll;
+	rs->poll_adaptive = inherited_rs ? inherited_rs->poll_adaptive : 0;
 	if (type == SOCK_DGRAM) {
 		rs->udp_sock = -1;
 		rs->epfd = -1;
+	} else {
+		dlist_init(&rs->srq_list);
 	}
 
 	if (inherited_rs) {
@@ -613,6 +855,11 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 		if (type == SOCK_STREAM) {
 			rs->ctrl_max_seqno = inherited_rs->ctrl_max_seqno;
 			rs->target_iomap_size = inherited_rs->target_iomap_size;
+			rs->zcopy_threshold = inherited_rs->zcopy_threshold;
+			rs->cq_group_id = inherited_rs->cq_group_id;
+			rs->srq_size = inherited_rs->srq_size;
+			rs->rbuf_max = inherited_rs->rbuf_max;
+			rs->sbuf_max = inherited_rs->sbuf_max;
 		}
 	} else {
 		rs->sbuf_size = def_wmem;
@@ -623,6 +870,8 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 		if (type == SOCK_STREAM) {
 			rs->ctrl_max_seqno = RS_QP_CTRL_SIZE;
 			rs->target_iomap_size = def_iomap_size;
+			rs->rbuf_max = def_mem_max;
+			rs->sbuf_max = def_wmem_max;
 		}
 	}
 	fastlock_init(&rs->slock);
@@ -630,6 +879,7 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 	fastlock_init(&rs->cq_lock);
 	fastlock_init(&rs->cq_wait_lock);
 	fastlock_init(&rs->map_lock);
+	dlist_init(&rs->epoll_list);
 	dlist_init(&rs->iomap_list);
 	dlist_init(&rs->iomap_queue);
 	return rs;
@@ -700,6 +950,257 @@ static void ds_set_qp_size(struct rsocket *rs)
 		rs->sbuf_size = rs->sq_size * RS_SNDLOWAT;
 }
 
+/*
+ * The iomap size is exchanged with the peer in a scaled format.  Round the
+ * local size to the value the peer will see, so that both sides agree on the
+ * location of any entries that follow the iomap in the target buffer list.
+ */
+static int rs_conn_iomap_size(struct rsocket *rs)
+{
+	return rs_scale_to_value((uint8_t)
+		rs_value_to_scale(rs->target_iomap_size, 8), 8);
+}
+
+static int rs_post_srq_recv(struct rs_srq *srq, int cnt)
+{
+	struct ibv_recv_wr wr, *bad;
+	int ret = 0;
+
+	wr.wr_id = rs_recv_wr_id(0);
+	wr.next = NULL;
+	wr.sg_list = NULL;
+	wr.num_sge = 0;
+
+	while (!ret && cnt--)
+		ret = ibv_post_srq_recv(srq->srq, &wr, &bad);
+
+	return rdma_seterrno(ret);
+}
+
+/* The top class is always rbuf_size, whatever rbuf_min was rounded to */
+static uint32_t rs_srq_rbuf_size(struct rs_srq *srq, int cls)
+{
+	if (cls == RS_SRQ_RBUF_CLASSES - 1)
+		return srq->rbuf_size;
+	return min(srq->rbuf_min << cls, srq->rbuf_size);
+}
+
+static int rs_grow_rbuf_pool(struct rs_srq *srq, int cls)
+{
+	struct rs_rbuf_chunk *chunk;
+	struct rs_rbuf *rbuf;
+	uint32_t size;
+	size_t len;
+	int i;
+
+	chunk = calloc(1, sizeof(*chunk) + sizeof(*rbuf) * RS_SRQ_RBUF_CNT);
+	if (!chunk)
+		return ERR(ENOMEM);
+
+	size = rs_srq_rbuf_size(srq, cls);
+	chunk->cls = cls;
+	len = (size_t) size * RS_SRQ_RBUF_CNT;
+	chunk->buf = calloc(len, 1);
+	if (!chunk->buf)
+		goto err1;
+
+	chunk->mr = ibv_reg_mr(srq->pd, chunk->buf, len, IBV_ACCESS_LOCAL_WRITE |
+			       IBV_ACCESS_REMOTE_WRITE);
+	if (!chunk->mr)
+		goto err2;
+
+	rbuf = (struct rs_rbuf *) (chunk + 1);
+	for (i = 0; i < RS_SRQ_RBUF_CNT; i++) {
+		rbuf[i].chunk = chunk;
+		rbuf[i].buf = chunk->buf + (size_t) size * i;
+		rbuf[i].next = srq->rbuf_free[cls];
+		srq->rbuf_free[cls] = &rbuf[i];
+	}
+	dlist_insert_tail(&chunk->entry, &srq->chunk_list);
+	return 0;
+
+err2:
+	free(chunk->buf);
+err1:
+	free(chunk);
+	return ERR(ENOMEM);
+}
+
+static struct rs_rbuf *rs_get_rbuf(struct rs_srq *srq, int cls)
+{
+	struct rs_rbuf *rbuf = NULL;
+
+	fastlock_acquire(&srq->lock);
+	if (srq->rbuf_free[cls] || !rs_grow_rbuf_pool(srq, cls)) {
+		rbuf = srq->rbuf_free[cls];
+		srq->rbuf_free[cls] = rbuf->next;
+	}
+	fastlock_release(&srq->lock);
+	return rbuf;
+}
+
+static void rs_put_rbuf(struct rs_srq *srq, struct rs_rbuf *rbuf)
+{
+	int cls = rbuf->chunk->cls;
+
+	fastlock_acquire(&srq->lock);
+	rbuf->next = srq->rbuf_free[cls];
+	srq->rbuf_free[cls] = rbuf;
+	fastlock_release(&srq->lock);
+}
+
+/*
+ * Grant an accepted rsocket its share of the SRQ's receives.  Each
+ * connection may use up to 1/RS_SRQ_CREDIT_SHARE of the SRQ, so that the
+ * credits advertised across all connections never exceed the receives
+ * posted to it.  If not enough credits remain, the rsocket uses its own
+ * receive queue.
+ */
+static int rs_get_srq_credits(struct rs_srq *srq, struct rsocket *rs)
+{
+	uint32_t credits;
+
+	credits = max_t(uint32_t, srq->size / RS_SRQ_CREDIT_SHARE, RS_QP_MIN_SIZE);
+	credits = min_t(uint32_t, credits, rs->rq_size);
+
+	fastlock_acquire(&srq->lock);
+	credits = min(credits, srq->credits);
+	if (credits >= RS_QP_MIN_SIZE)
+		srq->credits -= credits;
+	else
+		credits = 0;
+	fastlock_release(&srq->lock);
+
+	if (!credits)
+		return ERR(ENOMEM);
+
+	rs->srq_credits = rs->rq_size = credits;
+	return 0;
+}
+
+static void rs_put_srq_credits(struct rs_srq *srq, struct rsocket *rs)
+{
+	fastlock_acquire(&srq->lock);
+	srq->credits += rs->srq_credits;
+	fastlock_release(&srq->lock);
+	rs->srq_credits = 0;
+}
+
+static struct rs_srq *rs_alloc_srq(struct rsocket *rs, uint32_t size)
+{
+	struct ibv_srq_init_attr attr;
+	struct rs_srq *srq;
+
+	srq = calloc(1, sizeof(*srq));
+	if (!srq)
+		return NULL;
+
+	memset(&attr, 0, sizeof attr);
+	attr.attr.max_wr = size;
+	attr.attr.max_sge = 1;
+	srq->srq = ibv_create_srq(rs->cm_id->pd, &attr);
+	if (!srq->srq)
+		goto err1;
+
+	if (rs_post_srq_recv(srq, size))
+		goto err2;
+
+	srq->verbs = rs->cm_id->verbs;
+	srq->pd = rs->cm_id->pd;
+	srq->size = srq->credits = size;
+	srq->rbuf_size = rs->rbuf_size;
+	srq->rbuf_min = min_t(uint32_t, RS_SRQ_RBUF_MIN, rs->rbuf_size);
+	srq->rbuf_min = max(srq->rbuf_min,
+			    rs->rbuf_size >> (RS_SRQ_RBUF_CLASSES - 1)) & ~1;
+	fastlock_init(&srq->lock);
+	dlist_init(&srq->chunk_list);
+	return srq;
+
+err2:
+	ibv_destroy_srq(srq->srq);
+err1:
+	free(srq);
+	return NULL;
+}
+
+static void rs_free_srq(struct rs_srq *srq)
+{
+	struct rs_rbuf_chunk *chunk;
+
+	ibv_destroy_srq(srq->srq);
+	while (!dlist_empty(&srq->chunk_list)) {
+		chunk = container_of(srq->chunk_list.next,
+				     struct rs_rbuf_chunk, entry);
+		dlist_remove(&chunk->entry);
+		ibv_dereg_mr(chunk->mr);
+		free(chunk->buf);
+		free(chunk);
+	}
+	fastlock_destroy(&srq->lock);
+	free(srq);
+}
+
+/*
+ * Returns a reference to the listening rsocket's SRQ for the device of a
+ * newly accepted rsocket.  Receives on an SRQ carry no per-connection
+ * buffer, so iWarp, which delivers control messages through receive
+ * buffers, is not supported.  The SRQ is released when the last rsocket
+ * using it is closed.  If no SRQ is available, the rsocket uses its own
+ * receive queue.
+ */
+static struct rs_srq *rs_get_srq(struct rsocket *listen_rs, struct rsocket *rs)
+{
+	struct rs_srq *srq;
+	dlist_entry *entry;
+
+	if (rs->cm_id->verbs->device->transport_type == IBV_TRANSPORT_IWARP)
+		return NULL;
+
+	pthread_mutex_lock(&mut);
+	for (entry = listen_rs->srq_list.next; entry != &listen_rs->srq_list;
+	     entry = entry->next) {
+		srq = container_of(entry, struct rs_srq, entry);
+		if (srq->verbs == rs->cm_id->verbs &&
+		    srq->rbuf_size == rs->rbuf_size)
+			goto found;
+	}
+
+	srq = rs_alloc_srq(rs, listen_rs->srq_size);
+	if (!srq)
+		goto out;
+
+	dlist_insert_tail(&srq->entry, &listen_rs->srq_list);
+found:
+	srq->refcnt++;
+out:
+	pthread_mutex_unlock(&mut);
+	return srq;
+}
+
+static void rs_put_srq(struct rs_srq *srq)
+{
+	pthread_mutex_lock(&mut);
+	if (!--srq->refcnt) {
+		dlist_remove(&srq->entry);
+		rs_free_srq(srq);
+	}
+	pthread_mutex_unlock(&mut);
+}
+
+/* SRQs outlive the listening rsocket while accepted rsockets use them */
+static void rs_release_srqs(struct rsocket *rs)
+{
+	dlist_entry *entry;
+
+	pthread_mutex_lock(&mut);
+	while (!dlist_empty(&rs->srq_list)) {
+		entry = rs->srq_list.next;
+		dlist_remove(entry);
+		dlist_init(entry);
+	}
+	pthread_mutex_unlock(&mut);
+}
+
 static int rs_init_bufs(struct rsocket *rs)
 {
 	uint32_t total_rbuf_size, total_sbuf_size;
@@ -720,8 +1221,11 @@ static int rs_init_bufs(struct rsocket *rs)
 	if (!rs->smr)
 		return -1;
 
+	rs->target_iomap_size = rs_conn_iomap_size(rs);
 	len = sizeof(*rs->target_sgl) * RS_SGL_SIZE +
 	      sizeof(*rs->target_iomap) * rs->target_iomap_size;
+	if (rs->zcopy_threshold)
+		len += sizeof(*rs->target_dra);
 	rs->target_buffer_list = malloc(len);
 	if (!rs->target_buffer_list)
 		return ERR(ENOMEM);
@@ -734,17 +1238,31 @@ static int rs_init_bufs(struct rsocket *rs)
 	rs->target_sgl = rs->target_buffer_list;
 	if (rs->target_iomap_size)
 		rs->target_iomap = (struct rs_iomap *) (rs->target_sgl + RS_SGL_SIZE);
-
-	total_rbuf_size = rs->rbuf_size;
-	if (rs->opts & RS_OPT_MSG_SEND)
-		total_rbuf_size += rs->rq_size * RS_MSG_SIZE;
-	rs->rbuf = calloc(total_rbuf_size, 1);
-	if (!rs->rbuf)
-		return ERR(ENOMEM);
-
-	rs->rmr = rdma_reg_write(rs->cm_id, rs->rbuf, total_rbuf_size);
-	if (!rs->rmr)
-		return -1;
+	if (rs->zcopy_threshold)
+		rs->target_dra = (struct rs_sge *) ((struct rs_iomap *)
+				 (rs->target_sgl + RS_SGL_SIZE) + rs->target_iomap_size);
+
+	if (rs->srq) {
+		rs->rbuf_slice = rs_get_rbuf(rs->srq, 0);
+		if (!rs->rbuf_slice)
+			return -1;
+
+		rs->rbuf = rs->rbuf_slice->buf;
+		rs->rmr = rs->rbuf_slice->chunk->mr;
+		rs->rbuf_size = rs_srq_rbuf_size(rs->srq, 0);
+		rs->rbuf_max = rs->srq->rbuf_size;
+	} else {
+		total_rbuf_size = rs->rbuf_size;
+		if (rs->opts & RS_OPT_MSG_SEND)
+			total_rbuf_size += rs->rq_size * RS_MSG_SIZE;
+		rs->rbuf = calloc(total_rbuf_size, 1);
+		if (!rs->rbuf)
+			return ERR(ENOMEM);
+
+		rs->rmr = rdma_reg_write(rs->cm_id, rs->rbuf, total_rbuf_size);
+		if (!rs->rmr)
+			return -1;
+	}
 
 	rs->ssgl[0].addr = rs->ssgl[1].addr = (uintptr_t) rs->sbuf;
 	rs->sbuf_bytes_avail = rs->sbuf_size;
@@ -752,8 +1270,15 @@ static int rs_init_bufs(struct rsocket *rs)
 
 	rs->rbuf_free_offset = rs->rbuf_size >> 1;
 	rs->rbuf_bytes_avail = rs->rbuf_size >> 1;
+	rs->rbuf_adv = rs->rbuf_size >> 1;
 	rs->sqe_avail = rs->sq_size - rs->ctrl_max_seqno;
 	rs->rseq_comp = rs->rq_size >> 1;
+	rs->xfer_start = RS_OLAP_START_SIZE;
+	rs->xfer_max = RS_MAX_TRANSFER;
+
+	/* Message buffers follow the rbuf */
+	if (rs->opts & RS_OPT_MSG_SEND)
+		rs->rbuf_max = rs->rbuf_size;
 	return 0;
 }
 
@@ -775,107 +1300,461 @@ static int ds_init_bufs(struct ds_qp *qp)
 	return 0;
 }
 
+static dlist_entry cq_group_list = { &cq_group_list, &cq_group_list };
+static atomic_int cq_thread_cnt;
+static _Atomic(uint64_t) dest_map_cnt;
+static __thread int cq_thread_id;
+
 /*
- * If a user is waiting on a datagram rsocket through poll or select, then
- * we need the first completion to generate an event on the related epoll fd
- * in order to signal the user.  We arm the CQ on creation for this purpose
+ * Per thread groups use negative ids, so that they do not collide with
+ * groups selected by the user.
  */
-static int rs_create_cq(struct rsocket *rs, struct rdma_cm_id *cm_id)
+static int rs_cq_group_key(struct rsocket *rs)
 {
-	cm_id->recv_cq_channel = ibv_create_comp_channel(cm_id->verbs);
-	if (!cm_id->recv_cq_channel)
-		return -1;
+	if (rs->cq_group_id != RS_CQ_GROUP_THREAD)
+		return rs->cq_group_id;
 
-	cm_id->recv_cq = ibv_create_cq(cm_id->verbs, rs->sq_size + rs->rq_size,
-				       cm_id, cm_id->recv_cq_channel, 0);
-	if (!cm_id->recv_cq)
-		goto err1;
+	if (!cq_thread_id)
+		cq_thread_id = RS_CQ_GROUP_THREAD -
+			       atomic_fetch_add(&cq_thread_cnt, 1);
+	return cq_thread_id;
+}
 
-	if (rs->fd_flags & O_NONBLOCK) {
-		if (set_fd_nonblock(cm_id->recv_cq_channel->fd, true))
-			goto err2;
-	}
+static struct rs_cq_group *rs_alloc_cq_group(struct ibv_context *verbs,
+					     int id, int cqe)
+{
+	struct rs_cq_group *grp;
 
-	ibv_req_notify_cq(cm_id->recv_cq, 0);
-	cm_id->send_cq_channel = cm_id->recv_cq_channel;
-	cm_id->send_cq = cm_id->recv_cq;
-	return 0;
+	grp = calloc(1, sizeof(*grp));
+	if (!grp)
+		return NULL;
 
+	grp->channel = ibv_create_comp_channel(verbs);
+	if (!grp->channel)
+		goto err1;
+
+	grp->cq = ibv_create_cq(verbs, cqe, grp, grp->channel, 0);
+	if (!grp->cq)
+		goto err2;
+
+	/* Members share the channel, so only poll(2) may block on it */
+	if (set_fd_nonblock(grp->channel->fd, true))
+		goto err3;
+
+	grp->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+	if (grp->wake_fd < 0)
+		goto err3;
+
+	ibv_req_notify_cq(grp->cq, 0);
+	grp->id = id;
+	grp->verbs = verbs;
+	grp->cqe = grp->cq->cqe;
+	fastlock_init(&grp->lock);
+	dlist_init(&grp->active_list);
+	dlist_init(&grp->waiters);
+	return grp;
+
+err3:
+	ibv_destroy_cq(grp->cq);
 err2:
-	ibv_destroy_cq(cm_id->recv_cq);
-	cm_id->recv_cq = NULL;
+	ibv_destroy_comp_channel(grp->channel);
 err1:
-	ibv_destroy_comp_channel(cm_id->recv_cq_channel);
-	cm_id->recv_cq_channel = NULL;
-	return -1;
+	free(grp);
+	return NULL;
 }
 
-static inline int rs_post_recv(struct rsocket *rs)
+static void rs_free_cq_group(struct rs_cq_group *grp)
 {
-	struct ibv_recv_wr wr, *bad;
-	struct ibv_sge sge;
-
-	wr.next = NULL;
-	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		wr.wr_id = rs_recv_wr_id(0);
-		wr.sg_list = NULL;
-		wr.num_sge = 0;
-	} else {
-		wr.wr_id = rs_recv_wr_id(rs->rbuf_msg_index);
-		sge.addr = (uintptr_t) rs->rbuf + rs->rbuf_size +
-			   (rs->rbuf_msg_index * RS_MSG_SIZE);
-		sge.length = RS_MSG_SIZE;
-		sge.lkey = rs->rmr->lkey;
+	struct rs_wc *wc;
 
-		wr.sg_list = &sge;
-		wr.num_sge = 1;
-		if(++rs->rbuf_msg_index == rs->rq_size)
-			rs->rbuf_msg_index = 0;
+	while ((wc = grp->wc_free)) {
+		grp->wc_free = wc->next;
+		free(wc);
 	}
 
-	return rdma_seterrno(ibv_post_recv(rs->cm_id->qp, &wr, &bad));
+	ibv_ack_cq_events(grp->cq, grp->unack_cqe);
+	ibv_destroy_cq(grp->cq);
+	ibv_destroy_comp_channel(grp->channel);
+	close(grp->wake_fd);
+	idm_destroy(&grp->members);
+	fastlock_destroy(&grp->lock);
+	free(grp);
 }
 
-static inline int ds_post_recv(struct rsocket *rs, struct ds_qp *qp, uint32_t offset)
+/*
+ * Returns a reference to the rsocket's group, growing the group's CQ by
+ * cqe entries.  If the CQ cannot be resized, the caller falls back to
+ * using a private CQ.
+ */
+static struct rs_cq_group *rs_get_cq_group(struct rsocket *rs, int cqe)
 {
-	struct ibv_recv_wr wr, *bad;
-	struct ibv_sge sge[2];
+	struct rs_cq_group *grp;
+	dlist_entry *entry;
+	int id, ret;
 
-	sge[0].addr = (uintptr_t) qp->rbuf + rs->rbuf_size;
-	sge[0].length = sizeof(struct ibv_grh);
-	sge[0].lkey = qp->rmr->lkey;
-	sge[1].addr = (uintptr_t) qp->rbuf + offset;
-	sge[1].length = RS_SNDLOWAT;
-	sge[1].lkey = qp->rmr->lkey;
+	id = rs_cq_group_key(rs);
+	pthread_mutex_lock(&mut);
+	for (entry = cq_group_list.next; entry != &cq_group_list;
+	     entry = entry->next) {
+		grp = container_of(entry, struct rs_cq_group, entry);
+		if (grp->id == id && grp->verbs == rs->cm_id->verbs)
+			goto found;
+	}
 
-	wr.wr_id = rs_recv_wr_id(offset);
-	wr.next = NULL;
-	wr.sg_list = sge;
-	wr.num_sge = 2;
+	grp = rs_alloc_cq_group(rs->cm_id->verbs, id, cqe);
+	if (!grp)
+		goto out;
 
-	return rdma_seterrno(ibv_post_recv(qp->cm_id->qp, &wr, &bad));
+	dlist_insert_tail(&grp->entry, &cq_group_list);
+found:
+	if (grp->cqe_used + cqe > grp->cqe) {
+		fastlock_acquire(&grp->lock);
+		ret = ibv_resize_cq(grp->cq, max(grp->cqe * 2, grp->cqe_used + cqe));
+		if (!ret)
+			grp->cqe = grp->cq->cqe;
+		fastlock_release(&grp->lock);
+		if (ret) {
+			grp = NULL;
+			goto out;
+		}
+	}
+
+	grp->cqe_used += cqe;
+	grp->refcnt++;
+out:
+	pthread_mutex_unlock(&mut);
+	return grp;
 }
 
-static int rs_create_ep(struct rsocket *rs)
+static void rs_hold_cq_group(struct rs_cq_group *grp)
 {
-	struct ibv_qp_init_attr qp_attr;
+	pthread_mutex_lock(&mut);
+	grp->refcnt++;
+	pthread_mutex_unlock(&mut);
+}
+
+static void rs_put_cq_group(struct rs_cq_group *grp, int cqe)
+{
+	pthread_mutex_lock(&mut);
+	grp->cqe_used -= cqe;
+	if (!--grp->refcnt) {
+		dlist_remove(&grp->entry);
+		rs_free_cq_group(grp);
+	}
+	pthread_mutex_unlock(&mut);
+}
+
+static int rs_join_cq_group(struct rsocket *rs)
+{
+	struct rs_cq_group *grp = rs->cq_group;
+	int ret;
+
+	fastlock_acquire(&grp->lock);
+	ret = idm_set(&grp->members, rs->index, rs);
+	fastlock_release(&grp->lock);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Completions still queued for the rsocket, or left in the CQ for its QP,
+ * are discarded.
+ */
+static void rs_leave_cq_group(struct rsocket *rs)
+{
+	struct rs_cq_group *grp = rs->cq_group;
+
+	fastlock_acquire(&grp->lock);
+	if (idm_lookup(&grp->members, rs->index) == rs)
+		idm_clear(&grp->members, rs->index);
+
+	if (rs->wc_head) {
+		rs->wc_tail->next = grp->wc_free;
+		grp->wc_free = rs->wc_head;
+		rs->wc_head = rs->wc_tail = NULL;
+		dlist_remove(&rs->active_entry);
+	}
+	fastlock_release(&grp->lock);
+}
+
+/*
+ * Reserve enough entries to hold a full batch before polling, so that
+ * completions are never dropped.
+ */
+static int rs_grow_wc_pool(struct rs_cq_group *grp)
+{
+	struct rs_wc *wc;
+	int i;
+
+	for (i = 0, wc = grp->wc_free; i < RS_CQ_POLL_BATCH && wc; i++)
+		wc = wc->next;
+
+	for (; i < RS_CQ_POLL_BATCH; i++) {
+		wc = malloc(sizeof(*wc));
+		if (!wc)
+			return ERR(ENOMEM);
+
+		wc->next = grp->wc_free;
+		grp->wc_free = wc;
+	}
+	return 0;
+}
+
+static void rs_queue_wc(struct rs_cq_group *grp, struct rsocket *rs,
+			struct ibv_wc *wc)
+{
+	struct rs_wc *entry;
+
+	entry = grp->wc_free;
+	grp->wc_free = entry->next;
+	entry->wc = *wc;
+	entry->next = NULL;
+
+	if (rs->wc_tail) {
+		rs->wc_tail->next = entry;
+	} else {
+		rs->wc_head = entry;
+		dlist_insert_tail(&rs->active_entry, &grp->active_list);
+	}
+	rs->wc_tail = entry;
+}
+
+/* Wake the waiters that now have completions queued.  Caller holds the lock. */
+static void rs_wake_cq_waiters(struct rs_cq_group *grp)
+{
+	struct rs_cq_waiter *waiter;
+	dlist_entry *entry, *next;
+	uint64_t cnt = 1;
+
+	for (entry = grp->waiters.next; entry != &grp->waiters; entry = next) {
+		next = entry->next;
+		waiter = container_of(entry, struct rs_cq_waiter, entry);
+		if (!waiter->rs->wc_head ||
+		    write(grp->wake_fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+			continue;
+
+		dlist_remove(&waiter->entry);
+		waiter->woken = 1;
+	}
+}
+
+/*
+ * Drain the CQ, moving each completion to its rsocket.  Completions for
+ * QPs that have since left the group are dropped.  Caller holds the lock.
+ */
+static int rs_dispatch_cq(struct rs_cq_group *grp)
+{
+	struct ibv_wc wc[RS_CQ_POLL_BATCH];
+	struct rsocket *rs;
+	int i, ret;
+
+	do {
+		ret = rs_grow_wc_pool(grp);
+		if (ret)
+			return ret;
+
+		ret = ibv_poll_cq(grp->cq, RS_CQ_POLL_BATCH, wc);
+		for (i = 0; i < ret; i++) {
+			rs = idm_lookup(&grp->members, rs_wr_index(wc[i].wr_id));
+			if (rs && rs->cm_id->qp->qp_num == wc[i].qp_num)
+				rs_queue_wc(grp, rs, &wc[i]);
+		}
+	} while (ret == RS_CQ_POLL_BATCH);
+
+	if (!dlist_empty(&grp->waiters))
+		rs_wake_cq_waiters(grp);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Completion events on a shared channel are not tied to any one rsocket.
+ * Whoever retrieves an event re-arms the CQ and dispatches all completions,
+ * so the other members see their completions without a separate event.
+ */
+static void rs_get_group_event(struct rs_cq_group *grp)
+{
+	struct ibv_cq *cq;
+	void *context;
+
+	fastlock_acquire(&grp->lock);
+	if (!ibv_get_cq_event(grp->channel, &cq, &context)) {
+		if (++grp->unack_cqe >= grp->cqe) {
+			ibv_ack_cq_events(grp->cq, grp->unack_cqe);
+			grp->unack_cqe = 0;
+		}
+		ibv_req_notify_cq(grp->cq, 0);
+		rs_dispatch_cq(grp);
+	}
+	fastlock_release(&grp->lock);
+}
+
+static int rs_poll_wc(struct rsocket *rs, struct ibv_wc *wc)
+{
+	struct rs_cq_group *grp = rs->cq_group;
+	struct rs_wc *entry;
+	int ret = 0;
+
+	if (!grp)
+		return ibv_poll_cq(rs->cm_id->recv_cq, 1, wc);
+
+	fastlock_acquire(&grp->lock);
+	if (!rs->wc_head)
+		ret = rs_dispatch_cq(grp);
+
+	entry = rs->wc_head;
+	if (entry) {
+		*wc = entry->wc;
+		rs->wc_head = entry->next;
+		if (!rs->wc_head) {
+			rs->wc_tail = NULL;
+			dlist_remove(&rs->active_entry);
+		}
+		entry->next = grp->wc_free;
+		grp->wc_free = entry;
+		ret = 1;
+	}
+	fastlock_release(&grp->lock);
+	return ret;
+}
+
+static void rs_req_notify_cq(struct rsocket *rs)
+{
+	if (rs->cq_group) {
+		fastlock_acquire(&rs->cq_group->lock);
+		ibv_req_notify_cq(rs->cq_group->cq, 0);
+		fastlock_release(&rs->cq_group->lock);
+	} else {
+		ibv_req_notify_cq(rs->cm_id->recv_cq, 0);
+	}
+}
+
+/*
+ * If a user is waiting on a datagram rsocket through poll or select, then
+ * we need the first completion to generate an event on the related epoll fd
+ * in order to signal the user.  We arm the CQ on creation for this purpose
+ */
+static int rs_create_cq(struct rsocket *rs, struct rdma_cm_id *cm_id)
+{
+	if (rs->type == SOCK_STREAM && rs->cq_group_id && !rs->srq &&
+	    rs->index <= RS_WR_ID_INDEX_MASK) {
+		rs->cq_group = rs_get_cq_group(rs, rs->sq_size + rs->rq_size);
+		if (rs->cq_group) {
+			rs->wr_tag = (uint64_t) rs->index << RS_WR_ID_INDEX_SHIFT;
+			return 0;
+		}
+	}
+
+	cm_id->recv_cq_channel = ibv_create_comp_channel(cm_id->verbs);
+	if (!cm_id->recv_cq_channel)
+		return -1;
+
+	cm_id->recv_cq = ibv_create_cq(cm_id->verbs, rs->sq_size + rs->rq_size,
+				       cm_id, cm_id->recv_cq_channel, 0);
+	if (!cm_id->recv_cq)
+		goto err1;
+
+	if (rs->fd_flags & O_NONBLOCK) {
+		if (set_fd_nonblock(cm_id->recv_cq_channel->fd, true))
+			goto err2;
+	}
+
+	ibv_req_notify_cq(cm_id->recv_cq, 0);
+	cm_id->send_cq_channel = cm_id->recv_cq_channel;
+	cm_id->send_cq = cm_id->recv_cq;
+	return 0;
+
+err2:
+	ibv_destroy_cq(cm_id->recv_cq);
+	cm_id->recv_cq = NULL;
+err1:
+	ibv_destroy_comp_channel(cm_id->recv_cq_channel);
+	cm_id->recv_cq_channel = NULL;
+	return -1;
+}
+
+static inline int rs_post_recv(struct rsocket *rs)
+{
+	struct ibv_recv_wr wr, *bad;
+	struct ibv_sge sge;
+
+	wr.next = NULL;
+	if (!(rs->opts & RS_OPT_MSG_SEND)) {
+		wr.wr_id = rs->wr_tag | rs_recv_wr_id(0);
+		wr.sg_list = NULL;
+		wr.num_sge = 0;
+	} else {
+		wr.wr_id = rs->wr_tag | rs_recv_wr_id(rs->rbuf_msg_index);
+		sge.addr = (uintptr_t) rs->rbuf + rs->rbuf_size +
+			   (rs->rbuf_msg_index * RS_MSG_SIZE);
+		sge.length = RS_MSG_SIZE;
+		sge.lkey = rs->rmr->lkey;
+
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+		if(++rs->rbuf_msg_index == rs->rq_size)
+			rs->rbuf_msg_index = 0;
+	}
+
+	return rdma_seterrno(ibv_post_recv(rs->cm_id->qp, &wr, &bad));
+}
+
+static void ds_init_recv_wr(struct rsocket *rs, struct ds_qp *qp, uint32_t offset,
+			    struct ibv_recv_wr *wr, struct ibv_sge *sge)
+{
+	sge[0].addr = (uintptr_t) qp->rbuf + rs->rbuf_size;
+	sge[0].length = sizeof(struct ibv_grh);
+	sge[0].lkey = qp->rmr->lkey;
+	sge[1].addr = (uintptr_t) qp->rbuf + offset;
+	sge[1].length = RS_SNDLOWAT;
+	sge[1].lkey = qp->rmr->lkey;
+
+	wr->wr_id = rs_recv_wr_id(offset);
+	wr->next = NULL;
+	wr->sg_list = sge;
+	wr->num_sge = 2;
+}
+
+static inline int ds_post_recv(struct rsocket *rs, struct ds_qp *qp, uint32_t offset)
+{
+	struct ibv_recv_wr wr, *bad;
+	struct ibv_sge sge[2];
+
+	ds_init_recv_wr(rs, qp, offset, &wr, sge);
+	return rdma_seterrno(ibv_post_recv(qp->cm_id->qp, &wr, &bad));
+}
+
+static int rs_create_ep(struct rsocket *rs)
+{
+	struct ibv_qp_init_attr qp_attr;
 	int i, ret;
 
 	rs_set_qp_size(rs);
 	if (rs->cm_id->verbs->device->transport_type == IBV_TRANSPORT_IWARP)
 		rs->opts |= RS_OPT_MSG_SEND;
+	if (rs->srq && rs_get_srq_credits(rs->srq, rs)) {
+		rs_put_srq(rs->srq);
+		rs->srq = NULL;
+	}
 	ret = rs_create_cq(rs, rs->cm_id);
 	if (ret)
 		return ret;
 
 	memset(&qp_attr, 0, sizeof qp_attr);
 	qp_attr.qp_context = rs;
-	qp_attr.send_cq = rs->cm_id->send_cq;
-	qp_attr.recv_cq = rs->cm_id->recv_cq;
+	if (rs->cq_group) {
+		/* Keep the shared CQ out of the cm_id, which would destroy it */
+		qp_attr.send_cq = rs->cq_group->cq;
+		qp_attr.recv_cq = rs->cq_group->cq;
+	} else {
+		qp_attr.send_cq = rs->cm_id->send_cq;
+		qp_attr.recv_cq = rs->cm_id->recv_cq;
+	}
 	qp_attr.qp_type = IBV_QPT_RC;
 	qp_attr.sq_sig_all = 1;
 	qp_attr.cap.max_send_wr = rs->sq_size;
-	qp_attr.cap.max_recv_wr = rs->rq_size;
+	if (rs->srq)
+		qp_attr.srq = rs->srq->srq;
+	else
+		qp_attr.cap.max_recv_wr = rs->rq_size;
 	qp_attr.cap.max_send_sge = 2;
 	qp_attr.cap.max_recv_sge = 1;
 	qp_attr.cap.max_inline_data = rs->sq_inline;
@@ -884,6 +1763,12 @@ static int rs_create_ep(struct rsocket *rs)
 	if (ret)
 		return ret;
 
+	if (rs->cq_group) {
+		ret = rs_join_cq_group(rs);
+		if (ret)
+			return ret;
+	}
+
 	rs->sq_inline = qp_attr.cap.max_inline_data;
 	if ((rs->opts & RS_OPT_MSG_SEND) && (rs->sq_inline < RS_MSG_SIZE))
 		return ERR(ENOTSUP);
@@ -892,7 +1777,7 @@ static int rs_create_ep(struct rsocket *rs)
 	if (ret)
 		return ret;
 
-	for (i = 0; i < rs->rq_size; i++) {
+	for (i = 0; !rs->srq && i < rs->rq_size; i++) {
 		ret = rs_post_recv(rs);
 		if (ret)
 			return ret;
@@ -929,6 +1814,16 @@ static void rs_free_iomappings(struct rsocket *rs)
 	}
 }
 
+static void rs_free_zcopy_mrs(struct rsocket *rs)
+{
+	int i;
+
+	for (i = 0; i < RS_ZCOPY_MR_CNT; i++) {
+		if (rs->zcopy_mr[i].mr)
+			ibv_dereg_mr(rs->zcopy_mr[i].mr);
+	}
+}
+
 static void ds_free_qp(struct ds_qp *qp)
 {
 	if (qp->smr)
@@ -942,7 +1837,7 @@ static void ds_free_qp(struct ds_qp *qp)
 
 	if (qp->cm_id) {
 		if (qp->cm_id->qp) {
-			tdelete(&qp->dest.addr, &qp->rs->dest_map, ds_compare_addr);
+			addrm_remove(&qp->rs->dest_map, &qp->dest);
 			epoll_ctl(qp->rs->epfd, EPOLL_CTL_DEL,
 				  qp->cm_id->recv_cq_channel->fd, NULL);
 			rdma_destroy_qp(qp->cm_id);
@@ -977,7 +1872,7 @@ static void ds_free(struct rsocket *rs)
 	if (rs->sbuf)
 		free(rs->sbuf);
 
-	tdestroy(rs->dest_map, free);
+	addrm_destroy(&rs->dest_map, free);
 	fastlock_destroy(&rs->map_lock);
 	fastlock_destroy(&rs->cq_wait_lock);
 	fastlock_destroy(&rs->cq_lock);
@@ -1002,12 +1897,22 @@ static void rs_free(struct rsocket *rs)
 		free(rs->sbuf);
 	}
 
-	if (rs->rbuf) {
+	if (rs->sbuf_next) {
+		rdma_dereg_mr(rs->smr_next);
+		free(rs->sbuf_next);
+	}
+
+	if (rs->rbuf && !rs->srq) {
 		if (rs->rmr)
 			rdma_dereg_mr(rs->rmr);
 		free(rs->rbuf);
 	}
 
+	if (rs->rbuf_next && !rs->srq) {
+		rdma_dereg_mr(rs->rmr_next);
+		free(rs->rbuf_next);
+	}
+
 	if (rs->target_buffer_list) {
 		if (rs->target_mr)
 			rdma_dereg_mr(rs->target_mr);
@@ -1019,13 +1924,29 @@ static void rs_free(struct rsocket *rs)
 
 	if (rs->cm_id) {
 		rs_free_iomappings(rs);
+		rs_free_zcopy_mrs(rs);
+		if (rs->cq_group)
+			rs_leave_cq_group(rs);
 		if (rs->cm_id->qp) {
-			ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
+			if (!rs->cq_group)
+				ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
 			rdma_destroy_qp(rs->cm_id);
 		}
+		if (rs->cq_group)
+			rs_put_cq_group(rs->cq_group, rs->sq_size + rs->rq_size);
+		if (rs->srq) {
+			if (rs->rbuf_slice)
+				rs_put_rbuf(rs->srq, rs->rbuf_slice);
+			if (rs->rbuf_next_slice)
+				rs_put_rbuf(rs->srq, rs->rbuf_next_slice);
+			rs_put_srq_credits(rs->srq, rs);
+			rs_put_srq(rs->srq);
+		}
 		rdma_destroy_id(rs->cm_id);
 	}
 
+	rs_release_srqs(rs);
+
 	fastlock_destroy(&rs->map_lock);
 	fastlock_destroy(&rs->cq_wait_lock);
 	fastlock_destroy(&rs->cq_lock);
@@ -1045,6 +1966,8 @@ static void rs_format_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
 	conn->version = 1;
 	conn->flags = RS_CONN_FLAG_IOMAP |
 		      (rs_host_is_net() ? RS_CONN_FLAG_NET : 0);
+	if (rs->target_dra && !(rs->opts & RS_OPT_MSG_SEND))
+		conn->flags |= RS_CONN_FLAG_DRA;
 	conn->credits = htobe16(rs->rq_size);
 	memset(conn->reserved, 0, sizeof conn->reserved);
 	conn->target_iomap_size = (uint8_t) rs_value_to_scale(rs->target_iomap_size, 8);
@@ -1073,6 +1996,14 @@ static void rs_save_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
 					sizeof(rs->remote_sgl) * rs->remote_sgl.length;
 		rs->remote_iomap.length = rs_scale_to_value(conn->target_iomap_size, 8);
 		rs->remote_iomap.key = rs->remote_sgl.key;
+
+		if ((conn->flags & RS_CONN_FLAG_DRA) && rs->target_dra &&
+		    !(rs->opts & RS_OPT_MSG_SEND)) {
+			rs->remote_dra.addr = rs->remote_iomap.addr +
+				sizeof(struct rs_iomap) * rs->remote_iomap.length;
+			rs->remote_dra.key = rs->remote_sgl.key;
+			rs->opts |= RS_OPT_DRA;
+		}
 	}
 
 	rs->target_sgl[0].addr = be64toh((__force __be64)conn->data_buf.addr);
@@ -1084,6 +2015,7 @@ static void rs_save_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
 
 static int ds_init(struct rsocket *rs, int domain)
 {
+	rs->dest_map_id = atomic_fetch_add(&dest_map_cnt, 1) + 1;
 	rs->udp_sock = socket(domain, SOCK_DGRAM, 0);
 	if (rs->udp_sock < 0)
 		return rs->udp_sock;
@@ -1121,7 +2053,7 @@ static int ds_init_ep(struct rsocket *rs)
 	}
 	msg->next = NULL;
 
-	ret = rs_notify_svc(&udp_svc, rs, RS_SVC_ADD_DGRAM);
+	ret = rs_notify_svc(udp_svc_get(rs), rs, RS_SVC_ADD_DGRAM);
 	if (ret)
 		return ret;
 
@@ -1257,6 +2189,9 @@ int raccept(int socket, struct sockaddr *addr, socklen_t *addrlen)
 	if (rs->fd_flags & O_NONBLOCK)
 		set_fd_nonblock(new_rs->cm_id->channel->fd, true);
 
+	if (rs->srq_size)
+		new_rs->srq = rs_get_srq(rs, new_rs);
+
 	ret = rs_create_ep(new_rs);
 	if (ret)
 		goto err;
@@ -1481,7 +2416,12 @@ static int ds_add_qp_dest(struct ds_qp *qp, union socket_addr *addr,
 	if (!qp->dest.ah)
 		return ERR(ENOMEM);
 
-	tsearch(&qp->dest.addr, &qp->rs->dest_map, ds_compare_addr);
+	if (!addrm_lookup(&qp->rs->dest_map, &addr->sa) &&
+	    addrm_insert(&qp->rs->dest_map, &qp->dest)) {
+		ibv_destroy_ah(qp->dest.ah);
+		qp->dest.ah = NULL;
+		return -1;
+	}
 	return 0;
 }
 
@@ -1573,18 +2513,47 @@ static int ds_get_qp(struct rsocket *rs, union socket_addr *src_addr,
 	return ds_create_qp(rs, src_addr, addrlen, qp);
 }
 
+/*
+ * Each thread remembers the last destination that it found.  Map ids are
+ * never reused, and a map's generation changes whenever a destination is
+ * removed, so a cached destination is valid while both match.
+ */
+static __thread struct {
+	uint64_t	  map_id;
+	uint32_t	  gen;
+	struct ds_dest	  *dest;
+} last_dest;
+
+static struct ds_dest *ds_find_dest(struct rsocket *rs,
+				    const struct sockaddr *addr)
+{
+	struct ds_dest *dest;
+
+	if (last_dest.map_id == rs->dest_map_id &&
+	    last_dest.gen == rs->dest_map.gen &&
+	    !ds_compare_addr(addr, &last_dest.dest->addr))
+		return last_dest.dest;
+
+	dest = addrm_lookup(&rs->dest_map, addr);
+	if (dest) {
+		last_dest.map_id = rs->dest_map_id;
+		last_dest.gen = rs->dest_map.gen;
+		last_dest.dest = dest;
+	}
+	return dest;
+}
+
 static int ds_get_dest(struct rsocket *rs, const struct sockaddr *addr,
 		       socklen_t addrlen, struct ds_dest **dest)
 {
 	union socket_addr src_addr;
 	socklen_t src_len;
 	struct ds_qp *qp;
-	struct ds_dest **tdest, *new_dest;
+	struct ds_dest *new_dest;
 	int ret = 0;
 
 	fastlock_acquire(&rs->map_lock);
-	tdest = tfind(addr, &rs->dest_map, ds_compare_addr);
-	if (tdest)
+	if ((new_dest = ds_find_dest(rs, addr)))
 		goto found;
 
 	ret = ds_get_src_addr(rs, addr, addrlen, &src_addr, &src_len);
@@ -1595,21 +2564,25 @@ static int ds_get_dest(struct rsocket *rs, const struct sockaddr *addr,
 	if (ret)
 		goto out;
 
-	tdest = tfind(addr, &rs->dest_map, ds_compare_addr);
-	if (!tdest) {
-		new_dest = calloc(1, sizeof(*new_dest));
-		if (!new_dest) {
-			ret = ERR(ENOMEM);
-			goto out;
-		}
+	if ((new_dest = ds_find_dest(rs, addr)))
+		goto found;
+
+	new_dest = calloc(1, sizeof(*new_dest));
+	if (!new_dest) {
+		ret = ERR(ENOMEM);
+		goto out;
+	}
 
-		memcpy(&new_dest->addr, addr, addrlen);
-		new_dest->qp = qp;
-		tdest = tsearch(&new_dest->addr, &rs->dest_map, ds_compare_addr);
+	memcpy(&new_dest->addr, addr, addrlen);
+	new_dest->qp = qp;
+	ret = addrm_insert(&rs->dest_map, new_dest);
+	if (ret) {
+		free(new_dest);
+		goto out;
 	}
 
 found:
-	*dest = *tdest;
+	*dest = new_dest;
 out:
 	fastlock_release(&rs->map_lock);
 	return ret;
@@ -1653,7 +2626,7 @@ static int rs_post_msg(struct rsocket *rs, uint32_t msg)
 	struct ibv_send_wr wr, *bad;
 	struct ibv_sge sge;
 
-	wr.wr_id = rs_send_wr_id(msg);
+	wr.wr_id = rs->wr_tag | rs_send_wr_id(msg);
 	wr.next = NULL;
 	if (!(rs->opts & RS_OPT_MSG_SEND)) {
 		wr.sg_list = NULL;
@@ -1681,7 +2654,7 @@ static int rs_post_write(struct rsocket *rs,
 {
 	struct ibv_send_wr wr, *bad;
 
-	wr.wr_id = rs_send_wr_id(wr_data);
+	wr.wr_id = rs->wr_tag | rs_send_wr_id(wr_data);
 	wr.next = NULL;
 	wr.sg_list = sgl;
 	wr.num_sge = nsge;
@@ -1704,7 +2677,7 @@ static int rs_post_write_msg(struct rsocket *rs,
 
 	wr.next = NULL;
 	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		wr.wr_id = rs_send_wr_id(msg);
+		wr.wr_id = rs->wr_tag | rs_send_wr_id(msg);
 		wr.sg_list = sgl;
 		wr.num_sge = nsge;
 		wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
@@ -1717,7 +2690,8 @@ static int rs_post_write_msg(struct rsocket *rs,
 	} else {
 		ret = rs_post_write(rs, sgl, nsge, msg, flags, addr, rkey);
 		if (!ret) {
-			wr.wr_id = rs_send_wr_id(rs_msg_set(rs_msg_op(msg), 0)) |
+			wr.wr_id = rs->wr_tag |
+				   rs_send_wr_id(rs_msg_set(rs_msg_op(msg), 0)) |
 				   RS_WR_ID_FLAG_MSG_SEND;
 			sge.addr = (uintptr_t) &msg;
 			sge.lkey = 0;
@@ -1733,21 +2707,26 @@ static int rs_post_write_msg(struct rsocket *rs,
 	}
 }
 
+static void ds_init_send_wr(struct rsocket *rs, struct ibv_sge *sge,
+			    uint32_t wr_data, struct ibv_send_wr *wr)
+{
+	wr->wr_id = rs_send_wr_id(wr_data);
+	wr->next = NULL;
+	wr->sg_list = sge;
+	wr->num_sge = 1;
+	wr->opcode = IBV_WR_SEND;
+	wr->send_flags = (sge->length <= rs->sq_inline) ? IBV_SEND_INLINE : 0;
+	wr->wr.ud.ah = rs->conn_dest->ah;
+	wr->wr.ud.remote_qpn = rs->conn_dest->qpn;
+	wr->wr.ud.remote_qkey = RDMA_UDP_QKEY;
+}
+
 static int ds_post_send(struct rsocket *rs, struct ibv_sge *sge,
 			uint32_t wr_data)
 {
 	struct ibv_send_wr wr, *bad;
 
-	wr.wr_id = rs_send_wr_id(wr_data);
-	wr.next = NULL;
-	wr.sg_list = sge;
-	wr.num_sge = 1;
-	wr.opcode = IBV_WR_SEND;
-	wr.send_flags = (sge->length <= rs->sq_inline) ? IBV_SEND_INLINE : 0;
-	wr.wr.ud.ah = rs->conn_dest->ah;
-	wr.wr.ud.remote_qpn = rs->conn_dest->qpn;
-	wr.wr.ud.remote_qkey = RDMA_UDP_QKEY;
-
+	ds_init_send_wr(rs, sge, wr_data, &wr);
 	return rdma_seterrno(ibv_post_send(rs->conn_dest->qp->cm_id->qp, &wr, &bad));
 }
 
@@ -1755,6 +2734,21 @@ static int ds_post_send(struct rsocket *rs, struct ibv_sge *sge,
  * Update target SGE before sending data.  Otherwise the remote side may
  * update the entry before we do.
  */
+static void rs_use_target_sge(struct rsocket *rs, uint32_t length,
+			      uint64_t *addr, uint32_t *rkey)
+{
+	*addr = rs->target_sgl[rs->target_sge].addr;
+	*rkey = rs->target_sgl[rs->target_sge].key;
+
+	rs->target_sgl[rs->target_sge].addr += length;
+	rs->target_sgl[rs->target_sge].length -= length;
+
+	if (!rs->target_sgl[rs->target_sge].length) {
+		if (++rs->target_sge == RS_SGL_SIZE)
+			rs->target_sge = 0;
+	}
+}
+
 static int rs_write_data(struct rsocket *rs,
 			 struct ibv_sge *sgl, int nsge,
 			 uint32_t length, int flags)
@@ -1767,20 +2761,45 @@ static int rs_write_data(struct rsocket *rs,
 	if (rs->opts & RS_OPT_MSG_SEND)
 		rs->sqe_avail--;
 	rs->sbuf_bytes_avail -= length;
+	rs->sbytes += length;
 
-	addr = rs->target_sgl[rs->target_sge].addr;
-	rkey = rs->target_sgl[rs->target_sge].key;
+	rs_use_target_sge(rs, length, &addr, &rkey);
+	return rs_post_write_msg(rs, sgl, nsge, rs_msg_set(RS_OP_DATA, length),
+				 flags, addr, rkey);
+}
 
-	rs->target_sgl[rs->target_sge].addr += length;
-	rs->target_sgl[rs->target_sge].length -= length;
+/*
+ * Zero-copy variant of rs_write_data.  Data is written directly from a
+ * registered user buffer, so no send buffer space is consumed.  The caller
+ * must wait for the write to complete before returning the buffer to the
+ * application.
+ */
+static int rs_write_zcopy(struct rsocket *rs, struct ibv_sge *sge)
+{
+	struct ibv_send_wr wr, *bad;
+	uint32_t msg;
+	int ret;
 
-	if (!rs->target_sgl[rs->target_sge].length) {
-		if (++rs->target_sge == RS_SGL_SIZE)
-			rs->target_sge = 0;
-	}
+	rs->sseq_no++;
+	rs->sqe_avail--;
+	rs->sbytes += sge->length;
 
-	return rs_post_write_msg(rs, sgl, nsge, rs_msg_set(RS_OP_DATA, length),
-				 flags, addr, rkey);
+	msg = rs_msg_set(RS_OP_DATA, sge->length);
+	wr.wr_id = rs->wr_tag | rs_send_wr_id(msg) | RS_WR_ID_FLAG_ZCOPY;
+	wr.next = NULL;
+	wr.sg_list = sge;
+	wr.num_sge = 1;
+	wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+	wr.send_flags = 0;
+	wr.imm_data = htobe32(msg);
+	rs_use_target_sge(rs, sge->length, &wr.wr.rdma.remote_addr,
+			  &wr.wr.rdma.rkey);
+
+	atomic_fetch_add(&rs->zcopy_pending, 1);
+	ret = rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
+	if (ret)
+		atomic_fetch_sub(&rs->zcopy_pending, 1);
+	return ret;
 }
 
 static int rs_write_direct(struct rsocket *rs, struct rs_iomap *iom, uint64_t offset,
@@ -1818,26 +2837,102 @@ static uint32_t rs_sbuf_left(struct rsocket *rs)
 			   rs->ssgl[0].addr);
 }
 
-static void rs_send_credits(struct rsocket *rs)
-{
+/*
+ * While a larger rbuf is advertised, the remainder of the current rbuf
+ * may not be advertised again.
+ */
+static int rs_rbuf_avail(struct rsocket *rs)
+{
+	return !rs->rbuf_next && (rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1));
+}
+
+/*
+ * If the peer has filled all of the rbuf space that we advertised by the
+ * time we free more, it is waiting on us.  After this happens repeatedly,
+ * we replace the rbuf with a larger one.  The switch is made when the next
+ * region to advertise is the start of the rbuf, so that the peer's writes
+ * move to the new rbuf after filling the second half of the current one.
+ * The receive side switches after reading that data (see rs_switch_rbuf).
+ */
+static void rs_grow_rbuf(struct rsocket *rs)
+{
+	uint32_t size;
+
+	if (rs->rbytes == rs->rbuf_adv)
+		rs->rbuf_stalls++;
+	else
+		rs->rbuf_stalls = 0;
+
+	if (rs->rbuf_stalls < RS_RBUF_GROW_STALLS || rs->rbuf_free_offset ||
+	    rs->rbuf_size >= rs->rbuf_max)
+		return;
+
+	if (rs->srq) {
+		if (rs->rbuf_slice->chunk->cls == RS_SRQ_RBUF_CLASSES - 1)
+			return;
+
+		rs->rbuf_next_slice = rs_get_rbuf(rs->srq,
+						  rs->rbuf_slice->chunk->cls + 1);
+		if (!rs->rbuf_next_slice)
+			return;
+
+		rs->rbuf_next = rs->rbuf_next_slice->buf;
+		rs->rmr_next = rs->rbuf_next_slice->chunk->mr;
+		rs->rbuf_next_size = rs_srq_rbuf_size(rs->srq,
+					rs->rbuf_next_slice->chunk->cls);
+		rs->rbuf_stalls = 0;
+		return;
+	}
+
+	size = min(rs->rbuf_size << 1, rs->rbuf_max) & ~1;
+	rs->rbuf_next = calloc(size, 1);
+	if (!rs->rbuf_next)
+		return;
+
+	rs->rmr_next = rdma_reg_write(rs->cm_id, rs->rbuf_next, size);
+	if (!rs->rmr_next) {
+		free(rs->rbuf_next);
+		rs->rbuf_next = NULL;
+		return;
+	}
+
+	rs->rbuf_next_size = size;
+	rs->rbuf_stalls = 0;
+}
+
+static void rs_send_credits(struct rsocket *rs)
+{
 	struct ibv_sge ibsge;
 	struct rs_sge sge, *sge_buf;
+	uint8_t *addr;
+	uint32_t key, len;
 	int flags;
 
 	rs->ctrl_seqno++;
 	rs->rseq_comp = rs->rseq_no + (rs->rq_size >> 1);
-	if (rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) {
+	if (rs_rbuf_avail(rs)) {
 		if (rs->opts & RS_OPT_MSG_SEND)
 			rs->ctrl_seqno++;
 
+		rs_grow_rbuf(rs);
+		if (rs->rbuf_next) {
+			addr = rs->rbuf_next;
+			key = rs->rmr_next->rkey;
+			len = rs->rbuf_next_size >> 1;
+		} else {
+			addr = &rs->rbuf[rs->rbuf_free_offset];
+			key = rs->rmr->rkey;
+			len = rs->rbuf_size >> 1;
+		}
+
 		if (!(rs->opts & RS_OPT_SWAP_SGL)) {
-			sge.addr = (uintptr_t) &rs->rbuf[rs->rbuf_free_offset];
-			sge.key = rs->rmr->rkey;
-			sge.length = rs->rbuf_size >> 1;
+			sge.addr = (uintptr_t) addr;
+			sge.key = key;
+			sge.length = len;
 		} else {
-			sge.addr = bswap_64((uintptr_t) &rs->rbuf[rs->rbuf_free_offset]);
-			sge.key = bswap_32(rs->rmr->rkey);
-			sge.length = bswap_32(rs->rbuf_size >> 1);
+			sge.addr = bswap_64((uintptr_t) addr);
+			sge.key = bswap_32(key);
+			sge.length = bswap_32(len);
 		}
 
 		if (rs->sq_inline < sizeof sge) {
@@ -1858,10 +2953,16 @@ static void rs_send_credits(struct rsocket *rs)
 			rs->remote_sgl.addr + rs->remote_sge * sizeof(struct rs_sge),
 			rs->remote_sgl.key);
 
+		/* On a switch, the first half of the current rbuf is retired */
+		rs->rbuf_adv += len;
 		rs->rbuf_bytes_avail -= rs->rbuf_size >> 1;
-		rs->rbuf_free_offset += rs->rbuf_size >> 1;
-		if (rs->rbuf_free_offset >= rs->rbuf_size)
-			rs->rbuf_free_offset = 0;
+		if (rs->rbuf_next) {
+			rs->rbuf_free_offset = len;
+		} else {
+			rs->rbuf_free_offset += len;
+			if (rs->rbuf_free_offset >= rs->rbuf_size)
+				rs->rbuf_free_offset = 0;
+		}
 		if (++rs->remote_sge == rs->remote_sgl.length)
 			rs->remote_sge = 0;
 	} else {
@@ -1883,11 +2984,11 @@ static inline int rs_2ctrl_avail(struct rsocket *rs)
 static int rs_give_credits(struct rsocket *rs)
 {
 	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		return ((rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) ||
+		return (rs_rbuf_avail(rs) ||
 			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
 		       rs_ctrl_avail(rs) && (rs->state & rs_connected);
 	} else {
-		return ((rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) ||
+		return (rs_rbuf_avail(rs) ||
 			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
 		       rs_2ctrl_avail(rs) && (rs->state & rs_connected);
 	}
@@ -1899,16 +3000,116 @@ static void rs_update_credits(struct rsocket *rs)
 		rs_send_credits(rs);
 }
 
+/*
+ * Post a user buffer to the peer for direct data placement.  The message
+ * carries the number of data bytes that we have received, which tells the
+ * sender how much of its stream is still in flight to our rbuf.  That data
+ * makes up the start of the user buffer.
+ */
+static int rs_post_dra_sgl(struct rsocket *rs, struct ibv_mr *mr,
+			   void *buf, uint32_t len)
+{
+	struct ibv_sge ibsge;
+	struct rs_sge sge, *sge_buf;
+	int flags;
+
+	rs->ctrl_seqno++;
+	if (!(rs->opts & RS_OPT_SWAP_SGL)) {
+		sge.addr = (uintptr_t) buf;
+		sge.key = mr->rkey;
+		sge.length = len;
+	} else {
+		sge.addr = bswap_64((uintptr_t) buf);
+		sge.key = bswap_32(mr->rkey);
+		sge.length = bswap_32(len);
+	}
+
+	if (rs->sq_inline < sizeof sge) {
+		sge_buf = rs_get_ctrl_buf(rs);
+		memcpy(sge_buf, &sge, sizeof sge);
+		ibsge.addr = (uintptr_t) sge_buf;
+		ibsge.lkey = rs->smr->lkey;
+		flags = 0;
+	} else {
+		ibsge.addr = (uintptr_t) &sge;
+		ibsge.lkey = 0;
+		flags = IBV_SEND_INLINE;
+	}
+	ibsge.length = sizeof(sge);
+
+	return rs_post_write_msg(rs, &ibsge, 1,
+		rs_msg_set(RS_OP_DRA_SGL, rs->rbytes & RS_MSG_DATA_MASK),
+		flags, rs->remote_dra.addr, rs->remote_dra.key);
+}
+
+/*
+ * Answer the peer's posted direct-receive buffer, writing len bytes of the
+ * data stream at the given offset into it.  The caller must hold the cq_lock
+ * and have a control message available.
+ */
+static int rs_post_dra(struct rsocket *rs, struct ibv_sge *sge,
+		       uint32_t len, uint32_t offset)
+{
+	struct ibv_send_wr wr, *bad;
+	uint32_t msg;
+	int ret;
+
+	rs->ctrl_seqno++;
+	msg = rs_msg_set(RS_OP_DRA, len);
+	wr.wr_id = rs->wr_tag | rs_send_wr_id(msg);
+	wr.next = NULL;
+	wr.sg_list = len ? sge : NULL;
+	wr.num_sge = len ? 1 : 0;
+	wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+	wr.send_flags = 0;
+	wr.imm_data = htobe32(msg);
+	wr.wr.rdma.remote_addr = rs->dra_sge.addr + offset;
+	wr.wr.rdma.rkey = rs->dra_sge.key;
+
+	if (len) {
+		wr.wr_id |= RS_WR_ID_FLAG_ZCOPY;
+		atomic_fetch_add(&rs->zcopy_pending, 1);
+	}
+	ret = rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
+	if (ret && len)
+		atomic_fetch_sub(&rs->zcopy_pending, 1);
+	return ret;
+}
+
+/*
+ * A posted direct-receive buffer must always be answered, or the peer's
+ * rrecv cannot complete.  If no rsend is running that could fill it, reply
+ * that no data was placed, and the peer receives through its rbuf.
+ * Caller must hold the cq_lock.
+ */
+static void rs_update_dra(struct rsocket *rs)
+{
+	int state = RS_DRA_POSTED;
+
+	if (!(rs->opts & RS_OPT_DRA) ||
+	    atomic_load(&rs->dra_state) != RS_DRA_POSTED ||
+	    atomic_load(&rs->send_active) || !rs_ctrl_avail(rs) ||
+	    !(rs->state & rs_writable))
+		return;
+
+	if (atomic_compare_exchange_strong(&rs->dra_state, &state, RS_DRA_IDLE))
+		rs_post_dra(rs, NULL, 0, 0);
+}
+
 static int rs_poll_cq(struct rsocket *rs)
 {
 	struct ibv_wc wc;
 	uint32_t msg;
 	int ret, rcnt = 0;
 
-	while ((ret = ibv_poll_cq(rs->cm_id->recv_cq, 1, &wc)) > 0) {
+	while ((ret = rs_poll_wc(rs, &wc)) > 0) {
 		if (rs_wr_is_recv(wc.wr_id)) {
-			if (wc.status != IBV_WC_SUCCESS)
+			if (wc.status != IBV_WC_SUCCESS) {
+				/* Flushed receives were still taken from the SRQ */
+				if (rs->srq)
+					rcnt++;
 				continue;
+			}
 			rcnt++;
 
 			if (wc.wc_flags & IBV_WC_WITH_IMM) {
@@ -1925,16 +3126,30 @@ static int rs_poll_cq(struct rsocket *rs)
 			case RS_OP_IOMAP_SGL:
 				/* The iomap was updated, that's nice to know. */
 				break;
+			case RS_OP_DRA_SGL:
+				rs->dra_sge.addr = rs->target_dra->addr;
+				rs->dra_sge.key = rs->target_dra->key;
+				rs->dra_sge.length = rs->target_dra->length;
+				rs->dra_base = rs_msg_data(msg);
+				atomic_store(&rs->dra_state, RS_DRA_POSTED);
+				break;
+			case RS_OP_DRA:
+				rs->dra_len = rs_msg_data(msg);
+				rs->dra_tail = rs->rmsg_tail;
+				rs->dra_done = 1;
+				break;
 			case RS_OP_CTRL:
 				if (rs_msg_data(msg) == RS_CTRL_DISCONNECT) {
 					rs->state = rs_disconnected;
-					return 0;
+					ret = 0;
+					goto repost;
 				} else if (rs_msg_data(msg) == RS_CTRL_SHUTDOWN) {
 					if (rs->state & rs_writable) {
 						rs->state &= ~rs_readable;
 					} else {
 						rs->state = rs_disconnected;
-						return 0;
+						ret = 0;
+						goto repost;
 					}
 				}
 				break;
@@ -1944,13 +3159,19 @@ static int rs_poll_cq(struct rsocket *rs)
 			default:
 				rs->rmsg[rs->rmsg_tail].op = rs_msg_op(msg);
 				rs->rmsg[rs->rmsg_tail].data = rs_msg_data(msg);
+				rs->rbytes += rs_msg_data(msg);
 				if (++rs->rmsg_tail == rs->rq_size + 1)
 					rs->rmsg_tail = 0;
 				break;
 			}
 		} else {
+			if (rs_wr_is_zcopy(wc.wr_id))
+				atomic_fetch_sub(&rs->zcopy_pending, 1);
+
 			switch  (rs_msg_op(rs_wr_data(wc.wr_id))) {
 			case RS_OP_SGL:
+			case RS_OP_DRA_SGL:
+			case RS_OP_DRA:
 				rs->ctrl_max_seqno++;
 				break;
 			case RS_OP_CTRL:
@@ -1965,7 +3186,8 @@ static int rs_poll_cq(struct rsocket *rs)
 				break;
 			default:
 				rs->sqe_avail++;
-				rs->sbuf_bytes_avail += rs_msg_data(rs_wr_data(wc.wr_id));
+				if (!rs_wr_is_zcopy(wc.wr_id))
+					rs->sbuf_bytes_avail += rs_msg_data(rs_wr_data(wc.wr_id));
 				break;
 			}
 			if (wc.status != IBV_WC_SUCCESS && (rs->state & rs_connected)) {
@@ -1975,18 +3197,86 @@ static int rs_poll_cq(struct rsocket *rs)
 		}
 	}
 
-	if (rs->state & rs_connected) {
+repost:
+	if (rs->srq) {
+		/* Receives taken from the SRQ are replaced even when disconnected */
+		if (!ret && rcnt)
+			ret = rs_post_srq_recv(rs->srq, rcnt);
+	} else if (rs->state & rs_connected) {
 		while (!ret && rcnt--)
 			ret = rs_post_recv(rs);
+	}
 
-		if (ret) {
-			rs->state = rs_error;
-			rs->err = errno;
-		}
+	if (ret && (rs->state & rs_connected)) {
+		rs->state = rs_error;
+		rs->err = errno;
 	}
 	return ret;
 }
 
+/*
+ * Another member may retrieve the channel event and queue this rsocket's
+ * completions while it waits, so the wait is registered with the group,
+ * and rs_dispatch_cq wakes it through wake_fd.  A wake count taken by the
+ * wrong waiter is not lost, since each woken waiter removes exactly one.
+ */
+static int rs_get_group_cq_event(struct rsocket *rs)
+{
+	struct rs_cq_group *grp = rs->cq_group;
+	struct rs_cq_waiter waiter = { .rs = rs };
+	struct pollfd fds[2];
+	uint64_t cnt;
+	int ret, woken;
+
+	fastlock_acquire(&grp->lock);
+	if (rs->wc_head) {
+		fastlock_release(&grp->lock);
+		rs->cq_armed = 0;
+		return 0;
+	}
+	dlist_insert_tail(&waiter.entry, &grp->waiters);
+	fastlock_release(&grp->lock);
+
+	fds[0].fd = grp->channel->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = grp->wake_fd;
+	fds[1].events = POLLIN;
+	do {
+		ret = poll(fds, 2, -1);
+		if (ret < 0)
+			break;
+
+		if (fds[0].revents) {
+			rs_get_group_event(grp);
+			break;
+		}
+
+		/* The count may belong to waiters that have yet to run */
+		fastlock_acquire(&grp->lock);
+		woken = waiter.woken;
+		fastlock_release(&grp->lock);
+		if (!woken)
+			sched_yield();
+	} while (!woken);
+
+	/* Take the count written for this waiter, which is always there */
+	fastlock_acquire(&grp->lock);
+	if (!waiter.woken)
+		dlist_remove(&waiter.entry);
+	else if (read(grp->wake_fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		rs->state = rs_error;
+	fastlock_release(&grp->lock);
+
+	if (ret < 0) {
+		if (errno != EINTR)
+			rs->state = rs_error;
+		return ret;
+	}
+
+	rs->cq_armed = 0;
+	return 0;
+}
+
 static int rs_get_cq_event(struct rsocket *rs)
 {
 	struct ibv_cq *cq;
@@ -1996,6 +3286,9 @@ static int rs_get_cq_event(struct rsocket *rs)
 	if (!rs->cq_armed)
 		return 0;
 
+	if (rs->cq_group)
+		return rs_get_group_cq_event(rs);
+
 	ret = ibv_get_cq_event(rs->cm_id->recv_cq_channel, &cq, &context);
 	if (!ret) {
 		if (++rs->unack_cqe >= rs->sq_size + rs->rq_size) {
@@ -2031,6 +3324,7 @@ static int rs_process_cq(struct rsocket *rs, int nonblock, int (*test)(struct rs
 	fastlock_acquire(&rs->cq_lock);
 	do {
 		rs_update_credits(rs);
+		rs_update_dra(rs);
 		ret = rs_poll_cq(rs);
 		if (test(rs)) {
 			ret = 0;
@@ -2040,10 +3334,11 @@ static int rs_process_cq(struct rsocket *rs, int nonblock, int (*test)(struct rs
 		} else if (nonblock) {
 			ret = ERR(EWOULDBLOCK);
 		} else if (!rs->cq_armed) {
-			ibv_req_notify_cq(rs->cm_id->recv_cq, 0);
+			rs_req_notify_cq(rs);
 			rs->cq_armed = 1;
 		} else {
 			rs_update_credits(rs);
+			rs_update_dra(rs);
 			fastlock_acquire(&rs->cq_wait_lock);
 			fastlock_release(&rs->cq_lock);
 
@@ -2054,33 +3349,94 @@ static int rs_process_cq(struct rsocket *rs, int nonblock, int (*test)(struct rs
 	} while (!ret);
 
 	rs_update_credits(rs);
+	rs_update_dra(rs);
 	fastlock_release(&rs->cq_lock);
 	return ret;
 }
 
-static int rs_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
+/* Blocking calls on one rsocket may run in several threads at once */
+static void rs_count_poll(_Atomic(uint64_t) *cnt)
+{
+	atomic_fetch_add_explicit(cnt, 1, memory_order_relaxed);
+}
+
+static uint32_t rs_time_us(struct timeval *s)
+{
+	struct timeval e;
+
+	gettimeofday(&e, NULL);
+	return (e.tv_sec - s->tv_sec) * 1000000 + (e.tv_usec - s->tv_usec) + 1;
+}
+
+/*
+ * In adaptive mode, the polling time follows the time that recent waits
+ * took to complete, up to the configured budget.  A wait that polling
+ * would have covered sets the polling time to cover similar waits.  A
+ * longer wait means the spin was wasted, so the polling time is halved.
+ * Adaptive rsockets also skip polling on single CPU systems, where the
+ * thread that we wait on needs our CPU, and yield in the second half of
+ * the polling time.
+ */
+static void rs_adapt_poll(struct rsocket *rs, uint32_t wait_time)
+{
+	if (!rs->poll_adaptive)
+		return;
+
+	if (wait_time <= rs->busy_poll)
+		rs->poll_time = min_t(uint32_t, max(rs->poll_time, wait_time << 1),
+				      rs->busy_poll);
+	else
+		rs->poll_time >>= 1;
+}
+
+/*
+ * Poll for the test condition for up to the rsocket's polling time before
+ * blocking.
+ */
+static int rs_wait_comp(struct rsocket *rs, int nonblock,
+			int (*test)(struct rsocket *rs),
+			int (*process)(struct rsocket *rs, int nonblock,
+				       int (*test)(struct rsocket *rs)))
 {
-	struct timeval s, e;
-	uint32_t poll_time = 0;
+	struct timeval s;
+	uint32_t poll_time, budget;
 	int ret;
 
-	do {
-		ret = rs_process_cq(rs, 1, test);
-		if (!ret || nonblock || errno != EWOULDBLOCK)
-			return ret;
+	ret = process(rs, 1, test);
+	if (!ret || nonblock || errno != EWOULDBLOCK)
+		return ret;
 
-		if (!poll_time)
-			gettimeofday(&s, NULL);
+	gettimeofday(&s, NULL);
+	budget = (rs->poll_adaptive && single_cpu) ? 0 : rs->poll_time;
+	for (poll_time = rs_time_us(&s); poll_time <= budget;
+	     poll_time = rs_time_us(&s)) {
+		if (rs->poll_adaptive && poll_time > (budget >> 1))
+			sched_yield();
 
-		gettimeofday(&e, NULL);
-		poll_time = (e.tv_sec - s.tv_sec) * 1000000 +
-			    (e.tv_usec - s.tv_usec) + 1;
-	} while (poll_time <= polling_time);
+		ret = process(rs, 1, test);
+		if (!ret || errno != EWOULDBLOCK) {
+			if (!ret) {
+				rs_count_poll(&rs->poll_stats.spin_hits);
+				rs_adapt_poll(rs, poll_time);
+			}
+			return ret;
+		}
+	}
 
-	ret = rs_process_cq(rs, 0, test);
+	if (budget)
+		rs_count_poll(&rs->poll_stats.spin_misses);
+	rs_count_poll(&rs->poll_stats.blocked);
+	ret = process(rs, 0, test);
+	if (!ret)
+		rs_adapt_poll(rs, rs_time_us(&s));
 	return ret;
 }
 
+static int rs_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
+{
+	return rs_wait_comp(rs, nonblock, test, rs_process_cq);
+}
+
 static int ds_valid_recv(struct ds_qp *qp, struct ibv_wc *wc)
 {
 	struct ds_header *hdr;
@@ -2221,25 +3577,7 @@ static int ds_process_cqs(struct rsocket *rs, int nonblock, int (*test)(struct r
 
 static int ds_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
 {
-	struct timeval s, e;
-	uint32_t poll_time = 0;
-	int ret;
-
-	do {
-		ret = ds_process_cqs(rs, 1, test);
-		if (!ret || nonblock || errno != EWOULDBLOCK)
-			return ret;
-
-		if (!poll_time)
-			gettimeofday(&s, NULL);
-
-		gettimeofday(&e, NULL);
-		poll_time = (e.tv_sec - s.tv_sec) * 1000000 +
-			    (e.tv_usec - s.tv_usec) + 1;
-	} while (poll_time <= polling_time);
-
-	ret = ds_process_cqs(rs, 0, test);
-	return ret;
+	return rs_wait_comp(rs, nonblock, test, ds_process_cqs);
 }
 
 static int rs_nonblocking(struct rsocket *rs, int flags)
@@ -2279,6 +3617,27 @@ static int rs_can_send(struct rsocket *rs)
 	}
 }
 
+enum {
+	RS_STALL_WAIT = 1 << 0,
+	RS_STALL_SQ   = 1 << 1,
+	RS_STALL_SBUF = 1 << 2
+};
+
+/* Record why a send must wait for completions */
+static void rs_send_stalled(struct rsocket *rs)
+{
+	rs->send_stall |= RS_STALL_WAIT;
+	if (rs->sqe_avail < ((rs->opts & RS_OPT_MSG_SEND) ? 2 : 1))
+		rs->send_stall |= RS_STALL_SQ;
+	if (rs->sbuf_bytes_avail < RS_SNDLOWAT)
+		rs->send_stall |= RS_STALL_SBUF;
+}
+
+static uint32_t rs_next_olen(struct rsocket *rs, uint32_t olen)
+{
+	return olen < rs->xfer_max ? min(olen << 1, rs->xfer_max) : olen;
+}
+
 static int ds_can_send(struct rsocket *rs)
 {
 	return rs->sqe_avail;
@@ -2316,6 +3675,75 @@ static int rs_conn_all_sends_done(struct rsocket *rs)
 	       !(rs->state & rs_connected);
 }
 
+static int rs_conn_zcopy_done(struct rsocket *rs)
+{
+	return !atomic_load(&rs->zcopy_pending) || !(rs->state & rs_connected);
+}
+
+static int rs_conn_dra_done(struct rsocket *rs)
+{
+	return rs->dra_done || !(rs->state & rs_readable);
+}
+
+/*
+ * Zero-copy transfers are limited to blocking calls, since the user's buffer
+ * must remain registered and unchanged until the transfer completes.
+ */
+static int rs_zcopy_ok(struct rsocket *rs, size_t len, int flags)
+{
+	return rs->zcopy_threshold && len >= rs->zcopy_threshold &&
+	       !rs_nonblocking(rs, flags) && !(rs->opts & RS_OPT_MSG_SEND);
+}
+
+static struct rs_zcopy_mr *
+rs_get_zcopy_mr(struct rsocket *rs, const void *buf, size_t len, int access)
+{
+	struct rs_zcopy_mr *zmr, *free_zmr = NULL;
+	int i;
+
+	fastlock_acquire(&rs->map_lock);
+	for (i = 0; i < RS_ZCOPY_MR_CNT; i++) {
+		zmr = &rs->zcopy_mr[i];
+		if (!zmr->mr) {
+			if (!free_zmr)
+				free_zmr = zmr;
+			continue;
+		}
+
+		if ((zmr->access & access) == access &&
+		    (uintptr_t) buf >= (uintptr_t) zmr->mr->addr &&
+		    (uintptr_t) buf + len <=
+		    (uintptr_t) zmr->mr->addr + zmr->mr->length)
+			goto found;
+	}
+
+	zmr = free_zmr;
+	if (!zmr)
+		goto out;
+
+	zmr->mr = ibv_reg_mr(rs->cm_id->pd, (void *) buf, len, access);
+	if (!zmr->mr) {
+		zmr = NULL;
+		goto out;
+	}
+	zmr->access = access;
+found:
+	zmr->refcnt++;
+out:
+	fastlock_release(&rs->map_lock);
+	return zmr;
+}
+
+static void rs_put_zcopy_mr(struct rsocket *rs, struct rs_zcopy_mr *zmr)
+{
+	fastlock_acquire(&rs->map_lock);
+	if (!--zmr->refcnt) {
+		ibv_dereg_mr(zmr->mr);
+		zmr->mr = NULL;
+	}
+	fastlock_release(&rs->map_lock);
+}
+
 static void ds_set_src(struct sockaddr *addr, socklen_t *addrlen,
 		       struct ds_header *hdr)
 {
@@ -2380,11 +3808,14 @@ static ssize_t ds_recvfrom(struct rsocket *rs, void *buf, size_t len, int flags,
 static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
 {
 	size_t left = len;
-	uint32_t end_size, rsize;
+	uint32_t end_size, rsize, rbuf_size;
 	int rmsg_head, rbuf_offset;
+	uint8_t *rbuf;
 
 	rmsg_head = rs->rmsg_head;
 	rbuf_offset = rs->rbuf_offset;
+	rbuf = rs->rbuf;
+	rbuf_size = rs->rbuf_size;
 
 	for (; left && (rmsg_head != rs->rmsg_tail); left -= rsize) {
 		if (left < rs->rmsg[rmsg_head].data) {
@@ -2395,15 +3826,22 @@ static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
 				rmsg_head = 0;
 		}
 
-		end_size = rs->rbuf_size - rbuf_offset;
+		/* Data past the end of the rbuf may be in its replacement */
+		if (rbuf_offset == rbuf_size && rs->rbuf_next) {
+			rbuf = rs->rbuf_next;
+			rbuf_size = rs->rbuf_next_size;
+			rbuf_offset = 0;
+		}
+
+		end_size = rbuf_size - rbuf_offset;
 		if (rsize > end_size) {
-			memcpy(buf, &rs->rbuf[rbuf_offset], end_size);
+			memcpy(buf, &rbuf[rbuf_offset], end_size);
 			rbuf_offset = 0;
 			buf += end_size;
 			rsize -= end_size;
 			left -= end_size;
 		}
-		memcpy(buf, &rs->rbuf[rbuf_offset], rsize);
+		memcpy(buf, &rbuf[rbuf_offset], rsize);
 		rbuf_offset += rsize;
 		buf += rsize;
 	}
@@ -2411,14 +3849,131 @@ static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
 	return len - left;
 }
 
+/*
+ * Once all data in the current rbuf has been read, move to its replacement.
+ * The second half of the old rbuf is retired, and the second half of the new
+ * one becomes available to advertise.
+ */
+static void rs_switch_rbuf(struct rsocket *rs)
+{
+	fastlock_acquire(&rs->cq_lock);
+	if (rs->srq) {
+		rs_put_rbuf(rs->srq, rs->rbuf_slice);
+		rs->rbuf_slice = rs->rbuf_next_slice;
+		rs->rbuf_next_slice = NULL;
+	} else {
+		rdma_dereg_mr(rs->rmr);
+		free(rs->rbuf);
+	}
+
+	rs->rbuf_bytes_avail += (rs->rbuf_next_size >> 1) - (rs->rbuf_size >> 1);
+	rs->rbuf = rs->rbuf_next;
+	rs->rmr = rs->rmr_next;
+	rs->rbuf_size = rs->rbuf_next_size;
+	rs->rbuf_offset = 0;
+	rs->rbuf_next = NULL;
+	rs->rmr_next = NULL;
+	fastlock_release(&rs->cq_lock);
+}
+
+/*
+ * Copy received data into the user's buffer, stopping at rmsg index end.
+ */
+static size_t rs_copy_rdata(struct rsocket *rs, void *buf, size_t len, int end)
+{
+	size_t left = len;
+	uint32_t end_size, rsize;
+
+	for (; left && (rs->rmsg_head != end); left -= rsize) {
+		if (rs->rbuf_offset == rs->rbuf_size && rs->rbuf_next)
+			rs_switch_rbuf(rs);
+
+		if (left < rs->rmsg[rs->rmsg_head].data) {
+			rsize = left;
+			rs->rmsg[rs->rmsg_head].data -= left;
+		} else {
+			rs->rseq_no++;
+			rsize = rs->rmsg[rs->rmsg_head].data;
+			if (++rs->rmsg_head == rs->rq_size + 1)
+				rs->rmsg_head = 0;
+		}
+
+		end_size = rs->rbuf_size - rs->rbuf_offset;
+		if (rsize > end_size) {
+			memcpy(buf, &rs->rbuf[rs->rbuf_offset], end_size);
+			rs->rbuf_offset = 0;
+			buf += end_size;
+			rsize -= end_size;
+			left -= end_size;
+			rs->rbuf_bytes_avail += end_size;
+		}
+		memcpy(buf, &rs->rbuf[rs->rbuf_offset], rsize);
+		rs->rbuf_offset += rsize;
+		buf += rsize;
+		rs->rbuf_bytes_avail += rsize;
+	}
+
+	if (rs->rbuf_offset == rs->rbuf_size && rs->rbuf_next)
+		rs_switch_rbuf(rs);
+
+	return len - left;
+}
+
+static int rs_dra_ok(struct rsocket *rs, size_t len, int flags)
+{
+	return (rs->opts & RS_OPT_DRA) && !(flags & MSG_PEEK) &&
+	       (rs->state & rs_readable) && rs_zcopy_ok(rs, len, flags);
+}
+
+/*
+ * Post the user's buffer to the peer, so that data the peer sends after
+ * seeing it is written directly into place.  Data already in flight to our
+ * rbuf forms the start of the buffer and is copied as usual.  Returns 0 if
+ * no data was received, in which case the caller should fall back to the
+ * buffered receive path.
+ */
+static ssize_t rs_recv_direct(struct rsocket *rs, void *buf, size_t len)
+{
+	struct rs_zcopy_mr *zmr;
+	ssize_t ret;
+
+	zmr = rs_get_zcopy_mr(rs, buf, len,
+			      IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+	if (!zmr)
+		return 0;
+
+	fastlock_acquire(&rs->cq_lock);
+	if (rs_have_rdata(rs) || !rs_ctrl_avail(rs)) {
+		fastlock_release(&rs->cq_lock);
+		rs_put_zcopy_mr(rs, zmr);
+		return 0;
+	}
+
+	rs->dra_done = 0;
+	ret = rs_post_dra_sgl(rs, zmr->mr, buf,
+			      min_t(size_t, len, RS_MSG_DATA_MASK));
+	fastlock_release(&rs->cq_lock);
+	if (ret)
+		goto out;
+
+	rs_get_comp(rs, 0, rs_conn_dra_done);
+	if (!rs->dra_done)
+		goto out;	/* peer will not place data, use rbuf path */
+
+	ret = rs_copy_rdata(rs, buf, len, rs->dra_tail) + rs->dra_len;
+	rs->dra_done = 0;
+out:
+	rs_put_zcopy_mr(rs, zmr);
+	return ret;
+}
+
 /*
  * Continue to receive any queued data even if the remote side has disconnected.
  */
 ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 {
 	struct rsocket *rs;
-	size_t left = len;
-	uint32_t end_size, rsize;
+	size_t left = len, rsize;
 	int ret = 0;
 
 	rs = idm_at(&idm, socket);
@@ -2440,7 +3995,18 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 		}
 	}
 	fastlock_acquire(&rs->rlock);
-	do {
+	if (rs_dra_ok(rs, len, flags) && !rs_have_rdata(rs)) {
+		ret = rs_recv_direct(rs, buf, len);
+		if (ret < 0)
+			goto out;
+		left -= ret;
+		buf += ret;
+		ret = 0;
+		if (left < len && (!left || !(flags & MSG_WAITALL)))
+			goto out;
+	}
+
+	do {
 		if (!rs_have_rdata(rs)) {
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
 					  rs_conn_have_rdata);
@@ -2453,34 +4019,12 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 			break;
 		}
 
-		for (; left && rs_have_rdata(rs); left -= rsize) {
-			if (left < rs->rmsg[rs->rmsg_head].data) {
-				rsize = left;
-				rs->rmsg[rs->rmsg_head].data -= left;
-			} else {
-				rs->rseq_no++;
-				rsize = rs->rmsg[rs->rmsg_head].data;
-				if (++rs->rmsg_head == rs->rq_size + 1)
-					rs->rmsg_head = 0;
-			}
-
-			end_size = rs->rbuf_size - rs->rbuf_offset;
-			if (rsize > end_size) {
-				memcpy(buf, &rs->rbuf[rs->rbuf_offset], end_size);
-				rs->rbuf_offset = 0;
-				buf += end_size;
-				rsize -= end_size;
-				left -= end_size;
-				rs->rbuf_bytes_avail += end_size;
-			}
-			memcpy(buf, &rs->rbuf[rs->rbuf_offset], rsize);
-			rs->rbuf_offset += rsize;
-			buf += rsize;
-			rs->rbuf_bytes_avail += rsize;
-		}
-
+		rsize = rs_copy_rdata(rs, buf, left, rs->rmsg_tail);
+		left -= rsize;
+		buf += rsize;
 	} while (left && (flags & MSG_WAITALL) && (rs->state & rs_readable));
 
+out:
 	fastlock_release(&rs->rlock);
 	return (ret && left == len) ? ret : len - left;
 }
@@ -2517,12 +4061,199 @@ static ssize_t rrecvv(int socket, const struct iovec *iov, int iovcnt, int flags
 	return rrecv(socket, iov[0].iov_base, iov[0].iov_len, flags);
 }
 
+/* Receive buffers released by rrecvmmsg, reposted as a single chain */
+struct ds_recv_batch {
+	struct ds_qp		*qp;
+	int			cnt;
+	struct ibv_recv_wr	wr[DS_MMSG_BATCH];
+	struct ibv_sge		sge[DS_MMSG_BATCH][2];
+};
+
+static int ds_post_recvs(struct ds_recv_batch *batch)
+{
+	struct ibv_recv_wr *bad;
+	int ret;
+
+	if (!batch->cnt)
+		return 0;
+
+	batch->wr[batch->cnt - 1].next = NULL;
+	ret = rdma_seterrno(ibv_post_recv(batch->qp->cm_id->qp, batch->wr, &bad));
+	batch->cnt = 0;
+	return ret;
+}
+
+static void ds_queue_recv(struct rsocket *rs, struct ds_recv_batch *batch,
+			  struct ds_qp *qp, uint32_t offset)
+{
+	struct ibv_recv_wr *wr;
+
+	if (batch->cnt == DS_MMSG_BATCH || (batch->cnt && batch->qp != qp))
+		ds_post_recvs(batch);
+
+	wr = &batch->wr[batch->cnt];
+	ds_init_recv_wr(rs, qp, offset, wr, batch->sge[batch->cnt]);
+	wr->next = wr + 1;
+	batch->qp = qp;
+	batch->cnt++;
+}
+
+static size_t rs_copy_to_iov(const struct iovec *iov, size_t iovcnt,
+			     const void *src, size_t len)
+{
+	size_t size, left = len;
+
+	for (; left && iovcnt; iov++, iovcnt--) {
+		size = min(iov->iov_len, left);
+		memcpy(iov->iov_base, src, size);
+		src += size;
+		left -= size;
+	}
+	return len - left;
+}
+
+static int rs_mmsg_timedout(struct timeval *s, struct timespec *timeout)
+{
+	struct timeval e;
+
+	if (!timeout)
+		return 0;
+
+	gettimeofday(&e, NULL);
+	return (e.tv_sec - s->tv_sec) * 1000000000LL +
+	       (e.tv_usec - s->tv_usec) * 1000LL >=
+	       timeout->tv_sec * 1000000000LL + timeout->tv_nsec;
+}
+
+/*
+ * Messages are taken from the queue filled by ds_poll_cqs, which drains all
+ * available completions each time that it is called.  The receive buffers
+ * are reposted in chains, rather than one at a time.
+ */
+static int ds_recvmmsg(struct rsocket *rs, struct mmsghdr *msgvec,
+		       unsigned int vlen, int flags, struct timespec *timeout)
+{
+	struct ds_recv_batch batch;
+	struct ds_rmsg *rmsg;
+	struct ds_header *hdr;
+	struct msghdr *msg;
+	struct timeval s;
+	unsigned int i;
+	size_t len;
+	int ret = 0;
+
+	if (!(rs->state & rs_readable))
+		return ERR(EINVAL);
+
+	if (timeout)
+		gettimeofday(&s, NULL);
+
+	batch.cnt = 0;
+	for (i = 0; i < vlen; i++) {
+		msg = &msgvec[i].msg_hdr;
+		if (msg->msg_control && msg->msg_controllen) {
+			ret = ERR(ENOTSUP);
+			break;
+		}
+
+		if (!rs_have_rdata(rs)) {
+			ds_post_recvs(&batch);
+			ret = ds_get_comp(rs, rs_nonblocking(rs, flags) ||
+					  (i && (flags & MSG_WAITFORONE)),
+					  rs_have_rdata);
+			if (ret)
+				break;
+		}
+
+		rmsg = &rs->dmsg[rs->rmsg_head];
+		hdr = (struct ds_header *) (rmsg->qp->rbuf + rmsg->offset);
+		len = rmsg->length - hdr->length;
+		msgvec[i].msg_len = rs_copy_to_iov(msg->msg_iov, msg->msg_iovlen,
+						   (void *) hdr + hdr->length, len);
+		msg->msg_flags = (msgvec[i].msg_len < len) ? MSG_TRUNC : 0;
+		if (msg->msg_name)
+			ds_set_src(msg->msg_name, &msg->msg_namelen, hdr);
+
+		if (flags & MSG_PEEK) {
+			i++;
+			break;
+		}
+
+		ds_queue_recv(rs, &batch, rmsg->qp, rmsg->offset);
+		if (++rs->rmsg_head == rs->rq_size + 1)
+			rs->rmsg_head = 0;
+		rs->rqe_avail++;
+
+		if (rs_mmsg_timedout(&s, timeout)) {
+			i++;
+			break;
+		}
+	}
+
+	ds_post_recvs(&batch);
+	return i ? i : ret;
+}
+
+int rrecvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	      int flags, struct timespec *timeout)
+{
+	struct rsocket *rs;
+	struct msghdr *msg;
+	struct timeval s;
+	unsigned int i;
+	ssize_t ret = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM) {
+		fastlock_acquire(&rs->rlock);
+		ret = ds_recvmmsg(rs, msgvec, vlen, flags, timeout);
+		fastlock_release(&rs->rlock);
+		return ret;
+	}
+
+	if (timeout)
+		gettimeofday(&s, NULL);
+
+	for (i = 0; i < vlen; i++) {
+		if (i && (flags & MSG_WAITFORONE))
+			flags |= MSG_DONTWAIT;
+
+		msg = &msgvec[i].msg_hdr;
+		if (msg->msg_control && msg->msg_controllen) {
+			ret = ERR(ENOTSUP);
+			break;
+		}
+
+		ret = rrecvv(socket, msg->msg_iov, (int) msg->msg_iovlen, flags);
+		if (ret <= 0)
+			break;
+
+		/* As with TCP, connected stream rsockets report no source */
+		msgvec[i].msg_len = ret;
+		msg->msg_namelen = 0;
+		msg->msg_flags = 0;
+		if (rs_mmsg_timedout(&s, timeout)) {
+			i++;
+			break;
+		}
+	}
+	return i ? i : ret;
+}
+
 ssize_t rrecvmsg(int socket, struct msghdr *msg, int flags)
 {
-	if (msg->msg_control && msg->msg_controllen)
-		return ERR(ENOTSUP);
+	struct mmsghdr mmsg;
+	int ret;
+
+	mmsg.msg_hdr = *msg;
+	ret = rrecvmmsg(socket, &mmsg, 1, flags, NULL);
+	if (ret <= 0)
+		return ret;
 
-	return rrecvv(socket, msg->msg_iov, (int) msg->msg_iovlen, msg->msg_flags);
+	*msg = mmsg.msg_hdr;
+	return mmsg.msg_len;
 }
 
 ssize_t rread(int socket, void *buf, size_t count)
@@ -2545,6 +4276,7 @@ static int rs_send_iomaps(struct rsocket *rs, int flags)
 	fastlock_acquire(&rs->map_lock);
 	while (!dlist_empty(&rs->iomap_queue)) {
 		if (!rs_can_send(rs)) {
+			rs_send_stalled(rs);
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
 					  rs_conn_can_send);
 			if (ret)
@@ -2684,16 +4416,166 @@ static ssize_t dsend(struct rsocket *rs, const void *buf, size_t len, int flags)
 	return ret ? ret : len;
 }
 
+/*
+ * Claim the peer's posted direct-receive buffer and answer it.  Any data in
+ * flight to the peer's rbuf that was sent after the peer posted the buffer
+ * occupies its start, so direct data is placed after it.  If the user's
+ * buffer is not registered for zero-copy, we reply that no data was placed.
+ * Returns the number of bytes written into the posted buffer.
+ */
+static int rs_send_dra(struct rsocket *rs, const void *buf, size_t left,
+		       struct rs_zcopy_mr *zmr)
+{
+	struct ibv_sge sge;
+	uint32_t offset, len = 0;
+	int state = RS_DRA_POSTED;
+	int ret;
+
+	fastlock_acquire(&rs->cq_lock);
+	if (!rs_ctrl_avail(rs) ||
+	    !atomic_compare_exchange_strong(&rs->dra_state, &state, RS_DRA_IDLE)) {
+		fastlock_release(&rs->cq_lock);
+		return 0;
+	}
+
+	offset = (rs->sbytes - rs->dra_base) & RS_MSG_DATA_MASK;
+	if (zmr && offset < rs->dra_sge.length) {
+		len = min_t(size_t, left, rs->dra_sge.length - offset);
+		sge.addr = (uintptr_t) buf;
+		sge.length = len;
+		sge.lkey = zmr->mr->lkey;
+	}
+
+	ret = rs_post_dra(rs, &sge, len, offset);
+	fastlock_release(&rs->cq_lock);
+	return ret ? ret : len;
+}
+
+/*
+ * Allocate a larger sbuf for a sender that ran out of sbuf space.  The new
+ * size covers the send that stalled, so that a large transfer reaches its
+ * size in one step rather than doubling on every call.  The sbuf is
+ * replaced later by rs_switch_sbuf, which never waits for completions.
+ */
+static void rs_grow_sbuf(struct rsocket *rs, size_t len)
+{
+	uint32_t size, total;
+
+	size = rs->sbuf_size << 1;
+	while (size < len && size < rs->sbuf_max)
+		size <<= 1;
+	size = min(size, rs->sbuf_max);
+
+	total = size;
+	if (rs->sq_inline < RS_MAX_CTRL_MSG)
+		total += RS_MAX_CTRL_MSG * RS_QP_CTRL_SIZE;
+	rs->sbuf_next = calloc(total, 1);
+	if (!rs->sbuf_next)
+		return;
+
+	rs->smr_next = rdma_reg_msgs(rs->cm_id, rs->sbuf_next, total);
+	if (!rs->smr_next) {
+		free(rs->sbuf_next);
+		rs->sbuf_next = NULL;
+		return;
+	}
+	rs->sbuf_next_size = size;
+}
+
+/*
+ * Replace the sbuf with the larger one once no sends, including control
+ * messages, are outstanding.  Completions are only polled, so a sender
+ * with writes in flight keeps using the current sbuf and retries on its
+ * next call.
+ */
+static void rs_switch_sbuf(struct rsocket *rs)
+{
+	struct ibv_mr *mr;
+	uint8_t *sbuf;
+
+	if (rs_get_comp(rs, 1, rs_conn_all_sends_done))
+		return;
+
+	fastlock_acquire(&rs->cq_lock);
+	if (!(rs->state & rs_connected) || !rs_conn_all_sends_done(rs)) {
+		fastlock_release(&rs->cq_lock);
+		return;
+	}
+
+	sbuf = rs->sbuf;
+	mr = rs->smr;
+	rs->sbuf = rs->sbuf_next;
+	rs->smr = rs->smr_next;
+	rs->sbuf_bytes_avail += rs->sbuf_next_size - rs->sbuf_size;
+	rs->sbuf_size = rs->sbuf_next_size;
+	rs->ssgl[0].addr = rs->ssgl[1].addr = (uintptr_t) rs->sbuf;
+	rs->ssgl[0].lkey = rs->ssgl[1].lkey = rs->smr->lkey;
+	rs->sbuf_next = NULL;
+	rs->smr_next = NULL;
+	fastlock_release(&rs->cq_lock);
+
+	rdma_dereg_mr(mr);
+	free(sbuf);
+}
+
+/*
+ * Adapt the size of writes to the traffic seen by the last call.  A sender
+ * that waited for completions is limited by bandwidth, so it starts with
+ * larger writes, and uses fewer, larger writes if it ran out of send queue
+ * entries.  A sender that ran out of sbuf space prepares a larger sbuf, up
+ * to its limit.  A sender that did not wait is sensitive to latency, so it
+ * returns to small initial writes, which overlap copying with the transfer.
+ */
+static void rs_adapt_send(struct rsocket *rs, size_t len)
+{
+	if (rs->send_stall) {
+		rs->xfer_start = rs_next_olen(rs, rs->xfer_start);
+		if ((rs->send_stall & RS_STALL_SQ) &&
+		    rs->xfer_max < (rs->sbuf_size >> 1))
+			rs->xfer_max = min(rs->xfer_max << 1, rs->sbuf_size >> 1);
+		if ((rs->send_stall & RS_STALL_SBUF) && !rs->sbuf_next &&
+		    rs->sbuf_size < rs->sbuf_max)
+			rs_grow_sbuf(rs, len);
+	} else if (len < rs->xfer_start) {
+		rs->xfer_start = max_t(uint32_t, rs->xfer_start >> 1,
+				       RS_OLAP_START_SIZE);
+	}
+	rs->send_stall = 0;
+}
+
+static void rs_send_done(struct rsocket *rs, struct rs_zcopy_mr *zmr)
+{
+	if (rs->opts & RS_OPT_DRA) {
+		atomic_store(&rs->send_active, 0);
+		if (atomic_load(&rs->dra_state) == RS_DRA_POSTED) {
+			fastlock_acquire(&rs->cq_lock);
+			rs_update_dra(rs);
+			fastlock_release(&rs->cq_lock);
+		}
+	}
+
+	if (zmr) {
+		if (atomic_load(&rs->zcopy_pending))
+			rs_get_comp(rs, 0, rs_conn_zcopy_done);
+		rs_put_zcopy_mr(rs, zmr);
+	}
+}
+
 /*
  * We overlap sending the data, by posting a small work request immediately,
  * then increasing the size of the send on each iteration.
+ *
+ * Large, blocking transfers may instead be sent directly from the user's
+ * buffer (see RDMA_ZCOPY_THRESHOLD), in which case we wait for the writes
+ * to complete before returning.
  */
 ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 {
 	struct rsocket *rs;
+	struct rs_zcopy_mr *zmr = NULL;
 	struct ibv_sge sge;
 	size_t left = len;
-	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
+	uint32_t xfer_size, olen;
 	int ret = 0;
 
 	rs = idm_at(&idm, socket);
@@ -2716,13 +4598,35 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 	}
 
 	fastlock_acquire(&rs->slock);
+	if (rs->sbuf_next)
+		rs_switch_sbuf(rs);
 	if (rs->iomap_pending) {
 		ret = rs_send_iomaps(rs, flags);
 		if (ret)
 			goto out;
 	}
+
+	if (rs_zcopy_ok(rs, len, flags))
+		zmr = rs_get_zcopy_mr(rs, buf, len, 0);
+	if (rs->opts & RS_OPT_DRA)
+		atomic_store(&rs->send_active, 1);
+
+	olen = rs->xfer_start;
+
 	for (; left; left -= xfer_size, buf += xfer_size) {
+		if ((rs->opts & RS_OPT_DRA) &&
+		    atomic_load(&rs->dra_state) == RS_DRA_POSTED) {
+			ret = rs_send_dra(rs, buf, left, zmr);
+			if (ret < 0)
+				break;
+			xfer_size = ret;
+			ret = 0;
+			if (xfer_size)
+				continue;
+		}
+
 		if (!rs_can_send(rs)) {
+			rs_send_stalled(rs);
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
 					  rs_conn_can_send);
 			if (ret)
@@ -2733,10 +4637,21 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 			}
 		}
 
+		if (zmr) {
+			xfer_size = min_t(size_t, left,
+					  rs->target_sgl[rs->target_sge].length);
+			sge.addr = (uintptr_t) buf;
+			sge.length = xfer_size;
+			sge.lkey = zmr->mr->lkey;
+			ret = rs_write_zcopy(rs, &sge);
+			if (ret)
+				break;
+			continue;
+		}
+
 		if (olen < left) {
 			xfer_size = olen;
-			if (olen < RS_MAX_TRANSFER)
-				olen <<= 1;
+			olen = rs_next_olen(rs, olen);
 		} else {
 			xfer_size = left;
 		}
@@ -2771,6 +4686,8 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 		if (ret)
 			break;
 	}
+	rs_send_done(rs, zmr);
+	rs_adapt_send(rs, len);
 out:
 	fastlock_release(&rs->slock);
 
@@ -2837,7 +4754,7 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 	struct rsocket *rs;
 	const struct iovec *cur_iov;
 	size_t left, len, offset = 0;
-	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
+	uint32_t xfer_size, olen;
 	int i, ret = 0;
 
 	rs = idm_at(&idm, socket);
@@ -2859,13 +4776,18 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 	left = len;
 
 	fastlock_acquire(&rs->slock);
+	if (rs->sbuf_next)
+		rs_switch_sbuf(rs);
 	if (rs->iomap_pending) {
 		ret = rs_send_iomaps(rs, flags);
 		if (ret)
 			goto out;
 	}
+
+	olen = rs->xfer_start;
 	for (; left; left -= xfer_size) {
 		if (!rs_can_send(rs)) {
+			rs_send_stalled(rs);
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
 					  rs_conn_can_send);
 			if (ret)
@@ -2878,8 +4800,7 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 
 		if (olen < left) {
 			xfer_size = olen;
-			if (olen < RS_MAX_TRANSFER)
-				olen <<= 1;
+			olen = rs_next_olen(rs, olen);
 		} else {
 			xfer_size = left;
 		}
@@ -2912,6 +4833,7 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 		if (ret)
 			break;
 	}
+	rs_adapt_send(rs, len);
 out:
 	fastlock_release(&rs->slock);
 
@@ -2926,68 +4848,237 @@ ssize_t rsendmsg(int socket, const struct msghdr *msg, int flags)
 	return rsendv(socket, msg->msg_iov, (int) msg->msg_iovlen, flags);
 }
 
-ssize_t rwrite(int socket, const void *buf, size_t count)
-{
-	return rsend(socket, buf, count, 0);
-}
-
-ssize_t rwritev(int socket, const struct iovec *iov, int iovcnt)
-{
-	return rsendv(socket, iov, iovcnt, 0);
-}
+/* Datagrams queued by rsendmmsg to a single QP, posted as one chain */
+struct ds_send_batch {
+	struct ds_qp		*qp;
+	int			cnt;
+	struct ibv_send_wr	wr[DS_MMSG_BATCH];
+	struct ibv_sge		sge[DS_MMSG_BATCH];
+};
 
-static struct pollfd *rs_fds_alloc(nfds_t nfds)
+/*
+ * Post the queued sends, adding the number posted to sent.  If the post
+ * fails, the send buffers of the messages that were not posted are
+ * returned to the free list.
+ */
+static int ds_post_sends(struct rsocket *rs, struct ds_send_batch *batch,
+			 unsigned int *sent)
 {
-	static __thread struct pollfd *rfds;
-	static __thread nfds_t rnfds;
+	struct ibv_send_wr *bad;
+	struct ds_smsg *smsg;
+	int i, ret;
 
-	if (nfds > rnfds) {
-		if (rfds)
-			free(rfds);
+	if (!batch->cnt)
+		return 0;
 
-		rfds = malloc(sizeof(*rfds) * nfds);
-		rnfds = rfds ? nfds : 0;
+	batch->wr[batch->cnt - 1].next = NULL;
+	ret = rdma_seterrno(ibv_post_send(batch->qp->cm_id->qp, batch->wr, &bad));
+	if (ret) {
+		for (i = bad - batch->wr; i < batch->cnt; i++) {
+			smsg = (struct ds_smsg *) (rs->sbuf +
+				rs_wr_data(batch->wr[i].wr_id));
+			smsg->next = rs->smsg_free;
+			rs->smsg_free = smsg;
+			rs->sqe_avail++;
+		}
+		batch->cnt = bad - batch->wr;
 	}
 
-	return rfds;
+	*sent += batch->cnt;
+	batch->cnt = 0;
+	return ret;
 }
 
-static int rs_poll_rs(struct rsocket *rs, int events,
-		      int nonblock, int (*test)(struct rsocket *rs))
+static int ds_sendmmsg(struct rsocket *rs, struct mmsghdr *msgvec,
+		       unsigned int vlen, int flags)
 {
-	struct pollfd fds;
-	short revents;
-	int ret;
-
-check_cq:
-	if ((rs->type == SOCK_STREAM) && ((rs->state & rs_connected) ||
-	     (rs->state == rs_disconnected) || (rs->state & rs_error))) {
-		rs_process_cq(rs, nonblock, test);
+	struct ds_send_batch batch;
+	const struct iovec *iov;
+	struct msghdr *msg;
+	struct ds_smsg *smsg;
+	struct ds_qp *qp;
+	unsigned int i, sent = 0;
+	size_t len, offset;
+	int ret = 0, err;
+
+	batch.cnt = 0;
+	for (i = 0; i < vlen; i++) {
+		msg = &msgvec[i].msg_hdr;
+		if (msg->msg_control && msg->msg_controllen) {
+			ret = ERR(ENOTSUP);
+			break;
+		}
 
-		revents = 0;
-		if ((events & POLLIN) && rs_conn_have_rdata(rs))
-			revents |= POLLIN;
-		if ((events & POLLOUT) && rs_can_send(rs))
-			revents |= POLLOUT;
-		if (!(rs->state & rs_connected)) {
-			if (rs->state == rs_disconnected)
-				revents |= POLLHUP;
-			else
-				revents |= POLLERR;
+		if (msg->msg_name) {
+			if (!rs->conn_dest ||
+			    ds_compare_addr(msg->msg_name, &rs->conn_dest->addr)) {
+				ret = ds_get_dest(rs, msg->msg_name,
+						  msg->msg_namelen, &rs->conn_dest);
+				if (ret)
+					break;
+			}
+		} else if (!rs->conn_dest) {
+			ret = ERR(EDESTADDRREQ);
+			break;
 		}
 
-		return revents;
-	} else if (rs->type == SOCK_DGRAM) {
-		ds_process_cqs(rs, nonblock, test);
+		if (!rs->conn_dest->ah) {
+			ret = ds_post_sends(rs, &batch, &sent);
+			if (ret)
+				break;
 
-		revents = 0;
-		if ((events & POLLIN) && rs_have_rdata(rs))
-			revents |= POLLIN;
-		if ((events & POLLOUT) && ds_can_send(rs))
-			revents |= POLLOUT;
+			ret = ds_sendv_udp(rs, msg->msg_iov, msg->msg_iovlen,
+					   flags, RS_OP_DATA);
+			if (ret < 0)
+				break;
 
-		return revents;
-	}
+			msgvec[i].msg_len = ret;
+			sent++;
+			ret = 0;
+			continue;
+		}
+
+		qp = rs->conn_dest->qp;
+		for (len = 0, offset = 0; offset < msg->msg_iovlen; offset++)
+			len += msg->msg_iov[offset].iov_len;
+		if (qp->hdr.length + len > RS_SNDLOWAT) {
+			ret = ERR(EMSGSIZE);
+			break;
+		}
+
+		if (batch.cnt == DS_MMSG_BATCH || (batch.cnt && batch.qp != qp) ||
+		    !ds_can_send(rs)) {
+			ret = ds_post_sends(rs, &batch, &sent);
+			if (ret)
+				break;
+		}
+
+		if (!ds_can_send(rs)) {
+			ret = ds_get_comp(rs, rs_nonblocking(rs, flags), ds_can_send);
+			if (ret)
+				break;
+		}
+
+		smsg = rs->smsg_free;
+		rs->smsg_free = smsg->next;
+		rs->sqe_avail--;
+
+		memcpy((void *) smsg, &qp->hdr, qp->hdr.length);
+		iov = msg->msg_iov;
+		offset = 0;
+		rs_copy_iov((void *) smsg + qp->hdr.length, &iov, &offset, len);
+
+		batch.sge[batch.cnt].addr = (uintptr_t) smsg;
+		batch.sge[batch.cnt].length = qp->hdr.length + len;
+		batch.sge[batch.cnt].lkey = qp->smr->lkey;
+		ds_init_send_wr(rs, &batch.sge[batch.cnt],
+				(uint8_t *) smsg - rs->sbuf, &batch.wr[batch.cnt]);
+		batch.wr[batch.cnt].next = &batch.wr[batch.cnt + 1];
+		batch.qp = qp;
+		batch.cnt++;
+		msgvec[i].msg_len = len;
+	}
+
+	err = ds_post_sends(rs, &batch, &sent);
+	if (!ret)
+		ret = err;
+	return sent ? sent : ret;
+}
+
+int rsendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	struct rsocket *rs;
+	unsigned int i;
+	ssize_t ret = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM) {
+		if (rs->state == rs_init) {
+			ret = ds_init_ep(rs);
+			if (ret)
+				return ret;
+		}
+
+		fastlock_acquire(&rs->slock);
+		ret = ds_sendmmsg(rs, msgvec, vlen, flags);
+		fastlock_release(&rs->slock);
+		return ret;
+	}
+
+	for (i = 0; i < vlen; i++) {
+		ret = rsendmsg(socket, &msgvec[i].msg_hdr, flags);
+		if (ret < 0)
+			break;
+
+		msgvec[i].msg_len = ret;
+	}
+	return i ? i : ret;
+}
+
+ssize_t rwrite(int socket, const void *buf, size_t count)
+{
+	return rsend(socket, buf, count, 0);
+}
+
+ssize_t rwritev(int socket, const struct iovec *iov, int iovcnt)
+{
+	return rsendv(socket, iov, iovcnt, 0);
+}
+
+static struct pollfd *rs_fds_alloc(nfds_t nfds)
+{
+	static __thread struct pollfd *rfds;
+	static __thread nfds_t rnfds;
+
+	if (nfds > rnfds) {
+		if (rfds)
+			free(rfds);
+
+		rfds = malloc(sizeof(*rfds) * nfds);
+		rnfds = rfds ? nfds : 0;
+	}
+
+	return rfds;
+}
+
+static int rs_poll_rs(struct rsocket *rs, int events,
+		      int nonblock, int (*test)(struct rsocket *rs))
+{
+	struct pollfd fds;
+	short revents;
+	int ret;
+
+check_cq:
+	if ((rs->type == SOCK_STREAM) && ((rs->state & rs_connected) ||
+	     (rs->state == rs_disconnected) || (rs->state & rs_error))) {
+		rs_process_cq(rs, nonblock, test);
+
+		revents = 0;
+		if ((events & POLLIN) && rs_conn_have_rdata(rs))
+			revents |= POLLIN;
+		if ((events & POLLOUT) && rs_can_send(rs))
+			revents |= POLLOUT;
+		if (!(rs->state & rs_connected)) {
+			if (rs->state == rs_disconnected)
+				revents |= POLLHUP;
+			else
+				revents |= POLLERR;
+		}
+
+		return revents;
+	} else if (rs->type == SOCK_DGRAM) {
+		ds_process_cqs(rs, nonblock, test);
+
+		revents = 0;
+		if ((events & POLLIN) && rs_have_rdata(rs))
+			revents |= POLLIN;
+		if ((events & POLLOUT) && ds_can_send(rs))
+			revents |= POLLOUT;
+
+		return revents;
+	}
 
 	if (rs->state == rs_listening) {
 		fds.fd = rs->cm_id->channel->fd;
@@ -3019,6 +5110,46 @@ check_cq:
 	return 0;
 }
 
+/*
+ * Returns the fd that signals when the rsocket's state may have changed.
+ */
+static struct rs_cq_group *rs_poll_group(struct rsocket *rs)
+{
+	return (rs->type == SOCK_STREAM && rs->state >= rs_connected) ?
+		rs->cq_group : NULL;
+}
+
+static int rs_poll_fd(struct rsocket *rs)
+{
+	if (rs->type == SOCK_STREAM) {
+		if (rs->state < rs_connected)
+			return rs->cm_id->channel->fd;
+		else if (rs->cq_group)
+			return rs->cq_group->channel->fd;
+		else
+			return rs->cm_id->recv_cq_channel->fd;
+	}
+	return rs->epfd;
+}
+
+/*
+ * The event on a shared channel may have been retrieved through another
+ * member, so we must not block waiting for it.
+ */
+static void rs_poll_get_event(struct rsocket *rs)
+{
+	fastlock_acquire(&rs->cq_wait_lock);
+	if (rs_poll_group(rs)) {
+		rs_get_group_event(rs->cq_group);
+		rs->cq_armed = 0;
+	} else if (rs->type == SOCK_STREAM) {
+		rs_get_cq_event(rs);
+	} else {
+		ds_get_cq_event(rs);
+	}
+	fastlock_release(&rs->cq_wait_lock);
+}
+
 static int rs_poll_check(struct pollfd *fds, nfds_t nfds)
 {
 	struct rsocket *rs;
@@ -3049,14 +5180,7 @@ static int rs_poll_arm(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
 			if (fds[i].revents)
 				return 1;
 
-			if (rs->type == SOCK_STREAM) {
-				if (rs->state >= rs_connected)
-					rfds[i].fd = rs->cm_id->recv_cq_channel->fd;
-				else
-					rfds[i].fd = rs->cm_id->channel->fd;
-			} else {
-				rfds[i].fd = rs->epfd;
-			}
+			rfds[i].fd = rs_poll_fd(rs);
 			rfds[i].events = POLLIN;
 		} else {
 			rfds[i].fd = fds[i].fd;
@@ -3078,12 +5202,7 @@ static int rs_poll_events(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
 
 		rs = idm_lookup(&idm, fds[i].fd);
 		if (rs) {
-			fastlock_acquire(&rs->cq_wait_lock);
-			if (rs->type == SOCK_STREAM)
-				rs_get_cq_event(rs);
-			else
-				ds_get_cq_event(rs);
-			fastlock_release(&rs->cq_wait_lock);
+			rs_poll_get_event(rs);
 			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
 		} else {
 			fds[i].revents = rfds[i].revents;
@@ -3094,6 +5213,35 @@ static int rs_poll_events(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
 	return cnt;
 }
 
+/*
+ * Poll for as long as any of the rsockets would.  Adaptive rsockets do not
+ * poll on single CPU systems, and yield in the second half of the budget.
+ */
+static uint32_t rs_poll_budget(struct pollfd *fds, nfds_t nfds, int *adaptive)
+{
+	struct rsocket *rs;
+	uint32_t budget = 0;
+	int i;
+
+	for (i = 0; i < nfds; i++) {
+		if (fds[i].fd < 0)
+			continue;
+
+		rs = idm_lookup(&idm, fds[i].fd);
+		if (!rs)
+			continue;
+
+		if (rs->poll_adaptive) {
+			*adaptive = 1;
+			if (single_cpu)
+				continue;
+		}
+		if (rs->poll_time > budget)
+			budget = rs->poll_time;
+	}
+	return budget;
+}
+
 /*
  * We need to poll *all* fd's that the user specifies at least once.
  * Note that we may receive events on an rsocket that may not be reported
@@ -3102,23 +5250,25 @@ static int rs_poll_events(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
  */
 int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
 {
-	struct timeval s, e;
+	struct timeval s;
 	struct pollfd *rfds;
-	uint32_t poll_time = 0;
-	int ret;
+	uint32_t poll_time = 0, budget = 0;
+	int ret, adaptive = 0;
 
 	do {
 		ret = rs_poll_check(fds, nfds);
 		if (ret || !timeout)
 			return ret;
 
-		if (!poll_time)
+		if (!poll_time) {
 			gettimeofday(&s, NULL);
+			budget = rs_poll_budget(fds, nfds, &adaptive);
+		} else if (adaptive && poll_time > (budget >> 1)) {
+			sched_yield();
+		}
 
-		gettimeofday(&e, NULL);
-		poll_time = (e.tv_sec - s.tv_sec) * 1000000 +
-			    (e.tv_usec - s.tv_usec) + 1;
-	} while (poll_time <= polling_time);
+		poll_time = rs_time_us(&s);
+	} while (poll_time <= budget);
 
 	rfds = rs_fds_alloc(nfds);
 	if (!rfds)
@@ -3155,77 +5305,651 @@ rs_select_to_poll(int *nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfd
 			fds[i].events = POLLIN;
 		}
 
-		if (writefds && FD_ISSET(fd, writefds)) {
-			fds[i].fd = fd;
-			fds[i].events |= POLLOUT;
-		}
+		if (writefds && FD_ISSET(fd, writefds)) {
+			fds[i].fd = fd;
+			fds[i].events |= POLLOUT;
+		}
+
+		if (exceptfds && FD_ISSET(fd, exceptfds))
+			fds[i].fd = fd;
+
+		if (fds[i].fd)
+			i++;
+	}
+
+	*nfds = i;
+	return fds;
+}
+
+static int
+rs_poll_to_select(int nfds, struct pollfd *fds, fd_set *readfds,
+		  fd_set *writefds, fd_set *exceptfds)
+{
+	int i, cnt = 0;
+
+	for (i = 0; i < nfds; i++) {
+		if (readfds && (fds[i].revents & (POLLIN | POLLHUP))) {
+			FD_SET(fds[i].fd, readfds);
+			cnt++;
+		}
+
+		if (writefds && (fds[i].revents & POLLOUT)) {
+			FD_SET(fds[i].fd, writefds);
+			cnt++;
+		}
+
+		if (exceptfds && (fds[i].revents & ~(POLLIN | POLLOUT))) {
+			FD_SET(fds[i].fd, exceptfds);
+			cnt++;
+		}
+	}
+	return cnt;
+}
+
+static int rs_convert_timeout(struct timeval *timeout)
+{
+	return !timeout ? -1 :
+		timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+}
+
+int rselect(int nfds, fd_set *readfds, fd_set *writefds,
+	    fd_set *exceptfds, struct timeval *timeout)
+{
+	struct pollfd *fds;
+	int ret;
+
+	fds = rs_select_to_poll(&nfds, readfds, writefds, exceptfds);
+	if (!fds)
+		return ERR(ENOMEM);
+
+	ret = rpoll(fds, nfds, rs_convert_timeout(timeout));
+
+	if (readfds)
+		FD_ZERO(readfds);
+	if (writefds)
+		FD_ZERO(writefds);
+	if (exceptfds)
+		FD_ZERO(exceptfds);
+
+	if (ret > 0)
+		ret = rs_poll_to_select(nfds, fds, readfds, writefds, exceptfds);
+
+	free(fds);
+	return ret;
+}
+
+/*
+ * repoll - epoll style event notification for rsockets.
+ *
+ * Each set is backed by a kernel epoll fd.  Normal fds are registered with
+ * the kernel directly.  For an rsocket we register the fd that signals a
+ * state change (see rs_poll_fd), which is normally its CQ channel.  When
+ * that fires, the rsocket is placed on the set's ready list.  repoll_wait
+ * only examines rsockets on the ready list, so the cost of a call is
+ * proportional to the number of active sockets, not the size of the set.
+ * An rsocket is removed from the ready list once it no longer reports any
+ * events of interest, after its CQ has been re-armed.
+ */
+/*
+ * Members of a CQ group signal through the same channel, which can only be
+ * added to a kernel set once.
+ */
+struct rs_epsrc {
+	dlist_entry	  entry;
+	struct rs_cq_group *grp;
+	int		  kfd;
+	int		  refcnt;
+};
+
+struct rs_epitem {
+	struct rs_epoll	  *ep;
+	struct rsocket	  *rs;
+	struct rs_epsrc	  *src;
+	int		  fd;
+	int		  kfd;
+	int		  ready;
+	struct epoll_event event;
+	dlist_entry	  ep_entry;
+	dlist_entry	  rs_entry;
+	dlist_entry	  ready_entry;
+};
+
+struct rs_epoll {
+	int		  epfd;
+	fastlock_t	  lock;
+	struct index_map  items;
+	dlist_entry	  item_list;
+	dlist_entry	  ready_list;
+	dlist_entry	  src_list;
+};
+
+static struct epoll_event *rs_epoll_events_alloc(int maxevents)
+{
+	static __thread struct epoll_event *kevents;
+	static __thread int kmaxevents;
+
+	if (maxevents > kmaxevents) {
+		if (kevents)
+			free(kevents);
+
+		kevents = malloc(sizeof(*kevents) * maxevents);
+		kmaxevents = kevents ? maxevents : 0;
+	}
+
+	return kevents;
+}
+
+static void rs_epoll_set_ready(struct rs_epitem *item)
+{
+	if (!item->ready) {
+		dlist_insert_tail(&item->ready_entry, &item->ep->ready_list);
+		item->ready = 1;
+	}
+}
+
+static void rs_epoll_clear_ready(struct rs_epitem *item)
+{
+	if (item->ready) {
+		dlist_remove(&item->ready_entry);
+		item->ready = 0;
+	}
+}
+
+/*
+ * Kernel events for a shared channel carry the one's complement of the
+ * channel fd, to distinguish them from events for a single fd.
+ */
+static int rs_epoll_watch(struct rs_epitem *item, int kfd, uint32_t events)
+{
+	struct rs_epoll *ep = item->ep;
+	struct rs_cq_group *grp;
+	struct epoll_event kevent;
+	struct rs_epsrc *src;
+	dlist_entry *entry;
+	int ret;
+
+	grp = item->rs ? rs_poll_group(item->rs) : NULL;
+	if (!grp) {
+		kevent.events = events;
+		kevent.data.fd = item->fd;
+		ret = epoll_ctl(ep->epfd, EPOLL_CTL_ADD, kfd, &kevent);
+		if (!ret)
+			item->kfd = kfd;
+		return ret;
+	}
+
+	for (entry = ep->src_list.next; entry != &ep->src_list;
+	     entry = entry->next) {
+		src = container_of(entry, struct rs_epsrc, entry);
+		if (src->grp == grp)
+			goto found;
+	}
+
+	src = calloc(1, sizeof(*src));
+	if (!src)
+		return ERR(ENOMEM);
+
+	kevent.events = EPOLLIN;
+	kevent.data.fd = ~kfd;
+	ret = epoll_ctl(ep->epfd, EPOLL_CTL_ADD, kfd, &kevent);
+	if (ret) {
+		free(src);
+		return ret;
+	}
+
+	rs_hold_cq_group(grp);
+	src->grp = grp;
+	src->kfd = kfd;
+	dlist_insert_tail(&src->entry, &ep->src_list);
+found:
+	src->refcnt++;
+	item->src = src;
+	item->kfd = kfd;
+	return 0;
+}
+
+static int rs_epoll_unwatch(struct rs_epitem *item)
+{
+	struct rs_epsrc *src = item->src;
+	int ret = 0;
+
+	if (src) {
+		item->src = NULL;
+		if (!--src->refcnt) {
+			epoll_ctl(item->ep->epfd, EPOLL_CTL_DEL, src->kfd, NULL);
+			dlist_remove(&src->entry);
+			rs_put_cq_group(src->grp, 0);
+			free(src);
+		}
+	} else if (item->kfd >= 0) {
+		ret = epoll_ctl(item->ep->epfd, EPOLL_CTL_DEL, item->kfd, NULL);
+	}
+
+	item->kfd = -1;
+	return ret;
+}
+
+/*
+ * An rsocket signals through a different fd once it connects.
+ */
+static void rs_epoll_update_fd(struct rs_epitem *item)
+{
+	int kfd;
+
+	kfd = rs_poll_fd(item->rs);
+	if (kfd == item->kfd)
+		return;
+
+	rs_epoll_unwatch(item);
+	rs_epoll_watch(item, kfd, EPOLLIN);
+}
+
+static int rs_epoll_add(struct rs_epoll *ep, struct rs_epitem *item,
+			int fd, struct epoll_event *event)
+{
+	struct epoll_event kevent;
+	int ret;
+
+	if (item) {
+		/*
+		 * The kernel drops a normal fd from the set when it is
+		 * closed.  Discard our stale copy if that happened.
+		 */
+		kevent.events = item->event.events;
+		kevent.data.fd = fd;
+		if (item->rs || !epoll_ctl(ep->epfd, EPOLL_CTL_MOD, fd, &kevent))
+			return ERR(EEXIST);
+
+		idm_clear(&ep->items, fd);
+		dlist_remove(&item->ep_entry);
+		free(item);
+	}
+
+	item = calloc(1, sizeof(*item));
+	if (!item)
+		return ERR(ENOMEM);
+
+	item->ep = ep;
+	item->fd = fd;
+	item->kfd = -1;
+	item->event = *event;
+	item->rs = idm_lookup(&idm, fd);
+	if (item->rs)
+		ret = rs_epoll_watch(item, rs_poll_fd(item->rs), EPOLLIN);
+	else
+		ret = rs_epoll_watch(item, fd, event->events);
+	if (ret)
+		goto err1;
+
+	ret = idm_set(&ep->items, fd, item);
+	if (ret < 0)
+		goto err2;
+
+	dlist_insert_tail(&item->ep_entry, &ep->item_list);
+	if (item->rs) {
+		dlist_insert_tail(&item->rs_entry, &item->rs->epoll_list);
+		rs_epoll_set_ready(item);
+	}
+	return 0;
+
+err2:
+	rs_epoll_unwatch(item);
+err1:
+	free(item);
+	return ret;
+}
+
+static int rs_epoll_mod(struct rs_epoll *ep, struct rs_epitem *item,
+			struct epoll_event *event)
+{
+	struct epoll_event kevent;
+	int ret;
+
+	if (!item->rs) {
+		kevent.events = event->events;
+		kevent.data.fd = item->fd;
+		ret = epoll_ctl(ep->epfd, EPOLL_CTL_MOD, item->fd, &kevent);
+		if (ret)
+			return ret;
+	}
+
+	item->event = *event;
+	if (item->rs)
+		rs_epoll_set_ready(item);
+	return 0;
+}
+
+static int rs_epoll_del(struct rs_epoll *ep, struct rs_epitem *item)
+{
+	int ret;
+
+	ret = rs_epoll_unwatch(item);
+	if (item->rs)
+		ret = 0;
+
+	rs_epoll_clear_ready(item);
+	idm_clear(&ep->items, item->fd);
+	dlist_remove(&item->ep_entry);
+	if (item->rs)
+		dlist_remove(&item->rs_entry);
+	free(item);
+	return ret;
+}
+
+/*
+ * Called when an rsocket is closed, to remove it from all sets.  Taking
+ * each set's lock ensures that no repoll_wait call is accessing the rsocket.
+ */
+static void rs_epoll_detach(struct rsocket *rs)
+{
+	struct rs_epitem *item;
+	struct rs_epoll *ep;
+
+	pthread_mutex_lock(&ep_mut);
+	while (!dlist_empty(&rs->epoll_list)) {
+		item = container_of(rs->epoll_list.next, struct rs_epitem, rs_entry);
+		ep = item->ep;
+		fastlock_acquire(&ep->lock);
+		rs_epoll_del(ep, item);
+		fastlock_release(&ep->lock);
+	}
+	pthread_mutex_unlock(&ep_mut);
+}
+
+/*
+ * Converts a kernel event into a user event.  Events for normal fds are
+ * reported directly.  Events for rsockets are only a hint that the socket
+ * should be checked, so we consume the CQ event and queue the socket.
+ */
+static int rs_epoll_signal(struct rs_epoll *ep, struct epoll_event *kevent,
+			   struct epoll_event *event)
+{
+	struct rs_epitem *item;
+	struct rs_epsrc *src;
+	dlist_entry *entry;
+
+	if (kevent->data.fd < 0) {
+		for (entry = ep->src_list.next; entry != &ep->src_list;
+		     entry = entry->next) {
+			src = container_of(entry, struct rs_epsrc, entry);
+			if (src->kfd == ~kevent->data.fd) {
+				rs_get_group_event(src->grp);
+				break;
+			}
+		}
+		return 0;
+	}
+
+	item = idm_lookup(&ep->items, kevent->data.fd);
+	if (!item)
+		return 0;
+
+	if (!item->rs) {
+		event->events = kevent->events;
+		event->data = item->event.data;
+		return 1;
+	}
+
+	if (item->kfd != item->rs->index)
+		rs_poll_get_event(item->rs);
+	rs_epoll_set_ready(item);
+	return 0;
+}
+
+/*
+ * Completions for a group member may be retrieved while servicing any
+ * other member, so we queue every member that has completions waiting.
+ */
+static void rs_epoll_scan_groups(struct rs_epoll *ep)
+{
+	struct rs_epitem *item;
+	struct rs_epsrc *src;
+	struct rsocket *rs;
+	dlist_entry *entry, *act;
+
+	for (entry = ep->src_list.next; entry != &ep->src_list;
+	     entry = entry->next) {
+		src = container_of(entry, struct rs_epsrc, entry);
+		fastlock_acquire(&src->grp->lock);
+		for (act = src->grp->active_list.next;
+		     act != &src->grp->active_list; act = act->next) {
+			rs = container_of(act, struct rsocket, active_entry);
+			item = idm_lookup(&ep->items, rs->index);
+			if (item && item->rs == rs &&
+			    (item->event.events & ~(EPOLLET | EPOLLONESHOT)))
+				rs_epoll_set_ready(item);
+		}
+		fastlock_release(&src->grp->lock);
+	}
+}
+
+static int rs_epoll_check(struct rs_epitem *item)
+{
+	uint32_t events;
+	int revents;
+
+	events = item->event.events & (EPOLLIN | EPOLLOUT);
+	revents = rs_poll_rs(item->rs, events, 1, rs_poll_all);
+	if (!revents)
+		revents = rs_poll_rs(item->rs, events, 0, rs_is_cq_armed);
+
+	rs_epoll_update_fd(item);
+	return revents;
+}
+
+/*
+ * Level triggered rsockets that report an event remain on the ready list,
+ * but are moved to the end of it so that other sockets are not starved.
+ */
+static int rs_epoll_scan(struct rs_epoll *ep, struct epoll_event *events,
+			 int maxevents)
+{
+	struct rs_epitem *item;
+	dlist_entry *entry, *next;
+	dlist_entry done;
+	int revents, cnt = 0;
+
+	dlist_init(&done);
+	for (entry = ep->ready_list.next; entry != &ep->ready_list &&
+	     cnt < maxevents; entry = next) {
+		next = entry->next;
+		item = container_of(entry, struct rs_epitem, ready_entry);
+
+		revents = 0;
+		if (item->event.events & ~(EPOLLET | EPOLLONESHOT))
+			revents = rs_epoll_check(item);
+		if (!revents) {
+			rs_epoll_clear_ready(item);
+			continue;
+		}
+
+		events[cnt].events = revents;
+		events[cnt++].data = item->event.data;
+		if (item->event.events & EPOLLONESHOT) {
+			item->event.events &= EPOLLET | EPOLLONESHOT;
+			rs_epoll_clear_ready(item);
+		} else if (item->event.events & EPOLLET) {
+			rs_epoll_clear_ready(item);
+			rs_poll_rs(item->rs, 0, 0, rs_is_cq_armed);
+		} else {
+			dlist_remove(entry);
+			dlist_insert_tail(entry, &done);
+		}
+	}
+
+	while (!dlist_empty(&done)) {
+		entry = done.next;
+		dlist_remove(entry);
+		dlist_insert_tail(entry, &ep->ready_list);
+	}
+	return cnt;
+}
 
-		if (exceptfds && FD_ISSET(fd, exceptfds))
-			fds[i].fd = fd;
+int repoll_create(int flags)
+{
+	struct rs_epoll *ep;
+	int ret;
 
-		if (fds[i].fd)
-			i++;
+	ep = calloc(1, sizeof(*ep));
+	if (!ep)
+		return ERR(ENOMEM);
+
+	ep->epfd = epoll_create1(flags);
+	if (ep->epfd < 0) {
+		ret = ep->epfd;
+		goto err1;
 	}
 
-	*nfds = i;
-	return fds;
+	fastlock_init(&ep->lock);
+	dlist_init(&ep->item_list);
+	dlist_init(&ep->ready_list);
+	dlist_init(&ep->src_list);
+
+	pthread_mutex_lock(&ep_mut);
+	ret = idm_set(&ep_idm, ep->epfd, ep);
+	pthread_mutex_unlock(&ep_mut);
+	if (ret < 0)
+		goto err2;
+
+	return ep->epfd;
+
+err2:
+	fastlock_destroy(&ep->lock);
+	close(ep->epfd);
+err1:
+	free(ep);
+	return ret;
 }
 
-static int
-rs_poll_to_select(int nfds, struct pollfd *fds, fd_set *readfds,
-		  fd_set *writefds, fd_set *exceptfds)
+int repoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 {
-	int i, cnt = 0;
+	struct rs_epoll *ep;
+	struct rs_epitem *item;
+	int ret;
 
-	for (i = 0; i < nfds; i++) {
-		if (readfds && (fds[i].revents & (POLLIN | POLLHUP))) {
-			FD_SET(fds[i].fd, readfds);
-			cnt++;
-		}
+	ep = idm_lookup(&ep_idm, epfd);
+	if (!ep)
+		return ERR(EBADF);
 
-		if (writefds && (fds[i].revents & POLLOUT)) {
-			FD_SET(fds[i].fd, writefds);
-			cnt++;
-		}
+	if (fd == epfd)
+		return ERR(EINVAL);
 
-		if (exceptfds && (fds[i].revents & ~(POLLIN | POLLOUT))) {
-			FD_SET(fds[i].fd, exceptfds);
-			cnt++;
-		}
+	if (op != EPOLL_CTL_DEL && !event)
+		return ERR(EFAULT);
+
+	pthread_mutex_lock(&ep_mut);
+	fastlock_acquire(&ep->lock);
+	item = idm_lookup(&ep->items, fd);
+	switch (op) {
+	case EPOLL_CTL_ADD:
+		ret = rs_epoll_add(ep, item, fd, event);
+		break;
+	case EPOLL_CTL_MOD:
+		ret = item ? rs_epoll_mod(ep, item, event) : ERR(ENOENT);
+		break;
+	case EPOLL_CTL_DEL:
+		ret = item ? rs_epoll_del(ep, item) : ERR(ENOENT);
+		break;
+	default:
+		ret = ERR(EINVAL);
+		break;
 	}
-	return cnt;
+	fastlock_release(&ep->lock);
+	pthread_mutex_unlock(&ep_mut);
+	return ret;
 }
 
-static int rs_convert_timeout(struct timeval *timeout)
+/*
+ * Any rsocket events pending from a previous call are reported without
+ * blocking.  Otherwise, we wait in the kernel until a normal fd or the CQ
+ * of a monitored rsocket signals.  Note that an rsocket may signal without
+ * an event that is reported to the user (e.g. a credit update), in which
+ * case we return to waiting.
+ */
+/* Time left of a timeout in ms that started at s, -1 waits forever */
+static int rs_epoll_time_left(struct timeval *s, int timeout)
 {
-	return !timeout ? -1 :
-		timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+	struct timeval e;
+	int64_t elapsed;
+
+	if (timeout <= 0)
+		return timeout;
+
+	gettimeofday(&e, NULL);
+	elapsed = (e.tv_sec - s->tv_sec) * 1000LL +
+		  (e.tv_usec - s->tv_usec) / 1000;
+	return elapsed < timeout ? timeout - elapsed : 0;
 }
 
-int rselect(int nfds, fd_set *readfds, fd_set *writefds,
-	    fd_set *exceptfds, struct timeval *timeout)
+int repoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
 {
-	struct pollfd *fds;
-	int ret;
+	struct epoll_event *kevents;
+	struct rs_epoll *ep;
+	struct timeval s;
+	int i, ret, cnt, wait, left;
 
-	fds = rs_select_to_poll(&nfds, readfds, writefds, exceptfds);
-	if (!fds)
+	ep = idm_lookup(&ep_idm, epfd);
+	if (!ep)
+		return ERR(EBADF);
+
+	if (maxevents <= 0)
+		return ERR(EINVAL);
+
+	kevents = rs_epoll_events_alloc(maxevents);
+	if (!kevents)
 		return ERR(ENOMEM);
 
-	ret = rpoll(fds, nfds, rs_convert_timeout(timeout));
+	if (timeout > 0)
+		gettimeofday(&s, NULL);
 
-	if (readfds)
-		FD_ZERO(readfds);
-	if (writefds)
-		FD_ZERO(writefds);
-	if (exceptfds)
-		FD_ZERO(exceptfds);
+	do {
+		left = rs_epoll_time_left(&s, timeout);
 
-	if (ret > 0)
-		ret = rs_poll_to_select(nfds, fds, readfds, writefds, exceptfds);
+		fastlock_acquire(&ep->lock);
+		rs_epoll_scan_groups(ep);
+		wait = dlist_empty(&ep->ready_list) ? left : 0;
+		fastlock_release(&ep->lock);
 
-	free(fds);
-	return ret;
+		ret = epoll_wait(ep->epfd, kevents, maxevents, wait);
+		if (ret < 0)
+			return ret;
+
+		fastlock_acquire(&ep->lock);
+		for (i = 0, cnt = 0; i < ret; i++)
+			cnt += rs_epoll_signal(ep, &kevents[i], &events[cnt]);
+
+		rs_epoll_scan_groups(ep);
+		cnt += rs_epoll_scan(ep, &events[cnt], maxevents - cnt);
+		fastlock_release(&ep->lock);
+	} while (!cnt && left && (ret || !wait));
+
+	return cnt;
+}
+
+int repoll_close(int epfd)
+{
+	struct rs_epitem *item;
+	struct rs_epoll *ep;
+
+	pthread_mutex_lock(&ep_mut);
+	ep = idm_lookup(&ep_idm, epfd);
+	if (!ep) {
+		pthread_mutex_unlock(&ep_mut);
+		return ERR(EBADF);
+	}
+
+	idm_clear(&ep_idm, epfd);
+	while (!dlist_empty(&ep->item_list)) {
+		item = container_of(ep->item_list.next, struct rs_epitem, ep_entry);
+		rs_epoll_del(ep, item);
+	}
+	pthread_mutex_unlock(&ep_mut);
+
+	close(ep->epfd);
+	idm_destroy(&ep->items);
+	fastlock_destroy(&ep->lock);
+	free(ep);
+	return 0;
 }
 
 /*
@@ -3282,8 +6006,15 @@ out:
 
 	if (rs->state & rs_disconnected) {
 		/* Generate event by flushing receives to unblock rpoll */
-		ibv_req_notify_cq(rs->cm_id->recv_cq, 0);
+		rs_req_notify_cq(rs);
 		ucma_shutdown(rs->cm_id);
+
+		/* Receives posted to an SRQ are not flushed, so flush a send */
+		if (rs->srq && rs->sqe_avail) {
+			rs->sqe_avail--;
+			rs_post_write(rs, NULL, 0, rs_msg_set(RS_OP_WRITE, 0),
+				      0, 0, 0);
+		}
 	}
 
 	return ret;
@@ -3292,7 +6023,7 @@ out:
 static void ds_shutdown(struct rsocket *rs)
 {
 	if (rs->opts & RS_OPT_SVC_ACTIVE)
-		rs_notify_svc(&udp_svc, rs, RS_SVC_REM_DGRAM);
+		rs_notify_svc(udp_svc_get(rs), rs, RS_SVC_REM_DGRAM);
 
 	if (rs->fd_flags & O_NONBLOCK)
 		rs_set_nonblocking(rs, 0);
@@ -3320,6 +6051,7 @@ int rclose(int socket)
 		ds_shutdown(rs);
 	}
 
+	rs_epoll_detach(rs);
 	rs_free(rs);
 	return 0;
 }
@@ -3432,6 +6164,9 @@ int rsetsockopt(int socket, int level, int optname,
 			if ((rs->type == SOCK_STREAM && !rs->rbuf) ||
 			    (rs->type == SOCK_DGRAM && !rs->qp_list))
 				rs->rbuf_size = (*(uint32_t *) optval) << 1;
+			/* An explicit size disables growth, as with TCP */
+			if (rs->type == SOCK_STREAM && !rs->rbuf)
+				rs->rbuf_max = rs->rbuf_size;
 			ret = 0;
 			break;
 		case SO_SNDBUF:
@@ -3439,6 +6174,8 @@ int rsetsockopt(int socket, int level, int optname,
 				rs->sbuf_size = (*(uint32_t *) optval) << 1;
 			if (rs->sbuf_size < RS_SNDLOWAT)
 				rs->sbuf_size = RS_SNDLOWAT << 1;
+			if (rs->type == SOCK_STREAM && !rs->sbuf)
+				rs->sbuf_max = rs->sbuf_size;
 			ret = 0;
 			break;
 		case SO_LINGER:
@@ -3501,7 +6238,8 @@ int rsetsockopt(int socket, int level, int optname,
 		}
 		break;
 	case SOL_RDMA:
-		if (rs->state >= rs_opening) {
+		if (rs->state >= rs_opening && optname != RDMA_BUSY_POLL &&
+		    optname != RDMA_BUSY_POLL_ADAPTIVE) {
 			ret = ERR(EINVAL);
 			break;
 		}
@@ -3536,6 +6274,36 @@ int rsetsockopt(int socket, int level, int optname,
 				ret = ERR(ENOMEM);
 			}
 			break;
+		case RDMA_ZCOPY_THRESHOLD:
+			if (rs->type == SOCK_STREAM) {
+				rs->zcopy_threshold = *(uint32_t *) optval;
+				ret = 0;
+			}
+			break;
+		case RDMA_CQ_GROUP:
+			if (rs->type == SOCK_STREAM &&
+			    *(int *) optval >= RS_CQ_GROUP_THREAD) {
+				rs->cq_group_id = *(int *) optval;
+				ret = 0;
+			}
+			break;
+		case RDMA_SRQ:
+			if (rs->type == SOCK_STREAM) {
+				rs->srq_size = min_t(uint32_t, *(uint32_t *) optval,
+						     RS_QP_MAX_SIZE);
+				ret = 0;
+			}
+			break;
+		case RDMA_BUSY_POLL:
+			rs->busy_poll = *(uint32_t *) optval;
+			rs->poll_time = rs->busy_poll;
+			ret = 0;
+			break;
+		case RDMA_BUSY_POLL_ADAPTIVE:
+			rs->poll_adaptive = !!*(int *) optval;
+			rs->poll_time = rs->busy_poll;
+			ret = 0;
+			break;
 		default:
 			break;
 		}
@@ -3708,6 +6476,50 @@ int rgetsockopt(int socket, int level, int optname,
 				}
 			}
 			break;
+		case RDMA_ZCOPY_THRESHOLD:
+			if (rs->type == SOCK_STREAM) {
+				*((int *) optval) = rs->zcopy_threshold;
+				*optlen = sizeof(int);
+			} else {
+				ret = ENOTSUP;
+			}
+			break;
+		case RDMA_CQ_GROUP:
+			if (rs->type == SOCK_STREAM) {
+				*((int *) optval) = rs->cq_group_id;
+				*optlen = sizeof(int);
+			} else {
+				ret = ENOTSUP;
+			}
+			break;
+		case RDMA_SRQ:
+			if (rs->type == SOCK_STREAM) {
+				*((int *) optval) = rs->srq_size;
+				*optlen = sizeof(int);
+			} else {
+				ret = ENOTSUP;
+			}
+			break;
+		case RDMA_BUSY_POLL:
+			*((int *) optval) = rs->busy_poll;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_BUSY_POLL_ADAPTIVE:
+			*((int *) optval) = rs->poll_adaptive;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_POLL_STATS:
+			if (*optlen < sizeof(struct rsocket_poll_stats)) {
+				ret = EINVAL;
+			} else {
+				struct rsocket_poll_stats *stats = optval;
+
+				stats->spin_hits = atomic_load(&rs->poll_stats.spin_hits);
+				stats->spin_misses = atomic_load(&rs->poll_stats.spin_misses);
+				stats->blocked = atomic_load(&rs->poll_stats.blocked);
+				*optlen = sizeof(*stats);
+			}
+			break;
 		default:
 			ret = ENOTSUP;
 			break;
@@ -3880,18 +6692,22 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 	struct rs_iomap *iom = NULL;
 	struct ibv_sge sge;
 	size_t left = count;
-	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
+	uint32_t xfer_size, olen;
 	int ret = 0;
 
 	rs = idm_at(&idm, socket);
 	if (!rs)
 		return ERR(EBADF);
 	fastlock_acquire(&rs->slock);
+	if (rs->sbuf_next)
+		rs_switch_sbuf(rs);
 	if (rs->iomap_pending) {
 		ret = rs_send_iomaps(rs, flags);
 		if (ret)
 			goto out;
 	}
+
+	olen = rs->xfer_start;
 	for (; left; left -= xfer_size, buf += xfer_size, offset += xfer_size) {
 		if (!iom || offset > iom->offset + iom->sge.length) {
 			iom = rs_find_iomap(rs, offset);
@@ -3900,6 +6716,7 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 		}
 
 		if (!rs_can_send(rs)) {
+			rs_send_stalled(rs);
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
 					  rs_conn_can_send);
 			if (ret)
@@ -3912,8 +6729,7 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 
 		if (olen < left) {
 			xfer_size = olen;
-			if (olen < RS_MAX_TRANSFER)
-				olen <<= 1;
+			olen = rs_next_olen(rs, olen);
 		} else {
 			xfer_size = left;
 		}
@@ -3949,6 +6765,7 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 		if (ret)
 			break;
 	}
+	rs_adapt_send(rs, count);
 out:
 	fastlock_release(&rs->slock);
 
@@ -3959,92 +6776,34 @@ out:
  * Service Processing Threads
  ****************************************************************************/
 
-static int rs_svc_grow_sets(struct rs_svc *svc, int grow_size)
-{
-	struct rsocket **rss;
-	void *set, *contexts;
-
-	set = calloc(svc->size + grow_size, sizeof(*rss) + svc->context_size);
-	if (!set)
-		return ENOMEM;
-
-	svc->size += grow_size;
-	rss = set;
-	contexts = set + sizeof(*rss) * svc->size;
-	if (svc->cnt) {
-		memcpy(rss, svc->rss, sizeof(*rss) * (svc->cnt + 1));
-		memcpy(contexts, svc->contexts, svc->context_size * (svc->cnt + 1));
-	}
-
-	free(svc->rss);
-	svc->rss = rss;
-	svc->contexts = contexts;
-	return 0;
-}
-
-/*
- * Index 0 is reserved for the service's communication socket.
- */
-static int rs_svc_add_rs(struct rs_svc *svc, struct rsocket *rs)
-{
-	int ret;
-
-	if (svc->cnt >= svc->size - 1) {
-		ret = rs_svc_grow_sets(svc, 4);
-		if (ret)
-			return ret;
-	}
-
-	svc->rss[++svc->cnt] = rs;
-	return 0;
-}
-
-static int rs_svc_index(struct rs_svc *svc, struct rsocket *rs)
-{
-	int i;
-
-	for (i = 1; i <= svc->cnt; i++) {
-		if (svc->rss[i] == rs)
-			return i;
-	}
-	return -1;
-}
-
-static int rs_svc_rm_rs(struct rs_svc *svc, struct rsocket *rs)
-{
-	int i;
-
-	if ((i = rs_svc_index(svc, rs)) >= 0) {
-		svc->rss[i] = svc->rss[svc->cnt];
-		memcpy(svc->contexts + i * svc->context_size,
-		       svc->contexts + svc->cnt * svc->context_size,
-		       svc->context_size);
-		svc->cnt--;
-		return 0;
-	}
-	return EBADF;
-}
-
 static void udp_svc_process_sock(struct rs_svc *svc)
 {
 	struct rs_svc_msg msg;
+	struct epoll_event event;
 
 	read_all(svc->sock[1], &msg, sizeof msg);
 	switch (msg.cmd) {
 	case RS_SVC_ADD_DGRAM:
-		msg.status = rs_svc_add_rs(svc, msg.rs);
-		if (!msg.status) {
-			msg.rs->opts |= RS_OPT_SVC_ACTIVE;
-			udp_svc_fds = svc->contexts;
-			udp_svc_fds[svc->cnt].fd = msg.rs->udp_sock;
-			udp_svc_fds[svc->cnt].events = POLLIN;
-			udp_svc_fds[svc->cnt].revents = 0;
+		event.events = EPOLLIN;
+		event.data.ptr = msg.rs;
+		if (epoll_ctl(svc->epfd, EPOLL_CTL_ADD, msg.rs->udp_sock, &event)) {
+			msg.status = errno;
+			break;
 		}
+
+		msg.rs->opts |= RS_OPT_SVC_ACTIVE;
+		svc->cnt++;
+		msg.status = 0;
 		break;
 	case RS_SVC_REM_DGRAM:
-		msg.status = rs_svc_rm_rs(svc, msg.rs);
-		if (!msg.status)
-			msg.rs->opts &= ~RS_OPT_SVC_ACTIVE;
+		if (epoll_ctl(svc->epfd, EPOLL_CTL_DEL, msg.rs->udp_sock, NULL)) {
+			msg.status = EBADF;
+			break;
+		}
+
+		msg.rs->opts &= ~RS_OPT_SVC_ACTIVE;
+		svc->cnt--;
+		msg.status = 0;
 		break;
 	case RS_SVC_NOOP:
 		msg.status = 0;
@@ -4174,7 +6933,7 @@ static void udp_svc_forward(struct rsocket *rs, void *buf, size_t len,
 
 static void udp_svc_process_rs(struct rsocket *rs)
 {
-	static uint8_t buf[RS_SNDLOWAT];
+	uint8_t buf[RS_SNDLOWAT];
 	struct ds_dest *dest, *cur_dest;
 	struct ds_udp_header *udp_hdr;
 	union socket_addr addr;
@@ -4223,73 +6982,214 @@ static void udp_svc_process_rs(struct rsocket *rs)
 	}
 }
 
+/*
+ * Requests to add or remove rsockets are handled after the other events
+ * returned with them, so that we never touch an rsocket once its removal
+ * has been acknowledged.
+ */
 static void *udp_svc_run(void *arg)
 {
 	struct rs_svc *svc = arg;
 	struct rs_svc_msg msg;
-	int i, ret;
+	struct epoll_event events[16], event;
+	int i, cnt, ctrl;
 
-	ret = rs_svc_grow_sets(svc, 4);
-	if (ret) {
-		msg.status = ret;
+	svc->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (svc->epfd < 0) {
+		msg.status = errno;
+		write_all(svc->sock[1], &msg, sizeof msg);
+		return (void *) (uintptr_t) msg.status;
+	}
+
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (epoll_ctl(svc->epfd, EPOLL_CTL_ADD, svc->sock[1], &event)) {
+		msg.status = errno;
 		write_all(svc->sock[1], &msg, sizeof msg);
-		return (void *) (uintptr_t) ret;
+		close(svc->epfd);
+		return (void *) (uintptr_t) msg.status;
 	}
 
-	udp_svc_fds = svc->contexts;
-	udp_svc_fds[0].fd = svc->sock[1];
-	udp_svc_fds[0].events = POLLIN;
 	do {
-		for (i = 0; i <= svc->cnt; i++)
-			udp_svc_fds[i].revents = 0;
+		cnt = epoll_wait(svc->epfd, events, ARRAY_SIZE(events), -1);
+		for (i = 0, ctrl = 0; i < cnt; i++) {
+			if (events[i].data.ptr)
+				udp_svc_process_rs(events[i].data.ptr);
+			else
+				ctrl = 1;
+		}
 
-		poll(udp_svc_fds, svc->cnt + 1, -1);
-		if (udp_svc_fds[0].revents)
+		if (ctrl)
 			udp_svc_process_sock(svc);
-
-		for (i = 1; i <= svc->cnt; i++) {
-			if (udp_svc_fds[i].revents)
-				udp_svc_process_rs(svc->rss[i]);
-		}
 	} while (svc->cnt >= 1);
 
+	close(svc->epfd);
 	return NULL;
 }
 
 static uint32_t rs_get_time(void)
 {
-	struct timeval now;
+	struct timespec now;
 
-	memset(&now, 0, sizeof now);
-	gettimeofday(&now, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &now);
 	return (uint32_t) now.tv_sec;
 }
 
+static void rs_wheel_init(struct rs_timer_wheel *wheel, uint32_t now)
+{
+	int i, j;
+
+	wheel->now = now;
+	for (i = 0; i < RS_WHEEL_LEVELS; i++) {
+		for (j = 0; j < RS_WHEEL_SIZE; j++)
+			dlist_init(&wheel->slots[i][j]);
+	}
+}
+
+/*
+ * Expired timers go in the next slot to run.  Timers beyond the reach of
+ * the wheel are placed at its limit, and re-added when that slot runs.
+ */
+static void rs_wheel_add(struct rs_timer_wheel *wheel, struct rs_timer *timer)
+{
+	uint32_t delta, when;
+	int level;
+
+	delta = timer->expires - wheel->now;
+	if ((int32_t) delta <= 0)
+		delta = 1;
+	else if (delta > RS_WHEEL_MAX)
+		delta = RS_WHEEL_MAX;
+
+	for (level = 0; level < RS_WHEEL_LEVELS - 1; level++) {
+		if (delta < (1 << (RS_WHEEL_BITS * (level + 1))))
+			break;
+	}
+
+	when = wheel->now + delta;
+	dlist_insert_tail(&timer->entry, &wheel->slots[level]
+			  [(when >> (RS_WHEEL_BITS * level)) & RS_WHEEL_MASK]);
+}
+
+static void rs_wheel_del(struct rs_timer *timer)
+{
+	dlist_remove(&timer->entry);
+}
+
+static void rs_wheel_cascade(struct rs_timer_wheel *wheel, dlist_entry *slot)
+{
+	dlist_entry list;
+	struct rs_timer *timer;
+
+	dlist_init(&list);
+	if (dlist_empty(slot))
+		return;
+
+	dlist_insert_after(&list, slot);
+	dlist_remove(slot);
+	dlist_init(slot);
+	while (!dlist_empty(&list)) {
+		timer = container_of(list.next, struct rs_timer, entry);
+		dlist_remove(&timer->entry);
+
+		/* The current slot runs next, so it takes timers due now */
+		if (timer->expires == wheel->now)
+			dlist_insert_tail(&timer->entry, &wheel->slots[0]
+					  [wheel->now & RS_WHEEL_MASK]);
+		else
+			rs_wheel_add(wheel, timer);
+	}
+}
+
+/*
+ * Advance the wheel to the current time, moving each expired timer onto
+ * the expired list.
+ */
+static void rs_wheel_run(struct rs_timer_wheel *wheel, uint32_t now,
+			 dlist_entry *expired)
+{
+	struct rs_timer *timer;
+	dlist_entry *slot;
+	int level;
+
+	while ((int32_t) (now - wheel->now) > 0) {
+		wheel->now++;
+		for (level = 1; level < RS_WHEEL_LEVELS; level++) {
+			if ((wheel->now >> (RS_WHEEL_BITS * (level - 1))) &
+			    RS_WHEEL_MASK)
+				break;
+
+			rs_wheel_cascade(wheel, &wheel->slots[level]
+				[(wheel->now >> (RS_WHEEL_BITS * level)) & RS_WHEEL_MASK]);
+		}
+
+		slot = &wheel->slots[0][wheel->now & RS_WHEEL_MASK];
+		while (!dlist_empty(slot)) {
+			timer = container_of(slot->next, struct rs_timer, entry);
+			dlist_remove(&timer->entry);
+			if ((int32_t) (timer->expires - wheel->now) > 0)
+				rs_wheel_add(wheel, timer);
+			else
+				dlist_insert_tail(&timer->entry, expired);
+		}
+	}
+}
+
+/*
+ * Returns the number of seconds until the wheel next has work to do, or
+ * -1 if it is empty.
+ */
+static int rs_wheel_next(struct rs_timer_wheel *wheel)
+{
+	uint32_t base, next = 0;
+	int level, i, found = 0;
+
+	for (level = 0; level < RS_WHEEL_LEVELS; level++) {
+		base = wheel->now >> (RS_WHEEL_BITS * level);
+		for (i = 1; i <= RS_WHEEL_SIZE; i++) {
+			if (!dlist_empty(&wheel->slots[level]
+					 [(base + i) & RS_WHEEL_MASK])) {
+				if (!found || ((base + i) << (RS_WHEEL_BITS * level)) -
+					      wheel->now < next)
+					next = ((base + i) << (RS_WHEEL_BITS * level)) -
+					       wheel->now;
+				found = 1;
+				break;
+			}
+		}
+	}
+	return found ? (int) min_t(uint32_t, next, INT_MAX / 1000) : -1;
+}
+
 static void tcp_svc_process_sock(struct rs_svc *svc)
 {
 	struct rs_svc_msg msg;
-	int i;
 
 	read_all(svc->sock[1], &msg, sizeof msg);
 	switch (msg.cmd) {
 	case RS_SVC_ADD_KEEPALIVE:
-		msg.status = rs_svc_add_rs(svc, msg.rs);
-		if (!msg.status) {
-			msg.rs->opts |= RS_OPT_SVC_ACTIVE;
-			tcp_svc_timeouts = svc->contexts;
-			tcp_svc_timeouts[svc->cnt] = rs_get_time() +
-						     msg.rs->keepalive_time;
-		}
+		msg.rs->keepalive.expires = rs_get_time() + msg.rs->keepalive_time;
+		rs_wheel_add(&tcp_svc_wheel, &msg.rs->keepalive);
+		msg.rs->opts |= RS_OPT_SVC_ACTIVE;
+		svc->cnt++;
+		msg.status = 0;
 		break;
 	case RS_SVC_REM_KEEPALIVE:
-		msg.status = rs_svc_rm_rs(svc, msg.rs);
-		if (!msg.status)
+		if (msg.rs->opts & RS_OPT_SVC_ACTIVE) {
+			rs_wheel_del(&msg.rs->keepalive);
 			msg.rs->opts &= ~RS_OPT_SVC_ACTIVE;
+			svc->cnt--;
+			msg.status = 0;
+		} else {
+			msg.status = EBADF;
+		}
 		break;
 	case RS_SVC_MOD_KEEPALIVE:
-		i = rs_svc_index(svc, msg.rs);
-		if (i >= 0) {
-			tcp_svc_timeouts[i] = rs_get_time() + msg.rs->keepalive_time;
+		if (msg.rs->opts & RS_OPT_SVC_ACTIVE) {
+			rs_wheel_del(&msg.rs->keepalive);
+			msg.rs->keepalive.expires = rs_get_time() +
+						    msg.rs->keepalive_time;
+			rs_wheel_add(&tcp_svc_wheel, &msg.rs->keepalive);
 			msg.status = 0;
 		} else {
 			msg.status = EBADF;
@@ -4322,39 +7222,34 @@ static void tcp_svc_send_keepalive(struct rsocket *rs)
 static void *tcp_svc_run(void *arg)
 {
 	struct rs_svc *svc = arg;
-	struct rs_svc_msg msg;
+	struct rs_timer *timer;
+	struct rsocket *rs;
 	struct pollfd fds;
-	uint32_t now, next_timeout;
-	int i, ret, timeout;
-
-	ret = rs_svc_grow_sets(svc, 16);
-	if (ret) {
-		msg.status = ret;
-		write_all(svc->sock[1], &msg, sizeof msg);
-		return (void *) (uintptr_t) ret;
-	}
+	dlist_entry expired;
+	uint32_t now;
+	int timeout;
 
-	tcp_svc_timeouts = svc->contexts;
+	rs_wheel_init(&tcp_svc_wheel, rs_get_time());
 	fds.fd = svc->sock[1];
 	fds.events = POLLIN;
 	timeout = -1;
 	do {
-		poll(&fds, 1, timeout * 1000);
+		poll(&fds, 1, timeout < 0 ? -1 : timeout * 1000);
 		if (fds.revents)
 			tcp_svc_process_sock(svc);
 
 		now = rs_get_time();
-		next_timeout = ~0;
-		for (i = 1; i <= svc->cnt; i++) {
-			if (tcp_svc_timeouts[i] <= now) {
-				tcp_svc_send_keepalive(svc->rss[i]);
-				tcp_svc_timeouts[i] =
-					now + svc->rss[i]->keepalive_time;
-			}
-			if (tcp_svc_timeouts[i] < next_timeout)
-				next_timeout = tcp_svc_timeouts[i];
+		dlist_init(&expired);
+		rs_wheel_run(&tcp_svc_wheel, now, &expired);
+		while (!dlist_empty(&expired)) {
+			timer = container_of(expired.next, struct rs_timer, entry);
+			dlist_remove(&timer->entry);
+			rs = container_of(timer, struct rsocket, keepalive);
+			tcp_svc_send_keepalive(rs);
+			timer->expires = now + rs->keepalive_time;
+			rs_wheel_add(&tcp_svc_wheel, timer);
 		}
-		timeout = (int) (next_timeout - now);
+		timeout = rs_wheel_next(&tcp_svc_wheel);
 	} while (svc->cnt >= 1);
 
 	return NULL;
@@ -39,6 +39,7 @@
 #include <errno.h>
 #include <poll.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
 
 #ifdef __cplusplus
@@ -61,6 +62,11 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags);
 ssize_t rsendto(int socket, const void *buf, size_t len, int flags,
 		const struct sockaddr *dest_addr, socklen_t addrlen);
 ssize_t rsendmsg(int socket, const struct msghdr *msg, int flags);
+struct mmsghdr;
+struct timespec;
+int rrecvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	      int flags, struct timespec *timeout);
+int rsendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags);
 ssize_t rread(int socket, void *buf, size_t count);
 ssize_t rreadv(int socket, const struct iovec *iov, int iovcnt);
 ssize_t rwrite(int socket, const void *buf, size_t count);
@@ -70,6 +76,11 @@ int rpoll(struct pollfd *fds, nfds_t nfds, int timeout);
 int rselect(int nfds, fd_set *readfds, fd_set *writefds,
 	    fd_set *exceptfds, struct timeval *timeout);
 
+int repoll_create(int flags);
+int repoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int repoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+int repoll_close(int epfd);
+
 int rgetpeername(int socket, struct sockaddr *addr, socklen_t *addrlen);
 int rgetsockname(int socket, struct sockaddr *addr, socklen_t *addrlen);
 
@@ -79,7 +90,20 @@ enum {
 	RDMA_RQSIZE,
 	RDMA_INLINE,
 	RDMA_IOMAPSIZE,
-	RDMA_ROUTE
+	RDMA_ROUTE,
+	RDMA_ZCOPY_THRESHOLD,
+	RDMA_CQ_GROUP,
+	RDMA_SRQ,
+	RDMA_BUSY_POLL,
+	RDMA_BUSY_POLL_ADAPTIVE,
+	RDMA_POLL_STATS
+};
+
+/* Counters returned by RDMA_POLL_STATS */
+struct rsocket_poll_stats {
+	uint64_t	spin_hits;	/* waits satisfied by polling */
+	uint64_t	spin_misses;	/* waits that polled, then blocked */
+	uint64_t	blocked;	/* all waits that blocked */
 };
 
 int rsetsockopt(int socket, int level, int optname,
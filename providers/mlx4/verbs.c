@@ -801,7 +801,8 @@ static struct ibv_qp *_mlx4_create_qp_ex_rss(struct ibv_context *context,
 	int ret;
 
 	if (!(attr->comp_mask & IBV_QP_INIT_ATTR_RX_HASH) ||
-	    !(attr->comp_mask & IBV_QP_INIT_ATTR_IND_TABLE))
+	    !(attr->comp_mask & IBV_QP_INIT_ATTR_IND_TABLE) ||
+	    attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS)
 		return NULL;
 
 	if (attr->qp_type != IBV_QPT_RAW_PACKET)
@@ -518,6 +518,17 @@ struct mlx5_qp {
 	int                             rss_qp;
 	uint32_t			flags; /* Use enum mlx5_qp_flags */
 	enum mlx5dv_dc_type		dc_type;
+
+	/* State of the batch built through struct ibv_qp_ex */
+	struct mlx5_wqe_ctrl_seg       *cur_ctrl;
+	void			       *cur_data;
+	uint32_t			cur_size;
+	uint8_t				cur_setters_cnt;
+	bool				inl_wqe;
+	int				nreq;
+	int				err;
+	unsigned int			cur_post_rb;
+	uint8_t				fm_cache_rb;
 };
 
 struct mlx5_ah {
@@ -831,6 +842,8 @@ void *mlx5_get_atomic_laddr(struct mlx5_qp *qp, uint16_t idx, int *byte_count);
 void *mlx5_get_send_wqe(struct mlx5_qp *qp, int n);
 int mlx5_copy_to_recv_wqe(struct mlx5_qp *qp, int idx, void *buf, int size);
 int mlx5_copy_to_send_wqe(struct mlx5_qp *qp, int idx, void *buf, int size);
+int mlx5_qp_fill_wr_pfns(struct mlx5_qp *mqp,
+			 const struct ibv_qp_init_attr_ex *attr);
 int mlx5_copy_to_recv_srq(struct mlx5_srq *srq, int idx, void *buf, int size);
 struct ibv_xrcd *mlx5_open_xrcd(struct ibv_context *context,
 				struct ibv_xrcd_init_attr *xrcd_init_attr);
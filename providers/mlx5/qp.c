@@ -237,12 +237,20 @@ static void set_atomic_seg(struct mlx5_wqe_atomic_seg *aseg,
 	}
 }
 
+static void _set_datagram_seg(struct mlx5_wqe_datagram_seg *dseg,
+			      struct mlx5_wqe_av *av, uint32_t remote_qpn,
+			      uint32_t remote_qkey)
+{
+	memcpy(&dseg->av, av, sizeof dseg->av);
+	dseg->av.dqp_dct = htobe32(remote_qpn | MLX5_EXTENDED_UD_AV);
+	dseg->av.key.qkey.qkey = htobe32(remote_qkey);
+}
+
 static void set_datagram_seg(struct mlx5_wqe_datagram_seg *dseg,
 			     struct ibv_send_wr *wr)
 {
-	memcpy(&dseg->av, &to_mah(wr->wr.ud.ah)->av, sizeof dseg->av);
-	dseg->av.dqp_dct = htobe32(wr->wr.ud.remote_qpn | MLX5_EXTENDED_UD_AV);
-	dseg->av.key.qkey.qkey = htobe32(wr->wr.ud.remote_qkey);
+	_set_datagram_seg(dseg, &to_mah(wr->wr.ud.ah)->av, wr->wr.ud.remote_qpn,
+			  wr->wr.ud.remote_qkey);
 }
 
 static void set_data_ptr_seg(struct mlx5_wqe_data_seg *dseg, struct ibv_sge *sg,
@@ -1167,6 +1175,590 @@ int mlx5_bind_mw(struct ibv_qp *qp, struct ibv_mw *mw,
 	return 0;
 }
 
+/*
+ * The ibv_qp_ex calls write each WQE straight into the send queue.  An
+ * opcode call builds the control and address segments of a new WQE, and
+ * the setters that follow add its data.  The WQE is finalized, and
+ * sq.cur_post moved past it, once its last setter has been called: the
+ * data setter for RC and UC, or both the address and data setters for UD.
+ * After an error nothing more is built, and wr_complete() drops the batch.
+ */
+static inline bool _common_wqe_init(struct ibv_qp_ex *ibqp,
+				    enum ibv_wr_opcode ib_op)
+{
+	struct mlx5_qp *mqp = to_mqp((struct ibv_qp *)ibqp);
+	struct mlx5_wqe_ctrl_seg *ctrl;
+	uint8_t fence;
+	uint32_t idx;
+
+	if (unlikely(mqp->err))
+		return false;
+
+	if (unlikely(mlx5_wq_overflow(&mqp->sq, mqp->nreq,
+				      to_mcq(ibqp->qp_base.send_cq)))) {
+		FILE *fp = to_mctx(ibqp->qp_base.context)->dbg_fp;
+
+		mlx5_dbg(fp, MLX5_DBG_QP_SEND, "work queue overflow\n");
+		mqp->err = ENOMEM;
+		return false;
+	}
+
+	idx = mqp->sq.cur_post & (mqp->sq.wqe_cnt - 1);
+	mqp->sq.wrid[idx] = ibqp->wr_id;
+	mqp->sq.wqe_head[idx] = mqp->sq.head + mqp->nreq;
+
+	ctrl = mlx5_get_send_wqe(mqp, idx);
+	*(uint32_t *)((void *)ctrl + 8) = 0;
+	ctrl->imm = 0;
+
+	if (ibqp->wr_flags & IBV_SEND_FENCE)
+		fence = MLX5_WQE_CTRL_FENCE;
+	else
+		fence = mqp->fm_cache;
+	mqp->fm_cache = 0;
+
+	ctrl->fm_ce_se = mqp->sq_signal_bits | fence |
+		(ibqp->wr_flags & IBV_SEND_SIGNALED ?
+		 MLX5_WQE_CTRL_CQ_UPDATE : 0) |
+		(ibqp->wr_flags & IBV_SEND_SOLICITED ?
+		 MLX5_WQE_CTRL_SOLICITED : 0);
+	ctrl->opmod_idx_opcode = htobe32(((mqp->sq.cur_post & 0xffff) << 8) |
+					 mlx5_ib_opcode[ib_op]);
+
+	mqp->cur_ctrl = ctrl;
+	mqp->cur_setters_cnt = 0;
+	mqp->nreq++;
+	return true;
+}
+
+static inline void _common_wqe_finalize(struct mlx5_qp *mqp)
+{
+	mqp->cur_ctrl->qpn_ds = htobe32(mqp->cur_size |
+					(mqp->ibv_qp->qp_num << 8));
+
+	if (unlikely(mqp->wq_sig))
+		mqp->cur_ctrl->signature = wq_sig(mqp->cur_ctrl);
+
+#ifdef MLX5_DEBUG
+	if (mlx5_debug_mask & MLX5_DBG_QP_SEND)
+		dump_wqe(to_mctx(mqp->ibv_qp->context)->dbg_fp,
+			 mqp->sq.cur_post & (mqp->sq.wqe_cnt - 1),
+			 mqp->cur_size, mqp);
+#endif
+
+	mqp->sq.cur_post += DIV_ROUND_UP(mqp->cur_size * 16, MLX5_SEND_WQE_BB);
+}
+
+static inline void _mlx5_send_wr_send(struct ibv_qp_ex *ibqp,
+				      enum ibv_wr_opcode ib_op)
+{
+	struct mlx5_qp *mqp = to_mqp((struct ibv_qp *)ibqp);
+	size_t transport_seg_sz = 0;
+
+	if (!_common_wqe_init(ibqp, ib_op))
+		return;
+
+	if (ibqp->qp_base.qp_type == IBV_QPT_UD)
+		transport_seg_sz = sizeof(struct mlx5_wqe_datagram_seg);
+
+	mqp->cur_data = (void *)mqp->cur_ctrl +
+			sizeof(struct mlx5_wqe_ctrl_seg) + transport_seg_sz;
+	/* With a datagram segment the data may start past the SQ end */
+	if (unlikely(mqp->cur_data == mqp->sq.qend))
+		mqp->cur_data = mlx5_get_send_wqe(mqp, 0);
+
+	mqp->cur_size = (sizeof(struct mlx5_wqe_ctrl_seg) +
+			 transport_seg_sz) / 16;
+}
+
+static void mlx5_send_wr_send(struct ibv_qp_ex *ibqp)
+{
+	_mlx5_send_wr_send(ibqp, IBV_WR_SEND);
+}
+
+static void mlx5_send_wr_send_imm(struct ibv_qp_ex *ibqp, __be32 imm_data)
+{
+	struct mlx5_qp *mqp = to_mqp((struct ibv_qp *)ibqp);
+
+	_mlx5_send_wr_send(ibqp, IBV_WR_SEND_WITH_IMM);
+	if (likely(!mqp->err))
+		mqp->cur_ctrl->imm = imm_data;
+}
+
+static inline void _mlx5_send_wr_rdma(struct ibv_qp_ex *ibqp, uint32_t rkey,
+				      uint64_t remote_addr,
+				      enum ibv_wr_opcode ib_op)
+{
+	struct mlx5_qp *mqp = to_mqp((struct ibv_qp *)ibqp);
+	void *raddr_seg;
+
+	if (!_common_wqe_init(ibqp, ib_op))
+		return;
+
+	raddr_seg = (void *)mqp->cur_ctrl + sizeof(struct mlx5_wqe_ctrl_seg);
+	set_raddr_seg(raddr_seg, remote_addr, rkey);
+
+	mqp->cur_data = raddr_seg + sizeof(struct mlx5_wqe_raddr_seg);
+	mqp->cur_size = (sizeof(struct mlx5_wqe_ctrl_seg) +
+			 sizeof(struct mlx5_wqe_raddr_seg)) / 16;
+}
+
+static void mlx5_send_wr_rdma_write(struct ibv_qp_ex *ibqp, uint32_t rkey,
+				    uint64_t remote_addr)
+{
+	_mlx5_send_wr_rdma(ibqp, rkey, remote_addr, IBV_WR_RDMA_WRITE);
+}
+
+static void mlx5_send_wr_rdma_write_imm(struct ibv_qp_ex *ibqp, uint32_t rkey,
+					uint64_t remote_addr, __be32 imm_data)
+{
+	struct mlx5_qp *mqp = to_mqp((struct ibv_qp *)ibqp);
+
+	_mlx5_send_wr_rdma(ibqp, rkey, remote_addr, IBV_WR_RDMA_WRITE_WITH_IMM);
+	if (likely(!mqp->err))
+		mqp->cur_ctrl->imm = imm_data;
+}
+
+static void mlx5_send_wr_rdma_read(struct ibv_qp_ex *ibqp, uint32_t rkey,
+				   uint64_t remote_addr)
+{
+	_mlx5_send_wr_rdma(ibqp, rkey, remote_addr, IBV_WR_RDMA_READ);
+}
+
+static inline void _mlx5_send_wr_atomic(struct ibv_qp_ex *ibqp, uint32_t rkey,
+					uint64_t remote_addr,
+					uint64_t compare_add,
+					uint64_t swap, enum ibv_wr_opcode ib_op)
+{
+	struct mlx5_qp *mqp = to_mqp((struct ibv_qp *)ibqp);
+	void *raddr_seg;
+
+	if (unlikely(!mqp->atomics_enabled)) {
+		FILE *fp = to_mctx(ibqp->qp_base.context)->dbg_fp;
+
+		mlx5_dbg(fp, MLX5_DBG_QP_SEND, "atomic operations are not supported\n");
+		if (!mqp->err)
+			mqp->err = ENOSYS;
+		return;
+	}
+
+	if (!_common_wqe_init(ibqp, ib_op))
+		return;
+
+	raddr_seg = (void *)mqp->cur_ctrl + sizeof(struct mlx5_wqe_ctrl_seg);
+	set_raddr_seg(raddr_seg, remote_addr, rkey);
+	set_atomic_seg(raddr_seg + sizeof(struct mlx5_wqe_raddr_seg), ib_op,
+		       swap, compare_add);
+
+	mqp->cur_data = raddr_seg + sizeof(struct mlx5_wqe_raddr_seg) +
+			sizeof(struct mlx5_wqe_atomic_seg);
+	mqp->cur_size = (sizeof(struct mlx5_wqe_ctrl_seg) +
+			 sizeof(struct mlx5_wqe_raddr_seg) +
+			 sizeof(struct mlx5_wqe_atomic_seg)) / 16;
+}
+
+static void mlx5_send_wr_atomic_cmp_swp(struct ibv_qp_ex *ibqp, uint32_t rkey,
+					uint64_t remote_addr, uint64_t compare,
+					uint64_t swap)
+{
+	_mlx5_send_wr_atomic(ibqp, rkey, remote_addr, compare, swap,
+			     IBV_WR_ATOMIC_CMP_AND_SWP);
+}
+
+static void mlx5_send_wr_atomic_fetch_add(struct ibv_qp_ex *ibqp,
+					  uint32_t rkey, uint64_t remote_addr,
+					  uint64_t add)
+{
+	_mlx5_send_wr_atomic(ibqp, rkey, remote_addr, add, 0,
+			     IBV_WR_ATOMIC_FETCH_AND_ADD);
+}
+
+static inline void _mlx5_send_wr_set_sge(struct mlx5_qp *mqp, uint32_t lkey,
+					 uint64_t addr, uint32_t length)
+{
+	struct mlx5_wqe_data_seg *dseg;
+
+	if (unlikely(!length))
+		return;
+
+	dseg = mqp->cur_data;
+	dseg->byte_count = htobe32(length);
+	dseg->lkey = htobe32(lkey);
+	dseg->addr = htobe64(addr);
+	mqp->cur_size += sizeof(*dseg) / 16;
+}
+
+static inline void _mlx5_send_wr_set_sge_list(struct mlx5_qp *mqp,
+					      size_t num_sge,
+					      const struct ibv_sge *sg_list)
+{
+	struct mlx5_wqe_data_seg *dseg = mqp->cur_data;
+	size_t i;
+
+	if (unlikely(num_sge > mqp->sq.max_gs)) {
+		FILE *fp = to_mctx(mqp->ibv_qp->context)->dbg_fp;
+
+		mlx5_dbg(fp, MLX5_DBG_QP_SEND, "max gs exceeded %zu (max = %d)\n",
+			 num_sge, mqp->sq.max_gs);
+		mqp->err = ENOMEM;
+		return;
+	}
+
+	for (i = 0; i < num_sge; i++) {
+		if (unlikely(dseg == mqp->sq.qend))
+			dseg = mlx5_get_send_wqe(mqp, 0);
+
+		if (unlikely(!sg_list[i].length))
+			continue;
+
+		dseg->byte_count = htobe32(sg_list[i].length);
+		dseg->lkey = htobe32(sg_list[i].lkey);
+		dseg->addr = htobe64(sg_list[i].addr);
+		dseg++;
+		mqp->cur_size += sizeof(*dseg) / 16;
+	}
+}
+
+static inline void memcpy_to_wqe(struct mlx5_qp *mqp, void **dest, void *src,
+				 size_t n)
+{
+	if (unlikely(*dest + n > mqp->sq.qend)) {
+		size_t copy = mqp->sq.qend - *dest;
+
+		memcpy(*dest, src, copy);
+		src += copy;
+		n -= copy;
+		*dest = mlx5_get_send_wqe(mqp, 0);
+	}
+	memcpy(*dest, src, n);
+	*dest += n;
+}
+
+static inline void _mlx5_send_wr_set_inline_data(struct mlx5_qp *mqp,
+						 void *addr, size_t length)
+{
+	struct mlx5_wqe_inline_seg *dseg = mqp->cur_data;
+	void *wqe = (void *)dseg + sizeof(*dseg);
+
+	if (unlikely(length > mqp->max_inline_data)) {
+		FILE *fp = to_mctx(mqp->ibv_qp->context)->dbg_fp;
+
+		mlx5_dbg(fp, MLX5_DBG_QP_SEND, "inline data %zu exceeds %d\n",
+			 length, mqp->max_inline_data);
+		mqp->err = ENOMEM;
+		return;
+	}
+
+	mqp->inl_wqe = true;
+	if (unlikely(!length))
+		return;
+
+	memcpy_to_wqe(mqp, &wqe, addr, length);
+	dseg->byte_count = htobe32(length | MLX5_INLINE_SEG);
+	mqp->cur_size += DIV_ROUND_UP(length + sizeof(*dseg), 16);
+}
+
+static inline void
+_mlx5_send_wr_set_inline_data_list(struct mlx5_qp *mqp, size_t num_buf,
+				   const struct ibv_data_buf *buf_list)
+{
+	struct mlx5_wqe_inline_seg *dseg = mqp->cur_data;
+	void *wqe = (void *)dseg + sizeof(*dseg);
+	size_t inl_size = 0;
+	size_t i;
+
+	for (i = 0; i < num_buf; i++) {
+		inl_size += buf_list[i].length;
+		if (unlikely(inl_size > mqp->max_inline_data)) {
+			FILE *fp = to_mctx(mqp->ibv_qp->context)->dbg_fp;
+
+			mlx5_dbg(fp, MLX5_DBG_QP_SEND,
+				 "inline data %zu exceeds %d\n",
+				 inl_size, mqp->max_inline_data);
+			mqp->err = ENOMEM;
+			return;
+		}
+
+		memcpy_to_wqe(mqp, &wqe, buf_list[i].addr, buf_list[i].length);
+	}
+
+	mqp->inl_wqe = true;
+	if (unlikely(!inl_size))
+		return;
+
+	dseg->byte_count = htobe32(inl_size | MLX5_INLINE_SEG);
+	mqp->cur_size += DIV_ROUND_UP(inl_size + sizeof(*dseg), 16);
+}
+
+static void mlx5_send_wr_set_sge_rc_uc(struct ibv_qp_ex *ibqp, uint32_t lkey,
+				       uint64_t addr, uint32_t length)
+{
+	struct mlx5_qp *mqp = to_mqp((struct ibv_qp *)ibqp);
+
+	if (unlikely(mqp->err))
+		return;
+
+	_mlx5_send_wr_set_sge(mqp, lkey, addr, length);
+	_common_wqe_finalize(mqp);
+}
+
+static void mlx5_send_wr_set_sge_list_rc_uc(struct ibv_qp_ex *ibqp,
+					    size_t num_sge,
+					    const struct ibv_sge *sg_list)
+{
+	struct mlx5_qp *mqp = to_mqp((struct ibv_qp *)ibqp);
+
+	if (unlikely(mqp->err))
+		return;
+
+	_mlx5_send_wr_set_sge_list(mqp, num_sge, sg_list);
+	if (likely(!mqp->err))
+		_common_wqe_finalize(mqp);
+}
+
+static void mlx5_send_wr_set_inline_data_rc_uc(struct ibv_qp_ex *ibqp,
+					       void *addr, size_t length)
+{
+	struct mlx5_qp *mqp = to_mqp((struct ibv_qp *)ibqp);
+
+	if (unlikely(mqp->err))
+		return;
+
+	_mlx5_send_wr_set_inline_data(mqp, addr, length);
+	if (likely(!mqp->err))
+		_common_wqe_finalize(mqp);
+}
+
+static void
+mlx5_send_wr_set_inline_data_list_rc_uc(struct ibv_qp_ex *ibqp,
+					size_t num_buf,
+					const struct ibv_data_buf *buf_list)
+{
+	struct mlx5_qp *mqp = to_mqp((struct ibv_qp *)ibqp);
+
+	if (unlikely(mqp->err))
+		return;
+
+	_mlx5_send_wr_set_inline_data_list(mqp, num_buf, buf_list);
+	if (likely(!mqp->err))
+		_common_wqe_finalize(mqp);
+}
+
+enum {
+	MLX5_SEND_WR_SETTERS_UD = 2,
+};
+
+/* A UD WQE is complete once both its address and its data are set */
+static inline void _mlx5_send_wr_setter_ud(struct mlx5_qp *mqp)
+{
+	if (mqp->cur_setters_cnt == MLX5_SEND_WR_SETTERS_UD - 1)
+		_common_wqe_finalize(mqp);
+	else
+		mqp->cur_setters_cnt++;
+}
+
+static void mlx5_send_wr_set_ud_addr(struct ibv_qp_ex *ibqp, struct ibv_ah *ah,
+				     uint32_t remote_qpn, uint32_t remote_qkey)
+{
+	struct mlx5_qp *mqp = to_mqp((struct ibv_qp *)ibqp);
+	struct mlx5_wqe_datagram_seg *dseg;
+
+	if (unlikely(mqp->err))
+		return;
+
+	dseg = (void *)mqp->cur_ctrl + sizeof(struct mlx5_wqe_ctrl_seg);
+	_set_datagram_seg(dseg, &to_mah(ah)->av, remote_qpn, remote_qkey);
+	_mlx5_send_wr_setter_ud(mqp);
+}
+
+static void mlx5_send_wr_set_sge_ud(struct ibv_qp_ex *ibqp, uint32_t lkey,
+				    uint64_t addr, uint32_t length)
+{
+	struct mlx5_qp *mqp = to_mqp((struct ibv_qp *)ibqp);
+
+	if (unlikely(mqp->err))
+		return;
+
+	_mlx5_send_wr_set_sge(mqp, lkey, addr, length);
+	_mlx5_send_wr_setter_ud(mqp);
+}
+
+static void mlx5_send_wr_set_sge_list_ud(struct ibv_qp_ex *ibqp,
+					 size_t num_sge,
+					 const struct ibv_sge *sg_list)
+{
+	struct mlx5_qp *mqp = to_mqp((struct ibv_qp *)ibqp);
+
+	if (unlikely(mqp->err))
+		return;
+
+	_mlx5_send_wr_set_sge_list(mqp, num_sge, sg_list);
+	if (likely(!mqp->err))
+		_mlx5_send_wr_setter_ud(mqp);
+}
+
+static void mlx5_send_wr_set_inline_data_ud(struct ibv_qp_ex *ibqp,
+					    void *addr, size_t length)
+{
+	struct mlx5_qp *mqp = to_mqp((struct ibv_qp *)ibqp);
+
+	if (unlikely(mqp->err))
+		return;
+
+	_mlx5_send_wr_set_inline_data(mqp, addr, length);
+	if (likely(!mqp->err))
+		_mlx5_send_wr_setter_ud(mqp);
+}
+
+static void
+mlx5_send_wr_set_inline_data_list_ud(struct ibv_qp_ex *ibqp, size_t num_buf,
+				     const struct ibv_data_buf *buf_list)
+{
+	struct mlx5_qp *mqp = to_mqp((struct ibv_qp *)ibqp);
+
+	if (unlikely(mqp->err))
+		return;
+
+	_mlx5_send_wr_set_inline_data_list(mqp, num_buf, buf_list);
+	if (likely(!mqp->err))
+		_mlx5_send_wr_setter_ud(mqp);
+}
+
+static void mlx5_send_wr_start(struct ibv_qp_ex *ibqp)
+{
+	struct mlx5_qp *mqp = to_mqp((struct ibv_qp *)ibqp);
+
+	mlx5_spin_lock(&mqp->sq.lock);
+
+	mqp->cur_post_rb = mqp->sq.cur_post;
+	mqp->fm_cache_rb = mqp->fm_cache;
+	mqp->err = 0;
+	mqp->nreq = 0;
+	mqp->inl_wqe = false;
+}
+
+static void mlx5_send_wr_rollback(struct mlx5_qp *mqp)
+{
+	mqp->sq.cur_post = mqp->cur_post_rb;
+	mqp->fm_cache = mqp->fm_cache_rb;
+}
+
+static int mlx5_send_wr_complete(struct ibv_qp_ex *ibqp)
+{
+	struct mlx5_qp *mqp = to_mqp((struct ibv_qp *)ibqp);
+	int err = mqp->err;
+
+	if (unlikely(err))
+		mlx5_send_wr_rollback(mqp);
+	else
+		post_send_db(mqp, mqp->bf, mqp->nreq, mqp->inl_wqe,
+			     mqp->cur_size, mqp->fm_cache, mqp->cur_ctrl);
+
+	mlx5_spin_unlock(&mqp->sq.lock);
+
+	return err;
+}
+
+static void mlx5_send_wr_abort(struct ibv_qp_ex *ibqp)
+{
+	struct mlx5_qp *mqp = to_mqp((struct ibv_qp *)ibqp);
+
+	mlx5_send_wr_rollback(mqp);
+
+	mlx5_spin_unlock(&mqp->sq.lock);
+}
+
+enum {
+	MLX5_SUPPORTED_SEND_OPS_FLAGS_UD =
+		IBV_QP_EX_WITH_SEND |
+		IBV_QP_EX_WITH_SEND_WITH_IMM,
+	MLX5_SUPPORTED_SEND_OPS_FLAGS_UC =
+		MLX5_SUPPORTED_SEND_OPS_FLAGS_UD |
+		IBV_QP_EX_WITH_RDMA_WRITE |
+		IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM,
+	MLX5_SUPPORTED_SEND_OPS_FLAGS_RC =
+		MLX5_SUPPORTED_SEND_OPS_FLAGS_UC |
+		IBV_QP_EX_WITH_RDMA_READ |
+		IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP |
+		IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD,
+};
+
+static void fill_wr_builders_read_atomic(struct ibv_qp_ex *ibqp)
+{
+	ibqp->wr_rdma_read = mlx5_send_wr_rdma_read;
+	ibqp->wr_atomic_cmp_swp = mlx5_send_wr_atomic_cmp_swp;
+	ibqp->wr_atomic_fetch_add = mlx5_send_wr_atomic_fetch_add;
+}
+
+static void fill_wr_builders_write(struct ibv_qp_ex *ibqp)
+{
+	ibqp->wr_rdma_write = mlx5_send_wr_rdma_write;
+	ibqp->wr_rdma_write_imm = mlx5_send_wr_rdma_write_imm;
+}
+
+static void fill_wr_builders_send(struct ibv_qp_ex *ibqp)
+{
+	ibqp->wr_send = mlx5_send_wr_send;
+	ibqp->wr_send_imm = mlx5_send_wr_send_imm;
+}
+
+static void fill_wr_setters_rc_uc(struct ibv_qp_ex *ibqp)
+{
+	ibqp->wr_set_sge = mlx5_send_wr_set_sge_rc_uc;
+	ibqp->wr_set_sge_list = mlx5_send_wr_set_sge_list_rc_uc;
+	ibqp->wr_set_inline_data = mlx5_send_wr_set_inline_data_rc_uc;
+	ibqp->wr_set_inline_data_list = mlx5_send_wr_set_inline_data_list_rc_uc;
+}
+
+static void fill_wr_setters_ud(struct ibv_qp_ex *ibqp)
+{
+	ibqp->wr_set_ud_addr = mlx5_send_wr_set_ud_addr;
+	ibqp->wr_set_sge = mlx5_send_wr_set_sge_ud;
+	ibqp->wr_set_sge_list = mlx5_send_wr_set_sge_list_ud;
+	ibqp->wr_set_inline_data = mlx5_send_wr_set_inline_data_ud;
+	ibqp->wr_set_inline_data_list = mlx5_send_wr_set_inline_data_list_ud;
+}
+
+int mlx5_qp_fill_wr_pfns(struct mlx5_qp *mqp,
+			 const struct ibv_qp_init_attr_ex *attr)
+{
+	struct ibv_qp_ex *ibqp = &mqp->verbs_qp.qp_ex;
+	uint64_t ops = attr->send_ops_flags;
+
+	switch (attr->qp_type) {
+	case IBV_QPT_RC:
+		if (ops & ~MLX5_SUPPORTED_SEND_OPS_FLAGS_RC)
+			return EOPNOTSUPP;
+		fill_wr_builders_read_atomic(ibqp);
+		fill_wr_builders_write(ibqp);
+		fill_wr_builders_send(ibqp);
+		fill_wr_setters_rc_uc(ibqp);
+		break;
+	case IBV_QPT_UC:
+		if (ops & ~MLX5_SUPPORTED_SEND_OPS_FLAGS_UC)
+			return EOPNOTSUPP;
+		fill_wr_builders_write(ibqp);
+		fill_wr_builders_send(ibqp);
+		fill_wr_setters_rc_uc(ibqp);
+		break;
+	case IBV_QPT_UD:
+		if (ops & ~MLX5_SUPPORTED_SEND_OPS_FLAGS_UD ||
+		    mqp->flags & MLX5_QP_FLAGS_USE_UNDERLAY)
+			return EOPNOTSUPP;
+		fill_wr_builders_send(ibqp);
+		fill_wr_setters_ud(ibqp);
+		break;
+	default:
+		return EOPNOTSUPP;
+	}
+
+	ibqp->wr_start = mlx5_send_wr_start;
+	ibqp->wr_complete = mlx5_send_wr_complete;
+	ibqp->wr_abort = mlx5_send_wr_abort;
+
+	return 0;
+}
+
 static void set_sig_seg(struct mlx5_qp *qp, struct mlx5_rwqe_sig *sig,
 			int size, uint16_t idx)
 {
@@ -1559,7 +1559,8 @@ enum {
 					IBV_QP_INIT_ATTR_CREATE_FLAGS |
 					IBV_QP_INIT_ATTR_MAX_TSO_HEADER |
 					IBV_QP_INIT_ATTR_IND_TABLE |
-					IBV_QP_INIT_ATTR_RX_HASH),
+					IBV_QP_INIT_ATTR_RX_HASH |
+					IBV_QP_INIT_ATTR_SEND_OPS_FLAGS),
 };
 
 enum {
@@ -1675,6 +1676,16 @@ static struct ibv_qp *create_qp(struct ibv_context *context,
 		qp->flags |= MLX5_QP_FLAGS_USE_UNDERLAY;
 	}
 
+	if (attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS) {
+		ret = mlx5_qp_fill_wr_pfns(qp, attr);
+		if (ret) {
+			mlx5_dbg(fp, MLX5_DBG_QP,
+				 "Unsupported send_ops_flags for create_qp\n");
+			errno = ret;
+			goto err;
+		}
+	}
+
 	memset(&cmd, 0, sizeof(cmd));
 	memset(&resp, 0, sizeof(resp));
 	memset(&resp_ex, 0, sizeof(resp_ex));
@@ -1871,6 +1882,9 @@ static struct ibv_qp *create_qp(struct ibv_context *context,
 	qp->rsc.rsn = (ctx->cqe_version && !is_xrc_tgt(attr->qp_type)) ?
 		      usr_idx : ibqp->qp_num;
 
+	if (attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS)
+		qp->verbs_qp.comp_mask |= VERBS_QP_EX;
+
 	if (mparent_domain)
 		atomic_fetch_add(&mparent_domain->mpd.refcount, 1);
 	return ibqp;
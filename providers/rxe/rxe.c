@@ -44,6 +44,7 @@
 #include <netinet/in.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <time.h>
 
 #include <endian.h>
 #include <pthread.h>
@@ -156,6 +157,22 @@ static int rxe_dereg_mr(struct verbs_mr *vmr)
 	return 0;
 }
 
+static void rxe_flush_sq_db(struct ibv_context *ibctx);
+
+static int map_cq(struct ibv_context *context, struct rxe_cq *cq,
+		  struct mminfo *mi)
+{
+	cq->queue = mmap(NULL, mi->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 context->cmd_fd, mi->offset);
+	if ((void *)cq->queue == MAP_FAILED)
+		return errno;
+
+	cq->mmap_info = *mi;
+	pthread_spin_init(&cq->lock, PTHREAD_PROCESS_PRIVATE);
+
+	return 0;
+}
+
 static struct ibv_cq *rxe_create_cq(struct ibv_context *context, int cqe,
 				    struct ibv_comp_channel *channel,
 				    int comp_vector)
@@ -164,29 +181,236 @@ static struct ibv_cq *rxe_create_cq(struct ibv_context *context, int cqe,
 	struct urxe_create_cq_resp resp;
 	int ret;
 
-	cq = malloc(sizeof *cq);
+	cq = calloc(1, sizeof *cq);
 	if (!cq) {
 		return NULL;
 	}
 
 	ret = ibv_cmd_create_cq(context, cqe, channel, comp_vector,
-				&cq->ibv_cq, NULL, 0,
+				ibv_cq_ex_to_cq(&cq->ibv_cq), NULL, 0,
 				&resp.ibv_resp, sizeof resp);
 	if (ret) {
 		free(cq);
 		return NULL;
 	}
 
-	cq->queue = mmap(NULL, resp.mi.size, PROT_READ | PROT_WRITE, MAP_SHARED,
-			 context->cmd_fd, resp.mi.offset);
-	if ((void *)cq->queue == MAP_FAILED) {
-		ibv_cmd_destroy_cq(&cq->ibv_cq);
+	ret = map_cq(context, cq, &resp.mi);
+	if (ret) {
+		ibv_cmd_destroy_cq(ibv_cq_ex_to_cq(&cq->ibv_cq));
 		free(cq);
+		errno = ret;
 		return NULL;
 	}
 
-	cq->mmap_info = resp.mi;
-	pthread_spin_init(&cq->lock, PTHREAD_PROCESS_PRIVATE);
+	return ibv_cq_ex_to_cq(&cq->ibv_cq);
+}
+
+/*
+ * The ibv_cq_ex polling calls read completions in place.  Entries are
+ * only released to the kernel by end_poll, so that the accessors may read
+ * the current entry until then.
+ */
+static inline int cq_fetch(struct rxe_cq *cq)
+{
+	struct rxe_queue *q = cq->queue;
+
+	if (cq->cur_index == atomic_load_explicit(&q->producer_index,
+						  memory_order_acquire))
+		return ENOENT;
+
+	cq->wc = addr_from_index(q, cq->cur_index);
+	cq->ibv_cq.wr_id = cq->wc->wr_id;
+	cq->ibv_cq.status = cq->wc->status;
+	cq->cur_index = next_index(q, cq->cur_index);
+
+	return 0;
+}
+
+static int __cq_start_poll(struct rxe_cq *cq)
+{
+	cq->cur_index = atomic_load_explicit(&cq->queue->consumer_index,
+					     memory_order_relaxed);
+	return cq_fetch(cq);
+}
+
+static int cq_start_poll(struct ibv_cq_ex *ibcq,
+			 struct ibv_poll_cq_attr *attr)
+{
+	rxe_flush_sq_db(ibcq->context);
+
+	return __cq_start_poll(to_rcq(ibv_cq_ex_to_cq(ibcq)));
+}
+
+/* The doorbells are rung before the spinlock is taken, see rxe_poll_cq() */
+static int cq_start_poll_lock(struct ibv_cq_ex *ibcq,
+			      struct ibv_poll_cq_attr *attr)
+{
+	struct rxe_cq *cq = to_rcq(ibv_cq_ex_to_cq(ibcq));
+	int ret;
+
+	rxe_flush_sq_db(ibcq->context);
+
+	pthread_spin_lock(&cq->lock);
+	ret = __cq_start_poll(cq);
+	if (ret)
+		pthread_spin_unlock(&cq->lock);
+
+	return ret;
+}
+
+static int cq_next_poll(struct ibv_cq_ex *ibcq)
+{
+	return cq_fetch(to_rcq(ibv_cq_ex_to_cq(ibcq)));
+}
+
+static void cq_end_poll(struct ibv_cq_ex *ibcq)
+{
+	struct rxe_cq *cq = to_rcq(ibv_cq_ex_to_cq(ibcq));
+
+	atomic_store_explicit(&cq->queue->consumer_index, cq->cur_index,
+			      memory_order_release);
+}
+
+static void cq_end_poll_lock(struct ibv_cq_ex *ibcq)
+{
+	struct rxe_cq *cq = to_rcq(ibv_cq_ex_to_cq(ibcq));
+
+	cq_end_poll(ibcq);
+	pthread_spin_unlock(&cq->lock);
+}
+
+static inline struct ibv_wc *cq_cur_wc(struct ibv_cq_ex *ibcq)
+{
+	return to_rcq(ibv_cq_ex_to_cq(ibcq))->wc;
+}
+
+static enum ibv_wc_opcode cq_read_opcode(struct ibv_cq_ex *ibcq)
+{
+	return cq_cur_wc(ibcq)->opcode;
+}
+
+static uint32_t cq_read_vendor_err(struct ibv_cq_ex *ibcq)
+{
+	return cq_cur_wc(ibcq)->vendor_err;
+}
+
+static uint32_t cq_read_byte_len(struct ibv_cq_ex *ibcq)
+{
+	return cq_cur_wc(ibcq)->byte_len;
+}
+
+static __be32 cq_read_imm_data(struct ibv_cq_ex *ibcq)
+{
+	return cq_cur_wc(ibcq)->imm_data;
+}
+
+static uint32_t cq_read_qp_num(struct ibv_cq_ex *ibcq)
+{
+	return cq_cur_wc(ibcq)->qp_num;
+}
+
+static uint32_t cq_read_src_qp(struct ibv_cq_ex *ibcq)
+{
+	return cq_cur_wc(ibcq)->src_qp;
+}
+
+static unsigned int cq_read_wc_flags(struct ibv_cq_ex *ibcq)
+{
+	return cq_cur_wc(ibcq)->wc_flags;
+}
+
+static uint32_t cq_read_slid(struct ibv_cq_ex *ibcq)
+{
+	return cq_cur_wc(ibcq)->slid;
+}
+
+static uint8_t cq_read_sl(struct ibv_cq_ex *ibcq)
+{
+	return cq_cur_wc(ibcq)->sl;
+}
+
+static uint8_t cq_read_dlid_path_bits(struct ibv_cq_ex *ibcq)
+{
+	return cq_cur_wc(ibcq)->dlid_path_bits;
+}
+
+static void rxe_cq_fill_pfns(struct rxe_cq *cq,
+			     struct ibv_cq_init_attr_ex *attr)
+{
+	struct ibv_cq_ex *ibcq = &cq->ibv_cq;
+
+	if (attr->comp_mask & IBV_CQ_INIT_ATTR_MASK_FLAGS &&
+	    attr->flags & IBV_CREATE_CQ_ATTR_SINGLE_THREADED) {
+		ibcq->start_poll = cq_start_poll;
+		ibcq->end_poll = cq_end_poll;
+	} else {
+		ibcq->start_poll = cq_start_poll_lock;
+		ibcq->end_poll = cq_end_poll_lock;
+	}
+	ibcq->next_poll = cq_next_poll;
+
+	ibcq->read_opcode = cq_read_opcode;
+	ibcq->read_vendor_err = cq_read_vendor_err;
+	ibcq->read_wc_flags = cq_read_wc_flags;
+	if (attr->wc_flags & IBV_WC_EX_WITH_BYTE_LEN)
+		ibcq->read_byte_len = cq_read_byte_len;
+	if (attr->wc_flags & IBV_WC_EX_WITH_IMM)
+		ibcq->read_imm_data = cq_read_imm_data;
+	if (attr->wc_flags & IBV_WC_EX_WITH_QP_NUM)
+		ibcq->read_qp_num = cq_read_qp_num;
+	if (attr->wc_flags & IBV_WC_EX_WITH_SRC_QP)
+		ibcq->read_src_qp = cq_read_src_qp;
+	if (attr->wc_flags & IBV_WC_EX_WITH_SLID)
+		ibcq->read_slid = cq_read_slid;
+	if (attr->wc_flags & IBV_WC_EX_WITH_SL)
+		ibcq->read_sl = cq_read_sl;
+	if (attr->wc_flags & IBV_WC_EX_WITH_DLID_PATH_BITS)
+		ibcq->read_dlid_path_bits = cq_read_dlid_path_bits;
+}
+
+static struct ibv_cq_ex *rxe_create_cq_ex(struct ibv_context *context,
+					  struct ibv_cq_init_attr_ex *attr)
+{
+	struct rxe_cq *cq;
+	struct urxe_create_cq_ex cmd = {};
+	struct urxe_create_cq_ex_resp resp = {};
+	int ret;
+
+	if (!check_comp_mask(attr->comp_mask, IBV_CQ_INIT_ATTR_MASK_FLAGS)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* The kernel reports a struct ibv_wc, without timestamps */
+	if (attr->wc_flags & ~IBV_WC_STANDARD_FLAGS ||
+	    (attr->comp_mask & IBV_CQ_INIT_ATTR_MASK_FLAGS &&
+	     attr->flags & ~IBV_CREATE_CQ_ATTR_SINGLE_THREADED)) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+
+	cq = calloc(1, sizeof *cq);
+	if (!cq)
+		return NULL;
+
+	ret = ibv_cmd_create_cq_ex(context, attr, &cq->ibv_cq,
+				   &cmd.ibv_cmd, sizeof cmd,
+				   &resp.ibv_resp, sizeof resp);
+	if (ret) {
+		free(cq);
+		errno = ret;
+		return NULL;
+	}
+
+	ret = map_cq(context, cq, &resp.mi);
+	if (ret) {
+		ibv_cmd_destroy_cq(ibv_cq_ex_to_cq(&cq->ibv_cq));
+		free(cq);
+		errno = ret;
+		return NULL;
+	}
+
+	rxe_cq_fill_pfns(cq, attr);
 
 	return &cq->ibv_cq;
 }
@@ -243,6 +467,13 @@ static int rxe_destroy_cq(struct ibv_cq *ibcq)
 	return 0;
 }
 
+static int rxe_req_notify_cq(struct ibv_cq *ibcq, int solicited_only)
+{
+	rxe_flush_sq_db(ibcq->context);
+
+	return ibv_cmd_req_notify_cq(ibcq, solicited_only);
+}
+
 static int rxe_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
 {
 	struct rxe_cq *cq = to_rcq(ibcq);
@@ -250,6 +481,8 @@ static int rxe_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
 	int npolled;
 	uint8_t *src;
 
+	rxe_flush_sq_db(ibcq->context);
+
 	pthread_spin_lock(&cq->lock);
 	q = cq->queue;
 
@@ -434,62 +667,638 @@ static int rxe_post_srq_recv(struct ibv_srq *ibvsrq,
 	return rc;
 }
 
-static struct ibv_qp *rxe_create_qp(struct ibv_pd *pd,
-				    struct ibv_qp_init_attr *attr)
+/* send a null post send as a doorbell */
+static int post_send_db(struct ibv_qp *ibqp)
 {
-	struct ibv_create_qp cmd;
-	struct urxe_create_qp_resp resp;
-	struct rxe_qp *qp;
-	int ret;
+	struct ibv_post_send cmd;
+	struct ib_uverbs_post_send_resp resp;
 
-	qp = malloc(sizeof *qp);
-	if (!qp) {
+	cmd.hdr.command	= IB_USER_VERBS_CMD_POST_SEND;
+	cmd.hdr.in_words = sizeof(cmd) / 4;
+	cmd.hdr.out_words = sizeof(resp) / 4;
+	cmd.response	= (uintptr_t)&resp;
+	cmd.qp_handle	= ibqp->handle;
+	cmd.wr_count	= 0;
+	cmd.sge_count	= 0;
+	cmd.wqe_size	= sizeof(struct ibv_send_wr);
+
+	verbs_stats_add(ibqp->context, VERBS_STATS_DOORBELL, 1);
+	if (write(ibqp->context->cmd_fd, &cmd, sizeof(cmd)) != sizeof(cmd))
+		return errno;
+
+	return 0;
+}
+
+/*
+ * The doorbell is a system call that runs the kernel requester.  When
+ * RXE_DEFER_DOORBELL is set and the send queue still held work requests
+ * before this post, the doorbell is deferred.  Deferred doorbells of the
+ * context are rung together by the next CQ poll or notification request,
+ * so posts made between two polls cost one system call.
+ *
+ * A non-empty send queue does not mean that the requester is running, so
+ * nothing else may ring a deferred doorbell.  rxe_db_thread() rings the
+ * doorbells that are still deferred RXE_DB_DEFER_US after the first one.
+ */
+static int rxe_ring_sq_db(struct rxe_qp *qp, bool busy)
+{
+	struct rxe_context *ctx = to_rctx(qp->vqp.qp.context);
+
+	if (!busy || !ctx->defer_db)
+		return post_send_db(&qp->vqp.qp);
+
+	verbs_stats_add(&ctx->ibv_ctx.context, ctx->stats_deferred_db, 1);
+
+	pthread_mutex_lock(&ctx->db_mutex);
+	if (!qp->db_pending) {
+		if (list_empty(&ctx->db_list))
+			pthread_cond_signal(&ctx->db_cond);
+		qp->db_pending = true;
+		list_add_tail(&ctx->db_list, &qp->db_entry);
+		atomic_store_explicit(&ctx->db_pending, true,
+				      memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&ctx->db_mutex);
+
+	return 0;
+}
+
+/* Caller holds db_mutex */
+static void __rxe_flush_sq_db(struct rxe_context *ctx)
+{
+	struct rxe_qp *qp, *tmp;
+
+	atomic_store_explicit(&ctx->db_pending, false, memory_order_relaxed);
+	list_for_each_safe(&ctx->db_list, qp, tmp, db_entry) {
+		list_del(&qp->db_entry);
+		qp->db_pending = false;
+		post_send_db(&qp->vqp.qp);
+	}
+}
+
+static void rxe_flush_sq_db(struct ibv_context *ibctx)
+{
+	struct rxe_context *ctx = to_rctx(ibctx);
+
+	if (!atomic_load_explicit(&ctx->db_pending, memory_order_relaxed))
+		return;
+
+	pthread_mutex_lock(&ctx->db_mutex);
+	__rxe_flush_sq_db(ctx);
+	pthread_mutex_unlock(&ctx->db_mutex);
+}
+
+static void *rxe_db_thread(void *arg)
+{
+	struct rxe_context *ctx = arg;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&ctx->db_mutex);
+	while (!ctx->db_stop) {
+		if (list_empty(&ctx->db_list)) {
+			pthread_cond_wait(&ctx->db_cond, &ctx->db_mutex);
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_nsec += RXE_DB_DEFER_US * 1000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		while (!ctx->db_stop && !list_empty(&ctx->db_list) &&
+		       pthread_cond_timedwait(&ctx->db_cond, &ctx->db_mutex,
+					      &deadline) != ETIMEDOUT)
+			;
+		__rxe_flush_sq_db(ctx);
+	}
+	pthread_mutex_unlock(&ctx->db_mutex);
+
+	return NULL;
+}
+
+static void rxe_start_db_thread(struct rxe_context *ctx)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ctx->db_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (ctx->defer_db &&
+	    pthread_create(&ctx->db_thread, NULL, rxe_db_thread, ctx))
+		ctx->defer_db = false;
+}
+
+static void rxe_stop_db_thread(struct rxe_context *ctx)
+{
+	if (ctx->defer_db) {
+		pthread_mutex_lock(&ctx->db_mutex);
+		ctx->db_stop = true;
+		pthread_cond_signal(&ctx->db_cond);
+		pthread_mutex_unlock(&ctx->db_mutex);
+		pthread_join(ctx->db_thread, NULL);
+	}
+
+	pthread_cond_destroy(&ctx->db_cond);
+}
+
+/*
+ * The ibv_qp_ex calls build each WQE in place at the producer end of the
+ * send queue.  An opcode call claims the next slot and the setters that
+ * follow fill in its address and data.  The producer index is published,
+ * and the kernel told, only when wr_complete() finds no error.
+ */
+static inline struct rxe_qp *ex_to_rqp(struct ibv_qp_ex *ibqp)
+{
+	return container_of(ibqp, struct rxe_qp, vqp.qp_ex);
+}
+
+static struct rxe_send_wqe *init_ex_wqe(struct ibv_qp_ex *ibqp,
+					enum ibv_wr_opcode opcode)
+{
+	struct rxe_qp *qp = ex_to_rqp(ibqp);
+	struct rxe_queue *q = qp->sq.queue;
+	struct rxe_send_wqe *wqe;
+
+	if (qp->err)
+		return NULL;
+
+	if (((qp->cur_index + 1 - atomic_load(&q->consumer_index)) &
+	     q->index_mask) == 0) {
+		qp->err = ENOMEM;
 		return NULL;
 	}
 
-	ret = ibv_cmd_create_qp(pd, &qp->ibv_qp, attr, &cmd, sizeof cmd,
-				&resp.ibv_resp, sizeof resp);
-	if (ret) {
-		free(qp);
+	wqe = addr_from_index(q, qp->cur_index);
+	memset(wqe, 0, sizeof(*wqe));
+
+	wqe->wr.wr_id = ibqp->wr_id;
+	wqe->wr.opcode = opcode;
+	/* Inline data is chosen by the setter, not by wr_flags */
+	wqe->wr.send_flags = ibqp->wr_flags & ~IBV_SEND_INLINE;
+	wqe->ssn = qp->ssn++;
+
+	qp->cur_index = next_index(q, qp->cur_index);
+	return wqe;
+}
+
+/* The WQE that the setters apply to, or NULL after an error */
+static struct rxe_send_wqe *cur_ex_wqe(struct rxe_qp *qp)
+{
+	if (qp->err)
 		return NULL;
+
+	return addr_from_index(qp->sq.queue, qp->cur_index - 1);
+}
+
+static void wr_send(struct ibv_qp_ex *ibqp)
+{
+	init_ex_wqe(ibqp, IBV_WR_SEND);
+}
+
+static void wr_send_imm(struct ibv_qp_ex *ibqp, __be32 imm_data)
+{
+	struct rxe_send_wqe *wqe = init_ex_wqe(ibqp, IBV_WR_SEND_WITH_IMM);
+
+	if (wqe)
+		wqe->wr.ex.imm_data = imm_data;
+}
+
+static void init_ex_rdma(struct ibv_qp_ex *ibqp, enum ibv_wr_opcode opcode,
+			 uint32_t rkey, uint64_t remote_addr, __be32 imm_data)
+{
+	struct rxe_send_wqe *wqe = init_ex_wqe(ibqp, opcode);
+
+	if (!wqe)
+		return;
+
+	wqe->wr.ex.imm_data = imm_data;
+	wqe->wr.wr.rdma.remote_addr = remote_addr;
+	wqe->wr.wr.rdma.rkey = rkey;
+	wqe->iova = remote_addr;
+}
+
+static void wr_rdma_write(struct ibv_qp_ex *ibqp, uint32_t rkey,
+			  uint64_t remote_addr)
+{
+	init_ex_rdma(ibqp, IBV_WR_RDMA_WRITE, rkey, remote_addr, 0);
+}
+
+static void wr_rdma_write_imm(struct ibv_qp_ex *ibqp, uint32_t rkey,
+			      uint64_t remote_addr, __be32 imm_data)
+{
+	init_ex_rdma(ibqp, IBV_WR_RDMA_WRITE_WITH_IMM, rkey, remote_addr,
+		     imm_data);
+}
+
+static void wr_rdma_read(struct ibv_qp_ex *ibqp, uint32_t rkey,
+			 uint64_t remote_addr)
+{
+	init_ex_rdma(ibqp, IBV_WR_RDMA_READ, rkey, remote_addr, 0);
+}
+
+static void init_ex_atomic(struct ibv_qp_ex *ibqp, enum ibv_wr_opcode opcode,
+			   uint32_t rkey, uint64_t remote_addr,
+			   uint64_t compare_add, uint64_t swap)
+{
+	struct rxe_qp *qp = ex_to_rqp(ibqp);
+	struct rxe_send_wqe *wqe;
+
+	if (remote_addr & 0x7) {
+		if (!qp->err)
+			qp->err = EINVAL;
+		return;
+	}
+
+	wqe = init_ex_wqe(ibqp, opcode);
+	if (!wqe)
+		return;
+
+	wqe->wr.wr.atomic.remote_addr = remote_addr;
+	wqe->wr.wr.atomic.compare_add = compare_add;
+	wqe->wr.wr.atomic.swap = swap;
+	wqe->wr.wr.atomic.rkey = rkey;
+	wqe->iova = remote_addr;
+}
+
+static void wr_atomic_cmp_swp(struct ibv_qp_ex *ibqp, uint32_t rkey,
+			      uint64_t remote_addr, uint64_t compare,
+			      uint64_t swap)
+{
+	init_ex_atomic(ibqp, IBV_WR_ATOMIC_CMP_AND_SWP, rkey, remote_addr,
+		       compare, swap);
+}
+
+static void wr_atomic_fetch_add(struct ibv_qp_ex *ibqp, uint32_t rkey,
+				uint64_t remote_addr, uint64_t add)
+{
+	init_ex_atomic(ibqp, IBV_WR_ATOMIC_FETCH_AND_ADD, rkey, remote_addr,
+		       add, 0);
+}
+
+static void wr_set_ud_addr(struct ibv_qp_ex *ibqp, struct ibv_ah *ah,
+			   uint32_t remote_qpn, uint32_t remote_qkey)
+{
+	struct rxe_send_wqe *wqe = cur_ex_wqe(ex_to_rqp(ibqp));
+
+	if (!wqe)
+		return;
+
+	memcpy(&wqe->av, &to_rah(ah)->av, sizeof(wqe->av));
+	wqe->wr.wr.ud.remote_qpn = remote_qpn;
+	wqe->wr.wr.ud.remote_qkey = remote_qkey;
+}
+
+static void set_ex_length(struct rxe_send_wqe *wqe, uint32_t length,
+			  uint32_t num_sge)
+{
+	wqe->dma.length = length;
+	wqe->dma.resid = length;
+	wqe->dma.num_sge = num_sge;
+}
+
+static int check_ex_atomic_length(struct rxe_qp *qp,
+				  struct rxe_send_wqe *wqe, uint32_t length)
+{
+	if ((wqe->wr.opcode == IBV_WR_ATOMIC_CMP_AND_SWP ||
+	     wqe->wr.opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) && length < 8) {
+		qp->err = EINVAL;
+		return qp->err;
 	}
 
+	return 0;
+}
+
+static void wr_set_sge(struct ibv_qp_ex *ibqp, uint32_t lkey, uint64_t addr,
+		       uint32_t length)
+{
+	struct rxe_qp *qp = ex_to_rqp(ibqp);
+	struct rxe_send_wqe *wqe = cur_ex_wqe(qp);
+
+	if (!wqe || check_ex_atomic_length(qp, wqe, length))
+		return;
+
+	if (!length)
+		return;
+
+	wqe->dma.sge[0].addr = addr;
+	wqe->dma.sge[0].length = length;
+	wqe->dma.sge[0].lkey = lkey;
+	set_ex_length(wqe, length, 1);
+}
+
+static void wr_set_sge_list(struct ibv_qp_ex *ibqp, size_t num_sge,
+			    const struct ibv_sge *sg_list)
+{
+	struct rxe_qp *qp = ex_to_rqp(ibqp);
+	struct rxe_send_wqe *wqe = cur_ex_wqe(qp);
+	uint32_t length = 0;
+	size_t i;
+
+	if (!wqe)
+		return;
+
+	if (num_sge > qp->sq.max_sge) {
+		qp->err = EINVAL;
+		return;
+	}
+
+	for (i = 0; i < num_sge; i++) {
+		wqe->dma.sge[i].addr = sg_list[i].addr;
+		wqe->dma.sge[i].length = sg_list[i].length;
+		wqe->dma.sge[i].lkey = sg_list[i].lkey;
+		length += sg_list[i].length;
+	}
+
+	if (check_ex_atomic_length(qp, wqe, length))
+		return;
+
+	set_ex_length(wqe, length, num_sge);
+}
+
+static void wr_set_inline_data(struct ibv_qp_ex *ibqp, void *addr,
+			       size_t length)
+{
+	struct rxe_qp *qp = ex_to_rqp(ibqp);
+	struct rxe_send_wqe *wqe = cur_ex_wqe(qp);
+
+	if (!wqe)
+		return;
+
+	if (length > qp->sq.max_inline) {
+		qp->err = ENOMEM;
+		return;
+	}
+
+	memcpy(wqe->dma.inline_data, addr, length);
+	wqe->wr.send_flags |= IBV_SEND_INLINE;
+	set_ex_length(wqe, length, 0);
+}
+
+static void wr_set_inline_data_list(struct ibv_qp_ex *ibqp, size_t num_buf,
+				    const struct ibv_data_buf *buf_list)
+{
+	struct rxe_qp *qp = ex_to_rqp(ibqp);
+	struct rxe_send_wqe *wqe = cur_ex_wqe(qp);
+	uint8_t *inline_data;
+	size_t length = 0;
+	size_t i;
+
+	if (!wqe)
+		return;
+
+	inline_data = wqe->dma.inline_data;
+	for (i = 0; i < num_buf; i++) {
+		length += buf_list[i].length;
+		if (length > qp->sq.max_inline) {
+			qp->err = ENOMEM;
+			return;
+		}
+
+		memcpy(inline_data, buf_list[i].addr, buf_list[i].length);
+		inline_data += buf_list[i].length;
+	}
+
+	wqe->wr.send_flags |= IBV_SEND_INLINE;
+	set_ex_length(wqe, length, 0);
+}
+
+static void wr_start(struct ibv_qp_ex *ibqp)
+{
+	struct rxe_qp *qp = ex_to_rqp(ibqp);
+
+	pthread_spin_lock(&qp->sq.lock);
+
+	qp->err = 0;
+	qp->ssn_rb = qp->ssn;
+	qp->cur_index = atomic_load_explicit(&qp->sq.queue->producer_index,
+					     memory_order_relaxed);
+}
+
+static int wr_complete(struct ibv_qp_ex *ibqp)
+{
+	struct rxe_qp *qp = ex_to_rqp(ibqp);
+	int err = qp->err;
+	bool busy;
+
+	if (err) {
+		qp->ssn = qp->ssn_rb;
+		pthread_spin_unlock(&qp->sq.lock);
+		return err;
+	}
+
+	if (qp->ssn == qp->ssn_rb) {
+		pthread_spin_unlock(&qp->sq.lock);
+		return 0;
+	}
+
+	busy = !queue_empty(qp->sq.queue);
+	atomic_thread_fence(memory_order_release);
+	atomic_store(&qp->sq.queue->producer_index, qp->cur_index);
+
+	pthread_spin_unlock(&qp->sq.lock);
+
+	return rxe_ring_sq_db(qp, busy);
+}
+
+static void wr_abort(struct ibv_qp_ex *ibqp)
+{
+	struct rxe_qp *qp = ex_to_rqp(ibqp);
+
+	qp->ssn = qp->ssn_rb;
+	pthread_spin_unlock(&qp->sq.lock);
+}
+
+enum {
+	RXE_SUP_UD_QP_SEND_OPS_FLAGS =
+		IBV_QP_EX_WITH_SEND |
+		IBV_QP_EX_WITH_SEND_WITH_IMM,
+	RXE_SUP_UC_QP_SEND_OPS_FLAGS =
+		RXE_SUP_UD_QP_SEND_OPS_FLAGS |
+		IBV_QP_EX_WITH_RDMA_WRITE |
+		IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM,
+	RXE_SUP_RC_QP_SEND_OPS_FLAGS =
+		RXE_SUP_UC_QP_SEND_OPS_FLAGS |
+		IBV_QP_EX_WITH_RDMA_READ |
+		IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP |
+		IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD,
+};
+
+static int rxe_qp_fill_wr_pfns(struct rxe_qp *qp,
+			       struct ibv_qp_init_attr_ex *attr)
+{
+	struct ibv_qp_ex *ibqp = &qp->vqp.qp_ex;
+	uint64_t sup;
+
+	switch (attr->qp_type) {
+	case IBV_QPT_RC:
+		sup = RXE_SUP_RC_QP_SEND_OPS_FLAGS;
+		break;
+	case IBV_QPT_UC:
+		sup = RXE_SUP_UC_QP_SEND_OPS_FLAGS;
+		break;
+	case IBV_QPT_UD:
+		sup = RXE_SUP_UD_QP_SEND_OPS_FLAGS;
+		break;
+	default:
+		return EOPNOTSUPP;
+	}
+
+	if (attr->send_ops_flags & ~sup)
+		return EOPNOTSUPP;
+
+	ibqp->wr_send = wr_send;
+	ibqp->wr_send_imm = wr_send_imm;
+	if (attr->qp_type != IBV_QPT_UD) {
+		ibqp->wr_rdma_write = wr_rdma_write;
+		ibqp->wr_rdma_write_imm = wr_rdma_write_imm;
+	}
+	if (attr->qp_type == IBV_QPT_RC) {
+		ibqp->wr_rdma_read = wr_rdma_read;
+		ibqp->wr_atomic_cmp_swp = wr_atomic_cmp_swp;
+		ibqp->wr_atomic_fetch_add = wr_atomic_fetch_add;
+	}
+	if (attr->qp_type == IBV_QPT_UD)
+		ibqp->wr_set_ud_addr = wr_set_ud_addr;
+
+	ibqp->wr_set_sge = wr_set_sge;
+	ibqp->wr_set_sge_list = wr_set_sge_list;
+	ibqp->wr_set_inline_data = wr_set_inline_data;
+	ibqp->wr_set_inline_data_list = wr_set_inline_data_list;
+	ibqp->wr_start = wr_start;
+	ibqp->wr_complete = wr_complete;
+	ibqp->wr_abort = wr_abort;
+
+	return 0;
+}
+
+static int map_queue_pair(int cmd_fd, struct rxe_qp *qp,
+			  struct ibv_qp_init_attr *attr,
+			  struct rxe_create_qp_resp *resp)
+{
 	if (attr->srq) {
 		qp->rq.max_sge = 0;
 		qp->rq.queue = NULL;
 		qp->rq_mmap_info.size = 0;
 	} else {
 		qp->rq.max_sge = attr->cap.max_recv_sge;
-		qp->rq.queue = mmap(NULL, resp.rq_mi.size, PROT_READ | PROT_WRITE,
+		qp->rq.queue = mmap(NULL, resp->rq_mi.size, PROT_READ | PROT_WRITE,
 				    MAP_SHARED,
-				    pd->context->cmd_fd, resp.rq_mi.offset);
-		if ((void *)qp->rq.queue == MAP_FAILED) {
-			ibv_cmd_destroy_qp(&qp->ibv_qp);
-			free(qp);
-			return NULL;
-		}
+				    cmd_fd, resp->rq_mi.offset);
+		if ((void *)qp->rq.queue == MAP_FAILED)
+			return errno;
 
-		qp->rq_mmap_info = resp.rq_mi;
+		qp->rq_mmap_info = resp->rq_mi;
 		pthread_spin_init(&qp->rq.lock, PTHREAD_PROCESS_PRIVATE);
 	}
 
 	qp->sq.max_sge = attr->cap.max_send_sge;
 	qp->sq.max_inline = attr->cap.max_inline_data;
-	qp->sq.queue = mmap(NULL, resp.sq_mi.size, PROT_READ | PROT_WRITE,
+	qp->sq.queue = mmap(NULL, resp->sq_mi.size, PROT_READ | PROT_WRITE,
 			    MAP_SHARED,
-			    pd->context->cmd_fd, resp.sq_mi.offset);
+			    cmd_fd, resp->sq_mi.offset);
 	if ((void *)qp->sq.queue == MAP_FAILED) {
 		if (qp->rq_mmap_info.size)
 			munmap(qp->rq.queue, qp->rq_mmap_info.size);
-		ibv_cmd_destroy_qp(&qp->ibv_qp);
+		return errno;
+	}
+
+	qp->sq_mmap_info = resp->sq_mi;
+	pthread_spin_init(&qp->sq.lock, PTHREAD_PROCESS_PRIVATE);
+
+	return 0;
+}
+
+static struct ibv_qp *rxe_create_qp(struct ibv_pd *pd,
+				    struct ibv_qp_init_attr *attr)
+{
+	struct ibv_create_qp cmd;
+	struct urxe_create_qp_resp resp;
+	struct rxe_qp *qp;
+	int ret;
+
+	qp = calloc(1, sizeof *qp);
+	if (!qp) {
+		return NULL;
+	}
+
+	ret = ibv_cmd_create_qp(pd, &qp->vqp.qp, attr, &cmd, sizeof cmd,
+				&resp.ibv_resp, sizeof resp);
+	if (ret) {
 		free(qp);
 		return NULL;
 	}
 
-	qp->sq_mmap_info = resp.sq_mi;
-	pthread_spin_init(&qp->sq.lock, PTHREAD_PROCESS_PRIVATE);
+	ret = map_queue_pair(pd->context->cmd_fd, qp, attr, &resp.drv_payload);
+	if (ret) {
+		ibv_cmd_destroy_qp(&qp->vqp.qp);
+		free(qp);
+		return NULL;
+	}
 
-	return &qp->ibv_qp;
+	return &qp->vqp.qp;
+}
+
+enum {
+	RXE_QP_COMP_MASK_SUP = IBV_QP_INIT_ATTR_PD |
+			       IBV_QP_INIT_ATTR_SEND_OPS_FLAGS,
+};
+
+static struct ibv_qp *rxe_create_qp_ex(struct ibv_context *context,
+				       struct ibv_qp_init_attr_ex *attr)
+{
+	struct ibv_create_qp cmd;
+	struct urxe_create_qp_resp resp;
+	struct rxe_qp *qp;
+	int ret;
+
+	if (attr->comp_mask & ~RXE_QP_COMP_MASK_SUP ||
+	    !(attr->comp_mask & IBV_QP_INIT_ATTR_PD)) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+
+	qp = calloc(1, sizeof *qp);
+	if (!qp)
+		return NULL;
+
+	if (attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS) {
+		ret = rxe_qp_fill_wr_pfns(qp, attr);
+		if (ret) {
+			errno = ret;
+			goto err_free;
+		}
+	}
+
+	ret = ibv_cmd_create_qp_ex(context, &qp->vqp, sizeof(qp->vqp), attr,
+				   &cmd, sizeof cmd,
+				   &resp.ibv_resp, sizeof resp);
+	if (ret) {
+		errno = ret;
+		goto err_free;
+	}
+
+	ret = map_queue_pair(context->cmd_fd, qp,
+			     (struct ibv_qp_init_attr *)attr,
+			     &resp.drv_payload);
+	if (ret) {
+		errno = ret;
+		goto err_destroy;
+	}
+
+	if (attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS)
+		qp->vqp.comp_mask |= VERBS_QP_EX;
+
+	return &qp->vqp.qp;
+
+err_destroy:
+	ibv_cmd_destroy_qp(&qp->vqp.qp);
+err_free:
+	free(qp);
+	return NULL;
 }
 
 static int rxe_query_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
@@ -518,6 +1327,13 @@ static int rxe_destroy_qp(struct ibv_qp *ibv_qp)
 
 	ret = ibv_cmd_destroy_qp(ibv_qp);
 	if (!ret) {
+		struct rxe_context *ctx = to_rctx(ibv_qp->context);
+
+		pthread_mutex_lock(&ctx->db_mutex);
+		if (qp->db_pending)
+			list_del(&qp->db_entry);
+		pthread_mutex_unlock(&ctx->db_mutex);
+
 		if (qp->rq_mmap_info.size)
 			munmap(qp->rq.queue, qp->rq_mmap_info.size);
 		if (qp->sq_mmap_info.size)
@@ -663,27 +1479,6 @@ static int post_one_send(struct rxe_qp *qp, struct rxe_wq *sq,
 	return 0;
 }
 
-/* send a null post send as a doorbell */
-static int post_send_db(struct ibv_qp *ibqp)
-{
-	struct ibv_post_send cmd;
-	struct ib_uverbs_post_send_resp resp;
-
-	cmd.hdr.command	= IB_USER_VERBS_CMD_POST_SEND;
-	cmd.hdr.in_words = sizeof(cmd) / 4;
-	cmd.hdr.out_words = sizeof(resp) / 4;
-	cmd.response	= (uintptr_t)&resp;
-	cmd.qp_handle	= ibqp->handle;
-	cmd.wr_count	= 0;
-	cmd.sge_count	= 0;
-	cmd.wqe_size	= sizeof(struct ibv_send_wr);
-
-	if (write(ibqp->context->cmd_fd, &cmd, sizeof(cmd)) != sizeof(cmd))
-		return errno;
-
-	return 0;
-}
-
 /* this API does not make a distinction between
    restartable and non-restartable errors */
 static int rxe_post_send(struct ibv_qp *ibqp,
@@ -694,6 +1489,8 @@ static int rxe_post_send(struct ibv_qp *ibqp,
 	int err;
 	struct rxe_qp *qp = to_rqp(ibqp);
 	struct rxe_wq *sq = &qp->sq;
+	unsigned int posted = 0;
+	bool busy;
 
 	if (!bad_wr)
 		return EINVAL;
@@ -705,6 +1502,7 @@ static int rxe_post_send(struct ibv_qp *ibqp,
 
 	pthread_spin_lock(&sq->lock);
 
+	busy = !queue_empty(sq->queue);
 	while (wr_list) {
 		rc = post_one_send(qp, sq, wr_list);
 		if (rc) {
@@ -712,12 +1510,16 @@ static int rxe_post_send(struct ibv_qp *ibqp,
 			break;
 		}
 
+		posted++;
 		wr_list = wr_list->next;
 	}
 
 	pthread_spin_unlock(&sq->lock);
 
-	err =  post_send_db(ibqp);
+	if (!posted)
+		return rc;
+
+	err = rxe_ring_sq_db(qp, busy);
 	return err ? err : rc;
 }
 
@@ -833,8 +1635,9 @@ static const struct verbs_context_ops rxe_ctx_ops = {
 	.reg_mr = rxe_reg_mr,
 	.dereg_mr = rxe_dereg_mr,
 	.create_cq = rxe_create_cq,
+	.create_cq_ex = rxe_create_cq_ex,
 	.poll_cq = rxe_poll_cq,
-	.req_notify_cq = ibv_cmd_req_notify_cq,
+	.req_notify_cq = rxe_req_notify_cq,
 	.resize_cq = rxe_resize_cq,
 	.destroy_cq = rxe_destroy_cq,
 	.create_srq = rxe_create_srq,
@@ -843,6 +1646,7 @@ static const struct verbs_context_ops rxe_ctx_ops = {
 	.destroy_srq = rxe_destroy_srq,
 	.post_srq_recv = rxe_post_srq_recv,
 	.create_qp = rxe_create_qp,
+	.create_qp_ex = rxe_create_qp_ex,
 	.query_qp = rxe_query_qp,
 	.modify_qp = rxe_modify_qp,
 	.destroy_qp = rxe_destroy_qp,
@@ -872,6 +1676,14 @@ static struct verbs_context *rxe_alloc_context(struct ibv_device *ibdev,
 
 	verbs_set_ops(&context->ibv_ctx, &rxe_ctx_ops);
 
+	context->defer_db = !!getenv("RXE_DEFER_DOORBELL");
+	context->stats_deferred_db =
+		verbs_stats_register(&context->ibv_ctx.context,
+				     "deferred_doorbell");
+	pthread_mutex_init(&context->db_mutex, NULL);
+	list_head_init(&context->db_list);
+	rxe_start_db_thread(context);
+
 	return &context->ibv_ctx;
 
 out:
@@ -884,6 +1696,8 @@ static void rxe_free_context(struct ibv_context *ibctx)
 {
 	struct rxe_context *context = to_rctx(ibctx);
 
+	rxe_stop_db_thread(context);
+	pthread_mutex_destroy(&context->db_mutex);
 	verbs_uninit_context(&context->ibv_ctx);
 	free(context);
 }
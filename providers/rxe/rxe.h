@@ -37,6 +37,9 @@
 #define RXE_H
 
 #include <infiniband/driver.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <ccan/list.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <rdma/rdma_user_rxe.h> /* struct rxe_av */
@@ -53,15 +56,30 @@ struct rxe_device {
 	int	abi_version;
 };
 
+/* Longest time that RXE_DEFER_DOORBELL may hold back a doorbell */
+#define RXE_DB_DEFER_US		50
+
 struct rxe_context {
 	struct verbs_context	ibv_ctx;
+	/* QPs with a deferred send queue doorbell, see rxe_ring_sq_db() */
+	bool			defer_db;
+	_Atomic(bool)		db_pending;
+	pthread_mutex_t		db_mutex;
+	struct list_head	db_list;
+	pthread_cond_t		db_cond;
+	pthread_t		db_thread;
+	bool			db_stop;
+	int			stats_deferred_db;
 };
 
 struct rxe_cq {
-	struct ibv_cq		ibv_cq;
+	struct ibv_cq_ex	ibv_cq;
 	struct mminfo		mmap_info;
 	struct rxe_queue		*queue;
 	pthread_spinlock_t	lock;
+	/* Completion read by the ibv_cq_ex accessors, and the next index */
+	struct ibv_wc		*wc;
+	uint32_t		cur_index;
 };
 
 struct rxe_ah {
@@ -77,15 +95,24 @@ struct rxe_wq {
 };
 
 struct rxe_qp {
-	struct ibv_qp		ibv_qp;
+	struct verbs_qp		vqp;
 	struct mminfo		rq_mmap_info;
 	struct rxe_wq		rq;
 	struct mminfo		sq_mmap_info;
 	struct rxe_wq		sq;
 	unsigned int		ssn;
+
+	/* State of the batch built through struct ibv_qp_ex */
+	uint32_t		cur_index;
+	unsigned int		ssn_rb;
+	int			err;
+
+	/* Protected by rxe_context.db_mutex */
+	bool			db_pending;
+	struct list_node	db_entry;
 };
 
-#define qp_type(qp)		((qp)->ibv_qp.qp_type)
+#define qp_type(qp)		((qp)->vqp.qp.qp_type)
 
 struct rxe_srq {
 	struct ibv_srq		ibv_srq;
@@ -108,12 +135,12 @@ static inline struct rxe_device *to_rdev(struct ibv_device *ibdev)
 
 static inline struct rxe_cq *to_rcq(struct ibv_cq *ibcq)
 {
-	return to_rxxx(cq, cq);
+	return container_of((struct ibv_cq_ex *)ibcq, struct rxe_cq, ibv_cq);
 }
 
 static inline struct rxe_qp *to_rqp(struct ibv_qp *ibqp)
 {
-	return to_rxxx(qp, qp);
+	return container_of(ibqp, struct rxe_qp, vqp.qp);
 }
 
 static inline struct rxe_srq *to_rsrq(struct ibv_srq *ibsrq)
@@ -64,6 +64,7 @@
 #include <infiniband/umad.h>
 #include <infiniband/umad_types.h>
 #include <infiniband/umad_sa.h>
+#include <ccan/list.h>
 #include "srp_ib_types.h"
 
 #include "srp_daemon.h"
@@ -217,7 +218,7 @@ static int srpd_sys_read_uint64(const char *dir_name, const char *file_name,
 
 static void usage(const char *argv0)
 {
-	fprintf(stderr, "Usage: %s [-vVcaeon] [-d <umad device> | -i <infiniband device> [-p <port_num>]] [-t <timeout (ms)>] [-r <retries>] [-R <rescan time>] [-f <rules file>\n", argv0);
+	fprintf(stderr, "Usage: %s [-vVcaeon] [-d <umad device> | -i <infiniband device> [-p <port_num>]] [-t <timeout (ms)>] [-r <retries>] [-w <window>] [-R <rescan time>] [-f <rules file>] [-C <cache file>]\n", argv0);
 	fprintf(stderr, "-v 			Verbose\n");
 	fprintf(stderr, "-V 			debug Verbose\n");
 	fprintf(stderr, "-c 			prints connection Commands\n");
@@ -232,35 +233,15 @@ static void usage(const char *argv0)
 	fprintf(stderr, "-T <retry timeout>	Retries to connect to existing target after Timeout of <retry timeout> seconds\n");
 	fprintf(stderr, "-l <tl_retry timeout>	Transport retry count before failing IO. should be in range [2..7], (default 2)\n");
 	fprintf(stderr, "-f <rules file>	use rules File to set to which target(s) to connect (default: " SRP_DEAMON_CONFIG_FILE ")\n");
+	fprintf(stderr, "-C <cache file>	keep the target Cache in <cache file> across restarts\n");
 	fprintf(stderr, "-t <timeout>		Timeout for mad response in milliseconds\n");
 	fprintf(stderr, "-r <retries>		number of send Retries for each mad\n");
+	fprintf(stderr, "-w <window>		number of mads in flight during a rescan (default 16)\n");
 	fprintf(stderr, "-n 			New connection command format - use also initiator extension\n");
 	fprintf(stderr, "--systemd		Enable systemd integration.\n");
 	fprintf(stderr, "\nExample: srp_daemon -e -n -i mthca0 -p 1 -R 60\n");
 }
 
-static int
-check_equal_uint64(char *dir_name, const char *attr, uint64_t val)
-{
-	uint64_t attr_value;
-
-	if (srpd_sys_read_uint64(dir_name, attr, &attr_value))
-		return 0;
-
-	return attr_value == val;
-}
-
-static int
-check_equal_uint16(char *dir_name, const char *attr, uint16_t val)
-{
-	uint64_t attr_value;
-
-	if (srpd_sys_read_uint64(dir_name, attr, &attr_value))
-		return 0;
-
-	return val == (attr_value & 0xffff);
-}
-
 static int recalc(struct resources *res);
 
 static void pr_cmd(char *target_str, int not_connected)
@@ -399,80 +380,200 @@ static int is_enabled_by_rules_file(struct target_details *target)
 
 
 
-static int add_non_exist_target(struct target_details *target)
+/*
+ * An SRP host of the local port, as found under /sys/class/scsi_host.  A scan
+ * reads all hosts once into a list sorted by id_ext instead of walking the
+ * directory again for every target that it finds.
+ */
+struct srp_host {
+	uint64_t		id_ext;
+	uint64_t		service_id;
+	uint64_t		ioc_guid;
+	union umad_gid		dgid;
+	uint16_t		pkey;
+	bool			has_pkey;
+};
+
+struct srp_hosts {
+	struct srp_host	       *hosts;
+	int			num;
+	int			size;
+};
+
+/* Returns 0 if dir_name is an SRP host of the local port */
+static int read_srp_host(const char *dir_name, struct srp_host *host)
 {
-	char scsi_host_dir[256];
-	DIR *dir;
+	uint64_t pkey = 0;
+
+	if (srpd_sys_read_uint64(dir_name, "id_ext", &host->id_ext) ||
+	    srpd_sys_read_uint64(dir_name, "service_id", &host->service_id) ||
+	    srpd_sys_read_uint64(dir_name, "ioc_guid", &host->ioc_guid))
+		return -1;
+
+	/*
+	 * In case this is an old kernel that does not have orig_dgid in
+	 * sysfs, use dgid instead (this is problematic when there is a dgid
+	 * redirection by the CM)
+	 */
+	if (srpd_sys_read_gid(dir_name, "orig_dgid", host->dgid.raw) &&
+	    srpd_sys_read_gid(dir_name, "dgid", host->dgid.raw))
+		return -1;
+
+	host->has_pkey = !srpd_sys_read_uint64(dir_name, "pkey", &pkey);
+	host->pkey = pkey;
+
+	/* If there is no local_ib_device in the scsi host dir (old kernel module), assumes it is equal */
+	if (check_not_equal_str(dir_name, "local_ib_device", config->dev_name))
+		return -1;
+
+	/* If there is no local_ib_port in the scsi host dir (old kernel module), assumes it is equal */
+	if (check_not_equal_int(dir_name, "local_ib_port", config->port_num))
+		return -1;
+
+	return 0;
+}
+
+static int cmp_srp_host(const void *a, const void *b)
+{
+	const struct srp_host *ha = a, *hb = b;
+
+	if (ha->id_ext != hb->id_ext)
+		return ha->id_ext < hb->id_ext ? -1 : 1;
+	return 0;
+}
+
+static int grow_srp_hosts(struct srp_hosts *hosts)
+{
+	struct srp_host *new_hosts;
+	int size = hosts->size * 2 + 8;
+
+	if (hosts->num < hosts->size)
+		return 0;
+
+	new_hosts = realloc(hosts->hosts, size * sizeof(*hosts->hosts));
+	if (!new_hosts)
+		return -ENOMEM;
+
+	hosts->hosts = new_hosts;
+	hosts->size = size;
+	return 0;
+}
+
+/* Inserts host, keeping the hosts sorted */
+static int add_srp_host(struct srp_hosts *hosts, const struct srp_host *host)
+{
+	int i;
+
+	if (grow_srp_hosts(hosts))
+		return -ENOMEM;
+
+	for (i = hosts->num; i > 0; --i) {
+		if (hosts->hosts[i - 1].id_ext <= host->id_ext)
+			break;
+		hosts->hosts[i] = hosts->hosts[i - 1];
+	}
+	hosts->hosts[i] = *host;
+	hosts->num++;
+
+	return 0;
+}
+
+static int read_srp_hosts(struct srp_hosts *hosts)
+{
+	char dir_name[32 + sizeof(((struct dirent *)0)->d_name)];
+	struct srp_host host;
 	struct dirent *subdir;
-	char *subdir_name_ptr;
-	int prefix_len;
-	union umad_gid dgid_val;
-	char target_config_str[255];
-	int len;
-	int not_connected = 1;
+	DIR *dir;
 
-	pr_debug("Found an SRP target with id_ext %s - check if it is already connected\n", target->id_ext);
+	memset(hosts, 0, sizeof(*hosts));
 
-	strcpy(scsi_host_dir, "/sys/class/scsi_host/");
-	dir=opendir(scsi_host_dir);
+	dir = opendir("/sys/class/scsi_host/");
 	if (!dir) {
 		perror("opendir - /sys/class/scsi_host/");
 		return -1;
 	}
-	prefix_len = strlen(scsi_host_dir);
-	subdir_name_ptr = scsi_host_dir + prefix_len;
-
-	subdir = (void *) 1; /* Dummy value to enter the loop */
-	while (subdir) {
-	        subdir = readdir(dir);
-
-		if (!subdir)
-			continue;
 
+	while ((subdir = readdir(dir))) {
 		if (subdir->d_name[0] == '.')
 			continue;
 
-		strncpy(subdir_name_ptr, subdir->d_name,
-			sizeof(scsi_host_dir) - prefix_len);
-		if (!check_equal_uint64(scsi_host_dir, "id_ext",
-				        strtoull(target->id_ext, NULL, 16)))
-			continue;
-		if (!check_equal_uint16(scsi_host_dir, "pkey", target->pkey) &&
-		    !config->execute)
+		snprintf(dir_name, sizeof(dir_name), "/sys/class/scsi_host/%s",
+			 subdir->d_name);
+		if (read_srp_host(dir_name, &host))
 			continue;
 
-		if (!check_equal_uint64(scsi_host_dir, "service_id",
-					target->h_service_id))
-			continue;
-		if (!check_equal_uint64(scsi_host_dir, "ioc_guid",
-					be64toh(target->ioc_prof.guid)))
-			continue;
-		if (srpd_sys_read_gid(scsi_host_dir, "orig_dgid",
-				      dgid_val.raw)) {
-			/*
-			 * In case this is an old kernel that does not have
-			 * orig_dgid in sysfs, use dgid instead (this is
-			 * problematic when there is a dgid redirection
-			 * by the CM)
-			 */
-			if (srpd_sys_read_gid(scsi_host_dir, "dgid",
-					      dgid_val.raw))
-				continue;
-		}
-		if (htobe64(target->subnet_prefix) !=
-		    dgid_val.global.subnet_prefix)
-			continue;
-		if (htobe64(target->h_guid) != dgid_val.global.interface_id)
-			continue;
+		if (grow_srp_hosts(hosts))
+			goto err;
+		hosts->hosts[hosts->num++] = host;
+	}
 
-		/* If there is no local_ib_device in the scsi host dir (old kernel module), assumes it is equal */
-		if (check_not_equal_str(scsi_host_dir, "local_ib_device", config->dev_name))
-			continue;
+	closedir(dir);
+	qsort(hosts->hosts, hosts->num, sizeof(*hosts->hosts), cmp_srp_host);
+	return 0;
 
-		/* If there is no local_ib_port in the scsi host dir (old kernel module), assumes it is equal */
-		if (check_not_equal_int(scsi_host_dir, "local_ib_port", config->port_num))
-			continue;
+err:
+	pr_err("out of memory\n");
+	closedir(dir);
+	free(hosts->hosts);
+	return -ENOMEM;
+}
+
+static bool srp_host_matches(const struct srp_host *host,
+			     const struct target_details *target)
+{
+	if ((!host->has_pkey || host->pkey != target->pkey) && !config->execute)
+		return false;
+
+	return host->service_id == target->h_service_id &&
+	       host->ioc_guid == be64toh(target->ioc_prof.guid) &&
+	       host->dgid.global.subnet_prefix == htobe64(target->subnet_prefix) &&
+	       host->dgid.global.interface_id == htobe64(target->h_guid);
+}
+
+static bool find_srp_host(struct srp_hosts *hosts,
+			  const struct target_details *target)
+{
+	uint64_t id_ext = strtoull(target->id_ext, NULL, 16);
+	int lo = 0, hi = hosts->num, mid;
 
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (hosts->hosts[mid].id_ext < id_ext)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < hosts->num && hosts->hosts[lo].id_ext == id_ext; ++lo)
+		if (srp_host_matches(&hosts->hosts[lo], target))
+			return true;
+
+	return false;
+}
+
+/*
+ * hosts is the snapshot of the current scan, or NULL to read the SRP hosts
+ * for this target alone.
+ */
+static int add_non_exist_target(struct target_details *target,
+				struct srp_hosts *hosts)
+{
+	struct srp_hosts local_hosts;
+	struct srp_host host;
+	char target_config_str[255];
+	int len;
+	int not_connected = 1;
+	int ret = -1;
+
+	pr_debug("Found an SRP target with id_ext %s - check if it is already connected\n", target->id_ext);
+
+	if (!hosts) {
+		if (read_srp_hosts(&local_hosts))
+			return -1;
+		hosts = &local_hosts;
+	}
+
+	if (find_srp_host(hosts, target)) {
 		/* there is a match - this target is already connected */
 
 		/* There is a rare possibility of a race in the following
@@ -498,16 +599,13 @@ static int add_non_exist_target(struct target_details *target)
 		   not_connected is set to zero to make sure that this target
 		   will be printed but not connected.
 		*/
-		if (config->all) {
-			not_connected = 0;
-			break;
+		if (!config->all) {
+			pr_debug("This target is already connected - skip\n");
+			ret = 0;
+			goto out;
 		}
 
-		pr_debug("This target is already connected - skip\n");
-		closedir(dir);
-
-		return 0;
-
+		not_connected = 0;
 	}
 
 	len = snprintf(target_config_str, sizeof(target_config_str), "id_ext=%s,"
@@ -523,8 +621,7 @@ static int add_non_exist_target(struct target_details *target)
 		(unsigned long long) target->h_service_id);
 	if (len >= sizeof(target_config_str)) {
 		pr_err("Target config string is too long, ignoring target\n");
-		closedir(dir);
-		return -1;
+		goto out;
 	}
 
 	if (target->ioc_prof.io_class != htobe16(SRP_REV16A_IB_IO_CLASS)) {
@@ -534,8 +631,7 @@ static int add_non_exist_target(struct target_details *target)
 
 		if (len >= sizeof(target_config_str)) {
 			pr_err("Target config string is too long, ignoring target\n");
-			closedir(dir);
-			return -1;
+			goto out;
 		}
 	}
 
@@ -547,8 +643,7 @@ static int add_non_exist_target(struct target_details *target)
 
 		if (len >= sizeof(target_config_str)) {
 			pr_err("Target config string is too long, ignoring target\n");
-			closedir(dir);
-			return -1;
+			goto out;
 		}
 	}
 
@@ -559,8 +654,7 @@ static int add_non_exist_target(struct target_details *target)
 
 		if (len >= sizeof(target_config_str)) {
 			pr_err("Target config string is too long, ignoring target\n");
-			closedir(dir);
-			return -1;
+			goto out;
 		}
 	}
 
@@ -572,8 +666,7 @@ static int add_non_exist_target(struct target_details *target)
 
 		if (len >= sizeof(target_config_str)) {
 			pr_err("Target config string is too long, ignoring target\n");
-			closedir(dir);
-			return -1;
+			goto out;
 		}
 	}
 
@@ -581,9 +674,35 @@ static int add_non_exist_target(struct target_details *target)
 
 	pr_cmd(target_config_str, not_connected);
 
-	closedir(dir);
+	/* Later targets of the scan must see the new connection */
+	if (config->execute && not_connected && hosts != &local_hosts) {
+		host.id_ext = strtoull(target->id_ext, NULL, 16);
+		host.service_id = target->h_service_id;
+		host.ioc_guid = be64toh(target->ioc_prof.guid);
+		host.dgid.global.subnet_prefix = htobe64(target->subnet_prefix);
+		host.dgid.global.interface_id = htobe64(target->h_guid);
+		host.pkey = target->pkey;
+		host.has_pkey = true;
+		if (add_srp_host(hosts, &host))
+			pr_err("out of memory\n");
+	}
+
+	ret = 1;
 
-	return 1;
+out:
+	if (hosts == &local_hosts)
+		free(local_hosts.hosts);
+	return ret;
+}
+
+static uint32_t mad_tid;
+
+static uint32_t next_tid(void)
+{
+	/* Skip tid 0 because OpenSM ignores it. */
+	if (++mad_tid == 0)
+		++mad_tid;
+	return mad_tid;
 }
 
 static int send_and_get(int portid, int agent, struct srp_ib_user_mad *out_mad,
@@ -594,13 +713,11 @@ static int send_and_get(int portid, int agent, struct srp_ib_user_mad *out_mad,
 	int i, len;
 	int in_agent;
 	int ret;
-	static uint32_t tid;
+	uint32_t tid;
 	uint32_t received_tid;
 
 	for (i = 0; i < config->mad_retries; ++i) {
-		/* Skip tid 0 because OpenSM ignores it. */
-		if (++tid == 0)
-			++tid;
+		tid = next_tid();
 		out_dm_mad->mad_hdr.tid = htobe64(tid);
 
 		ret = umad_send(portid, agent, out_mad, MAD_BLOCK_SIZE,
@@ -793,163 +910,828 @@ static int check_sm_cap(struct umad_resources *umad_res, int *mask_match)
 	return 0;
 }
 
-static int set_class_port_info(struct umad_resources *umad_res, uint16_t dlid)
+int get_node(struct umad_resources *umad_res, uint16_t dlid, uint64_t *guid)
 {
-	struct srp_ib_user_mad		in_mad, out_mad;
-	struct umad_dm_packet	       *out_dm_mad, *in_dm_mad;
-	struct umad_class_port_info    *cpi;
-	char val[64];
-	int i;
+	struct srp_ib_user_mad		out_mad, in_mad;
+	struct umad_sa_packet	       *out_sa_mad, *in_sa_mad;
+	struct srp_sa_node_rec	       *node;
 
-	init_srp_dm_mad(&out_mad, umad_res->agent, dlid, UMAD_ATTR_CLASS_PORT_INFO, 0);
+	in_sa_mad = get_data_ptr(in_mad);
+	out_sa_mad = get_data_ptr(out_mad);
 
-	out_dm_mad = get_data_ptr(out_mad);
-	out_dm_mad->mad_hdr.method = UMAD_METHOD_SET;
+	init_srp_sa_mad(&out_mad, umad_res->agent, umad_res->sm_lid,
+		        UMAD_SA_ATTR_NODE_REC, 0);
 
-	cpi                = (void *) out_dm_mad->data;
+	out_sa_mad->comp_mask     = htobe64(1); /* LID */
+	node			  = (void *) out_sa_mad->data;
+	node->lid		  = htobe16(dlid);
 
-	if (srpd_sys_read_string(umad_res->port_sysfs_path, "lid", val, sizeof val) < 0) {
-		pr_err("Couldn't read LID\n");
+	if (send_and_get(umad_res->portid, umad_res->agent, &out_mad, &in_mad, 0) < 0)
 		return -1;
+
+	node  = (void *) in_sa_mad->data;
+	*guid = be64toh(node->port_guid);
+
+	return 0;
+}
+
+int pkey_index_to_pkey(struct umad_resources *umad_res, int pkey_index,
+		       uint16_t *pkey)
+{
+	char pkey_file[18], pkey_str[16];
+
+	/* Read pkey */
+	snprintf(pkey_file, sizeof(pkey_file), "pkeys/%d", pkey_index);
+	if (srpd_sys_read_string(umad_res->port_sysfs_path, pkey_file,
+				 pkey_str, sizeof(pkey_str)) < 0)
+		return -1;
+
+	*pkey = strtoul(pkey_str, NULL, 0);
+	if (*pkey)
+		pr_debug("discover Targets for P_key %04x (index %d)\n",
+			 *pkey, pkey_index);
+	return 0;
+}
+
+/*
+ * A rescan queries every DM capable port of the fabric, and sending one MAD
+ * at a time spends most of the scan waiting for responses.  The discovery
+ * engine below keeps up to config->mad_window MADs in flight instead.  Each
+ * port runs through the discover_state states and moves to the next state
+ * once all of the MADs that it queued have completed.  The kernel MAD layer
+ * applies the timeout and the retries of each request, and completions are
+ * matched to their request by TID.
+ */
+enum discover_state {
+	DISCOVER_PORT,	/* NodeRecord, PortInfoRecord and shared P_Keys */
+	DISCOVER_CPI,	/* ClassPortInfo of Topspin targets */
+	DISCOVER_IOU,	/* IOUnitInfo */
+	DISCOVER_IOC,	/* IOControllerProfiles and ServiceEntries */
+	DISCOVER_DONE,
+};
+
+enum {
+	DISCOVER_NEED_NODE	= 1 << 0,
+	DISCOVER_NEED_PORT_INFO	= 1 << 1,
+	DISCOVER_NEED_PKEYS	= 1 << 2,
+};
+
+struct discover_ioc {
+	struct srp_dm_ioc_prof		prof;
+	struct srp_dm_svc_entries      *svc_entries;	/* four entries each */
+	bool			       *svc_valid;
+	bool				prof_valid;
+};
+
+struct discover_port {
+	struct list_node		entry;
+	enum discover_state		state;
+	unsigned int			flags;
+	int				pending;	/* MADs queued or in flight */
+	bool				failed;
+	bool				isdm;
+	bool				has_port_info;
+	bool				cached_iocs;	/* iocs belong to cached */
+	uint16_t			lid;
+	uint64_t			subnet_prefix;
+	uint64_t			h_guid;
+	struct srp_sa_port_info_rec	port_info;
+	/* Indexed like discover.local_pkeys, 0 if the P_Key is not shared */
+	uint16_t			pkeys[SRP_MAX_SHARED_PKEYS];
+	struct srp_dm_iou_info		iou_info;
+	struct discover_ioc	       *iocs;
+	struct cache_port	       *cached;
+};
+
+struct discover;
+struct discover_mad;
+
+typedef void (*discover_done_fn)(struct discover *disc,
+				 struct discover_mad *mad, void *data);
+
+struct discover_mad {
+	struct list_node		entry;
+	struct discover_port	       *port;
+	discover_done_fn		done;	/* data is NULL if the MAD failed */
+	uint32_t			tid;
+	int				ioc;
+	int				index;
+	struct srp_ib_user_mad		umad;
+};
+
+struct discover {
+	struct resources	       *res;
+	struct list_head		waiting;	/* ports not started yet */
+	struct list_head		queue;		/* MADs not sent yet */
+	struct discover_mad	      **window;
+	int				in_flight;
+	struct ib_user_mad	       *in_mad;
+	struct srp_hosts		hosts;
+	bool				scan;	/* a rescan of the fabric */
+	uint16_t			local_lid;
+	int				num_local_pkeys;
+	uint16_t			local_pkeys[SRP_MAX_SHARED_PKEYS];
+	int				ret;
+};
+
+/*
+ * Results of earlier rescans, keyed by port GUID.  A port whose PortInfo has
+ * not changed since the last rescan is not asked for its node record and
+ * shared P_Keys again, and its controllers and service entries are only
+ * queried again if the change ID of its IOUnitInfo, the generation of its
+ * DM data, has changed.  Ports named by a trap are always queried in full.
+ */
+struct cache_port {
+	struct list_node		entry;
+	uint64_t			h_guid;
+	struct srp_sa_port_info_rec	port_info;
+	uint16_t			pkeys[SRP_MAX_SHARED_PKEYS];
+	struct srp_dm_iou_info		iou_info;
+	struct discover_ioc	       *iocs;
+	unsigned int			scan;
+};
+
+static struct {
+	struct list_head		ports;
+	unsigned int			scan;
+	/* The P_Keys of cache_port are indexed like local_pkeys */
+	uint16_t			local_lid;
+	int				num_local_pkeys;
+	uint16_t			local_pkeys[SRP_MAX_SHARED_PKEYS];
+} target_cache = {
+	.ports = LIST_HEAD_INIT(target_cache.ports),
+};
+
+enum {
+	TARGET_CACHE_MAGIC	= 0x73727063,
+	TARGET_CACHE_VERSION	= 1,
+};
+
+static const uint64_t topspin_oui = 0x0005ad0000000000ull;
+static const uint64_t oui_mask    = 0xffffff0000000000ull;
+
+static void free_iocs(struct discover_ioc *iocs, int num)
+{
+	int i;
+
+	if (!iocs)
+		return;
+
+	for (i = 0; i < num; ++i) {
+		free(iocs[i].svc_entries);
+		free(iocs[i].svc_valid);
 	}
+	free(iocs);
+}
 
-	cpi->trap_lid = htobe16(strtol(val, NULL, 0));
+/* Compares the parts of PortInfo that identify the port and its state */
+static bool same_port_info(const struct srp_sa_port_info_rec *a,
+			   const struct srp_sa_port_info_rec *b)
+{
+	return a->endport_lid == b->endport_lid &&
+	       a->port_num == b->port_num &&
+	       a->subnet_prefix == b->subnet_prefix &&
+	       a->base_lid == b->base_lid &&
+	       a->capability_mask == b->capability_mask &&
+	       a->mkey_lmc == b->mkey_lmc &&
+	       a->state_info1 == b->state_info1;
+}
 
-	if (srpd_sys_read_string(umad_res->port_sysfs_path, "gids/0", val, sizeof val) < 0) {
-		pr_err("Couldn't read GID[0]\n");
+static struct cache_port *cache_find_guid(uint64_t h_guid)
+{
+	struct cache_port *cached;
+
+	list_for_each(&target_cache.ports, cached, entry)
+		if (cached->h_guid == h_guid)
+			return cached;
+
+	return NULL;
+}
+
+static struct cache_port *cache_find_lid(uint16_t lid)
+{
+	struct cache_port *cached;
+
+	list_for_each(&target_cache.ports, cached, entry)
+		if (be16toh(cached->port_info.endport_lid) == lid)
+			return cached;
+
+	return NULL;
+}
+
+static void cache_drop(struct cache_port *cached)
+{
+	if (!cached)
+		return;
+
+	list_del(&cached->entry);
+	free_iocs(cached->iocs, cached->iou_info.max_controllers);
+	free(cached);
+}
+
+static void cache_flush(void)
+{
+	struct cache_port *cached;
+
+	while ((cached = list_pop(&target_cache.ports, struct cache_port,
+				  entry)))
+		cache_drop(cached);
+}
+
+/* The cached P_Keys are only valid for the same local P_Key table */
+static void cache_begin_scan(struct discover *disc)
+{
+	if (disc->local_lid != target_cache.local_lid ||
+	    disc->num_local_pkeys != target_cache.num_local_pkeys ||
+	    memcmp(disc->local_pkeys, target_cache.local_pkeys,
+		   disc->num_local_pkeys * sizeof(disc->local_pkeys[0]))) {
+		cache_flush();
+		target_cache.local_lid = disc->local_lid;
+		target_cache.num_local_pkeys = disc->num_local_pkeys;
+		memcpy(target_cache.local_pkeys, disc->local_pkeys,
+		       sizeof(target_cache.local_pkeys));
+	}
+
+	target_cache.scan++;
+}
+
+static void cache_store(struct discover_port *port)
+{
+	struct cache_port *cached = port->cached;
+
+	if (!cached)
+		cached = cache_find_guid(port->h_guid);
+	if (!cached) {
+		cached = calloc(1, sizeof(*cached));
+		if (!cached)
+			return;
+		list_add_tail(&target_cache.ports, &cached->entry);
+	}
+
+	if (!port->cached_iocs) {
+		free_iocs(cached->iocs, cached->iou_info.max_controllers);
+		cached->iocs = port->iocs;
+		port->iocs = NULL;
+	}
+
+	cached->h_guid = port->h_guid;
+	cached->port_info = port->port_info;
+	memcpy(cached->pkeys, port->pkeys, sizeof(cached->pkeys));
+	cached->iou_info = port->iou_info;
+	cached->scan = target_cache.scan;
+}
+
+static int write_cache_port(FILE *file, struct cache_port *cached)
+{
+	struct discover_ioc *ioc;
+	uint8_t valid;
+	int i, num;
+
+	if (fwrite(&cached->h_guid, sizeof(cached->h_guid), 1, file) != 1 ||
+	    fwrite(&cached->port_info, sizeof(cached->port_info), 1, file) != 1 ||
+	    fwrite(cached->pkeys, sizeof(cached->pkeys), 1, file) != 1 ||
+	    fwrite(&cached->iou_info, sizeof(cached->iou_info), 1, file) != 1)
 		return -1;
+
+	for (i = 0; i < cached->iou_info.max_controllers; ++i) {
+		ioc = &cached->iocs[i];
+		valid = ioc->prof_valid && (!ioc->prof.service_entries ||
+					    ioc->svc_valid);
+		if (fwrite(&valid, sizeof(valid), 1, file) != 1)
+			return -1;
+		if (!valid)
+			continue;
+
+		num = (ioc->prof.service_entries + 3) / 4;
+		if (fwrite(&ioc->prof, sizeof(ioc->prof), 1, file) != 1 ||
+		    (num && fwrite(ioc->svc_valid, sizeof(*ioc->svc_valid),
+				   num, file) != num) ||
+		    (num && fwrite(ioc->svc_entries, sizeof(*ioc->svc_entries),
+				   num, file) != num))
+			return -1;
 	}
 
-	for (i = 0; i < 8; ++i)
-		cpi->trapgid.raw_be16[i] = htobe16(strtol(val + i * 5, NULL, 16));
+	return 0;
+}
 
-	if (send_and_get(umad_res->portid, umad_res->agent, &out_mad, &in_mad, 0) < 0)
+/* Writes the cache to config->cache_file, replacing the file atomically */
+static void save_target_cache(void)
+{
+	struct cache_port *cached;
+	uint32_t hdr[3] = { TARGET_CACHE_MAGIC, TARGET_CACHE_VERSION };
+	char *tmp_name;
+	FILE *file;
+
+	if (!config->cache_file)
+		return;
+
+	if (asprintf(&tmp_name, "%s.tmp", config->cache_file) < 0) {
+		pr_err("out of memory\n");
+		return;
+	}
+
+	file = fopen(tmp_name, "w");
+	if (!file) {
+		pr_err("cannot open %s (errno: %d)\n", tmp_name, errno);
+		free(tmp_name);
+		return;
+	}
+
+	list_for_each(&target_cache.ports, cached, entry)
+		hdr[2]++;
+
+	if (fwrite(hdr, sizeof(hdr), 1, file) != 1 ||
+	    fwrite(&target_cache.local_lid, sizeof(target_cache.local_lid), 1, file) != 1 ||
+	    fwrite(&target_cache.num_local_pkeys, sizeof(target_cache.num_local_pkeys), 1, file) != 1 ||
+	    fwrite(target_cache.local_pkeys, sizeof(target_cache.local_pkeys), 1, file) != 1)
+		goto err;
+
+	list_for_each(&target_cache.ports, cached, entry)
+		if (write_cache_port(file, cached))
+			goto err;
+
+	if (fclose(file)) {
+		file = NULL;
+		goto err;
+	}
+
+	if (rename(tmp_name, config->cache_file))
+		pr_err("cannot rename %s (errno: %d)\n", tmp_name, errno);
+	free(tmp_name);
+	return;
+
+err:
+	pr_err("failed to write %s\n", tmp_name);
+	if (file)
+		fclose(file);
+	unlink(tmp_name);
+	free(tmp_name);
+}
+
+static int read_cache_port(FILE *file, struct cache_port *cached)
+{
+	struct discover_ioc *ioc;
+	uint8_t valid;
+	int i, num;
+
+	if (fread(&cached->h_guid, sizeof(cached->h_guid), 1, file) != 1 ||
+	    fread(&cached->port_info, sizeof(cached->port_info), 1, file) != 1 ||
+	    fread(cached->pkeys, sizeof(cached->pkeys), 1, file) != 1 ||
+	    fread(&cached->iou_info, sizeof(cached->iou_info), 1, file) != 1)
 		return -1;
 
-	in_dm_mad = get_data_ptr(in_mad);
-	if (in_dm_mad->mad_hdr.status) {
+	cached->iocs = calloc(cached->iou_info.max_controllers ? : 1,
+			      sizeof(*cached->iocs));
+	if (!cached->iocs)
+		return -1;
+
+	for (i = 0; i < cached->iou_info.max_controllers; ++i) {
+		ioc = &cached->iocs[i];
+		if (fread(&valid, sizeof(valid), 1, file) != 1)
+			return -1;
+		if (!valid)
+			continue;
+
+		if (fread(&ioc->prof, sizeof(ioc->prof), 1, file) != 1)
+			return -1;
+		ioc->prof_valid = true;
+
+		num = (ioc->prof.service_entries + 3) / 4;
+		if (!num)
+			continue;
+
+		ioc->svc_valid = calloc(num, sizeof(*ioc->svc_valid));
+		ioc->svc_entries = calloc(num, sizeof(*ioc->svc_entries));
+		if (!ioc->svc_valid || !ioc->svc_entries ||
+		    fread(ioc->svc_valid, sizeof(*ioc->svc_valid), num, file) != num ||
+		    fread(ioc->svc_entries, sizeof(*ioc->svc_entries), num, file) != num)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Loads the cache written by an earlier srp_daemon.  The cache only saves
+ * queries, so a file that cannot be read is ignored.
+ */
+static void load_target_cache(void)
+{
+	struct cache_port *cached;
+	uint32_t hdr[3], i;
+	FILE *file;
+
+	if (!config->cache_file)
+		return;
+
+	file = fopen(config->cache_file, "r");
+	if (!file)
+		return;
+
+	if (fread(hdr, sizeof(hdr), 1, file) != 1 ||
+	    hdr[0] != TARGET_CACHE_MAGIC || hdr[1] != TARGET_CACHE_VERSION ||
+	    fread(&target_cache.local_lid, sizeof(target_cache.local_lid), 1, file) != 1 ||
+	    fread(&target_cache.num_local_pkeys, sizeof(target_cache.num_local_pkeys), 1, file) != 1 ||
+	    fread(target_cache.local_pkeys, sizeof(target_cache.local_pkeys), 1, file) != 1 ||
+	    target_cache.num_local_pkeys < 0 ||
+	    target_cache.num_local_pkeys > SRP_MAX_SHARED_PKEYS)
+		goto err;
+
+	for (i = 0; i < hdr[2]; ++i) {
+		cached = calloc(1, sizeof(*cached));
+		if (!cached)
+			goto err;
+		list_add_tail(&target_cache.ports, &cached->entry);
+		if (read_cache_port(file, cached))
+			goto err;
+	}
+
+	pr_debug("loaded %u ports from %s\n", hdr[2], config->cache_file);
+	fclose(file);
+	return;
+
+err:
+	pr_err("ignoring target cache %s\n", config->cache_file);
+	cache_flush();
+	target_cache.num_local_pkeys = 0;
+	fclose(file);
+}
+
+static struct discover_mad *discover_queue(struct discover *disc,
+					   struct discover_port *port,
+					   discover_done_fn done)
+{
+	struct discover_mad *mad;
+
+	mad = calloc(1, sizeof(*mad));
+	if (!mad) {
+		pr_err("out of memory\n");
+		port->failed = true;
+		return NULL;
+	}
+
+	mad->port = port;
+	mad->done = done;
+	list_add_tail(&disc->queue, &mad->entry);
+	port->pending++;
+
+	return mad;
+}
+
+static void node_rec_done(struct discover *disc, struct discover_mad *mad,
+			  void *data)
+{
+	struct umad_sa_packet	       *in_sa_mad = data;
+	struct srp_sa_node_rec	       *node;
+
+	if (!in_sa_mad || in_sa_mad->mad_hdr.status) {
+		mad->port->failed = true;
+		return;
+	}
+
+	node = (void *) in_sa_mad->data;
+	mad->port->h_guid = be64toh(node->port_guid);
+}
+
+static void queue_node_rec(struct discover *disc, struct discover_port *port)
+{
+	struct umad_resources	       *umad_res = disc->res->umad_res;
+	struct umad_sa_packet	       *out_sa_mad;
+	struct srp_sa_node_rec	       *node;
+	struct discover_mad	       *mad;
+
+	mad = discover_queue(disc, port, node_rec_done);
+	if (!mad)
+		return;
+
+	init_srp_sa_mad(&mad->umad, umad_res->agent, umad_res->sm_lid,
+			UMAD_SA_ATTR_NODE_REC, 0);
+
+	out_sa_mad		  = get_data_ptr(mad->umad);
+	out_sa_mad->comp_mask     = htobe64(1); /* LID */
+	node			  = (void *) out_sa_mad->data;
+	node->lid		  = htobe16(port->lid);
+}
+
+static void port_info_done(struct discover *disc, struct discover_mad *mad,
+			   void *data)
+{
+	struct umad_sa_packet	       *in_sa_mad = data;
+	struct srp_sa_port_info_rec    *port_info;
+
+	if (!in_sa_mad || in_sa_mad->mad_hdr.status) {
+		mad->port->failed = true;
+		return;
+	}
+
+	port_info = &mad->port->port_info;
+	memcpy(port_info, in_sa_mad->data, sizeof(*port_info));
+	mad->port->has_port_info = true;
+	mad->port->subnet_prefix = be64toh(port_info->subnet_prefix);
+	mad->port->isdm = !!(be32toh(port_info->capability_mask) & SRP_IS_DM);
+}
+
+static void queue_port_info(struct discover *disc, struct discover_port *port)
+{
+	struct umad_resources	       *umad_res = disc->res->umad_res;
+	struct umad_sa_packet	       *out_sa_mad;
+	struct srp_sa_port_info_rec    *port_info;
+	struct discover_mad	       *mad;
+
+	mad = discover_queue(disc, port, port_info_done);
+	if (!mad)
+		return;
+
+	init_srp_sa_mad(&mad->umad, umad_res->agent, umad_res->sm_lid,
+			UMAD_SA_ATTR_PORT_INFO_REC, 0);
+
+	out_sa_mad		  = get_data_ptr(mad->umad);
+	out_sa_mad->comp_mask     = htobe64(1); /* LID */
+	port_info                 = (void *) out_sa_mad->data;
+	port_info->endport_lid	  = htobe16(port->lid);
+}
+
+static void path_rec_done(struct discover *disc, struct discover_mad *mad,
+			  void *data)
+{
+	struct umad_sa_packet	       *in_sa_mad = data;
+	struct ib_path_rec	       *path_rec;
+
+	if (!in_sa_mad) {
+		if (!mad->port->failed)
+			pr_err("failed to get shared P_Keys with LID %#x\n",
+			       mad->port->lid);
+		mad->port->failed = true;
+		disc->ret = -1;
+		return;
+	}
+
+	/* The SM returns an error if the P_Key is not shared */
+	if (in_sa_mad->mad_hdr.status)
+		return;
+
+	path_rec = (struct ib_path_rec *) in_sa_mad->data;
+	mad->port->pkeys[mad->index] = be16toh(path_rec->pkey);
+}
+
+/*
+ * Due to OpenSM bug (issue #335016) SM won't return table of all shared
+ * P_Keys, it will return only the first shared P_Key, So we send a path
+ * record query for each P_Key in the local P_Key table.
+ */
+static void queue_path_rec(struct discover *disc, struct discover_port *port,
+			   int index)
+{
+	struct umad_resources	       *umad_res = disc->res->umad_res;
+	struct umad_sa_packet	       *out_sa_mad;
+	struct ib_path_rec	       *path_rec;
+	struct discover_mad	       *mad;
+
+	mad = discover_queue(disc, port, path_rec_done);
+	if (!mad)
+		return;
+
+	mad->index = index;
+	init_srp_sa_mad(&mad->umad, umad_res->agent, umad_res->sm_lid,
+			UMAD_SA_ATTR_PATH_REC, 0);
+
+	/* Mark components: DLID, SLID, PKEY */
+	out_sa_mad = get_data_ptr(mad->umad);
+	out_sa_mad->comp_mask = htobe64(1 << 4 | 1 << 5 | 1 << 13);
+	path_rec = (struct ib_path_rec *) out_sa_mad->data;
+	path_rec->slid = htobe16(disc->local_lid);
+	path_rec->dlid = htobe16(port->lid);
+	path_rec->pkey = htobe16(disc->local_pkeys[index]);
+}
+
+static void class_port_info_done(struct discover *disc,
+				 struct discover_mad *mad, void *data)
+{
+	struct umad_dm_packet	       *in_dm_mad = data;
+
+	if (in_dm_mad && in_dm_mad->mad_hdr.status)
 		pr_err("Class Port Info set returned status 0x%04x\n",
 			be16toh(in_dm_mad->mad_hdr.status));
-		return -1;
+
+	if (!in_dm_mad || in_dm_mad->mad_hdr.status)
+		pr_err("Warning: set of ClassPortInfo failed\n");
+}
+
+static void queue_class_port_info(struct discover *disc,
+				  struct discover_port *port)
+{
+	struct umad_resources	       *umad_res = disc->res->umad_res;
+	struct umad_dm_packet	       *out_dm_mad;
+	struct umad_class_port_info    *cpi;
+	struct discover_mad	       *mad;
+	char lid[64], gid[64];
+	int i;
+
+	if (srpd_sys_read_string(umad_res->port_sysfs_path, "lid", lid, sizeof lid) < 0) {
+		pr_err("Couldn't read LID\n");
+		goto err;
 	}
 
-	return 0;
+	if (srpd_sys_read_string(umad_res->port_sysfs_path, "gids/0", gid, sizeof gid) < 0) {
+		pr_err("Couldn't read GID[0]\n");
+		goto err;
+	}
+
+	mad = discover_queue(disc, port, class_port_info_done);
+	if (!mad)
+		goto err;
+
+	init_srp_dm_mad(&mad->umad, umad_res->agent, port->lid,
+			UMAD_ATTR_CLASS_PORT_INFO, 0);
+
+	out_dm_mad = get_data_ptr(mad->umad);
+	out_dm_mad->mad_hdr.method = UMAD_METHOD_SET;
+
+	cpi                = (void *) out_dm_mad->data;
+	cpi->trap_lid      = htobe16(strtol(lid, NULL, 0));
+
+	for (i = 0; i < 8; ++i)
+		cpi->trapgid.raw_be16[i] = htobe16(strtol(gid + i * 5, NULL, 16));
+
+	return;
+
+err:
+	pr_err("Warning: set of ClassPortInfo failed\n");
 }
 
-static int get_iou_info(struct umad_resources *umad_res, uint16_t dlid,
-			struct srp_dm_iou_info *iou_info)
+static void iou_info_done(struct discover *disc, struct discover_mad *mad,
+			  void *data)
 {
-	struct srp_ib_user_mad		in_mad, out_mad;
-	struct umad_dm_packet	       *in_dm_mad;
-
-	init_srp_dm_mad(&out_mad, umad_res->agent, dlid, SRP_DM_ATTR_IO_UNIT_INFO, 0);
-
-	if (send_and_get(umad_res->portid, umad_res->agent, &out_mad, &in_mad, 0) < 0)
-		return -1;
+	struct umad_dm_packet	       *in_dm_mad = data;
+	struct discover_port	       *port = mad->port;
 
-	in_dm_mad = get_data_ptr(in_mad);
-	if (in_dm_mad->mad_hdr.status) {
+	if (in_dm_mad && in_dm_mad->mad_hdr.status)
 		pr_err("IO Unit Info query returned status 0x%04x\n",
 			be16toh(in_dm_mad->mad_hdr.status));
-		return -1;
+
+	if (!in_dm_mad || in_dm_mad->mad_hdr.status) {
+		pr_err("failed to get iou info for dlid %#x\n", port->lid);
+		port->failed = true;
+		return;
 	}
 
-	memcpy(iou_info, in_dm_mad->data, sizeof *iou_info);
-/*
-	pr_debug("iou_info->max_controllers is %d\n", iou_info->max_controllers);
-*/
-	return 0;
+	memcpy(&port->iou_info, in_dm_mad->data, sizeof(port->iou_info));
+
+	/* Same change ID and controllers, the cached results are current */
+	if (port->cached && !memcmp(&port->cached->iou_info, &port->iou_info,
+				    sizeof(port->iou_info))) {
+		pr_debug("using cached controllers of lid %#x\n", port->lid);
+		port->iocs = port->cached->iocs;
+		port->cached_iocs = true;
+		return;
+	}
+
+	port->iocs = calloc(port->iou_info.max_controllers ? : 1,
+			    sizeof(*port->iocs));
+	if (!port->iocs) {
+		pr_err("out of memory\n");
+		port->failed = true;
+	}
 }
 
-static int get_ioc_prof(struct umad_resources *umad_res, uint16_t h_dlid, int ioc,
-			struct srp_dm_ioc_prof *ioc_prof)
+static void queue_iou_info(struct discover *disc, struct discover_port *port)
 {
-	struct srp_ib_user_mad		in_mad, out_mad;
-	struct umad_dm_packet	       *in_dm_mad;
+	struct umad_resources	       *umad_res = disc->res->umad_res;
+	struct discover_mad	       *mad;
 
-	init_srp_dm_mad(&out_mad, umad_res->agent, h_dlid, SRP_DM_ATTR_IO_CONTROLLER_PROFILE, ioc);
+	mad = discover_queue(disc, port, iou_info_done);
+	if (!mad)
+		return;
 
-	if (send_and_get(umad_res->portid, umad_res->agent, &out_mad, &in_mad, 0) < 0)
-		return -1;
+	init_srp_dm_mad(&mad->umad, umad_res->agent, port->lid,
+			SRP_DM_ATTR_IO_UNIT_INFO, 0);
+}
+
+static void svc_entries_done(struct discover *disc, struct discover_mad *mad,
+			     void *data)
+{
+	struct umad_dm_packet	       *in_dm_mad = data;
+	struct discover_ioc	       *ioc = &mad->port->iocs[mad->ioc - 1];
+
+	if (!in_dm_mad)
+		return;
 
-	in_dm_mad = get_data_ptr(in_mad);
 	if (in_dm_mad->mad_hdr.status) {
-		pr_err("IO Controller Profile query returned status 0x%04x for %d\n",
-			be16toh(in_dm_mad->mad_hdr.status), ioc);
-		return -1;
+		pr_err("Service Entries query returned status 0x%04x\n",
+			be16toh(in_dm_mad->mad_hdr.status));
+		return;
 	}
 
-	memcpy(ioc_prof, in_dm_mad->data, sizeof *ioc_prof);
-
-	return 0;
+	memcpy(&ioc->svc_entries[mad->index / 4], in_dm_mad->data,
+	       sizeof(*ioc->svc_entries));
+	ioc->svc_valid[mad->index / 4] = true;
 }
 
-static int get_svc_entries(struct umad_resources *umad_res, uint16_t dlid, int ioc,
-			   int start, int end, struct srp_dm_svc_entries *svc_entries)
+static void queue_svc_entries(struct discover *disc, struct discover_port *port,
+			      int ioc, int start, int end)
 {
-	struct srp_ib_user_mad		in_mad, out_mad;
-	struct umad_dm_packet	       *in_dm_mad;
+	struct umad_resources	       *umad_res = disc->res->umad_res;
+	struct discover_mad	       *mad;
+
+	mad = discover_queue(disc, port, svc_entries_done);
+	if (!mad)
+		return;
 
-	init_srp_dm_mad(&out_mad, umad_res->agent, dlid, SRP_DM_ATTR_SERVICE_ENTRIES,
+	mad->ioc = ioc;
+	mad->index = start;
+	init_srp_dm_mad(&mad->umad, umad_res->agent, port->lid,
+			SRP_DM_ATTR_SERVICE_ENTRIES,
 			(ioc << 16) | (end << 8) | start);
+}
 
-	if (send_and_get(umad_res->portid, umad_res->agent, &out_mad, &in_mad, 0) < 0)
-		return -1;
+static void ioc_prof_done(struct discover *disc, struct discover_mad *mad,
+			  void *data)
+{
+	struct umad_dm_packet	       *in_dm_mad = data;
+	struct discover_ioc	       *ioc = &mad->port->iocs[mad->ioc - 1];
+	int				num, j;
+
+	if (!in_dm_mad)
+		return;
 
-	in_dm_mad = get_data_ptr(in_mad);
 	if (in_dm_mad->mad_hdr.status) {
-		pr_err("Service Entries query returned status 0x%04x\n",
-			be16toh(in_dm_mad->mad_hdr.status));
-		return -1;
+		pr_err("IO Controller Profile query returned status 0x%04x for %d\n",
+			be16toh(in_dm_mad->mad_hdr.status), mad->ioc);
+		return;
 	}
 
-	memcpy(svc_entries, in_dm_mad->data, sizeof *svc_entries);
+	memcpy(&ioc->prof, in_dm_mad->data, sizeof(ioc->prof));
+	ioc->prof_valid = true;
 
-	return 0;
+	num = ioc->prof.service_entries;
+	if (!num)
+		return;
+
+	ioc->svc_entries = calloc((num + 3) / 4, sizeof(*ioc->svc_entries));
+	ioc->svc_valid = calloc((num + 3) / 4, sizeof(*ioc->svc_valid));
+	if (!ioc->svc_entries || !ioc->svc_valid) {
+		pr_err("out of memory\n");
+		return;
+	}
+
+	for (j = 0; j < num; j += 4)
+		queue_svc_entries(disc, mad->port, mad->ioc, j,
+				  j + 3 < num ? j + 3 : num - 1);
 }
 
-static int do_port(struct resources *res, uint16_t pkey, uint16_t dlid,
-		   uint64_t subnet_prefix, uint64_t h_guid)
+static void queue_ioc_prof(struct discover *disc, struct discover_port *port,
+			   int ioc)
 {
-	struct umad_resources 	       *umad_res = res->umad_res;
-	struct srp_dm_iou_info		iou_info;
-	struct srp_dm_svc_entries	svc_entries;
-	int				i, j, k, ret;
-
-	static const uint64_t topspin_oui = 0x0005ad0000000000ull;
-	static const uint64_t oui_mask    = 0xffffff0000000000ull;
+	struct umad_resources	       *umad_res = disc->res->umad_res;
+	struct discover_mad	       *mad;
 
-	struct target_details *target = (struct target_details *)
-		malloc(sizeof(struct target_details));
+	mad = discover_queue(disc, port, ioc_prof_done);
+	if (!mad)
+		return;
 
-	target->subnet_prefix = subnet_prefix;
-	target->h_guid = h_guid;
-	target->options = NULL;
+	mad->ioc = ioc;
+	init_srp_dm_mad(&mad->umad, umad_res->agent, port->lid,
+			SRP_DM_ATTR_IO_CONTROLLER_PROFILE, ioc);
+}
 
- 	pr_debug("enter do_port\n");
-	if ((target->h_guid & oui_mask) == topspin_oui &&
-	    set_class_port_info(umad_res, dlid))
-		pr_err("Warning: set of ClassPortInfo failed\n");
+static int ioc_state(struct srp_dm_iou_info *iou_info, int i)
+{
+	return (iou_info->controller_list[i / 2] >> (4 * (1 - i % 2))) & 0xf;
+}
 
-	ret = get_iou_info(umad_res, dlid, &iou_info);
-	if (ret < 0) {
-		pr_err("failed to get iou info for dlid %#x\n", dlid);
-		goto out;
+static void report_port(struct discover *disc, struct discover_port *port,
+			uint16_t pkey)
+{
+	struct srp_dm_iou_info	       *iou_info = &port->iou_info;
+	struct srp_dm_svc_entries      *svc_entries;
+	struct target_details	       *target;
+	struct discover_ioc	       *ioc;
+	int				i, j, k, n;
+
+	target = calloc(1, sizeof(*target));
+	if (!target) {
+		pr_err("out of memory\n");
+		return;
 	}
 
+	target->subnet_prefix = port->subnet_prefix;
+	target->h_guid = port->h_guid;
+	target->pkey = pkey;
+
+	pr_debug("enter report_port\n");
+
 	pr_human("IO Unit Info:\n");
-	pr_human("    port LID:        %04x\n", dlid);
+	pr_human("    port LID:        %04x\n", port->lid);
 	pr_human("    port GID:        %016llx%016llx\n",
 		 (unsigned long long) target->subnet_prefix,
 		 (unsigned long long) target->h_guid);
-	pr_human("    change ID:       %04x\n", be16toh(iou_info.change_id));
-	pr_human("    max controllers: 0x%02x\n", iou_info.max_controllers);
+	pr_human("    change ID:       %04x\n", be16toh(iou_info->change_id));
+	pr_human("    max controllers: 0x%02x\n", iou_info->max_controllers);
 
 	if (config->verbose > 0)
-		for (i = 0; i < iou_info.max_controllers; ++i) {
+		for (i = 0; i < iou_info->max_controllers; ++i) {
 			pr_human("    controller[%3d]: ", i + 1);
-			switch ((iou_info.controller_list[i / 2] >>
-				 (4 * (1 - i % 2))) & 0xf) {
+			switch (ioc_state(iou_info, i)) {
 			case SRP_DM_NO_IOC:      pr_human("not installed\n"); break;
 			case SRP_DM_IOC_PRESENT: pr_human("present\n");       break;
 			case SRP_DM_NO_SLOT:     pr_human("no slot\n");       break;
@@ -957,55 +1739,57 @@ static int do_port(struct resources *res, uint16_t pkey, uint16_t dlid,
 			}
 		}
 
-	for (i = 0; i < iou_info.max_controllers; ++i) {
-		if (((iou_info.controller_list[i / 2] >> (4 * (1 - i % 2))) & 0xf) ==
-		    SRP_DM_IOC_PRESENT) {
-			pr_human("\n");
+	for (i = 0; i < iou_info->max_controllers; ++i) {
+		if (ioc_state(iou_info, i) != SRP_DM_IOC_PRESENT)
+			continue;
 
-			if (get_ioc_prof(umad_res, dlid, i + 1, &target->ioc_prof))
-				continue;
+		pr_human("\n");
+
+		ioc = &port->iocs[i];
+		if (!ioc->prof_valid)
+			continue;
 
-			pr_human("    controller[%3d]\n", i + 1);
+		target->ioc_prof = ioc->prof;
 
-			pr_human("        GUID:      %016llx\n",
-				 (unsigned long long) be64toh(target->ioc_prof.guid));
-			pr_human("        vendor ID: %06x\n", be32toh(target->ioc_prof.vendor_id) >> 8);
-			pr_human("        device ID: %06x\n", be32toh(target->ioc_prof.device_id));
-			pr_human("        IO class : %04hx\n", be16toh(target->ioc_prof.io_class));
-			pr_human("        ID:        %s\n", target->ioc_prof.id);
-			pr_human("        service entries: %d\n", target->ioc_prof.service_entries);
+		pr_human("    controller[%3d]\n", i + 1);
 
-			for (j = 0; j < target->ioc_prof.service_entries; j += 4) {
-				int n;
+		pr_human("        GUID:      %016llx\n",
+			 (unsigned long long) be64toh(target->ioc_prof.guid));
+		pr_human("        vendor ID: %06x\n", be32toh(target->ioc_prof.vendor_id) >> 8);
+		pr_human("        device ID: %06x\n", be32toh(target->ioc_prof.device_id));
+		pr_human("        IO class : %04hx\n", be16toh(target->ioc_prof.io_class));
+		pr_human("        ID:        %s\n", target->ioc_prof.id);
+		pr_human("        service entries: %d\n", target->ioc_prof.service_entries);
 
-				n = j + 3;
-				if (n >= target->ioc_prof.service_entries)
-					n = target->ioc_prof.service_entries - 1;
+		for (j = 0; j < target->ioc_prof.service_entries; j += 4) {
+			n = j + 3;
+			if (n >= target->ioc_prof.service_entries)
+				n = target->ioc_prof.service_entries - 1;
 
-				if (get_svc_entries(umad_res, dlid, i + 1,
-						    j, n, &svc_entries))
+			if (!ioc->svc_valid || !ioc->svc_valid[j / 4])
+				continue;
+
+			svc_entries = &ioc->svc_entries[j / 4];
+
+			for (k = 0; k <= n - j; ++k) {
+
+				if (sscanf(svc_entries->service[k].name,
+					   "SRP.T10:%16s",
+					   target->id_ext) != 1)
 					continue;
 
-				for (k = 0; k <= n - j; ++k) {
-
-					if (sscanf(svc_entries.service[k].name,
-						   "SRP.T10:%16s",
-						   target->id_ext) != 1)
-						continue;
-
-					pr_human("            service[%3d]: %016llx / %s\n",
-						 j + k,
-						 (unsigned long long) be64toh(svc_entries.service[k].id),
-						 svc_entries.service[k].name);
-
-					target->h_service_id = be64toh(svc_entries.service[k].id);
-					target->pkey = pkey;
-					if (is_enabled_by_rules_file(target)) {
-						if (!add_non_exist_target(target) && !config->once) {
-							target->retry_time =
-								time(NULL) + config->retry_timeout;
-							push_to_retry_list(res->sync_res, target);
-						}
+				pr_human("            service[%3d]: %016llx / %s\n",
+					 j + k,
+					 (unsigned long long) be64toh(svc_entries->service[k].id),
+					 svc_entries->service[k].name);
+
+				target->h_service_id = be64toh(svc_entries->service[k].id);
+				if (is_enabled_by_rules_file(target)) {
+					if (!add_non_exist_target(target, &disc->hosts) &&
+					    !config->once) {
+						target->retry_time =
+							time(NULL) + config->retry_timeout;
+						push_to_retry_list(disc->res->sync_res, target);
 					}
 				}
 			}
@@ -1014,166 +1798,354 @@ static int do_port(struct resources *res, uint16_t pkey, uint16_t dlid,
 
 	pr_human("\n");
 
-out:
 	free(target);
-	return ret;
 }
 
-int get_node(struct umad_resources *umad_res, uint16_t dlid, uint64_t *guid)
+static void free_port(struct discover_port *port)
 {
-	struct srp_ib_user_mad		out_mad, in_mad;
-	struct umad_sa_packet	       *out_sa_mad, *in_sa_mad;
-	struct srp_sa_node_rec	       *node;
+	if (!port->cached_iocs)
+		free_iocs(port->iocs, port->iou_info.max_controllers);
+	free(port);
+}
 
-	in_sa_mad = get_data_ptr(in_mad);
-	out_sa_mad = get_data_ptr(out_mad);
+static bool port_has_pkeys(struct discover_port *port)
+{
+	int i;
 
-	init_srp_sa_mad(&out_mad, umad_res->agent, umad_res->sm_lid,
-		        UMAD_SA_ATTR_NODE_REC, 0);
+	for (i = 0; i < SRP_MAX_SHARED_PKEYS; ++i)
+		if (port->pkeys[i])
+			return true;
 
-	out_sa_mad->comp_mask     = htobe64(1); /* LID */
-	node			  = (void *) out_sa_mad->data;
-	node->lid		  = htobe16(dlid);
+	return false;
+}
 
-	if (send_and_get(umad_res->portid, umad_res->agent, &out_mad, &in_mad, 0) < 0)
-		return -1;
+/* Moves the port on until it waits for MADs or is done */
+static void discover_advance(struct discover *disc, struct discover_port *port)
+{
+	int i;
 
-	node  = (void *) in_sa_mad->data;
-	*guid = be64toh(node->port_guid);
+	while (!port->pending && port->state != DISCOVER_DONE) {
+		switch (port->state) {
+		case DISCOVER_PORT:
+			if (port->cached && !port->failed &&
+			    !same_port_info(&port->cached->port_info,
+					    &port->port_info)) {
+				/* PortInfo changed, query the shared P_Keys */
+				port->cached = NULL;
+				memset(port->pkeys, 0, sizeof(port->pkeys));
+				for (i = 0; i < disc->num_local_pkeys; ++i)
+					queue_path_rec(disc, port, i);
+				break;
+			}
 
-	return 0;
+			if (port->failed || !port->isdm || !port_has_pkeys(port)) {
+				port->state = DISCOVER_DONE;
+				break;
+			}
+
+			port->state = DISCOVER_CPI;
+			if ((port->h_guid & oui_mask) == topspin_oui)
+				queue_class_port_info(disc, port);
+			break;
+		case DISCOVER_CPI:
+			port->state = DISCOVER_IOU;
+			queue_iou_info(disc, port);
+			break;
+		case DISCOVER_IOU:
+			if (port->failed) {
+				port->state = DISCOVER_DONE;
+				break;
+			}
+
+			port->state = DISCOVER_IOC;
+			if (port->cached_iocs)
+				break;
+			for (i = 0; i < port->iou_info.max_controllers; ++i)
+				if (ioc_state(&port->iou_info, i) ==
+				    SRP_DM_IOC_PRESENT)
+					queue_ioc_prof(disc, port, i + 1);
+			break;
+		case DISCOVER_IOC:
+			for (i = 0; i < SRP_MAX_SHARED_PKEYS; ++i)
+				if (port->pkeys[i])
+					report_port(disc, port,
+						    port->pkeys[i]);
+			if (disc->scan)
+				cache_store(port);
+			port->state = DISCOVER_DONE;
+			break;
+		case DISCOVER_DONE:
+			break;
+		}
+	}
+
+	if (port->state == DISCOVER_DONE)
+		free_port(port);
 }
 
-static int get_port_info(struct umad_resources *umad_res, uint16_t dlid,
-			 uint64_t *subnet_prefix, int *isdm)
+static void discover_complete(struct discover *disc, struct discover_mad *mad,
+			      void *data)
 {
-	struct srp_ib_user_mad		out_mad, in_mad;
-	struct umad_sa_packet	       *out_sa_mad, *in_sa_mad;
-	struct srp_sa_port_info_rec    *port_info;
+	struct discover_port *port = mad->port;
 
-	in_sa_mad = get_data_ptr(in_mad);
-	out_sa_mad = get_data_ptr(out_mad);
+	mad->done(disc, mad, data);
+	free(mad);
 
-	init_srp_sa_mad(&out_mad, umad_res->agent, umad_res->sm_lid,
-		        UMAD_SA_ATTR_PORT_INFO_REC, 0);
+	port->pending--;
+	discover_advance(disc, port);
+}
 
-	out_sa_mad->comp_mask     = htobe64(1); /* LID */
-	port_info                 = (void *) out_sa_mad->data;
-	port_info->endport_lid	  = htobe16(dlid);
+static bool discover_start_port(struct discover *disc)
+{
+	struct discover_port *port;
+	int i;
 
-	if (send_and_get(umad_res->portid, umad_res->agent, &out_mad, &in_mad, 0) < 0)
-		return -1;
+	port = list_pop(&disc->waiting, struct discover_port, entry);
+	if (!port)
+		return false;
+
+	if (disc->scan)
+		port->cached = port->h_guid ? cache_find_guid(port->h_guid) :
+					      cache_find_lid(port->lid);
+	if (port->cached && port->has_port_info &&
+	    !same_port_info(&port->cached->port_info, &port->port_info))
+		port->cached = NULL;
+	if (port->cached) {
+		port->h_guid = port->cached->h_guid;
+		memcpy(port->pkeys, port->cached->pkeys, sizeof(port->pkeys));
+		port->flags &= ~(DISCOVER_NEED_NODE | DISCOVER_NEED_PKEYS);
+	}
+
+	if (port->flags & DISCOVER_NEED_NODE)
+		queue_node_rec(disc, port);
+	if (port->flags & DISCOVER_NEED_PORT_INFO)
+		queue_port_info(disc, port);
+	if (port->flags & DISCOVER_NEED_PKEYS)
+		for (i = 0; i < disc->num_local_pkeys; ++i)
+			queue_path_rec(disc, port, i);
+
+	discover_advance(disc, port);
+	return true;
+}
+
+/*
+ * Fills the window.  Ports are only started once the MADs of the ports
+ * before them have been sent, so the queue stays short on large fabrics.
+ */
+static void discover_send(struct discover *disc)
+{
+	struct umad_resources	       *umad_res = disc->res->umad_res;
+	struct umad_dm_packet	       *out_dm_mad;
+	struct discover_mad	       *mad;
+	int				retries, slot = 0;
 
-	port_info = (void *) in_sa_mad->data;
-	*subnet_prefix = be64toh(port_info->subnet_prefix);
-	*isdm          = !!(be32toh(port_info->capability_mask) & SRP_IS_DM);
+	retries = config->mad_retries > 1 ? config->mad_retries - 1 : 0;
 
-	return 0;
+	while (disc->in_flight < config->mad_window) {
+		mad = list_pop(&disc->queue, struct discover_mad, entry);
+		if (!mad) {
+			if (discover_start_port(disc))
+				continue;
+			break;
+		}
+
+		mad->tid = next_tid();
+		out_dm_mad = get_data_ptr(mad->umad);
+		out_dm_mad->mad_hdr.tid = htobe64(mad->tid);
+
+		if (umad_send(umad_res->portid, umad_res->agent, &mad->umad,
+			      MAD_BLOCK_SIZE, config->timeout, retries) < 0) {
+			pr_err("umad_send to %u failed\n", mad->port->lid);
+			discover_complete(disc, mad, NULL);
+			continue;
+		}
+
+		while (disc->window[slot])
+			++slot;
+		disc->window[slot] = mad;
+		disc->in_flight++;
+	}
 }
 
-int pkey_index_to_pkey(struct umad_resources *umad_res, int pkey_index,
-		       uint16_t *pkey)
+static void discover_fail_all(struct discover *disc)
 {
-	char pkey_file[18], pkey_str[16];
+	struct discover_mad *mad;
+	int i;
 
-	/* Read pkey */
-	snprintf(pkey_file, sizeof(pkey_file), "pkeys/%d", pkey_index);
-	if (srpd_sys_read_string(umad_res->port_sysfs_path, pkey_file,
-				 pkey_str, sizeof(pkey_str)) < 0)
-		return -1;
+	for (i = 0; i < config->mad_window; ++i) {
+		mad = disc->window[i];
+		if (!mad)
+			continue;
 
-	*pkey = strtoul(pkey_str, NULL, 0);
-	if (*pkey)
-		pr_debug("discover Targets for P_key %04x (index %d)\n",
-			 *pkey, pkey_index);
-	return 0;
+		disc->window[i] = NULL;
+		disc->in_flight--;
+		discover_complete(disc, mad, NULL);
+	}
 }
 
-static int get_shared_pkeys(struct resources *res,
-			    uint16_t dest_port_lid,
-			    uint16_t *pkeys)
+/*
+ * Timed out requests are returned by the kernel with a status instead of a
+ * response, so a single completion is always expected.  The receive only
+ * times out if the kernel lost track of the requests in flight.
+ */
+static void discover_recv(struct discover *disc)
 {
-	struct umad_resources          *umad_res = res->umad_res;
-	uint8_t                        *in_mad_buf;
-	struct srp_ib_user_mad		out_mad;
-	struct ib_user_mad	       *in_mad;
-	struct umad_sa_packet	       *out_sa_mad, *in_sa_mad;
-	struct ib_path_rec	       *path_rec;
-	ssize_t len;
-	int i, num_pkeys = 0;
-	uint16_t pkey;
-	uint16_t local_port_lid = get_port_lid(res->ud_res->ib_ctx,
-					       config->port_num, NULL);
+	struct umad_resources	       *umad_res = disc->res->umad_res;
+	struct umad_dm_packet	       *in_dm_mad = (void *) disc->in_mad->data;
+	struct discover_mad	       *mad;
+	uint32_t			tid;
+	int				agent, len, status, i;
+
+	len = node_table_response_size;
+	agent = umad_recv(umad_res->portid, disc->in_mad, &len,
+			  config->timeout * (config->mad_retries + 1));
+	if (agent < 0) {
+		pr_err("umad_recv failed - %d\n", agent);
+		discover_fail_all(disc);
+		return;
+	}
+	if (agent != umad_res->agent) {
+		pr_debug("umad_recv returned different agent\n");
+		return;
+	}
 
-	in_mad_buf = malloc(sizeof(struct ib_user_mad) +
-			    node_table_response_size);
-	if (!in_mad_buf)
-		return -ENOMEM;
+	tid = be64toh(in_dm_mad->mad_hdr.tid);
+	for (i = 0; i < config->mad_window; ++i)
+		if (disc->window[i] && disc->window[i]->tid == tid)
+			break;
+	if (i == config->mad_window) {
+		pr_debug("umad_recv returned unknown transaction id %u\n", tid);
+		return;
+	}
 
-	in_mad = (void *)in_mad_buf;
-	in_sa_mad = (void *)in_mad->data;
-	out_sa_mad = get_data_ptr(out_mad);
+	mad = disc->window[i];
+	disc->window[i] = NULL;
+	disc->in_flight--;
 
-	init_srp_sa_mad(&out_mad, umad_res->agent, umad_res->sm_lid,
-		        UMAD_SA_ATTR_PATH_REC, 0);
+	status = umad_status(disc->in_mad);
+	if (status) {
+		pr_err("bad MAD status (%u) from lid %#x\n", status,
+		       mad->port->lid);
+		discover_complete(disc, mad, NULL);
+		return;
+	}
 
-	/**
-	 * Due to OpenSM bug (issue #335016) SM won't return
-	 * table of all shared P_Keys, it will return only the first
-	 * shared P_Key, So we send path_rec over each P_Key in the P_Key
-	 * table. SM will return path record if P_Key is shared or else None.
-	 * Once SM bug will be fixed, this loop should be removed.
-	 **/
-	for (i = 0; ; i++) {
-		if (pkey_index_to_pkey(umad_res, i, &pkey))
+	discover_complete(disc, mad, in_dm_mad);
+}
+
+static void discover_run(struct discover *disc)
+{
+	for (;;) {
+		discover_send(disc);
+		if (!disc->in_flight)
 			break;
-		if (!pkey)
-			continue;
+		discover_recv(disc);
+	}
+}
 
-		/* Mark components: DLID, SLID, PKEY */
-		out_sa_mad->comp_mask = htobe64(1 << 4 | 1 << 5 | 1 << 13);
-		path_rec = (struct ib_path_rec *)out_sa_mad->data;
-		path_rec->slid = htobe16(local_port_lid);
-		path_rec->dlid = htobe16(dest_port_lid);
-		path_rec->pkey = htobe16(pkey);
-
-		len = send_and_get(umad_res->portid, umad_res->agent, &out_mad,
-				   (struct srp_ib_user_mad *)in_mad,
-				   node_table_response_size);
-		if (len < 0)
-			goto err;
+static struct discover_port *discover_add_port(struct discover *disc,
+					       uint16_t lid, unsigned int flags)
+{
+	struct discover_port *port;
 
-		path_rec = (struct ib_path_rec *)in_sa_mad->data;
-		pkeys[num_pkeys++] = be16toh(path_rec->pkey);
+	port = calloc(1, sizeof(*port));
+	if (!port) {
+		pr_err("out of memory\n");
+		return NULL;
 	}
 
-	free(in_mad_buf);
-	return num_pkeys;
-err:
-	free(in_mad_buf);
-	return -1;
+	port->lid = lid;
+	port->flags = flags;
+	list_add_tail(&disc->waiting, &port->entry);
+
+	return port;
 }
 
+/*
+ * A rescan reads the local P_Keys, and its results are cached until the
+ * next rescan.
+ */
+static int discover_init(struct discover *disc, struct resources *res,
+			 bool scan)
+{
+	uint16_t pkey;
+	int i;
+
+	memset(disc, 0, sizeof(*disc));
+	disc->res = res;
+	disc->scan = scan;
+	list_head_init(&disc->waiting);
+	list_head_init(&disc->queue);
+
+	disc->window = calloc(config->mad_window, sizeof(*disc->window));
+	disc->in_mad = malloc(sizeof(struct ib_user_mad) +
+			      node_table_response_size);
+	if (!disc->window || !disc->in_mad ||
+	    read_srp_hosts(&disc->hosts)) {
+		free(disc->window);
+		free(disc->in_mad);
+		return -ENOMEM;
+	}
+
+	if (!scan)
+		return 0;
+
+	disc->local_lid = get_port_lid(res->ud_res->ib_ctx, config->port_num,
+				       NULL);
+	for (i = 0; disc->num_local_pkeys < SRP_MAX_SHARED_PKEYS; ++i) {
+		if (pkey_index_to_pkey(res->umad_res, i, &pkey))
+			break;
+		if (pkey)
+			disc->local_pkeys[disc->num_local_pkeys++] = pkey;
+	}
+
+	cache_begin_scan(disc);
+	return 0;
+}
+
+static void discover_cleanup(struct discover *disc)
+{
+	struct discover_port *port;
+
+	while ((port = list_pop(&disc->waiting, struct discover_port, entry)))
+		free_port(port);
+
+	free(disc->window);
+	free(disc->in_mad);
+	free(disc->hosts.hosts);
+}
+
+/* Forgets the ports that the rescan did not find */
+static void discover_end_scan(struct discover *disc)
+{
+	struct cache_port *cached, *next;
+
+	list_for_each_safe(&target_cache.ports, cached, next, entry)
+		if (cached->scan != target_cache.scan)
+			cache_drop(cached);
+
+	save_target_cache();
+}
+
+
 static int do_dm_port_list(struct resources *res)
 {
 	struct umad_resources 	       *umad_res = res->umad_res;
-	uint8_t                        *in_mad_buf;
 	struct srp_ib_user_mad		out_mad;
 	struct ib_user_mad	       *in_mad;
 	struct umad_sa_packet	       *out_sa_mad, *in_sa_mad;
 	struct srp_sa_port_info_rec    *port_info;
+	struct discover_port	       *port;
+	struct discover			disc;
 	ssize_t len;
 	int size;
-	int i, j,num_pkeys;
-	uint16_t pkeys[SRP_MAX_SHARED_PKEYS];
-	uint64_t guid;
+	int i, ret;
 
-	in_mad_buf = malloc(sizeof(struct ib_user_mad) +
-			    node_table_response_size);
-	if (!in_mad_buf)
-		return -ENOMEM;
+	ret = discover_init(&disc, res, true);
+	if (ret)
+		return ret;
 
-	in_mad     = (void *) in_mad_buf;
+	in_mad     = disc.in_mad;
 	in_sa_mad  = (void *) in_mad->data;
 	out_sa_mad = get_data_ptr(out_mad);
 
@@ -1191,78 +2163,78 @@ static int do_dm_port_list(struct resources *res)
 			   (struct srp_ib_user_mad *) in_mad,
 			   node_table_response_size);
 	if (len < 0) {
-		free(in_mad_buf);
+		discover_cleanup(&disc);
 		return len;
 	}
 
 	size = ib_get_attr_size(in_sa_mad->attr_offset);
-	if (!size) {
-		if (config->verbose) {
-			printf("Query did not find any targets\n");
-		}
-		free(in_mad_buf);
-		return 0;
-	}
+	if (!size && config->verbose)
+		printf("Query did not find any targets\n");
 
-	for (i = 0; (i + 1) * size <= len - MAD_RMPP_HDR_SIZE; ++i) {
+	for (i = 0; size && (i + 1) * size <= len - MAD_RMPP_HDR_SIZE; ++i) {
 		port_info = (void *) in_sa_mad->data + i * size;
-		if (get_node(umad_res, be16toh(port_info->endport_lid), &guid))
-			continue;
-
-		num_pkeys = get_shared_pkeys(res, be16toh(port_info->endport_lid),
-					     pkeys);
-		if (num_pkeys < 0) {
-			pr_err("failed to get shared P_Keys with LID %#x\n",
-			       be16toh(port_info->endport_lid));
-			free(in_mad_buf);
-			return num_pkeys;
-		}
+		port = discover_add_port(&disc, be16toh(port_info->endport_lid),
+					 DISCOVER_NEED_NODE |
+					 DISCOVER_NEED_PKEYS);
+		if (!port)
+			break;
 
-		for (j = 0; j < num_pkeys; ++j)
-			do_port(res, pkeys[j], be16toh(port_info->endport_lid),
-				be64toh(port_info->subnet_prefix), guid);
+		memcpy(&port->port_info, port_info, sizeof(port->port_info));
+		port->has_port_info = true;
+		port->subnet_prefix = be64toh(port_info->subnet_prefix);
+		port->isdm = true;
 	}
 
-	free(in_mad_buf);
-	return 0;
+	discover_run(&disc);
+	discover_end_scan(&disc);
+	ret = disc.ret;
+
+	discover_cleanup(&disc);
+	return ret;
 }
 
 void handle_port(struct resources *res, uint16_t pkey, uint16_t lid, uint64_t h_guid)
 {
-	struct umad_resources *umad_res = res->umad_res;
-	uint64_t subnet_prefix;
-	int isdm;
+	struct discover_port *port;
+	struct discover disc;
 
 	pr_debug("enter handle_port for lid %#x\n", lid);
-	if (get_port_info(umad_res, lid, &subnet_prefix, &isdm))
-		return;
 
-	if (!isdm)
+	/* The trap may announce a change that the cache cannot detect */
+	cache_drop(cache_find_guid(h_guid));
+
+	if (discover_init(&disc, res, false))
 		return;
 
-	do_port(res, pkey, lid, subnet_prefix, h_guid);
+	port = discover_add_port(&disc, lid, DISCOVER_NEED_PORT_INFO);
+	if (port) {
+		port->h_guid = h_guid;
+		port->pkeys[0] = pkey;
+		discover_run(&disc);
+	}
+
+	discover_cleanup(&disc);
 }
 
 
 static int do_full_port_list(struct resources *res)
 {
 	struct umad_resources 	       *umad_res = res->umad_res;
-	uint8_t                        *in_mad_buf;
 	struct srp_ib_user_mad		out_mad;
 	struct ib_user_mad	       *in_mad;
 	struct umad_sa_packet	       *out_sa_mad, *in_sa_mad;
 	struct srp_sa_node_rec	       *node;
+	struct discover_port	       *port;
+	struct discover			disc;
 	ssize_t len;
 	int size;
-	int i, j, num_pkeys;
-	uint16_t pkeys[SRP_MAX_SHARED_PKEYS];
+	int i, ret;
 
-	in_mad_buf = malloc(sizeof(struct ib_user_mad) +
-			    node_table_response_size);
-	if (!in_mad_buf)
-		return -ENOMEM;
+	ret = discover_init(&disc, res, true);
+	if (ret)
+		return ret;
 
-	in_mad     = (void *) in_mad_buf;
+	in_mad     = disc.in_mad;
 	in_sa_mad  = (void *) in_mad->data;
 	out_sa_mad = get_data_ptr(out_mad);
 
@@ -1278,7 +2250,7 @@ static int do_full_port_list(struct resources *res)
 			   (struct srp_ib_user_mad *) in_mad,
 			   node_table_response_size);
 	if (len < 0) {
-		free(in_mad_buf);
+		discover_cleanup(&disc);
 		return len;
 	}
 
@@ -1286,25 +2258,24 @@ static int do_full_port_list(struct resources *res)
 
 	for (i = 0; (i + 1) * size <= len - MAD_RMPP_HDR_SIZE; ++i) {
 		node = (void *) in_sa_mad->data + i * size;
+		port = discover_add_port(&disc, be16toh(node->lid),
+					 DISCOVER_NEED_PORT_INFO |
+					 DISCOVER_NEED_PKEYS);
+		if (!port)
+			break;
 
-		num_pkeys = get_shared_pkeys(res, be16toh(node->lid),
-					     pkeys);
-		if (num_pkeys < 0) {
-			pr_err("failed to get shared P_Keys with LID %#x\n",
-			       be16toh(node->lid));
-			free(in_mad_buf);
-			return num_pkeys;
-		}
-
-		for (j = 0; j < num_pkeys; ++j)
-			(void) handle_port(res, pkeys[j], be16toh(node->lid),
-					   be64toh(node->port_guid));
+		port->h_guid = be64toh(node->port_guid);
 	}
 
-	free(in_mad_buf);
-	return 0;
+	discover_run(&disc);
+	discover_end_scan(&disc);
+	ret = disc.ret;
+
+	discover_cleanup(&disc);
+	return ret;
 }
 
+
 struct config_t *config;
 
 static void print_config(struct config_t *conf)
@@ -1317,12 +2288,15 @@ static void print_config(struct config_t *conf)
 	printf(" Mad Retries                		: %d\n", conf->mad_retries);
 	printf(" Number of outstanding WR   		: %u\n", conf->num_of_oust);
 	printf(" Mad timeout (msec)	     		: %u\n", conf->timeout);
+	printf(" Mad window                 		: %d\n", conf->mad_window);
 	printf(" Prints add target command  		: %d\n", conf->cmd);
  	printf(" Executes add target command		: %d\n", conf->execute);
  	printf(" Print also connected targets 		: %d\n", conf->all);
  	printf(" Report current targets and stop 	: %d\n", conf->once);
 	if (conf->rules_file)
 		printf(" Reads rules from 			: %s\n", conf->rules_file);
+	if (conf->cache_file)
+		printf(" Target cache file          		: %s\n", conf->cache_file);
 	if (conf->print_initiator_ext)
 		printf(" Print initiator_ext\n");
 	else
@@ -1596,7 +2570,7 @@ static const struct option long_opts[] = {
 	{ "systemd",        0, NULL, 'S' },
 	{}
 };
-static const char short_opts[] = "caveod:i:j:p:t:r:R:T:l:Vhnf:";
+static const char short_opts[] = "caveod:i:j:p:t:r:w:R:T:l:Vhnf:C:";
 
 /* Check if the --systemd options was passed in very early so we can setup
  * logging properly.
@@ -1633,6 +2607,7 @@ static int get_config(struct config_t *conf, int argc, char *argv[])
 	conf->debug_verbose    		= 0;
 	conf->timeout	 		= 5000;
 	conf->mad_retries 		= 3;
+	conf->mad_window 		= 16;
 	conf->recalc_time 		= 0;
 	conf->retry_timeout 		= 20;
 	conf->add_target_file  		= NULL;
@@ -1715,6 +2690,13 @@ static int get_config(struct config_t *conf, int argc, char *argv[])
 				return -1;
 			}
 			break;
+		case 'w':
+			conf->mad_window = atoi(optarg);
+			if (conf->mad_window <= 0) {
+				pr_err("Bad mad window - %s\n", optarg);
+				return -1;
+			}
+			break;
 		case 'R':
 			conf->recalc_time = atoi(optarg);
 			if (conf->recalc_time == 0) {
@@ -1732,6 +2714,9 @@ static int get_config(struct config_t *conf, int argc, char *argv[])
 		case 'f':
 			conf->rules_file = optarg;
 			break;
+		case 'C':
+			conf->cache_file = optarg;
+			break;
 		case 'l':
 			conf->tl_retry_count = atoi(optarg);
 			if (conf->tl_retry_count < 2 ||
@@ -1854,7 +2839,7 @@ static void *run_thread_retry_to_connect(void *res_in)
 			if (sleep_time > 0)
 				srp_sleep(sleep_time, 0);
 
-			add_non_exist_target(target);
+			add_non_exist_target(target, NULL);
 			free(target);
 			pthread_mutex_lock(&res->sync_res->retry_mutex);
 		}
@@ -2025,6 +3010,7 @@ static int ibsrpdm(int argc, char *argv[])
 	config->num_of_oust = 10;
 	config->timeout = 5000;
 	config->mad_retries = 3;
+	config->mad_window = 16;
 	config->all = 1;
 	config->once = 1;
 
@@ -2155,6 +3141,8 @@ int main(int argc, char *argv[])
 	if (ret)
 		goto cleanup_wakeup;
 
+	load_target_cache();
+
 catas_start:
 	subscribed = 0;
 
@@ -2323,6 +3311,7 @@ close_lockfd:
 		close(lockfd);
 cleanup_wakeup:
 	cleanup_wakeup_fd();
+	cache_flush();
 free_config:
 	free_config(config);
 close_log:
@@ -196,6 +196,7 @@ struct config_t {
 	int		port_num;
 	char	       *add_target_file;
 	int		mad_retries;
+	int		mad_window;
 	int		num_of_oust;
 	int		cmd;
 	int		once;
@@ -207,6 +208,7 @@ struct config_t {
 	int		recalc_time;
 	int		print_initiator_ext;
 	const char     *rules_file;
+	const char     *cache_file;
 	struct rule    *rules;
 	int 		retry_timeout;
 	int		tl_retry_count;
@@ -0,0 +1,364 @@
+/*
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Runs the discovery engine of srp_daemon against a fake SA and DM without
+ * an HCA.  Like umad_batch_test, the umad port is one end of a
+ * SOCK_SEQPACKET socketpair and a thread plays the kernel and the fabric
+ * on the other end.  The fabric holds back its answers until the daemon
+ * stops sending and then answers the newest request first, so the window
+ * is kept full and completions arrive out of order.
+ *
+ * srp_daemon relies on the ib_user_mad layout of current kernels, but the
+ * fake port is not opened through umad_open_port() and so umad_send()
+ * leaves the last 8 bytes of each request out.  No request uses them, and
+ * the answers are written with the full header like a current kernel does.
+ */
+
+#define main srp_daemon_main
+int srp_daemon_main(int argc, char *argv[]);
+#include "srp_daemon.c"
+#undef main
+
+#include <poll.h>
+#include <sys/socket.h>
+
+#define TEST_AGENT	3
+#define MAD_WINDOW	4
+#define MAX_HELD	64
+
+/*
+ * Ports 1 to NUM_PORTS are discovered.  All but NON_DM_LID are device
+ * managers with controllers 1 and 3 present, and every controller has
+ * NUM_SVC service entries.  Only ports with even LIDs share the second
+ * local P_Key, and the IOControllerProfile query of controller 3 of
+ * TIMEOUT_LID times out.
+ */
+#define NUM_PORTS	6
+#define NON_DM_LID	6
+#define TIMEOUT_LID	5
+#define TIMEOUT_IOC	3
+#define NUM_SVC		5
+
+/* NodeRecord, PortInfoRecord and two PathRecords per port */
+#define PORT_MADS	4
+/* IOUnitInfo, two IOControllerProfiles and two ServiceEntries each */
+#define DM_MADS		(1 + 2 * (1 + (NUM_SVC + 3) / 4))
+#define EXPECTED_MADS	(NUM_PORTS * PORT_MADS + \
+			 (NUM_PORTS - 1) * DM_MADS - (NUM_SVC + 3) / 4)
+#define EXPECTED_TARGETS ((NUM_PORTS - 1) * 2 * NUM_SVC - NUM_SVC)
+
+static int test_failures = 0;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			printf(" FAIL at line %d: %s\n", __LINE__, #cond);	\
+			test_failures++;				\
+		}							\
+	} while (0)
+
+struct fake_fabric {
+	int			fd;
+	int			num_mads;
+	int			max_outstanding;
+	int			num_held;
+	struct srp_ib_user_mad	held[MAX_HELD];
+};
+
+static uint64_t port_guid(uint16_t lid)
+{
+	return 0x0002c90300000000ull | lid;
+}
+
+static uint64_t target_id_ext(uint16_t lid, int ioc, int svc)
+{
+	return (uint64_t) lid << 16 | ioc << 8 | svc;
+}
+
+static void answer_sa(struct srp_ib_user_mad *mad)
+{
+	struct umad_sa_packet *sa_mad = get_data_ptr(*mad);
+	struct srp_sa_port_info_rec *port_info = (void *) sa_mad->data;
+	struct srp_sa_node_rec *node = (void *) sa_mad->data;
+	struct ib_path_rec *path_rec = (void *) sa_mad->data;
+	uint16_t lid, pkey;
+
+	switch (be16toh(sa_mad->mad_hdr.attr_id)) {
+	case UMAD_SA_ATTR_NODE_REC:
+		lid = be16toh(node->lid);
+		CHECK(lid >= 1 && lid <= NUM_PORTS);
+		node->port_guid = htobe64(port_guid(lid));
+		break;
+	case UMAD_SA_ATTR_PORT_INFO_REC:
+		lid = be16toh(port_info->endport_lid);
+		CHECK(lid >= 1 && lid <= NUM_PORTS);
+		port_info->subnet_prefix = htobe64(0xfe80000000000000ull);
+		if (lid != NON_DM_LID)
+			port_info->capability_mask = htobe32(SRP_IS_DM);
+		break;
+	case UMAD_SA_ATTR_PATH_REC:
+		lid = be16toh(path_rec->dlid);
+		pkey = be16toh(path_rec->pkey);
+		CHECK(pkey == 0xffff || pkey == 0x8001);
+		if (pkey == 0x8001 && lid % 2)
+			sa_mad->mad_hdr.status =
+				htobe16(UMAD_SA_STATUS_NO_RECORDS << 8);
+		break;
+	default:
+		CHECK(false);
+		break;
+	}
+}
+
+static void answer_dm(struct srp_ib_user_mad *mad)
+{
+	struct umad_dm_packet *dm_mad = get_data_ptr(*mad);
+	struct srp_dm_iou_info *iou_info = (void *) dm_mad->data;
+	struct srp_dm_ioc_prof *ioc_prof = (void *) dm_mad->data;
+	struct srp_dm_svc_entries *svc_entries = (void *) dm_mad->data;
+	uint16_t lid = be16toh(mad->hdr.addr.lid);
+	uint32_t attr_mod = be32toh(dm_mad->mad_hdr.attr_mod);
+	int ioc, start, end, k;
+
+	CHECK(lid >= 1 && lid <= NUM_PORTS && lid != NON_DM_LID);
+
+	switch (be16toh(dm_mad->mad_hdr.attr_id)) {
+	case SRP_DM_ATTR_IO_UNIT_INFO:
+		memset(iou_info, 0, sizeof(*iou_info));
+		iou_info->change_id = htobe16(1);
+		iou_info->max_controllers = 3;
+		iou_info->controller_list[0] = SRP_DM_IOC_PRESENT << 4 |
+					       SRP_DM_NO_IOC;
+		iou_info->controller_list[1] = SRP_DM_IOC_PRESENT << 4;
+		break;
+	case SRP_DM_ATTR_IO_CONTROLLER_PROFILE:
+		ioc = attr_mod;
+		CHECK(ioc == 1 || ioc == 3);
+		if (lid == TIMEOUT_LID && ioc == TIMEOUT_IOC) {
+			/* The kernel returns the request itself */
+			mad->hdr.status = ETIMEDOUT;
+			break;
+		}
+		memset(ioc_prof, 0, sizeof(*ioc_prof));
+		ioc_prof->guid = htobe64(port_guid(lid) << 8 | ioc);
+		ioc_prof->io_class = htobe16(SRP_REV16A_IB_IO_CLASS);
+		ioc_prof->service_entries = NUM_SVC;
+		break;
+	case SRP_DM_ATTR_SERVICE_ENTRIES:
+		ioc = attr_mod >> 16;
+		end = (attr_mod >> 8) & 0xff;
+		start = attr_mod & 0xff;
+		CHECK(start % 4 == 0 && end >= start && end < NUM_SVC &&
+		      end - start < 4);
+		memset(svc_entries, 0, sizeof(*svc_entries));
+		for (k = 0; k <= end - start; ++k) {
+			snprintf(svc_entries->service[k].name,
+				 sizeof(svc_entries->service[k].name),
+				 "SRP.T10:%016llx", (unsigned long long)
+				 target_id_ext(lid, ioc, start + k));
+			svc_entries->service[k].id =
+				htobe64(target_id_ext(lid, ioc, start + k));
+		}
+		break;
+	default:
+		CHECK(false);
+		break;
+	}
+}
+
+static void answer(struct fake_fabric *fabric, struct srp_ib_user_mad *mad)
+{
+	struct umad_hdr *hdr = get_data_ptr(*mad);
+
+	hdr->method = UMAD_METHOD_GET_RESP;
+	if (hdr->mgmt_class == UMAD_CLASS_SUBN_ADM)
+		answer_sa(mad);
+	else if (hdr->mgmt_class == UMAD_CLASS_DEVICE_MGMT)
+		answer_dm(mad);
+	else
+		CHECK(false);
+
+	CHECK(write(fabric->fd, mad, sizeof(*mad)) == sizeof(*mad));
+}
+
+static void *run_fake_fabric(void *arg)
+{
+	struct fake_fabric *fabric = arg;
+	struct pollfd pfd = { .fd = fabric->fd, .events = POLLIN };
+	struct srp_ib_user_mad *mad;
+	ssize_t len;
+
+	for (;;) {
+		if (!poll(&pfd, 1, fabric->num_held ? 5 : -1)) {
+			/* The daemon waits for an answer */
+			answer(fabric, &fabric->held[--fabric->num_held]);
+			continue;
+		}
+
+		CHECK(fabric->num_held < MAX_HELD);
+		if (fabric->num_held == MAX_HELD)
+			break;
+
+		mad = &fabric->held[fabric->num_held];
+		memset(mad, 0, sizeof(*mad));
+		len = read(fabric->fd, mad, sizeof(*mad));
+		if (len <= 0)
+			break;
+
+		CHECK(len == umad_size() + MAD_BLOCK_SIZE);
+		CHECK(mad->hdr.agent_id == TEST_AGENT);
+		fabric->num_mads++;
+		fabric->num_held++;
+		if (fabric->num_held > fabric->max_outstanding)
+			fabric->max_outstanding = fabric->num_held;
+	}
+
+	return NULL;
+}
+
+static bool expected_target(const struct srp_host *host)
+{
+	uint16_t lid = host->id_ext >> 16;
+	int ioc = (host->id_ext >> 8) & 0xff;
+	int svc = host->id_ext & 0xff;
+
+	return lid >= 1 && lid < NON_DM_LID && (ioc == 1 || ioc == 3) &&
+	       !(lid == TIMEOUT_LID && ioc == TIMEOUT_IOC) && svc < NUM_SVC &&
+	       host->service_id == host->id_ext &&
+	       host->ioc_guid == (port_guid(lid) << 8 | ioc) &&
+	       host->dgid.global.interface_id == htobe64(port_guid(lid)) &&
+	       host->pkey == 0xffff;
+}
+
+int main(void)
+{
+	static char add_target_file[] = "/dev/null";
+	struct config_t conf = {
+		.add_target_file	= add_target_file,
+		.mad_retries		= 3,
+		.mad_window		= MAD_WINDOW,
+		.once			= 1,
+		.execute		= 1,
+		.timeout		= 1000,
+	};
+	struct umad_resources umad_res = {
+		.agent			= TEST_AGENT,
+		.sm_lid			= 1,
+	};
+	struct resources res = { .umad_res = &umad_res };
+	struct fake_fabric *fabric;
+	struct discover_port *port;
+	struct discover disc;
+	pthread_t thread;
+	int fds[2], i, j;
+
+	config = &conf;
+	s_log_dest = log_to_stderr;
+
+	fabric = calloc(1, sizeof(*fabric));
+	if (!fabric || socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds)) {
+		perror("socketpair");
+		return 1;
+	}
+	umad_res.portid = fds[0];
+	fabric->fd = fds[1];
+
+	/* discover_init() without the sysfs reads of a real port */
+	memset(&disc, 0, sizeof(disc));
+	disc.res = &res;
+	list_head_init(&disc.waiting);
+	list_head_init(&disc.queue);
+	disc.window = calloc(config->mad_window, sizeof(*disc.window));
+	disc.in_mad = malloc(sizeof(struct ib_user_mad) +
+			     node_table_response_size);
+	if (!disc.window || !disc.in_mad) {
+		perror("malloc");
+		return 1;
+	}
+	disc.local_lid = 0x100;
+	disc.local_pkeys[disc.num_local_pkeys++] = 0xffff;
+	disc.local_pkeys[disc.num_local_pkeys++] = 0x8001;
+
+	for (i = 1; i <= NUM_PORTS; ++i) {
+		port = discover_add_port(&disc, i, DISCOVER_NEED_NODE |
+					 DISCOVER_NEED_PORT_INFO |
+					 DISCOVER_NEED_PKEYS);
+		CHECK(port);
+	}
+
+	if (pthread_create(&thread, NULL, run_fake_fabric, fabric)) {
+		perror("pthread_create");
+		return 1;
+	}
+
+	printf("Discovering %d ports with a window of %d MADs\n", NUM_PORTS,
+	       MAD_WINDOW);
+	discover_run(&disc);
+
+	close(umad_res.portid);
+	pthread_join(thread, NULL);
+	close(fabric->fd);
+
+	CHECK(disc.in_flight == 0);
+	CHECK(list_empty(&disc.waiting));
+	CHECK(list_empty(&disc.queue));
+	for (i = 0; i < MAD_WINDOW; ++i)
+		CHECK(!disc.window[i]);
+	CHECK(disc.ret == 0);
+
+	printf("%d MADs, at most %d in flight\n", fabric->num_mads,
+	       fabric->max_outstanding);
+	CHECK(fabric->num_mads == EXPECTED_MADS);
+	CHECK(fabric->max_outstanding == MAD_WINDOW);
+	CHECK(fabric->num_held == 0);
+
+	/* Each target is added once, on the first P_Key that it shares */
+	printf("%d targets added\n", disc.hosts.num);
+	CHECK(disc.hosts.num == EXPECTED_TARGETS);
+	for (i = 0; i < disc.hosts.num; ++i) {
+		CHECK(expected_target(&disc.hosts.hosts[i]));
+		for (j = 0; j < i; ++j)
+			CHECK(disc.hosts.hosts[j].id_ext !=
+			      disc.hosts.hosts[i].id_ext);
+	}
+
+	discover_cleanup(&disc);
+	free(fabric);
+
+	if (test_failures) {
+		printf("%d checks failed\n", test_failures);
+		return 1;
+	}
+
+	printf("PASS\n");
+	return 0;
+}
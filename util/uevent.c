@@ -0,0 +1,83 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <util/util.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+/*
+ * Open a socket for kobject uevents.  On failure ue->fd is -1, and the
+ * caller cannot learn about device changes.
+ */
+void rdma_uevent_open(struct rdma_uevent *ue)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1,
+	};
+
+	/* A socket inherited over fork is shared with the parent */
+	if (ue->fd >= 0)
+		close(ue->fd);
+
+	ue->pid = getpid();
+	ue->fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			NETLINK_KOBJECT_UEVENT);
+	if (ue->fd < 0)
+		return;
+
+	if (bind(ue->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(ue->fd);
+		ue->fd = -1;
+	}
+}
+
+/*
+ * Drains the uevent socket, true if an RDMA device changed.  In a child
+ * of fork the socket is opened again, and any change may have been missed.
+ */
+bool rdma_uevent_pending(struct rdma_uevent *ue)
+{
+	char buf[4096];
+	bool changed = false;
+	ssize_t len;
+
+	if (ue->pid != getpid()) {
+		rdma_uevent_open(ue);
+		return true;
+	}
+
+	if (ue->fd < 0)
+		return false;
+
+	for (;;) {
+		len = recv(ue->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			/* ENOBUFS reports that events were dropped */
+			changed = true;
+			if (errno != ENOBUFS && errno != EINTR)
+				break;
+			continue;
+		}
+
+		/* Matches infiniband, infiniband_verbs and infiniband_mad */
+		if (memmem(buf, len, "SUBSYSTEM=infiniband",
+			   strlen("SUBSYSTEM=infiniband")))
+			changed = true;
+	}
+
+	return changed;
+}
+
+void rdma_uevent_close(struct rdma_uevent *ue)
+{
+	if (ue->fd >= 0 && ue->pid == getpid())
+		close(ue->fd);
+	ue->fd = -1;
+}
@@ -23,4 +23,18 @@ static inline bool __good_snprintf(size_t len, int rc)
 
 int set_fd_nonblock(int fd, bool nonblock);
 
+#define RUN_WORKERS_MAX 8
+
+void run_workers(unsigned int num_threads, void *(*worker)(void *), void *arg);
+
+/* A netlink socket for the kobject uevents of RDMA devices */
+struct rdma_uevent {
+	int fd;
+	pid_t pid;
+};
+
+void rdma_uevent_open(struct rdma_uevent *ue);
+bool rdma_uevent_pending(struct rdma_uevent *ue);
+void rdma_uevent_close(struct rdma_uevent *ue);
+
 #endif
@@ -0,0 +1,36 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+#include <util/util.h>
+#include <pthread.h>
+#include <signal.h>
+
+/*
+ * Run worker(arg) in the calling thread and in up to num_threads - 1
+ * helper threads, limited to RUN_WORKERS_MAX in total, and wait for all of
+ * them to return.  The workers share arg and are expected to claim their
+ * items from it.  If a helper cannot be created the others take its share,
+ * so the work always completes, if only in the calling thread.
+ */
+void run_workers(unsigned int num_threads, void *(*worker)(void *), void *arg)
+{
+	pthread_t threads[RUN_WORKERS_MAX - 1];
+	unsigned int started = 0, i;
+	sigset_t mask, old_mask;
+
+	if (num_threads > RUN_WORKERS_MAX)
+		num_threads = RUN_WORKERS_MAX;
+
+	/* The helpers must not take signals meant for the application */
+	if (num_threads > 1) {
+		sigfillset(&mask);
+		pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+		for (; started < num_threads - 1; started++)
+			if (pthread_create(&threads[started], NULL, worker, arg))
+				break;
+		pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	}
+
+	worker(arg);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}